@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# bench.sh - compare the proxy engines with proxybench
+#
+#   usage: ./bench.sh <url> [conns] [requests] [engines...]
+#
+# Starts the proxy once per engine (default: thread epoll pool uring),
+# runs proxybench against it with the given URL and prints the results.
+# The first request fills the cache, so the runs measure cache hits; use a
+# URL larger than the object size limit to measure the miss path instead.
+#
+URL=$1
+CONNS=${2:-16}
+REQUESTS=${3:-2000}
+shift $(( $# < 3 ? $# : 3 ))
+ENGINES=${@:-thread epoll pool uring}
+
+if [ -z "$URL" ]; then
+    echo "usage: $0 <url> [conns] [requests] [engines...]"
+    exit 1
+fi
+
+make -s proxy proxybench || exit 1
+
+for engine in $ENGINES; do
+    port=$((20000 + RANDOM % 20000))
+    ./proxy -e $engine $port > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+
+    echo "== $engine"
+    ./proxybench -c 1 -n 1 localhost $port "$URL" > /dev/null
+    ./proxybench -c $CONNS -n $REQUESTS localhost $port "$URL"
+    echo
+
+    kill $pid
+    wait $pid 2> /dev/null || true
+done
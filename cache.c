@@ -25,154 +25,594 @@
  tail of the cache list) from the cache, until the ready-to-be-inserted 
  cache item would fit the unused size of the cache. Finally the new item 
  is inserted into cache.
-	
-	As per one of the requirements, multiple threads can read the cache 
- simultaneously, while only one thread is allowed to write the cache at 
- any time and no other threads can read the cache when it is writing. 
- In the contex of this program, reading means searching the cache for 
- the specific item. And writing means adding a new cached_item to the 
- cache, or using a piece of cached content and updating its recentness 
- after it has been found in the cache.
-
-    Modifications to the cache are safely synchronized among threads by 
- reader-writer lock. Accesses to the cache are strictly thread-safe.
+
+    The URIs are indexed by a Swiss-style hash table (see "cache_index.c"), 
+ so that searching the cache takes constant time however many items it 
+ holds. An item added for a URI already cached replaces the old one.
+
+    The cache is split into shards, chosen by the high bits of the URI 
+ hash (the low bits already place the item in the index). Each shard has 
+ its own list, index, eviction order and byte budget, and a mutex that 
+ serializes its writers. The cache memory is split evenly across the 
+ shards, so eviction is per shard. There are CACHE_MAX_SHARDS shards, or 
+ fewer if a shard would then be too small for the largest object. Status 
+ messages are printed after the shard is unlocked.
+
+    Hits take no lock at all. search_and_pin() enters an epoch (see 
+ "epoch.c"), finds the item through the index, which supports lookups 
+ concurrent with a writer, pins the item and leaves the epoch. The 
+ shard mutex only serializes the writers, which add and evict items. 
+ An evicted item is unlinked from the list and the index, then retired: 
+ it is freed once every hit that might have found it is done. The item 
+ found is thus always valid until it is pinned, and there is no recheck.
+
+    Cached items are never modified, and each has a reference count: the 
+ cache holds one reference while the item is cached, and search_and_pin() 
+ takes one more inside the epoch. The caller writes the content to its client directly from the item, 
+ holding no lock, then drops its reference with unpin_cache_item(). 
+ Retiring an evicted item drops the reference of the cache once the 
+ epochs allow it, and whoever drops the last reference frees the item, 
+ so a slow client only delays the freeing of the item it is sent.
+
+    An item, its URI and its content are a single chunk of the slab 
+ allocator (see "slab.c"), which maps the whole cache memory once, so the 
+ heap does not fragment as objects of all sizes come and go. An object 
+ larger than a slab page is split: its head chunk holds the item, a table 
+ of Cache_Chunks and the URI, and each Cache_Chunk is a whole page of 
+ content. Every chunk starts with the shard of the item, so evicting any 
+ of them evicts the item. max_object_size thus does not depend on the 
+ largest chunk, and the proxy sets it, with max_cache_size, at startup. The 
+ shards charge each item the size of its chunk, and their budgets add up 
+ to the slab arena: the cache holds what its accounting says. On a miss 
+ with a Content-Length, the response is received straight into the chunk 
+ from alloc_cache_item(), which insert_cache_item() then caches. Other 
+ responses are received into a Cache_Fill, slab pages taken one at a 
+ time (see reserve_cache_fill()), which become the chunks of the item 
+ once the response ends, or the content is copied into one chunk if it 
+ fits. When 
+ the allocator has no chunk of the size needed, it empties its least 
+ used page through evict_chunk(), which evicts the items on it.
+
+    A hit does not move its item to the head of the list: it sets the 
+ item's referenced flag (only if unset, so hot items are not 
+ written by every hit). Eviction gives a referenced tail item a second 
+ chance: the flag is cleared and the item moves to the head, and the next 
+ unreferenced tail item is evicted. This is the CLOCK approximation of 
+ LRU, with the list as the clock.
+
+    The eviction order is a Cache_Policy of each shard (see 
+ "cache_policy.c"), selected at startup: CLOCK as above by default, or 
+ LRU, SIEVE, SLRU, ARC or GDSF. The shard keeps the counts and the 
+ budget, and asks its policy where to insert an item and which one to 
+ evict. The flag set by hits is all that most policies learn about them; 
+ LRU alone reorders its list on hits, in batches (see "cache_policy.c"). 
+ Every item also counts its hits and remembers how long the origin took 
+ to send it, which GDSF weighs against its size.
+
+    Objects requested only once would push hot ones out of the cache. 
+ With admission on (the default), each shard 
+ keeps a TinyLFU frequency sketch (see "cache_sketch.c") that every 
+ lookup records its URI in, hit or miss. When a new object needs room, 
+ insert_cache_item() asks the policy which item it would evict first 
+ (its peek(), which evicts nothing), and only caches the object if the 
+ sketch estimates it more popular than that item; otherwise the object 
+ is dropped and the item stays, as does the state of the policy. A new 
+ copy of an object already cached replaces it without being weighed.
+
+    The hottest items are also kept in a small L1 of each thread (see 
+ "cache_l1.c"), which search_and_pin() looks up before the shard, so 
+ that their hits neither enter an epoch nor probe the shared index. 
+ Every removal from a shard bumps its generation, which tells the L1s to 
+ check their items again.
+
+    With a disk tier (see "cache_disk.c"), the items evicted by a policy 
+ or by the slab rebalancing, and those too large for a shard, are handed 
+ to disk_spill() before they are destroyed (the items refused by TinyLFU 
+ are not: they were deemed less popular than what memory holds). A miss 
+ in memory then reads the object from disk and caches it again, and a 
+ never cached item is thus freed by its last unpin, like the others.
+
+    The memory cache can also be written to a snapshot file periodically 
+ (see "cache_snapshot.c"), through pin_shard_items(), which pins the 
+ items of a shard so they are written without the shard locked. On 
+ startup, while the snapshot is being loaded back, a miss in memory looks 
+ there first.
+
+    Not every response may be cached, nor served forever. With the 
+ freshness on, insert_cache_item() only caches the responses whose 
+ headers allow it, and the item keeps the time it expires at (see 
+ "cache_fresh.c"). A hit on an expired item is a miss, and the timer 
+ wheel of each shard destroys its expired items as they expire. A relay 
+ asks cache_admits() as soon as the headers of a response are in, which 
+ also runs the TinyLFU check when the size is known, so that nothing is 
+ allocated, nor evicted, for a response that would not be cached.
  */
 
+#define _GNU_SOURCE	/* For memmem() */
 #include "cache.h"
+#include "cache_l1.h"
+#include "cache_disk.h"
+#include "cache_snapshot.h"
+#include "epoch.h"
 
+static Cache_Item *load_from_disk(Cache_List *cache_list, char *for_uri, 
+		uint64_t hash);
+static Cache_Item *alloc_item_head(char *uri, unsigned int length, 
+		unsigned int *chunk_count);
+static void *alloc_slab_chunk(size_t size);
+static size_t item_head_need(size_t uri_size, unsigned int length, 
+		unsigned int *chunk_count);
+static size_t item_head_size(Cache_Item *cache_item);
+static int headers_storable(Cache_List *cache_list, char *uri, 
+		int request, const char *headers, size_t header_length, 
+		unsigned int length, time_t *expires);
+static int admitted(Cache_Shard *shard, uint64_t hash, 
+		unsigned int chunk_size);
+static void set_item_shard(Cache_Item *cache_item, Cache_Shard *shard);
+static void drop_cache_reference(void *cache_item);
+static void evict_chunk(void *chunk);
 
+/*
+ *  Global/shared variables
+ */
+size_t max_cache_size = MAX_CACHE_SIZE;		/* Set before init_cache_list() */
+size_t max_object_size = MAX_OBJECT_SIZE;
+int cache_memfd = 0;
 
-/* Inititialize an empty cache / cache_list (safe to call) */
-void init_cache_list(Cache_List *cache_list){
-	cache_list->cached_item_count = 0;
-	cache_list->unused_size = MAX_CACHE_SIZE;
-	cache_list->head = NULL;
-	cache_list->tail = NULL;
-}
 
-/* Search the cache, if hit, copy content to the user buffer */
-int search_and_get(Cache_List *cache_list, char *for_uri, void *usrbuf, 
-		unsigned int *size) 
+/* Inititialize an empty cache / cache_list (safe to call), evicting with 
+   policy (NULL for CACHE_DEFAULT_POLICY), and filtering the new objects 
+   through TinyLFU if admission is set */
+void init_cache_list(Cache_List *cache_list, const Cache_Policy *policy, 
+		int admission)
 {
-	Cache_Item *cache_item = NULL;
+	unsigned int shard_count = CACHE_MAX_SHARDS, i;
+	size_t largest = SLAB_PAGE_SIZE;
+	Cache_Shard *shard;
+	int rc;
 
-	Pthread_rwlock_rdlock(&cache_rwlock);	/* Lock for concurrent reading */
+	if (policy == NULL) {
+		policy = find_cache_policy(CACHE_DEFAULT_POLICY);
+	}
+	slab_init(max_cache_size, cache_memfd);
 
-	cache_item = search_cache_item(cache_list, for_uri);	/* Reading */
-	
-	Pthread_rwlock_unlock(&cache_rwlock);	/* Unlocked reading */
+	/* Every shard must be able to hold the largest object: a whole slab 
+	 * page, or its chunks and a page for its head if it needs chunks */
+	if (slab_chunk_size(sizeof(Cache_Item) + MAXLINE + max_object_size) 
+			== 0) 
+	{
+		largest *= (max_object_size + CACHE_CHUNK_DATA - 1) 
+				/ CACHE_CHUNK_DATA + 1;
+	}
+	while (shard_count > 1 && slab_limit() / shard_count < largest) 
+		shard_count /= 2;
 
-	/* During this small transition period after releasing the reading lock 
-	 * but before acquiring the writing lock, it is possible that the cache 
-	 * item just found would be evicted by another writter who has been 
-	 * waiting in the que. So it needs to be double checked before using. If 
-	 * it is evicted, just treat it as a cache-miss.
-	 */
+	cache_list->shard_count = shard_count;
+	if ((rc = posix_memalign((void **) &cache_list->shards, 
+			__alignof__(Cache_Shard), shard_count * sizeof(Cache_Shard))) 
+			!= 0)
+	{
+		posix_error(rc, "posix_memalign error");
+	}
+	for (i = 0; i < shard_count; i++) {
+		shard = &cache_list->shards[i];
+		Pthread_mutex_init(&shard->mutex, NULL);
+		shard->cached_item_count = 0;
+		shard->max_size = slab_limit() / shard_count;
+		shard->unused_size = shard->max_size;
+		shard->policy = policy;
+		policy->init(shard);
+		shard->generation = 0;
+		shard->admission = admission;
+		if (admission) {
+			sketch_init(&shard->sketch, shard->max_size / SKETCH_ITEM_BYTES);
+		}
+		index_init(&shard->index, 0);
+		shard->timers = NULL;
+		shard->timer_time = 0;
+	}
+	cache_list->l1 = 1;
+	cache_list->freshness = 0;
+}
 
-	if (cache_item != NULL) {
+/* The shard of the URIs with this index_hash() */
+Cache_Shard *cache_shard(Cache_List *cache_list, uint64_t hash) {
+	return &cache_list->shards[(hash >> 48) & (cache_list->shard_count - 1)];
+}
 
-		Pthread_rwlock_wrlock(&cache_rwlock);	/* Lock for exlusive writing */
+/* Search the cache, if hit, pin the cache item and return it. Send its 
+ * content, then unpin it with unpin_cache_item(). Returns NULL on a miss.
+ */
+Cache_Item *search_and_pin(Cache_List *cache_list, char *for_uri) {
+	Cache_Item *cache_item = NULL;
+	uint64_t hash = index_hash(for_uri);
+	Cache_Shard *shard = cache_shard(cache_list, hash);
 
-		/* Check the item again in case it has been evicted instantaneously */
-		if (strcmp(cache_item->uri, for_uri) == 0) {
-			/* If it is still there, treat it as a cache-hit and use it */
-			use_cache_item(cache_list, cache_item, usrbuf, size);
-			print_cache_status(cache_list);
+	/* Hit or miss, it counts for the admission of the URI */
+	if (shard->admission) {
+		sketch_record(&shard->sketch, hash);
+	}
 
-			Pthread_rwlock_unlock(&cache_rwlock);	/* Unlock writing */
+	/* The L1 of the thread pins its items, no epoch needed */
+	if (cache_list->l1 
+			&& (cache_item = l1_find(shard, for_uri, hash)) != NULL) 
+	{
+		use_cache_item(cache_item);
+	}
+	else {
+		epoch_enter();	/* The item found stays valid until epoch_exit() */
 
-			return 0;
+		cache_item = index_find(&shard->index, for_uri, hash);
+		if (cache_item == NULL) {
+			/* Cache-miss, in memory at least */
+			epoch_exit();
+			return (disk_store.enabled || cache_snapshot.pending) ? 
+					load_from_disk(cache_list, for_uri, hash) : NULL;
 		}
-		else {
-			/* If it is lost, treated it as a cache-miss */
 
-			Pthread_rwlock_unlock(&cache_rwlock);	/* Unlock writing */
+		/* Cache-hit, pin it before leaving the epoch */
+		use_cache_item(cache_item);
 
-			return -1;
+		epoch_exit();
+		if (cache_list->l1) {
+			l1_offer(shard, cache_item);
 		}
 	}
-	else {
-		/* Cache-miss */
-		return -1;
+
+	/* Past its freshness lifetime: a miss, the timer wheel reclaims it */
+	if (ITEM_EXPIRED(cache_item, time(NULL))) {
+		unpin_cache_item(cache_item);
+		return (disk_store.enabled || cache_snapshot.pending) ? 
+				load_from_disk(cache_list, for_uri, hash) : NULL;
+	}
+
+	/* The referenced flag is enough for most policies */
+	if (shard->policy->hit != NULL) {
+		shard->policy->hit(shard, cache_item);
+	}
+
+	print_cache_status(cache_list, shard, 
+			__atomic_load_n(&shard->cached_item_count, __ATOMIC_RELAXED), 
+			__atomic_load_n(&shard->unused_size, __ATOMIC_RELAXED));
+	return cache_item;
+}
+
+/* Cache again an object of the snapshot still loading or of the disk 
+   tier, pinned for the caller */
+static Cache_Item *load_from_disk(Cache_List *cache_list, char *for_uri, 
+		uint64_t hash)
+{
+	Cache_Item *cache_item = NULL;
+
+	if (__atomic_load_n(&cache_snapshot.pending, __ATOMIC_ACQUIRE)) {
+		cache_item = snapshot_load(for_uri, hash);
+	}
+	if (cache_item == NULL && disk_store.enabled) {
+		cache_item = disk_load(for_uri, hash);
+	}
+	if (cache_item == NULL) {
+		return NULL;
+	}
+	/* Served even if the memory does not admit it */
+	__atomic_add_fetch(&cache_item->refcount, 1, __ATOMIC_RELAXED);
+	insert_cache_item(cache_list, cache_item);
+	return cache_item;
+}
+
+/* Drop a reference to a cache item, freeing it with the last one */
+void unpin_cache_item(Cache_Item *cache_item) {
+	if (__atomic_sub_fetch(&cache_item->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		free_cache_item(cache_item);
 	}
 }
 
-/* Search the cache for the target response item corresponidng to the URI.
- * Sub-function of search_and_get().
+/* Search a shard for the target response item corresponidng to the URI.
+ * Called with the shard locked.
  */
-Cache_Item *search_cache_item(Cache_List *cache_list, char *for_uri) {
-	if (DEBUG_MODE) printf("  search_cache_item():\n");
-	/* If Cache is empty */
-	if (cache_list->head == NULL) {
-		if (DEBUG_MODE) printf("    Empty cache.\n");
-		if (DEBUG_MODE) printf("  search_cache_item() finish.\n");
+Cache_Item *search_cache_item(Cache_Shard *shard, char *for_uri) {
+	return index_find(&shard->index, for_uri, index_hash(for_uri));
+}
+
+/* Allocate a cache item for a URI and length bytes of content, with the 
+   URI copied in: one slab chunk, or a head chunk and Cache_Chunks if it 
+   does not fit in one. The content is left to the caller, see 
+   item_segment(). Returns NULL if the object is larger than 
+   max_object_size, or if the slab allocator has no room even after 
+   rebalancing */
+Cache_Item *alloc_cache_item(char *uri, unsigned int length) {
+	unsigned int chunk_count, i;
+	Cache_Item *cache_item;
+	Cache_Chunk *chunk;
+
+	if (length > max_object_size) {
+		return NULL;
+	}
+	if ((cache_item = alloc_item_head(uri, length, &chunk_count)) == NULL) {
+		if (DEBUG_MODE) printf("    alloc_cache_item() failed.\n");
 		return NULL;
 	}
-	Cache_Item *cache_item = cache_list->head;
-	while (cache_item->next_item != NULL) {
-		/* Check cache items */
-		if (strcmp(cache_item->uri, for_uri) == 0) {
-			/* Cache hit! */
-			if (DEBUG_MODE) printf("  search_cache_item() finish.\n");	
-			return cache_item;
+	for (i = 0; i < chunk_count; i++) {
+		if ((chunk = alloc_slab_chunk(SLAB_PAGE_SIZE)) == NULL) {
+			/* Give back the chunks allocated so far */
+			cache_item->chunk_count = i;
+			free_cache_item(cache_item);
+			if (DEBUG_MODE) printf("    alloc_cache_item() failed.\n");
+			return NULL;
 		}
-		cache_item = cache_item->next_item;
+		chunk->item = cache_item;
+		cache_item->chunks[i] = chunk;
+		cache_item->chunk_size += SLAB_PAGE_SIZE;
 	}
-	/* Check last item */
-	if (strcmp(cache_item->uri, for_uri) == 0) {
-		/* Cache hit! */
-		if (DEBUG_MODE) printf("  search_cache_item() finish.\n");
-		return cache_item;
+	return cache_item;
+}
+
+/* Allocate the head chunk of a cache item for a URI and length bytes of 
+   content, with the URI copied in, and the content too if it fits. If 
+   not, its table is left for the *chunk_count Cache_Chunks to add, and 
+   their size to chunk_size. Returns NULL if out of memory */
+static Cache_Item *alloc_item_head(char *uri, unsigned int length, 
+		unsigned int *chunk_count) 
+{
+	size_t uri_size = strlen(uri) + 1;
+	size_t need = item_head_need(uri_size, length, chunk_count);
+	Cache_Item *cache_item;
+
+	if ((cache_item = alloc_slab_chunk(need)) == NULL) {
+		return NULL;
+	}
+	cache_item->item = cache_item;
+	cache_item->chunk_count = *chunk_count;
+	cache_item->chunk_size = slab_chunk_size(need);
+	cache_item->content_length = length;
+	if (*chunk_count == 0) {
+		cache_item->chunks = NULL;
+		cache_item->uri = (char *) (cache_item + 1);
+		cache_item->content = cache_item->uri + uri_size;
+	}
+	else {
+		cache_item->chunks = (Cache_Chunk **) (cache_item + 1);
+		cache_item->uri = (char *) (cache_item->chunks + *chunk_count);
+		cache_item->content = NULL;
+	}
+	memcpy(cache_item->uri, uri, uri_size);
+	cache_item->hash = index_hash(uri);
+	cache_item->referenced = 0;
+	cache_item->on_disk = 0;
+	cache_item->refcount = 1;	/* The reference of the cache */
+	cache_item->hits = 0;
+	cache_item->fetch_us = 0;
+	cache_item->expires = 0;
+	cache_item->timer_next = NULL;
+	cache_item->timer_prevp = NULL;
+	/* cache_item->shard is NULL, as in every chunk handed out */
+	return cache_item;
+}
+
+/* Bytes of the head chunk of an item for a URI of uri_size bytes and 
+   length bytes of content, and how many Cache_Chunks it needs besides */
+static size_t item_head_need(size_t uri_size, unsigned int length, 
+		unsigned int *chunk_count) 
+{
+	size_t need = sizeof(Cache_Item) + uri_size + length;
+
+	*chunk_count = 0;
+	if (slab_chunk_size(need) == 0) {
+		/* Too large for one chunk: the head holds the chunk table */
+		*chunk_count = (length + CACHE_CHUNK_DATA - 1) / CACHE_CHUNK_DATA;
+		need = sizeof(Cache_Item) + *chunk_count * sizeof(Cache_Chunk *) 
+				+ uri_size;
+	}
+	return need;
+}
+
+/* Allocate a slab chunk of size bytes, freeing memory if needed, or NULL */
+static void *alloc_slab_chunk(size_t size) {
+	void *chunk;
+
+	if ((chunk = slab_alloc(size)) == NULL) {
+		/* Free the items waiting for their epochs, then move a page */
+		epoch_reclaim();
+		if ((chunk = slab_alloc(size)) == NULL) {
+			slab_rebalance(size, evict_chunk);
+			chunk = slab_alloc(size);
+		}
+	}
+	return chunk;
+}
+
+/* The index-th contiguous part of the content of a cache item, and its 
+   length; NULL past the end */
+char *item_segment(Cache_Item *cache_item, unsigned int index, 
+		size_t *length) 
+{
+	if (cache_item->chunks == NULL) {
+		*length = cache_item->content_length;
+		return (index == 0) ? cache_item->content : NULL;
+	}
+	if (index >= cache_item->chunk_count) {
+		return NULL;
 	}
-	/* Cache miss. */
-	if (DEBUG_MODE) printf("  search_cache_item() finish.\n");
-	return NULL;
+	*length = (index + 1 < cache_item->chunk_count) ? CACHE_CHUNK_DATA 
+			: cache_item->content_length - index * CACHE_CHUNK_DATA;
+	return (char *) (cache_item->chunks[index] + 1);
 }
 
-/* Build a new cache_item */
+/* Build a new cache_item in a slab chunk */
 Cache_Item *build_cache_item(char *from_uri, char *from_content, 
 		unsigned int length) 
 {
 	if (DEBUG_MODE) printf("    build_cache_item():\n");
-	char *uri, *content;
 	Cache_Item *cache_item;
+	char *segment;
+	size_t part;
+	unsigned int i;
 
-	/* Malloc space for URI string, including one byte for null terminator */
-	if ((uri = (char *) malloc(strlen(from_uri) + 1)) == NULL) {
-		/* Abort caching if out of memory */
+	/* Abort caching if out of memory */
+	if ((cache_item = alloc_cache_item(from_uri, length)) == NULL) {
 		if (DEBUG_MODE) printf("    build_cache_item() failed.\n");
 		return NULL;
 	}
-	strcpy(uri, from_uri);
+	for (i = 0; (segment = item_segment(cache_item, i, &part)) != NULL; 
+			i++) 
+	{
+		memcpy(segment, from_content, part);
+		from_content += part;
+	}
+	if (DEBUG_MODE) printf("    build_cache_item() finish.\n");
 
-	/* Malloc space for content  */
-	if ((content = (char *) malloc(length)) == NULL) {
-		/* Abort caching if out of memory */
-		Free(uri);
-		if (DEBUG_MODE) printf("    build_cache_item() failed.\n");
+	return cache_item;
+}
+
+/* Start filling the content of a response of unknown length */
+void init_cache_fill(Cache_Fill *fill) {
+	fill->chunks = NULL;
+	fill->chunk_count = 0;
+	fill->length = 0;
+	fill->checked = 0;
+	fill->expires = 0;
+}
+
+/* Where the next bytes of content go, in the last page of a fill, or in 
+   a new one if it is full; *room is set to how many fit there. The caller 
+   adds those it writes to fill->length. Returns NULL once the content is 
+   max_object_size, or if the slab allocator has no room */
+char *reserve_cache_fill(Cache_Fill *fill, size_t *room) {
+	unsigned int used = fill->length - (fill->chunk_count > 0 
+			? (fill->chunk_count - 1) * CACHE_CHUNK_DATA : 0);
+	Cache_Chunk *chunk;
+
+	if (fill->length >= max_object_size) {
 		return NULL;
 	}
-	memcpy(content, from_content, length);
+	if (fill->chunks == NULL) {
+		/* Table for the largest object, freed once it is built */
+		fill->chunks = (Cache_Chunk **) Malloc(((max_object_size 
+				+ CACHE_CHUNK_DATA - 1) / CACHE_CHUNK_DATA) 
+				* sizeof(Cache_Chunk *));
+		if (fill->chunks == NULL) {
+			return NULL;
+		}
+	}
+	if (fill->chunk_count == 0 || used == CACHE_CHUNK_DATA) {
+		if ((chunk = alloc_slab_chunk(SLAB_PAGE_SIZE)) == NULL) {
+			return NULL;
+		}
+		/* Not any item's yet: evict_chunk() leaves it alone */
+		chunk->item = NULL;
+		fill->chunks[fill->chunk_count++] = chunk;
+		used = 0;
+	}
+	*room = CACHE_CHUNK_DATA - used;
+	if (*room > max_object_size - fill->length) {
+		*room = max_object_size - fill->length;
+	}
+	return (char *) (fill->chunks[fill->chunk_count - 1] + 1) + used;
+}
 
-	/* Malloc space for cache_item  */
-	if ((cache_item = malloc(sizeof(Cache_Item))) == NULL) {
-		/* Abort caching if out of memory */
-		Free(uri);
-		Free(content);
-		if (DEBUG_MODE) printf("    build_cache_item() failed.\n");
-		return NULL;
+/* Copy n bytes at the end of the content of a fill. Returns 0, or -1 if 
+   they do not fit, as reserve_cache_fill() */
+int append_cache_fill(Cache_Fill *fill, const char *data, size_t n) {
+	size_t room;
+	char *dst;
+
+	while (n > 0) {
+		if ((dst = reserve_cache_fill(fill, &room)) == NULL) {
+			return -1;
+		}
+		if (room > n) {
+			room = n;
+		}
+		memcpy(dst, data, room);
+		fill->length += room;
+		data += room;
+		n -= room;
 	}
-	cache_item->uri = uri;
-	cache_item->content = content;
-	cache_item->content_length = length;
-	if (DEBUG_MODE) printf("    build_cache_item() finish.\n");
+	return 0;
+}
 
+/* Check the response of a fill, to a request with the CACHE_REQ_* flags 
+   of request, with cache_admits(), once its headers are in the first 
+   page, or it is full. Returns 0 if it will not be cached, 
+   otherwise 1 (also while the headers are not all in) */
+int admit_cache_fill(Cache_List *cache_list, Cache_Fill *fill, char *uri, 
+		int request) 
+{
+	size_t length;
+	char *headers;
+
+	if (fill->checked || fill->chunk_count == 0) {
+		return 1;
+	}
+	headers = (char *) (fill->chunks[0] + 1);
+	length = (fill->length < CACHE_CHUNK_DATA) ? fill->length 
+			: CACHE_CHUNK_DATA;
+	if (length < CACHE_CHUNK_DATA && !memmem(headers, length, "\n\r\n", 3) 
+			&& !memmem(headers, length, "\n\n", 2)) 
+	{
+		return 1;
+	}
+	fill->checked = 1;
+	return cache_admits(cache_list, uri, request, headers, length, 0, 
+			&fill->expires) > 0;
+}
+
+/* Build the cache item of the content of a fill, which is emptied. A 
+   content that fits in one chunk is copied into it, otherwise the pages 
+   become its Cache_Chunks. Returns NULL if it is empty or out of memory */
+Cache_Item *build_filled_item(Cache_Fill *fill, char *uri) {
+	Cache_Item *cache_item = NULL;
+	unsigned int chunk_count, i;
+	char *segment;
+	size_t part;
+
+	if (fill->length == 0) {
+		free_cache_fill(fill);
+		return NULL;
+	}
+	item_head_need(strlen(uri) + 1, fill->length, &chunk_count);
+	if (chunk_count == 0) {
+		if ((cache_item = alloc_cache_item(uri, fill->length)) != NULL) {
+			segment = item_segment(cache_item, 0, &part);
+			memcpy(segment, fill->chunks[0] + 1, part);
+		}
+	}
+	else if ((cache_item = alloc_item_head(uri, fill->length, 
+			&chunk_count)) != NULL) 
+	{
+		for (i = 0; i < chunk_count; i++) {
+			fill->chunks[i]->item = cache_item;
+			cache_item->chunks[i] = fill->chunks[i];
+			cache_item->chunk_size += SLAB_PAGE_SIZE;
+		}
+		/* Only the pages left over are freed */
+		memmove(fill->chunks, fill->chunks + chunk_count, 
+				(fill->chunk_count - chunk_count) * sizeof(Cache_Chunk *));
+		fill->chunk_count -= chunk_count;
+	}
+	if (cache_item != NULL) {
+		cache_item->expires = fill->expires;
+	}
+	free_cache_fill(fill);
 	return cache_item;
 }
 
-/* Add a new cache item into the cache */
+/* Give back the pages of a fill, and empty it */
+void free_cache_fill(Cache_Fill *fill) {
+	unsigned int i;
+
+	for (i = 0; i < fill->chunk_count; i++) {
+		slab_free(fill->chunks[i], SLAB_PAGE_SIZE);
+	}
+	if (fill->chunks != NULL) {
+		Free(fill->chunks);
+	}
+	init_cache_fill(fill);
+}
+
+/* Add a new cache item, a copy of content, into the cache. fetch_us is 
+   how long the origin took to send it (0 if unknown) */
 void add_cache_item(Cache_List *cache_list, char *uri, char *content, 
-		unsigned int size)
+		unsigned int size, unsigned int fetch_us)
 {
 	if (DEBUG_MODE) printf("  add_cache_item():\n");
 	Cache_Item *cache_item = build_cache_item(uri, content, size);
@@ -182,138 +622,383 @@ void add_cache_item(Cache_List *cache_list, char *uri, char *content,
 		if (DEBUG_MODE) printf("  add_cache_item() failed.\n");
 		return;
 	}
+	cache_item->fetch_us = fetch_us;
+	insert_cache_item(cache_list, cache_item);
+	if (DEBUG_MODE) printf("  add_cache_item() finish.\n");
+}
+
+/* Insert an item from alloc_cache_item(), whose content is filled in, 
+   into the cache. The cache takes it over, whether it is cached or not */
+void insert_cache_item(Cache_List *cache_list, Cache_Item *cache_item) {
+	Cache_Item *old_item;
+	Cache_Shard *shard = cache_shard(cache_list, cache_item->hash);
+	unsigned int item_count, unused_size;
+	Slab_Stats stats;
+	char *headers;
+	size_t length;
+
+	/* Items read back from disk, and those checked by cache_admits(), 
+	 * know when they expire already */
+	if (cache_list->freshness && cache_item->expires == 0) {
+		headers = item_segment(cache_item, 0, &length);
+		if (!headers_storable(cache_list, cache_item->uri, 0, headers, 
+				length, cache_item->content_length, &cache_item->expires)) 
+		{
+			destroy_cache_item(NULL, cache_item);
+			return;
+		}
+	}
+
+	if (cache_item->chunk_size > shard->max_size) {
+		/* Would not fit even in an empty shard: maybe on disk */
+		disk_spill(cache_item);
+		destroy_cache_item(NULL, cache_item);
+		return;
+	}
 
-	Pthread_rwlock_wrlock(&cache_rwlock);	/* Lock for exlusive writing */
+	Pthread_mutex_lock(&shard->mutex);	/* Lock the shard */
 												/* Writing block */
-	while (cache_list->unused_size < size) {
-		evict_cache_item(cache_list);
+	/* The copy cached meanwhile by another miss, if any, was admitted: 
+	 * it is replaced. Otherwise, TinyLFU decides */
+	old_item = index_find(&shard->index, cache_item->uri, cache_item->hash);
+	if (old_item == NULL 
+			&& !admitted(shard, cache_item->hash, cache_item->chunk_size)) 
+	{
+		Pthread_mutex_unlock(&shard->mutex);
+		printf("\tResponse content (%u bytes) for URI: %s "
+				"has not been admitted.\n\n", 
+				cache_item->content_length, cache_item->uri);
+		destroy_cache_item(NULL, cache_item);
+		return;
 	}
-	insert_item_to_listhead(cache_list, cache_item);
-	printf("\tResponse content (%u bytes) for URI: %s has been cached.\n",
-			size, uri);
-	print_cache_status(cache_list);
+	if (old_item != NULL) {
+		destroy_cache_item(shard, old_item);
+	}
+	while (shard->unused_size < cache_item->chunk_size) {
+		evict_cache_item(shard);
+	}
+	insert_item_to_listhead(shard, cache_item);
+	index_insert(&shard->index, cache_item);
+	/* Now evict_chunk() may find it */
+	set_item_shard(cache_item, shard);
+	item_count = shard->cached_item_count;
+	unused_size = shard->unused_size;
+	/* Pinned while it is printed: another writer may evict it */
+	__atomic_add_fetch(&cache_item->refcount, 1, __ATOMIC_RELAXED);
+	if (DEBUG_MODE) check_cache_consistency(shard);
 												/* End of writing block */
-	Pthread_rwlock_unlock(&cache_rwlock);	/* Unlock writing */
+	Pthread_mutex_unlock(&shard->mutex);	/* Unlock the shard */
 
-	if (DEBUG_MODE) printf("  add_cache_item() finish.\n");
+	printf("\tResponse content (%u bytes) for URI: %s has been cached.\n",
+			cache_item->content_length, cache_item->uri);
+	unpin_cache_item(cache_item);
+	print_cache_status(cache_list, shard, item_count, unused_size);
+	slab_stats(&stats);
+	printf("\t(Slab pages: %u/%u\tChunks: %lu bytes for %lu requested, "
+		"%u pages moved)\n\n", 
+		stats.pages_used, stats.pages, 
+		(unsigned long) stats.chunk_bytes, 
+		(unsigned long) stats.requested_bytes, 
+		stats.moves);
+}
+
+/* Whether a response to a miss on uri, of length bytes (0 if not known 
+   yet) with its headers in the header_length bytes at headers, would be 
+   cached, checked before anything is allocated for it: the request, with 
+   the CACHE_REQ_* flags of request, and the headers allow it, and TinyLFU 
+   would admit an object of its size now. Without the freshness, the 
+   headers are not looked at, so the responses to a request that carried 
+   an Authorization or a Range header are never cached. Returns 1 if so, 
+   and sets *expires to what insert_cache_item() would set it to, for the 
+   item the response is received into; 0 if TinyLFU would not admit it; 
+   -1 if the request or the headers do not allow storing it at all */
+int cache_admits(Cache_List *cache_list, char *uri, int request, 
+		const char *headers, size_t header_length, unsigned int length, 
+		time_t *expires) 
+{
+	uint64_t hash = index_hash(uri);
+	Cache_Shard *shard = cache_shard(cache_list, hash);
+	unsigned int chunk_count;
+	size_t chunk_size;
+	int rc;
+
+	*expires = 0;
+	if (!cache_list->freshness && request != 0) {
+		printf("\tResponse content (%u bytes) for URI: %s "
+				"has not been cached: %s.\n\n", length, uri, 
+				(request & CACHE_REQ_RANGE) ? "request has Range" 
+				: fresh_reason(FRESH_AUTHORIZED));
+		return -1;
+	}
+	if (cache_list->freshness && !headers_storable(cache_list, uri, 
+			request, headers, header_length, length, expires)) 
+	{
+		return -1;
+	}
+	if (length == 0 || length > max_object_size) {
+		return 1;
+	}
+	chunk_size = slab_chunk_size(item_head_need(strlen(uri) + 1, length, 
+			&chunk_count)) + chunk_count * SLAB_PAGE_SIZE;
+	if (chunk_size > shard->max_size) {
+		/* For the disk tier, if any */
+		return 1;
+	}
+
+	Pthread_mutex_lock(&shard->mutex);
+	rc = index_find(&shard->index, uri, hash) != NULL 
+			|| admitted(shard, hash, chunk_size);
+	Pthread_mutex_unlock(&shard->mutex);
+	if (!rc) {
+		printf("\tResponse content (%u bytes) for URI: %s "
+				"has not been admitted.\n\n", length, uri);
+	}
+	return rc;
+}
+
+/* Whether the headers, at the start of a response for uri of length 
+   bytes to a request with the CACHE_REQ_* flags of request, allow caching 
+   it. If so, sets *expires to when it expires */
+static int headers_storable(Cache_List *cache_list, char *uri, 
+		int request, const char *headers, size_t header_length, 
+		unsigned int length, time_t *expires) 
+{
+	int rc = fresh_parse(headers, header_length, time(NULL), 
+			request & CACHE_REQ_AUTHORIZATION, expires);
+
+	if (rc != FRESH_STORE) {
+		printf("\tResponse content (%u bytes) for URI: %s "
+				"has not been cached: %s.\n\n", 
+				length, uri, fresh_reason(rc));
+		return 0;
+	}
+	return 1;
 }
 
-/* Permenantly evict a cache item from the cache list and destroying 
-   its content */
-void evict_cache_item(Cache_List *cache_list) {
+/* TinyLFU: whether a new object of chunk_size bytes is worth caching, 
+   that is more popular than the item the policy would evict first, which 
+   stays untouched if it is not. Called with the shard locked */
+static int admitted(Cache_Shard *shard, uint64_t hash, 
+		unsigned int chunk_size) 
+{
+	Cache_Item *victim;
+
+	if (!shard->admission || shard->unused_size >= chunk_size) {
+		return 1;
+	}
+	victim = shard->policy->peek(shard);
+	return sketch_estimate(&shard->sketch, hash) 
+			> sketch_estimate(&shard->sketch, victim->hash);
+}
+
+/* Permenantly evict a cache item from a shard and destroying its content. 
+   The policy of the shard picks which one. */
+void evict_cache_item(Cache_Shard *shard) {
+	Cache_Item *victim;
+
 	if (DEBUG_MODE) printf("    evict_cache_item():\n");
-	Cache_Item *cache_item = remove_item_from_list(cache_list, 
-			cache_list->tail);
-	free(cache_item->content);
-	free(cache_item->uri);
-	free(cache_item);
+	victim = shard->policy->victim(shard);
+	disk_spill(victim);
+	destroy_cache_item(shard, victim);
 	if (DEBUG_MODE) printf("    evict_cache_item() finish.\n");
 }
 
-/* Remove a cache item from the cache list, but not destoying it */
-Cache_Item *remove_item_from_list(Cache_List *cache_list, 
+/* Remove a cache item from the list and the index of its shard, and 
+   destroy it once no hit can find it and no hit has it pinned. A NULL 
+   shard destroys an item that was never added, as soon as it is 
+   unpinned. */
+void destroy_cache_item(Cache_Shard *shard, Cache_Item *cache_item) {
+	if (shard != NULL) {
+		set_item_shard(cache_item, NULL);
+		/* The L1s holding it will check it again */
+		__atomic_store_n(&shard->generation, shard->generation + 1, 
+				__ATOMIC_RELEASE);
+		remove_item_from_list(shard, cache_item);
+		index_remove(&shard->index, cache_item);
+		epoch_retire(cache_item, drop_cache_reference);
+	}
+	else {
+		/* Drop the reference it was allocated with */
+		unpin_cache_item(cache_item);
+	}
+}
+
+/* Drop the reference of the cache to a retired cache item */
+static void drop_cache_reference(void *cache_item) {
+	unpin_cache_item((Cache_Item *) cache_item);
+}
+
+/* Evict the cache item in a chunk of a page that slab_rebalance() 
+   empties, if it is still cached. Called with no shard locked */
+static void evict_chunk(void *chunk) {
+	/* The head of an item, or one of its Cache_Chunks */
+	Cache_Chunk *cache_chunk = (Cache_Chunk *) chunk;
+	Cache_Shard *shard = __atomic_load_n(&cache_chunk->shard, 
+			__ATOMIC_ACQUIRE);
+
+	if (shard == NULL) {
+		/* Not inserted yet, or already evicted */
+		return;
+	}
+	Pthread_mutex_lock(&shard->mutex);
+	/* Evicted meanwhile? The chunk cannot be reused while the page drains */
+	if (cache_chunk->shard == shard) {
+		disk_spill(cache_chunk->item);
+		destroy_cache_item(shard, cache_chunk->item);
+	}
+	Pthread_mutex_unlock(&shard->mutex);
+}
+
+/* Free a cache item, its URI and its content: its slab chunks */
+void free_cache_item(void *cache_item) {
+	Cache_Item *item = (Cache_Item *) cache_item;
+	unsigned int i;
+
+	for (i = 0; i < item->chunk_count; i++) {
+		slab_free(item->chunks[i], SLAB_PAGE_SIZE);
+	}
+	slab_free(item, item_head_size(item));
+}
+
+/* Bytes asked for the head chunk of a cache item */
+static size_t item_head_size(Cache_Item *cache_item) {
+	size_t size = sizeof(Cache_Item) + strlen(cache_item->uri) + 1;
+
+	if (cache_item->chunks == NULL) {
+		return size + cache_item->content_length;
+	}
+	/* The chunk table was sized for the whole content */
+	return size + (cache_item->content_length + CACHE_CHUNK_DATA - 1) 
+			/ CACHE_CHUNK_DATA * sizeof(Cache_Chunk *);
+}
+
+/* Set the shard of a cache item and of its chunks, where evict_chunk() 
+   reads it. Called with the lock of the shard held */
+static void set_item_shard(Cache_Item *cache_item, Cache_Shard *shard) {
+	unsigned int i;
+
+	for (i = 0; i < cache_item->chunk_count; i++) {
+		__atomic_store_n(&cache_item->chunks[i]->shard, shard, 
+				__ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&cache_item->shard, shard, __ATOMIC_RELEASE);
+}
+
+/* Pin the items cached in a shard, in the order of its policy, those to 
+   evict last first. Returns a table of *count items, which the caller 
+   unpins, then frees, or NULL if out of memory */
+Cache_Item **pin_shard_items(Cache_Shard *shard, unsigned int *count) {
+	Cache_Item **items, *cache_item;
+	unsigned int n = 0, i;
+	int queue;
+
+	Pthread_mutex_lock(&shard->mutex);
+	items = Malloc((shard->cached_item_count + 1) * sizeof(Cache_Item *));
+	if (items == NULL) {
+		Pthread_mutex_unlock(&shard->mutex);
+		*count = 0;
+		return NULL;
+	}
+	/* queues[1] holds the items hit again, for the policies using it */
+	for (queue = 1; queue >= 0; queue--) {
+		for (cache_item = shard->queues[queue].head; cache_item != NULL 
+				&& n < shard->cached_item_count; 
+				cache_item = cache_item->next_item) 
+		{
+			items[n++] = cache_item;
+		}
+	}
+	/* GDSF keeps its items in the heap, lowest priority first */
+	for (i = shard->heap_count; i-- > 0 && n < shard->cached_item_count; ) {
+		items[n++] = shard->heap[i];
+	}
+	for (i = 0; i < n; i++) {
+		__atomic_add_fetch(&items[i]->refcount, 1, __ATOMIC_RELAXED);
+	}
+	Pthread_mutex_unlock(&shard->mutex);
+
+	*count = n;
+	return items;
+}
+
+/* Remove a cache item from the lists of the shard policy, but not 
+   destoying it */
+Cache_Item *remove_item_from_list(Cache_Shard *shard, 
 		Cache_Item *cache_item) 
 {
 	if (DEBUG_MODE) printf("      remove_item_from_list():\n");
-	/* If it is the only item */
-	if (cache_item->prev_item == NULL && cache_item->next_item == NULL) {
-		cache_list->head = NULL;
-		cache_list->tail = NULL;
-	}
-	/* If it is the head item */
-	else if (cache_item->prev_item == NULL) {
-		cache_list->head = cache_item->next_item;
-		cache_item->next_item->prev_item = NULL;
-	}
-	/* If it is the tail item */
-	else if (cache_item->next_item == NULL) {
-		cache_list->tail = cache_item->prev_item;
-		cache_item->prev_item->next_item = NULL;
-	}
-	/* If it is an item in the middle of the list */
-	else {
-		cache_item->next_item->prev_item = cache_item->prev_item;
-		cache_item->prev_item->next_item = cache_item->next_item;
-	}
-	cache_list->cached_item_count--;
-	cache_list->unused_size += cache_item->content_length;
+	shard->policy->remove(shard, cache_item);
+	wheel_remove(shard, cache_item);
+	shard->cached_item_count--;
+	shard->unused_size += cache_item->chunk_size;
 	if (DEBUG_MODE) printf("      remove_item_from_list() finish.\n");
 	return cache_item;
 }
 
-/* Insert an existing cache item into the cache list */
-Cache_Item *insert_item_to_listhead(Cache_List *cache_list, 
+/* Insert an existing cache item into the lists of the shard policy, 
+   where it places new items (the list head for most) */
+Cache_Item *insert_item_to_listhead(Cache_Shard *shard, 
 		Cache_Item *cache_item) 
 {
 	if (DEBUG_MODE) printf("      insert_item_to_listhead():\n");
-	/* If cache is empty */
-	if (cache_list->head == NULL && cache_list->tail == NULL) {
-		cache_item->next_item = NULL;
-		cache_item->prev_item = NULL;
-		cache_list->head = cache_item;
-		cache_list->tail = cache_item;
-	}
-	/* If cache is not empty */
-	else {
-		cache_list->head->prev_item = cache_item;
-		cache_item->next_item = cache_list->head;
-		cache_item->prev_item = NULL;
-		cache_list->head = cache_item;
-	}
-	cache_list->cached_item_count++;
-	cache_list->unused_size -= cache_item->content_length;
+	shard->policy->insert(shard, cache_item);
+	wheel_add(shard, cache_item);
+	shard->cached_item_count++;
+	shard->unused_size -= cache_item->chunk_size;
 	if (DEBUG_MODE) printf("      insert_item_to_listhead() finish.\n");
 	return cache_item;
 }
 
-/* Use an already existed cached item */
-void use_cache_item(Cache_List *cache_list, Cache_Item *cache_item, 
-		void *usrbuf, unsigned int *size) 
-{
+/* Use an already existed cached item: pin it (lock-free, inside an epoch, 
+   where the reference of the cache is still held) */
+void use_cache_item(Cache_Item *cache_item) {
 	if (DEBUG_MODE) printf("    use_cache_item():\n");
-	remove_item_from_list(cache_list, cache_item);
-	insert_item_to_listhead(cache_list, cache_item);
-	*size = cache_item->content_length;
-	/* Copy the content data into user-buffer */
-	memcpy(usrbuf, cache_item->content, *size);
+	/* Mark it recently used, for the eviction */
+	if (!__atomic_load_n(&cache_item->referenced, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&cache_item->referenced, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&cache_item->refcount, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cache_item->hits, 1, __ATOMIC_RELAXED);
 	if (DEBUG_MODE) printf("    use_cache_item() finish.\n");
 }
 
-/* Print the utilization status of the cache */
-void print_cache_status(Cache_List *cache_list) {
-	printf("\n\t(Cached items: %u\tFree cache: %u bytes, %u%%)\n\n", 
-		cache_list->cached_item_count, 
-		cache_list->unused_size, 
-		cache_list->unused_size * 100 / MAX_CACHE_SIZE);
-	check_cache_consistency(cache_list);
+/* Print the utilization status of a shard */
+void print_cache_status(Cache_List *cache_list, Cache_Shard *shard, 
+		unsigned int item_count, unsigned int unused_size)
+{
+	printf("\n\t(Shard %d/%u cached items: %u\t"
+		"Free shard: %u bytes, %u%%)\n\n",
+		(int) (shard - cache_list->shards), cache_list->shard_count, 
+		item_count, 
+		unused_size, 
+		(unsigned int) ((uint64_t) unused_size * 100 / shard->max_size));
 }
 
 /* Check the bi-directional consistency of the cache_list in a simple way */
 /* (Useful for quickly identifying problems when debugging) */
-void check_cache_consistency(Cache_List *cache_list) {
-	unsigned int cnt1 = 0, cnt2 = 0;
+void check_cache_consistency(Cache_Shard *shard) {
+	unsigned int cnt1 = shard->heap_count, cnt2 = shard->heap_count, i;
 	Cache_Item *cache_item;
-	/* Count cache_items in forward direction */
-	if (cache_list->head != NULL) {
-		cache_item = cache_list->head;
-		cnt1++;
-		while (cache_item->next_item != NULL) {
-			cache_item = cache_item->next_item;
+
+	for (i = 0; i < 2; i++) {
+		/* Count cache_items in forward direction */
+		for (cache_item = shard->queues[i].head; cache_item != NULL; 
+				cache_item = cache_item->next_item)
+		{
 			cnt1++;
 		}
-	}
-	/* Count cache_items in backward direction */
-	if (cache_list->tail != NULL) {
-		cache_item = cache_list->tail;
-		cnt2++;
-		while (cache_item->prev_item != NULL) {
-			cache_item = cache_item->prev_item;
+		/* Count cache_items in backward direction */
+		for (cache_item = shard->queues[i].tail; cache_item != NULL; 
+				cache_item = cache_item->prev_item)
+		{
 			cnt2++;
 		}
 	}
-	if (cnt1 != cnt2 || cnt1 != cache_list->cached_item_count) {
+	if (cnt1 != cnt2 || cnt1 != shard->cached_item_count
+			|| cnt1 != shard->index.count) 
+	{
 		printf("\tCache corrupted! Cached items: %u\tcnt1 :%u\tcnt2: %u\n", 
-				cache_list->cached_item_count, cnt1, cnt2);
+				shard->cached_item_count, cnt1, cnt2);
 		exit(1);
 	}
 }
@@ -348,4 +1033,28 @@ int Pthread_rwlock_unlock(pthread_rwlock_t *rwlock) {
 	int i = pthread_rwlock_unlock(rwlock);
     if (i != 0) unix_error("Pthread_rwlock_unlock error");
     return i;
-}
\ No newline at end of file
+}
+
+/******************************************
+ * Wrappers for the pthread_mutex_* functions 
+ ******************************************/
+
+int Pthread_mutex_init(pthread_mutex_t *mutex,
+		const pthread_mutexattr_t *attr)
+{
+	int i = pthread_mutex_init(mutex, attr);
+	if (i != 0) unix_error("Pthread_mutex_init error");
+	return i;
+}
+
+int Pthread_mutex_lock(pthread_mutex_t *mutex) {
+	int i = pthread_mutex_lock(mutex);
+	if (i != 0) unix_error("Pthread_mutex_lock error");
+	return i;
+}
+
+int Pthread_mutex_unlock(pthread_mutex_t *mutex) {
+	int i = pthread_mutex_unlock(mutex);
+	if (i != 0) unix_error("Pthread_mutex_unlock error");
+	return i;
+}
@@ -25,29 +25,82 @@
  tail of the cache list) from the cache, until the ready-to-be-inserted 
  cache item would fit the unused size of the cache. Finally the new item 
  is inserted into cache.
-	
-	As per one of the requirements, multiple threads can read the cache 
- simultaneously, while only one thread is allowed to write the cache at 
- any time and no other threads can read the cache when it is writing. 
- In the contex of this program, reading means searching the cache for 
- the specific item. And writing means adding a new cached_item to the 
- cache, or using a piece of cached content and updating its recentness 
- after it has been found in the cache.
-
-    Modifications to the cache are safely synchronized among threads by 
- reader-writer lock. Accesses to the cache are strictly thread-safe.
+
+    Items are found by URI through a hash index kept alongside the list 
+ (see "cache_index.c"), in constant time however many items are cached.
+
+    The cache is split into shards selected by the hash of the URI. Each 
+ shard is a cache of its own: its list, its index, its share of the 
+ cache memory, and a mutex that serializes the writers of the shard, so 
+ that requests for URIs in different shards never wait for each other.
+
+    Hits take no lock. They look the index up inside an epoch (see 
+ "epoch.c"), and pin the item they find. A 
+ cached item is immutable: the hit is sent to the client straight from 
+ the cache memory, and the item is unpinned afterwards. Evicted items are 
+ freed once no hit can still find them and the last pin is dropped. 
+ Each thread also keeps its hottest items pinned in an L1 (see 
+ "cache_l1.c"), looked up before the shard.
+
+    The order in which a shard evicts its items is up to its eviction 
+ policy (see "cache_policy.c"): LRU, CLOCK, SIEVE, SLRU, ARC or GDSF, 
+ chosen when the cache is initialized.
+
+    With admission on, a new object is only cached if the TinyLFU 
+ frequency sketch of its shard (see "cache_sketch.c") estimates that it 
+ was requested more often than the item it would evict.
+
+    An item, its URI and its content are one chunk of the slab allocator 
+ (see "slab.c"), and each shard charges its items the size of their 
+ chunks, so that the shard budgets add up to the memory of the cache. 
+ The content of an object too large for one chunk is split over 
+ Cache_Chunks of a whole slab page each, which the item lists in a 
+ table after its header; item_segment() gives the parts of any content.
+
+    The cache and object sizes are max_cache_size and max_object_size, 
+ set before init_cache_list() (the proxy takes them from its command line 
+ or its config file); the macros below are their defaults.
+
+    With a disk tier (see "cache_disk.c"), evicted items are written to 
+ disk, and a miss in memory reads the object back from there. Snapshots 
+ of the memory cache (see "cache_snapshot.c") survive restarts.
+
+    With the freshness on, only the responses that HTTP allows to cache 
+ are, until the end of their freshness lifetime (see "cache_fresh.c").
  */
 
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include "csapp.h"
+#include "cache_index.h"
+#include "cache_policy.h"
+#include "cache_sketch.h"
+#include "cache_fresh.h"
+#include "slab.h"
 
 #define DEBUG_MODE 0	/* 0=off; 1=on, prints verbose message for debugging */
 
-/* Recommended max cache and object sizes */
+/* Recommended max cache and object sizes. MAX_OBJECT_SIZE is also the 
+ * size of the buffers that stage the response headers */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
-/* Cache related global variable(s) */
-pthread_rwlock_t cache_rwlock;
+/* Largest cache and object sizes that can be set */
+#define CACHE_SIZE_LIMIT (16ULL << 30)
+#define OBJECT_SIZE_LIMIT (1U << 30)
+
+/* Max number of cache shards (power of 2). Fewer are used if a shard 
+ * would not hold a max_object_size object */
+#define CACHE_MAX_SHARDS 16
+
+/* What cache_admits() is told of the request a response answers: the 
+ * headers it carried that limit caching the response */
+#define CACHE_REQ_AUTHORIZATION	0x1
+#define CACHE_REQ_RANGE		0x2
+
+/* Content bytes of a Cache_Chunk */
+#define CACHE_CHUNK_DATA (SLAB_PAGE_SIZE - sizeof(Cache_Chunk))
 
 
    /*---------------------------------------*
@@ -65,55 +118,163 @@ pthread_rwlock_t cache_rwlock;
 	|	pthread_rwlock_unlock(&lock);		|
 	*---------------------------------------*/
 
+/* Cache_Chunk that tracks a slab page holding a part of the content of a 
+   large cache item. Starts like a Cache_Item, for the slab rebalancing */
+typedef struct Cache_Chunk {
+	struct Cache_Shard *shard;	/* As its item's */
+	struct Cache_Item *item;	/* Whose content it holds */
+} Cache_Chunk;
+
 /* Cache_Item that tracks a piece of cached content */
 typedef struct Cache_Item {
- 	char *uri;			/* Treated as string with a null terminator */
- 	char *content;		/* Treated as consecutive memory bytes */
+ 	struct Cache_Shard *shard;	/* Shard it is cached in, or NULL. First, 
+ 	 				 * as the slab keeps it NULL in free chunks */
+ 	struct Cache_Item *item;	/* Itself, as in its Cache_Chunks */
+ 	char *uri;			/* Treated as string with a null terminator, 
+ 	 				 * stored right after the Cache_Item */
+ 	char *content;		/* Treated as consecutive memory bytes, 
+ 	 				 * stored right after the URI, or NULL */
+ 	Cache_Chunk **chunks;	/* Or the content is in these, the table 
+ 	 				 * stored right after the Cache_Item */
+ 	unsigned int chunk_count;
  	unsigned int content_length;
+ 	unsigned int chunk_size;	/* Slab chunks of the whole item */
+ 	uint64_t hash;		/* index_hash() of the URI */
+ 	int referenced;		/* Hit since it was last at the list head */
+ 	int refcount;		/* One while cached, plus one per pinned hit */
+ 	int queue;			/* Cache_Queue of the shard it is in */
+ 	unsigned int hits;	/* Since it was cached */
+ 	unsigned int fetch_us;	/* Origin latency, what a miss on it costs */
+ 	int on_disk;		/* Read from the disk tier, which still has it */
+ 	double priority;	/* GDSF priority when pushed to the heap */
+ 	unsigned int heap_index;	/* Position in the GDSF heap */
+ 	time_t expires;		/* End of its freshness lifetime, or 0 */
+ 	struct Cache_Item *timer_next;	/* In its slot of the timer wheel */
+ 	struct Cache_Item **timer_prevp;	/* Or NULL, if not on the wheel */
  	struct Cache_Item *next_item;	/* Points to next Cache_Item */
  	struct Cache_Item *prev_item;	/* Points to previous Cache_Item */
 } Cache_Item;
 
-/* Cache_List stucture that tracks of all the Cache_Items */
-typedef struct Cache_List {
+/* Cache_Fill that tracks the content of a response of unknown length, 
+   received into slab pages until its cache item is built */
+typedef struct Cache_Fill {
+	Cache_Chunk **chunks;	/* Pages filled so far, the last one partly */
+	unsigned int chunk_count;
+	unsigned int length;	/* Content bytes in the pages */
+	int checked;		/* The headers went through cache_admits() */
+	time_t expires;		/* For the item, from cache_admits() */
+} Cache_Fill;
+
+/* Cache_Shard that tracks the Cache_Items of one part of the URIs */
+typedef struct Cache_Shard {
+	pthread_mutex_t mutex;	/* Serializes the writers of the shard */
 	unsigned int cached_item_count;
 	unsigned int unused_size;
-	Cache_Item *head;	/* Points to first Cache_Item or null if empty cache */
-	Cache_Item *tail;	/* Points to last Cache_Item or null if empty cache */
+	unsigned int max_size;	/* Byte budget of the shard */
+	const Cache_Policy *policy;	/* Eviction policy, see "cache_policy.c" */
+	Cache_Queue queues[2];	/* Cache_Items in the order of the policy */
+	Read_Buffer *read_buffers;	/* LRU hits to apply, READ_BUFFER_STRIPES */
+	Cache_Item *hand;	/* Next SIEVE victim, or NULL for the tail */
+	unsigned int target;	/* Bytes of queues[0] aimed for by ARC */
+	Ghost_Lists ghosts;	/* Recent ARC victims */
+	Cache_Item **heap;	/* GDSF min-heap of the items by priority */
+	unsigned int heap_count, heap_size;
+	double inflation;	/* GDSF priority of the last victim */
+	unsigned int generation;	/* Removals, see "cache_l1.c" */
+	Cache_Item **timers;	/* Timer wheel, FRESH_WHEEL_SLOTS, or NULL */
+	time_t timer_time;	/* Second the wheel was last advanced to */
+	int admission;		/* Only cache objects more popular than victims */
+	Cache_Sketch sketch;	/* Request frequencies, for the admission */
+	Cache_Index index;	/* Finds the Cache_Items by URI */
+} __attribute__((aligned(64))) Cache_Shard;	/* No false sharing of locks */
+
+/* Cache_List stucture that tracks of all the Cache_Shards */
+typedef struct Cache_List {
+	unsigned int shard_count;	/* Power of 2 */
+	Cache_Shard *shards;
+	int l1;			/* Serve the hottest hits from per-thread L1s */
+	int freshness;		/* Only cache fresh responses, see fresh_init() */
 } Cache_List;
 
 
 
+extern size_t max_cache_size;
+extern size_t max_object_size;
+extern int cache_memfd;		/* Keep the slab arena in a memfd */
+
+
 /*
  * Function prototypes
  */
-void init_cache_list(Cache_List *cache_list);
+void init_cache_list(Cache_List *cache_list, const Cache_Policy *policy, 
+		int admission);
 
-int search_and_get(Cache_List *cache_list, char *for_uri, void *usrbuf, 
-		unsigned int *size);
+Cache_Shard *cache_shard(Cache_List *cache_list, uint64_t hash);
 
-Cache_Item *search_cache_item(Cache_List *cache_list, char *for_uri);
+Cache_Item *search_and_pin(Cache_List *cache_list, char *for_uri);
+
+void unpin_cache_item(Cache_Item *cache_item);
+
+Cache_Item *search_cache_item(Cache_Shard *shard, char *for_uri);
+
+Cache_Item *alloc_cache_item(char *uri, unsigned int length);
+
+char *item_segment(Cache_Item *cache_item, unsigned int index, 
+		size_t *length);
 
 Cache_Item *build_cache_item(char *from_uri, char *from_content, 
 		unsigned int length);
 
+void init_cache_fill(Cache_Fill *fill);
+
+char *reserve_cache_fill(Cache_Fill *fill, size_t *room);
+
+int append_cache_fill(Cache_Fill *fill, const char *data, size_t n);
+
+int admit_cache_fill(Cache_List *cache_list, Cache_Fill *fill, char *uri, 
+		int request);
+
+Cache_Item *build_filled_item(Cache_Fill *fill, char *uri);
+
+void free_cache_fill(Cache_Fill *fill);
+
 void add_cache_item(Cache_List *cache_list, char *uri, char *content, 
-		unsigned int size);
+		unsigned int size, unsigned int fetch_us);
 
-void evict_cache_item(Cache_List *cache_list);
+void insert_cache_item(Cache_List *cache_list, Cache_Item *cache_item);
 
-Cache_Item *remove_item_from_list(Cache_List *cache_list, 
+int cache_admits(Cache_List *cache_list, char *uri, int request, 
+		const char *headers, size_t header_length, unsigned int length, 
+		time_t *expires);
+
+void evict_cache_item(Cache_Shard *shard);
+
+void destroy_cache_item(Cache_Shard *shard, Cache_Item *cache_item);
+
+Cache_Item *remove_item_from_list(Cache_Shard *shard, 
 		Cache_Item *cache_item);
 
-Cache_Item *insert_item_to_listhead(Cache_List *cache_list, 
+Cache_Item *insert_item_to_listhead(Cache_Shard *shard, 
 		Cache_Item *cache_item);
 
-void use_cache_item(Cache_List *cache_list, Cache_Item *cache_item, 
-		void *usrbuf, unsigned int *size);
+void use_cache_item(Cache_Item *cache_item);
+
+Cache_Item **pin_shard_items(Cache_Shard *shard, unsigned int *count);
+
+void free_cache_item(void *cache_item);
 
-void print_cache_status(Cache_List *cache_list);
+void print_cache_status(Cache_List *cache_list, Cache_Shard *shard, 
+		unsigned int item_count, unsigned int unused_size);
 
-void check_cache_consistency(Cache_List *cache_list);
+void check_cache_consistency(Cache_Shard *shard);
+
+/* Wrappers for the pthread_mutex_* functions */
+int Pthread_mutex_init(pthread_mutex_t *mutex,
+		const pthread_mutexattr_t *attr);
+
+int Pthread_mutex_lock(pthread_mutex_t *mutex);
+
+int Pthread_mutex_unlock(pthread_mutex_t *mutex);
 
 /* Wrappers for the pthread_rwlock_* functions */
 int Pthread_rwlock_init(pthread_rwlock_t *rwlock,
@@ -123,4 +284,6 @@ int Pthread_rwlock_rdlock(pthread_rwlock_t *rwlock);
 
 int Pthread_rwlock_wrlock(pthread_rwlock_t *rwlock);
 
-int Pthread_rwlock_unlock(pthread_rwlock_t *rwlock);
\ No newline at end of file
+int Pthread_rwlock_unlock(pthread_rwlock_t *rwlock);
+
+#endif /* __CACHE_H__ */
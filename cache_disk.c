@@ -0,0 +1,681 @@
+/*
+ cache_disk.c for proxy lab
+ ----------------------
+ Contains the disk tier of the cache, a log-structured store.
+
+   About disk tier design
+ ----------------------
+    The memory of the cache holds a fraction of the objects that clients
+ ask for again, so most evicted objects were fetched again from their
+ origin. With "--disk-cache", the objects evicted from memory, and those
+ too large for a shard, are kept on disk instead, and a miss in memory
+ looks there before going to the origin.
+
+    The disk tier is a log: a fixed number of segment files of the same
+ size, and objects are only ever appended to the active one, as a
+ Disk_Record followed by the URI and the content. An in-memory index,
+ a chained hash table of Disk_Entry, tells where the last record of each
+ URI is; a record no longer indexed is dead space. Each segment also
+ lists its indexed entries and counts their bytes.
+
+    Segments are DISK_SEGMENT_SIZE bytes, smaller if the tier would have
+ fewer than DISK_MIN_SEGMENTS, and larger if it would have more than
+ DISK_MAX_SEGMENTS: every segment keeps its file open, and 64 MB
+ segments would take 262144 descriptors for the largest tier. The
+ descriptor limit is raised to the hard limit, which must leave
+ DISK_SPARE_FDS descriptors for the connections besides the segments.
+
+    Evictions happen with a shard locked, so they only pin the item and
+ queue it (see disk_spill()). One writer thread appends the queued items
+ and unpins them; if the queue holds DISK_QUEUE_BYTES of content already,
+ the evicted object is dropped rather than keeping more memory pinned.
+
+    A miss in memory reads the record with pread() into a new cache item
+ (see disk_load()), which is then cached in memory again. Such an item
+ remembers that the disk has it, and is not written again when evicted.
+ The read pins the segment, since the writer must not reuse it
+ meanwhile. The event-driven engines read on their loop thread, which
+ blocks the loop for the time of the read.
+
+    When the active segment is full, the writer moves on to a free one.
+ It keeps one free segment at all times: once the last one is taken, the
+ segment with the fewest live bytes is cleaned. If less than
+ DISK_GC_LIVE_PERCENT of it is live, its live records are copied to the
+ active segment, which was just emptied and thus has room for them;
+ otherwise its objects are dropped, as the oldest in the cache would be.
+ The segment is then truncated and free, once no read has it pinned.
+
+    Only the writer changes the index and the segments, so it reads and
+ writes the files without the lock, which the readers only take to find
+ a record and to pin its segment.
+
+    The segment files outlive the proxy. On startup, the writer first
+ indexes the records they hold, while the proxy already serves, then
+ goes on with the evictions queued meanwhile. Every record carries the
+ time it was written at, so the latest record of a URI wins whatever
+ segment it is in, and a checksum of its URI and content, checked on
+ every read. A record cut short by a crash ends the scan of its segment,
+ which is truncated there.
+
+    Records also keep the time their object expires at (see
+ "cache_fresh.c"). Expired objects are neither written nor read, nor
+ indexed by the recovery, and the cleaning of a segment drops them.
+ */
+
+#include "cache.h"
+#include "cache_disk.h"
+
+/*
+ *  Global/shared variables
+ */
+Disk_Store disk_store;
+
+
+/*
+ * Function prototypes
+ */
+static void *writer_thread(void *args);
+static void recover_segment(unsigned int id);
+static void write_record(Cache_Item *item);
+static void next_segment(void);
+static unsigned int free_segment(void);
+static unsigned int emptiest_segment(void);
+static void clean_segment(unsigned int victim);
+static Disk_Entry *find_entry(char *uri, uint64_t hash);
+static void index_record(char *uri, Disk_Record *record,
+        unsigned int segment, size_t offset);
+static void link_entry(Disk_Entry *entry, unsigned int segment);
+static void unlink_entry(Disk_Entry *entry);
+static void remove_entry(Disk_Entry *entry);
+static int pread_full(int fd, void *buf, size_t n, size_t offset);
+static int pwrite_full(int fd, const void *buf, size_t n, size_t offset);
+
+
+
+/* Start a disk tier of size bytes in directory dir, with the records
+   already in its segment files. Returns -1 if they cannot be opened */
+int disk_init(const char *dir, size_t size) {
+    Disk_Store *store = &disk_store;
+    char path[MAXLINE];
+    struct rlimit rl;
+    pthread_t tid;
+    unsigned int i;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    store->segment_size = DISK_SEGMENT_SIZE;
+    if (size / DISK_MIN_SEGMENTS < store->segment_size) {
+        store->segment_size = size / DISK_MIN_SEGMENTS;
+    }
+    if (size / store->segment_size > DISK_MAX_SEGMENTS) {
+        store->segment_size = (size + DISK_MAX_SEGMENTS - 1)
+                / DISK_MAX_SEGMENTS;
+    }
+    store->segment_count = size / store->segment_size;
+
+    /* Every segment keeps its file open, besides the sockets */
+    raise_fd_limit();
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+            && rl.rlim_cur < store->segment_count + DISK_SPARE_FDS)
+    {
+        fprintf(stderr, "the disk cache needs %u descriptors for its "
+                "segments and %d for the connections, the limit is %lu\n",
+                store->segment_count, DISK_SPARE_FDS,
+                (unsigned long) rl.rlim_cur);
+        errno = EMFILE;
+        return -1;
+    }
+    store->segments = Calloc(store->segment_count, sizeof(Disk_Segment));
+    for (i = 0; i < store->segment_count; i++) {
+        snprintf(path, sizeof(path), "%s/segment-%04u.log", dir, i);
+        if ((store->segments[i].fd = open(path, O_RDWR | O_CREAT
+                | O_CLOEXEC, 0644)) < 0)
+        {
+            return -1;
+        }
+    }
+
+    store->bucket_count = 1024;
+    while (store->bucket_count < size / DISK_ITEM_BYTES
+            && store->bucket_count < DISK_MAX_BUCKETS)
+    {
+        store->bucket_count *= 2;
+    }
+    store->buckets = Calloc(store->bucket_count, sizeof(Disk_Entry *));
+    store->dir = strdup(dir);
+    store->active = 0;
+    store->recovering = 1;
+    store->queue = NULL;
+    store->queue_tail = &store->queue;
+    Pthread_mutex_init(&store->mutex, NULL);
+    pthread_cond_init(&store->changed, NULL);
+    store->enabled = 1;
+
+    Pthread_create(&tid, NULL, writer_thread, NULL);
+    Pthread_detach(tid);
+
+    printf("{ Disk cache: %s, %u segments of %zu bytes }\n\n", dir,
+            store->segment_count, store->segment_size);
+    return 0;
+}
+
+/* Queue an item evicted from memory (called with its shard locked) to be
+   written to disk, unless the disk has it already */
+void disk_spill(Cache_Item *item) {
+    Disk_Store *store = &disk_store;
+    Disk_Spill *spill;
+
+    if (!store->enabled || item->on_disk || ITEM_EXPIRED(item, time(NULL))
+            || sizeof(Disk_Record) + strlen(item->uri) + item->content_length
+            > store->segment_size)
+    {
+        return;
+    }
+    if ((spill = Malloc(sizeof(Disk_Spill))) == NULL) {
+        return;
+    }
+
+    Pthread_mutex_lock(&store->mutex);
+    if (store->queue_bytes + item->content_length > DISK_QUEUE_BYTES) {
+        /* The writer is behind: keep no more memory pinned */
+        store->dropped++;
+        Pthread_mutex_unlock(&store->mutex);
+        Free(spill);
+        return;
+    }
+    __atomic_add_fetch(&item->refcount, 1, __ATOMIC_RELAXED);
+    spill->item = item;
+    spill->next = NULL;
+    *store->queue_tail = spill;
+    store->queue_tail = &spill->next;
+    store->queue_bytes += item->content_length;
+    pthread_cond_signal(&store->changed);
+    Pthread_mutex_unlock(&store->mutex);
+}
+
+/* Read the object of uri from disk into a new cache item, not cached yet,
+   or return NULL if the disk does not have it */
+Cache_Item *disk_load(char *uri, uint64_t hash) {
+    Disk_Store *store = &disk_store;
+    Disk_Entry *entry;
+    Disk_Segment *segment;
+    Disk_Record record;
+    Cache_Item *item = NULL;
+    char stored_uri[MAXLINE], *part;
+    size_t offset, uri_length = strlen(uri), length;
+    uint32_t checksum = DISK_CHECKSUM_SEED;
+    unsigned int i;
+
+    Pthread_mutex_lock(&store->mutex);
+    /* An expired record is dropped when its segment is cleaned */
+    if ((entry = find_entry(uri, hash)) == NULL
+            || ITEM_EXPIRED(entry, time(NULL)))
+    {
+        store->misses++;
+        Pthread_mutex_unlock(&store->mutex);
+        return NULL;
+    }
+    /* The writer does not reuse the segment while it is read */
+    segment = &store->segments[entry->segment];
+    segment->readers++;
+    offset = entry->offset;
+    Pthread_mutex_unlock(&store->mutex);
+
+    if (pread_full(segment->fd, &record, sizeof(record), offset) == 0
+            && disk_record_size(&record, store->segment_size) != 0
+            && record.hash == hash && record.uri_length == uri_length
+            && pread_full(segment->fd, stored_uri, uri_length,
+            offset + sizeof(record)) == 0
+            && !memcmp(stored_uri, uri, uri_length)
+            && (item = alloc_cache_item(uri, record.content_length)) != NULL)
+    {
+        checksum = disk_checksum(checksum, uri, uri_length);
+        offset += sizeof(record) + uri_length;
+        for (i = 0; (part = item_segment(item, i, &length)) != NULL; i++) {
+            if (pread_full(segment->fd, part, length, offset) == -1)
+                break;
+            checksum = disk_checksum(checksum, part, length);
+            offset += length;
+        }
+        if (part != NULL || checksum != record.checksum) {
+            fprintf(stderr, "disk cache: bad record for %s\n", uri);
+            destroy_cache_item(NULL, item);
+            item = NULL;
+        }
+    }
+
+    Pthread_mutex_lock(&store->mutex);
+    if (--segment->readers == 0) {
+        pthread_cond_signal(&store->changed);
+    }
+    if (item != NULL)
+        store->hits++;
+    else
+        store->misses++;
+    Pthread_mutex_unlock(&store->mutex);
+
+    if (item != NULL) {
+        item->fetch_us = record.fetch_us;
+        item->on_disk = 1;
+        item->expires = record.expires;
+        printf("\tResponse content (%u bytes) for URI: %s has been read "
+                "from the disk cache.\n\n", item->content_length, uri);
+    }
+    return item;
+}
+
+/* Thread appending the queued items to the log */
+static void *writer_thread(void *args) {
+    Disk_Store *store = &disk_store;
+    Disk_Spill *spill;
+    unsigned int i;
+    uint64_t newest = 0;
+
+    /* Index the records of the last run first, appending after them */
+    for (i = 0; i < store->segment_count; i++) {
+        recover_segment(i);
+        if (store->sequence > newest) {
+            newest = store->sequence;
+            store->active = i;
+        }
+    }
+    store->recovering = 0;
+    printf("{ Disk cache: %u objects in %zu bytes recovered }\n\n",
+            store->objects, store->live);
+
+    while (1) {
+        Pthread_mutex_lock(&store->mutex);
+        while (store->queue == NULL) {
+            pthread_cond_wait(&store->changed, &store->mutex);
+        }
+        spill = store->queue;
+        if ((store->queue = spill->next) == NULL) {
+            store->queue_tail = &store->queue;
+        }
+        store->queue_bytes -= spill->item->content_length;
+        Pthread_mutex_unlock(&store->mutex);
+
+        write_record(spill->item);
+        unpin_cache_item(spill->item);
+        Free(spill);
+    }
+    return NULL;
+}
+
+/* Index the records of a segment file, up to the first one that is not
+   whole. Raises store->sequence to the latest one */
+static void recover_segment(unsigned int id) {
+    Disk_Store *store = &disk_store;
+    Disk_Segment *segment = &store->segments[id];
+    Disk_Record record;
+    char uri[MAXLINE];
+    struct stat st;
+    size_t offset = 0, length;
+
+    if (fstat(segment->fd, &st) < 0) {
+        unix_error_nexit("fstat error");
+        st.st_size = 0;
+    }
+    while (pread_full(segment->fd, &record, sizeof(record), offset) == 0) {
+        length = disk_record_size(&record, store->segment_size);
+        if (length == 0 || offset + length > (size_t) st.st_size
+                || pread_full(segment->fd, uri, record.uri_length,
+                offset + sizeof(record)) == -1)
+        {
+            break;
+        }
+        uri[record.uri_length] = '\0';
+        if (index_hash(uri) != record.hash) {
+            break;
+        }
+        if (!ITEM_EXPIRED(&record, time(NULL))) {
+            Pthread_mutex_lock(&store->mutex);
+            index_record(uri, &record, id, offset);
+            Pthread_mutex_unlock(&store->mutex);
+        }
+        if (record.sequence > store->sequence) {
+            store->sequence = record.sequence;
+        }
+        offset += length;
+    }
+
+    /* Whatever follows was cut short */
+    if (offset < (size_t) st.st_size && ftruncate(segment->fd, offset) < 0) {
+        unix_error_nexit("ftruncate error");
+    }
+    segment->size = offset;
+}
+
+/* Append the record of an item to the active segment and index it */
+static void write_record(Cache_Item *item) {
+    Disk_Store *store = &disk_store;
+    Disk_Record record;
+    Disk_Segment *segment;
+    struct timespec now;
+    size_t offset, length, part_length;
+    char *part;
+    unsigned int i;
+    int rc;
+
+    disk_record_init(&record, item);
+    /* Later than any record, even if the clock went back */
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.sequence = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    if (record.sequence <= store->sequence) {
+        record.sequence = store->sequence + 1;
+    }
+    store->sequence = record.sequence;
+    length = sizeof(record) + record.uri_length + record.content_length;
+
+    /* Twice at most: the segment after a compacted one is empty */
+    while (store->segments[store->active].size + length
+            > store->segment_size)
+    {
+        next_segment();
+    }
+    segment = &store->segments[store->active];
+    offset = segment->size;
+
+    rc = pwrite_full(segment->fd, &record, sizeof(record), offset);
+    if (rc == 0) {
+        rc = pwrite_full(segment->fd, item->uri, record.uri_length,
+                offset + sizeof(record));
+    }
+    offset += sizeof(record) + record.uri_length;
+    for (i = 0; rc == 0 && (part = item_segment(item, i, &part_length))
+            != NULL; i++)
+    {
+        rc = pwrite_full(segment->fd, part, part_length, offset);
+        offset += part_length;
+    }
+
+    Pthread_mutex_lock(&store->mutex);
+    /* The space is used even if the write failed */
+    segment->size += length;
+    if (rc == 0) {
+        index_record(item->uri, &record, store->active,
+                segment->size - length);
+        store->spills++;
+    }
+    Pthread_mutex_unlock(&store->mutex);
+
+    if (rc == 0) {
+        printf("\tResponse content (%u bytes) for URI: %s has been written "
+                "to the disk cache.\n\n", item->content_length, item->uri);
+    }
+    else {
+        fprintf(stderr, "disk cache write error: %s\n", strerror(errno));
+    }
+}
+
+/* Move on to a free segment, then clean a segment if it was the last */
+static void next_segment(void) {
+    Disk_Store *store = &disk_store;
+    unsigned int next;
+
+    if ((next = free_segment()) == store->segment_count) {
+        /* None left by the last run: the active one is full, so the
+           objects of the emptiest one are dropped */
+        next = emptiest_segment();
+        clean_segment(next);
+    }
+    store->active = next;
+    if (free_segment() == store->segment_count) {
+        clean_segment(emptiest_segment());
+    }
+}
+
+/* A free segment other than the active one, or segment_count */
+static unsigned int free_segment(void) {
+    unsigned int i;
+
+    for (i = 0; i < disk_store.segment_count; i++) {
+        if (i != disk_store.active && disk_store.segments[i].size == 0)
+            return i;
+    }
+    return disk_store.segment_count;
+}
+
+/* The segment other than the active one with the fewest live bytes */
+static unsigned int emptiest_segment(void) {
+    unsigned int i, victim = disk_store.segment_count;
+    size_t live = (size_t) -1;
+
+    for (i = 0; i < disk_store.segment_count; i++) {
+        if (i != disk_store.active && disk_store.segments[i].live < live) {
+            victim = i;
+            live = disk_store.segments[i].live;
+        }
+    }
+    return victim;
+}
+
+/* Copy the live records of a segment to the active one, or drop them if
+   most of it is live, then truncate it */
+static void clean_segment(unsigned int victim) {
+    Disk_Store *store = &disk_store;
+    Disk_Segment *from = &store->segments[victim];
+    Disk_Segment *to = &store->segments[store->active];
+    Disk_Entry *entry;
+    size_t offset, length;
+    int compact;
+    char *buf;
+
+    Pthread_mutex_lock(&store->mutex);
+    compact = (from->live * 100 < store->segment_size * DISK_GC_LIVE_PERCENT);
+    while ((entry = from->entries) != NULL) {
+        if (!compact || to->size + entry->length > store->segment_size
+                || ITEM_EXPIRED(entry, time(NULL)))
+        {
+            remove_entry(entry);
+            continue;
+        }
+        /* Only this thread changes the entries: no lock needed to copy */
+        offset = entry->offset;
+        length = entry->length;
+        Pthread_mutex_unlock(&store->mutex);
+        buf = Malloc(length);
+        if (buf != NULL && (pread_full(from->fd, buf, length, offset) == -1
+                || pwrite_full(to->fd, buf, length, to->size) == -1))
+        {
+            Free(buf);
+            buf = NULL;
+        }
+        Pthread_mutex_lock(&store->mutex);
+        if (buf == NULL) {
+            remove_entry(entry);
+            continue;
+        }
+        Free(buf);
+        unlink_entry(entry);
+        entry->offset = to->size;
+        link_entry(entry, store->active);
+        to->size += length;
+        store->compacted++;
+    }
+
+    /* Reads of it may still be going on */
+    while (from->readers > 0) {
+        pthread_cond_wait(&store->changed, &store->mutex);
+    }
+    if (ftruncate(from->fd, 0) < 0) {
+        unix_error_nexit("ftruncate error");
+    }
+    from->size = 0;
+    Pthread_mutex_unlock(&store->mutex);
+
+    printf("{ Disk cache: segment %u %s, %u objects in %zu bytes }\n\n",
+            victim, compact ? "compacted" : "dropped", store->objects,
+            store->live);
+}
+
+/* Fill in the header of the record of an item, but its sequence */
+void disk_record_init(Disk_Record *record, Cache_Item *item) {
+    size_t length;
+    char *part;
+    unsigned int i;
+
+    record->magic = DISK_RECORD_MAGIC;
+    record->uri_length = strlen(item->uri);
+    record->content_length = item->content_length;
+    record->fetch_us = item->fetch_us;
+    record->hash = item->hash;
+    record->sequence = 0;
+    record->checksum = disk_checksum(DISK_CHECKSUM_SEED, item->uri,
+            record->uri_length);
+    for (i = 0; (part = item_segment(item, i, &length)) != NULL; i++) {
+        record->checksum = disk_checksum(record->checksum, part, length);
+    }
+    record->expires = (uint32_t) item->expires;
+}
+
+/* Bytes of a record with this header, or 0 if it is not a valid header
+   of a record of at most room bytes */
+size_t disk_record_size(Disk_Record *record, size_t room) {
+    size_t length;
+
+    if (record->magic != DISK_RECORD_MAGIC || record->uri_length == 0
+            || record->uri_length >= MAXLINE)
+    {
+        return 0;
+    }
+    length = sizeof(Disk_Record) + record->uri_length
+            + (size_t) record->content_length;
+    return (length <= room) ? length : 0;
+}
+
+/* FNV-1a checksum of n more bytes, from DISK_CHECKSUM_SEED */
+uint32_t disk_checksum(uint32_t sum, const void *buf, size_t n) {
+    const unsigned char *p = (const unsigned char *) buf;
+
+    while (n-- > 0) {
+        sum = (sum ^ *p++) * 16777619U;
+    }
+    return sum;
+}
+
+/* Entry of uri in the index, or NULL. Called with the lock held */
+static Disk_Entry *find_entry(char *uri, uint64_t hash) {
+    Disk_Entry *entry;
+
+    entry = disk_store.buckets[(hash >> 16) & (disk_store.bucket_count - 1)];
+    for (; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && !strcmp(entry->uri, uri))
+            return entry;
+    }
+    return NULL;
+}
+
+/* Point the entry of the URI of item to a record just written, adding
+   it if needed. Called with the lock held */
+static void index_record(char *uri, Disk_Record *record,
+        unsigned int segment, size_t offset)
+{
+    Disk_Store *store = &disk_store;
+    Disk_Entry *entry, **bucket;
+
+    if ((entry = find_entry(uri, record->hash)) != NULL) {
+        if (entry->sequence > record->sequence) {
+            /* Found by the recovery after a later one */
+            return;
+        }
+        /* The older record becomes dead space */
+        unlink_entry(entry);
+    }
+    else {
+        if ((entry = Malloc(sizeof(Disk_Entry))) == NULL)
+            return;
+        if ((entry->uri = strdup(uri)) == NULL) {
+            Free(entry);
+            return;
+        }
+        entry->hash = record->hash;
+        bucket = &store->buckets[(record->hash >> 16)
+                & (store->bucket_count - 1)];
+        entry->next = *bucket;
+        *bucket = entry;
+        store->objects++;
+    }
+    entry->offset = offset;
+    entry->length = sizeof(Disk_Record) + record->uri_length
+            + record->content_length;
+    entry->sequence = record->sequence;
+    entry->expires = record->expires;
+    link_entry(entry, segment);
+}
+
+/* Add an entry to the list and the live bytes of a segment */
+static void link_entry(Disk_Entry *entry, unsigned int segment) {
+    Disk_Segment *seg = &disk_store.segments[segment];
+
+    entry->segment = segment;
+    entry->seg_next = seg->entries;
+    entry->seg_prevp = &seg->entries;
+    if (seg->entries != NULL)
+        seg->entries->seg_prevp = &entry->seg_next;
+    seg->entries = entry;
+    seg->live += entry->length;
+    disk_store.live += entry->length;
+}
+
+/* Remove an entry from the list and the live bytes of its segment */
+static void unlink_entry(Disk_Entry *entry) {
+    Disk_Segment *seg = &disk_store.segments[entry->segment];
+
+    *entry->seg_prevp = entry->seg_next;
+    if (entry->seg_next != NULL)
+        entry->seg_next->seg_prevp = entry->seg_prevp;
+    seg->live -= entry->length;
+    disk_store.live -= entry->length;
+}
+
+/* Drop an entry from the index */
+static void remove_entry(Disk_Entry *entry) {
+    Disk_Entry **entryp;
+
+    entryp = &disk_store.buckets[(entry->hash >> 16)
+            & (disk_store.bucket_count - 1)];
+    while (*entryp != entry) {
+        entryp = &(*entryp)->next;
+    }
+    *entryp = entry->next;
+    unlink_entry(entry);
+    disk_store.objects--;
+    free(entry->uri);
+    Free(entry);
+}
+
+/* Read n bytes at offset of fd. Returns 0, or -1 on error or end of file */
+static int pread_full(int fd, void *buf, size_t n, size_t offset) {
+    ssize_t rc;
+
+    while (n > 0) {
+        if ((rc = pread(fd, buf, n, offset)) <= 0) {
+            if (rc < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (char *) buf + rc;
+        n -= rc;
+        offset += rc;
+    }
+    return 0;
+}
+
+/* Write n bytes at offset of fd. Returns 0, or -1 on error */
+static int pwrite_full(int fd, const void *buf, size_t n, size_t offset) {
+    ssize_t rc;
+
+    while (n > 0) {
+        if ((rc = pwrite(fd, buf, n, offset)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const char *) buf + rc;
+        n -= rc;
+        offset += rc;
+    }
+    return 0;
+}
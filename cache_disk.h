@@ -0,0 +1,109 @@
+/*
+ cache_disk.h for proxy lab
+ ----------------------
+ Contains the disk tier of the cache, a log-structured store.
+ See "cache_disk.c" for the design.
+ */
+
+#ifndef __CACHE_DISK_H__
+#define __CACHE_DISK_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+#define DISK_SEGMENT_SIZE   (64 << 20)  /* Segment file size */
+#define DISK_MIN_SEGMENTS   4           /* Smaller segments if fewer */
+#define DISK_MAX_SEGMENTS   1024        /* Larger segments if more, as
+                                           each keeps a file open */
+#define DISK_SPARE_FDS      1024        /* Descriptors left for sockets */
+#define DISK_ITEM_BYTES     16384       /* Expected bytes per object */
+#define DISK_MAX_BUCKETS    (1U << 24)  /* Of the index, 128 MB of them */
+#define DISK_QUEUE_BYTES    (16 << 20)  /* Evicted bytes waiting at most */
+#define DISK_GC_LIVE_PERCENT 50         /* Compact a segment below this */
+#define DISK_RECORD_MAGIC   0x31435850  /* "PXC1" */
+#define DISK_CHECKSUM_SEED  2166136261U /* FNV-1a offset basis */
+
+/* Default and largest sizes of the disk tier */
+#define DISK_DEFAULT_SIZE   (1ULL << 30)
+#define DISK_SIZE_LIMIT     (16ULL << 40)
+
+struct Cache_Item;
+
+/* Disk_Record that tracks an object in a segment file or a snapshot,
+   where it is followed by its URI (without null terminator) and its
+   content */
+typedef struct Disk_Record {
+    uint32_t magic;
+    uint32_t uri_length;
+    uint32_t content_length;
+    uint32_t fetch_us;
+    uint64_t hash;              /* index_hash() of the URI */
+    uint64_t sequence;          /* Written at, in ns: the latest one wins */
+    uint32_t checksum;          /* disk_checksum() of URI and content */
+    uint32_t expires;           /* End of its freshness, in s, or 0 */
+} Disk_Record;
+
+/* Disk_Entry that tracks where the last record of a URI is */
+typedef struct Disk_Entry {
+    uint64_t hash;
+    char *uri;
+    unsigned int segment;
+    size_t offset;              /* Of the record in the segment file */
+    size_t length;              /* Of the whole record */
+    uint64_t sequence;          /* Of the record */
+    time_t expires;             /* Of the record */
+    struct Disk_Entry *next;    /* In the bucket of the index */
+    struct Disk_Entry *seg_next;    /* In the list of its segment */
+    struct Disk_Entry **seg_prevp;
+} Disk_Entry;
+
+/* Disk_Segment that tracks one segment file */
+typedef struct Disk_Segment {
+    int fd;
+    size_t size;                /* Bytes appended */
+    size_t live;                /* Bytes of the records still indexed */
+    Disk_Entry *entries;        /* Its records still indexed */
+    int readers;                /* Reads in progress */
+} Disk_Segment;
+
+/* Disk_Spill that tracks an evicted item waiting to be written */
+typedef struct Disk_Spill {
+    struct Cache_Item *item;    /* Pinned until written */
+    struct Disk_Spill *next;
+} Disk_Spill;
+
+/* Disk_Store that tracks the disk tier */
+typedef struct Disk_Store {
+    int enabled;
+    int recovering;             /* Still indexing the segment files */
+    char *dir;
+    pthread_mutex_t mutex;      /* Guards all below */
+    pthread_cond_t changed;     /* Spills queued, or reads done */
+    Disk_Entry **buckets;
+    unsigned int bucket_count;  /* Power of 2 */
+    Disk_Segment *segments;
+    unsigned int segment_count;
+    size_t segment_size;
+    unsigned int active;        /* Segment appended to */
+    uint64_t sequence;          /* Of the last record written */
+    Disk_Spill *queue, **queue_tail;
+    size_t queue_bytes;
+    unsigned int objects;
+    size_t live;
+    unsigned long hits, misses, spills, dropped, compacted;
+} Disk_Store;
+
+extern Disk_Store disk_store;
+
+
+/*
+ * Function prototypes
+ */
+int disk_init(const char *dir, size_t size);
+void disk_spill(struct Cache_Item *item);
+struct Cache_Item *disk_load(char *uri, uint64_t hash);
+void disk_record_init(Disk_Record *record, struct Cache_Item *item);
+size_t disk_record_size(Disk_Record *record, size_t room);
+uint32_t disk_checksum(uint32_t sum, const void *buf, size_t n);
+
+#endif /* __CACHE_DISK_H__ */
@@ -0,0 +1,435 @@
+/*
+ cache_fresh.c for proxy lab
+ ----------------------
+ Contains the freshness model of the cached responses, and the timer
+ wheel that reclaims them once they expire.
+
+   About freshness design
+ ----------------------
+    Every response that fit used to be cached, and served for as long as
+ it stayed in memory: error pages, responses the origin marked no-store
+ or private, pages setting a cookie, and objects long out of date. With
+ the freshness on (the proxy turns it on with fresh_init()), the response
+ headers, in the first segment of a new cache item, are parsed by
+ fresh_parse() before insert_cache_item() caches it.
+
+    A response is not cached if its status is not final or is a partial
+ or a 304 one, if its Cache-Control says no-store, no-cache or private
+ (or, without a Cache-Control, its Pragma says no-cache), if it sets a
+ cookie, or if it varies on "*". A response to a request that carried an
+ Authorization header is only cached if its Cache-Control says public,
+ must-revalidate or s-maxage (RFC 7234, section 3.2). The proxy keys its
+ objects on the URI alone, so the other Vary headers are not honoured.
+
+    Otherwise its freshness lifetime is that of s-maxage, of max-age, or
+ of Expires, in this order (an Expires that is not a date expired long
+ ago). Without any of them, the lifetime is heuristic:
+ FRESH_HEURISTIC_PERCENT of the time since Last-Modified, capped at
+ FRESH_HEURISTIC_MAX, for the statuses cacheable by default; without a
+ Last-Modified either, the successful ones get fresh_default_ttl, and
+ the errors are not cached. The age the response already has, from its
+ Age or its Date header, is taken off. The item keeps the time it
+ expires at in seconds, which the disk tier and the snapshots store
+ with its record.
+
+    A hit on an expired item is a miss. The expired items are also
+ reclaimed as they expire, rather than when the policy gets to them:
+ each shard keeps a hashed timer wheel of FRESH_WHEEL_SLOTS one-second
+ slots, each a list of the items that expire in a second of that slot,
+ FRESH_WHEEL_SLOTS seconds apart. Items are put on the wheel as they are
+ inserted into the shard and taken off as they are removed, with its
+ lock held. A reaper thread advances the wheels every second, up to the
+ current time, and destroys the expired items of the slots it passes;
+ those of a later turn of the wheel stay in their slot.
+ */
+
+#define _GNU_SOURCE
+#include "cache.h"
+
+/* Fresh_Headers that tracks what a response says of its freshness */
+typedef struct Fresh_Headers {
+    int status;
+    int cache_control;          /* Has a Cache-Control header */
+    int no_store;               /* no-store or no-cache */
+    int private;
+    int public;                 /* public, or must-revalidate */
+    int pragma_no_cache;
+    int cookie;
+    int vary_all;
+    long max_age, s_maxage, age;    /* In seconds, or -1 */
+    time_t date, expires, last_modified;    /* Or -1 */
+    int has_expires;
+} Fresh_Headers;
+
+/*
+ *  Global/shared variables
+ */
+unsigned int fresh_default_ttl = FRESH_DEFAULT_TTL;
+
+
+/*
+ * Function prototypes
+ */
+static void *reaper_thread(void *args);
+static void parse_header(Fresh_Headers *headers, const char *name,
+        size_t name_length, const char *value);
+static void parse_cache_control(Fresh_Headers *headers, const char *value);
+static long parse_seconds(const char *value);
+static time_t parse_http_date(const char *value);
+static int heuristic_status(int status);
+
+
+
+/* Turn the freshness of the cache on, with a timer wheel in every shard
+   and the thread that advances them */
+void fresh_init(Cache_List *cache_list) {
+    Cache_Shard *shard;
+    pthread_t tid;
+    unsigned int i;
+
+    for (i = 0; i < cache_list->shard_count; i++) {
+        shard = &cache_list->shards[i];
+        shard->timers = Calloc(FRESH_WHEEL_SLOTS, sizeof(Cache_Item *));
+        shard->timer_time = time(NULL);
+    }
+    cache_list->freshness = 1;
+    Pthread_create(&tid, NULL, reaper_thread, cache_list);
+    Pthread_detach(tid);
+}
+
+/* Advance the wheels of the shards every second */
+static void *reaper_thread(void *args) {
+    Cache_List *cache_list = (Cache_List *) args;
+    Cache_Shard *shard;
+    unsigned int i, reclaimed;
+    time_t now;
+
+    while (1) {
+        sleep(1);
+        now = time(NULL);
+        reclaimed = 0;
+        for (i = 0; i < cache_list->shard_count; i++) {
+            shard = &cache_list->shards[i];
+            Pthread_mutex_lock(&shard->mutex);
+            reclaimed += wheel_advance(shard, now);
+            Pthread_mutex_unlock(&shard->mutex);
+        }
+        if (reclaimed > 0) {
+            printf("{ Freshness: %u expired objects reclaimed }\n\n",
+                    reclaimed);
+        }
+    }
+    return NULL;
+}
+
+/* Put an item that expires on the wheel of its shard. Called with the
+   shard locked */
+void wheel_add(Cache_Shard *shard, Cache_Item *item) {
+    Cache_Item **slot;
+
+    if (shard->timers == NULL || item->expires == 0) {
+        return;
+    }
+    slot = &shard->timers[item->expires & (FRESH_WHEEL_SLOTS - 1)];
+    item->timer_next = *slot;
+    if (*slot != NULL)
+        (*slot)->timer_prevp = &item->timer_next;
+    item->timer_prevp = slot;
+    *slot = item;
+}
+
+/* Take an item off the wheel of its shard, if it is on it. Called with
+   the shard locked */
+void wheel_remove(Cache_Shard *shard, Cache_Item *item) {
+    if (item->timer_prevp == NULL) {
+        return;
+    }
+    *item->timer_prevp = item->timer_next;
+    if (item->timer_next != NULL)
+        item->timer_next->timer_prevp = item->timer_prevp;
+    item->timer_next = NULL;
+    item->timer_prevp = NULL;
+}
+
+/* Destroy the items of a shard that expired by now, in the slots from
+   the last time the wheel was advanced to. Called with the shard locked.
+   Returns how many were destroyed */
+unsigned int wheel_advance(Cache_Shard *shard, time_t now) {
+    Cache_Item *item, *next;
+    unsigned int reclaimed = 0;
+    time_t t = shard->timer_time;
+
+    /* A whole turn passes every slot */
+    if (now - t > FRESH_WHEEL_SLOTS) {
+        t = now - FRESH_WHEEL_SLOTS;
+    }
+    while (t < now) {
+        t++;
+        for (item = shard->timers[t & (FRESH_WHEEL_SLOTS - 1)];
+                item != NULL; item = next)
+        {
+            next = item->timer_next;
+            if (ITEM_EXPIRED(item, now)) {
+                destroy_cache_item(shard, item);
+                reclaimed++;
+            }
+        }
+    }
+    if (now > shard->timer_time) {
+        shard->timer_time = now;
+    }
+    return reclaimed;
+}
+
+/* Parse the status line and the headers at the start of a response of
+   length bytes, received at now, to a request that carried an
+   Authorization header if authorized. Returns FRESH_STORE and sets
+   *expires to the time it expires at if it may be cached, or the reason
+   why not */
+int fresh_parse(const char *response, size_t length, time_t now,
+        int authorized, time_t *expires)
+{
+    Fresh_Headers headers = {0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, -1, 0};
+    const char *line = response, *end, *colon, *value;
+    char buf[MAXLINE];
+    size_t left = length, n;
+    long lifetime, age;
+    time_t base;
+
+    /* "HTTP/1.x NNN", the response is not a string */
+    if (response == NULL || length < 12 || memcmp(response, "HTTP/1.", 7)
+            || response[8] != ' ' || !isdigit((unsigned char) response[9])
+            || !isdigit((unsigned char) response[10])
+            || !isdigit((unsigned char) response[11]))
+    {
+        return FRESH_NOT_HTTP;
+    }
+    headers.status = (response[9] - '0') * 100 + (response[10] - '0') * 10
+            + (response[11] - '0');
+    while (1) {
+        if ((end = memchr(line, '\n', left)) == NULL) {
+            /* The headers do not end in the first segment */
+            return FRESH_NOT_HTTP;
+        }
+        n = end - line;
+        if (n > 0 && line[n - 1] == '\r')
+            n--;
+        if (n == 0)
+            break;
+        if (line != response && n < sizeof(buf)
+                && (colon = memchr(line, ':', n)) != NULL)
+        {
+            memcpy(buf, line, n);
+            buf[n] = '\0';
+            for (value = buf + (colon - line) + 1; *value == ' '
+                    || *value == '\t'; value++)
+            {
+            }
+            parse_header(&headers, buf, colon - line, value);
+        }
+        left -= end + 1 - line;
+        line = end + 1;
+    }
+
+    if (headers.status < 200 || headers.status == 206
+            || headers.status == 304)
+    {
+        return FRESH_STATUS;
+    }
+    if (headers.no_store
+            || (!headers.cache_control && headers.pragma_no_cache))
+    {
+        return FRESH_NO_STORE;
+    }
+    if (headers.private)
+        return FRESH_PRIVATE;
+    if (authorized && !headers.public && headers.s_maxage < 0)
+        return FRESH_AUTHORIZED;
+    if (headers.cookie)
+        return FRESH_COOKIE;
+    if (headers.vary_all)
+        return FRESH_VARY;
+
+    /* The time of the origin, if it sent a sensible one */
+    base = (headers.date >= 0 && headers.date <= now) ? headers.date : now;
+    if (headers.s_maxage >= 0) {
+        lifetime = headers.s_maxage;
+    }
+    else if (headers.max_age >= 0) {
+        lifetime = headers.max_age;
+    }
+    else if (headers.has_expires) {
+        lifetime = headers.expires > base ? headers.expires - base : 0;
+    }
+    else if (!heuristic_status(headers.status)) {
+        return FRESH_STATUS;
+    }
+    else if (headers.last_modified >= 0 && headers.last_modified < base) {
+        lifetime = (base - headers.last_modified)
+                / 100 * FRESH_HEURISTIC_PERCENT;
+        if (lifetime > FRESH_HEURISTIC_MAX)
+            lifetime = FRESH_HEURISTIC_MAX;
+    }
+    else if (headers.status < 400) {
+        lifetime = fresh_default_ttl;
+    }
+    else {
+        return FRESH_STATUS;
+    }
+    if (lifetime > FRESH_MAX_LIFETIME) {
+        lifetime = FRESH_MAX_LIFETIME;
+    }
+
+    age = now - base;
+    if (headers.age > age) {
+        age = headers.age;
+    }
+    if (lifetime <= age) {
+        return FRESH_STALE;
+    }
+    *expires = now + (lifetime - age);
+    return FRESH_STORE;
+}
+
+/* What fresh_parse() returning rc means */
+const char *fresh_reason(int rc) {
+    switch (rc) {
+    case FRESH_STORE:
+        return "cacheable";
+    case FRESH_NOT_HTTP:
+        return "no HTTP headers";
+    case FRESH_STATUS:
+        return "status not cacheable";
+    case FRESH_NO_STORE:
+        return "no-store or no-cache";
+    case FRESH_PRIVATE:
+        return "private";
+    case FRESH_COOKIE:
+        return "sets a cookie";
+    case FRESH_VARY:
+        return "varies on everything";
+    case FRESH_STALE:
+        return "already stale";
+    case FRESH_AUTHORIZED:
+        return "request has Authorization";
+    }
+    return "unknown";
+}
+
+/* Take what a header line of name_length bytes tells of the freshness */
+static void parse_header(Fresh_Headers *headers, const char *name,
+        size_t name_length, const char *value)
+{
+#define IS_HEADER(s) \
+    (name_length == sizeof(s) - 1 && strncasecmp(name, s, name_length) == 0)
+
+    if (IS_HEADER("Cache-Control")) {
+        headers->cache_control = 1;
+        parse_cache_control(headers, value);
+    }
+    else if (IS_HEADER("Pragma")) {
+        if (strcasestr(value, "no-cache") != NULL)
+            headers->pragma_no_cache = 1;
+    }
+    else if (IS_HEADER("Set-Cookie") || IS_HEADER("Set-Cookie2")) {
+        headers->cookie = 1;
+    }
+    else if (IS_HEADER("Vary")) {
+        if (strchr(value, '*') != NULL)
+            headers->vary_all = 1;
+    }
+    else if (IS_HEADER("Expires")) {
+        /* Not a date: expired */
+        headers->has_expires = 1;
+        headers->expires = parse_http_date(value);
+    }
+    else if (IS_HEADER("Date")) {
+        headers->date = parse_http_date(value);
+    }
+    else if (IS_HEADER("Last-Modified")) {
+        headers->last_modified = parse_http_date(value);
+    }
+    else if (IS_HEADER("Age")) {
+        headers->age = parse_seconds(value);
+    }
+#undef IS_HEADER
+}
+
+/* Take the directives of a Cache-Control header, which may be one of
+   several */
+static void parse_cache_control(Fresh_Headers *headers, const char *value) {
+    char buf[MAXLINE], *directive, *save;
+
+    strncpy(buf, value, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for (directive = strtok_r(buf, ",", &save); directive != NULL;
+            directive = strtok_r(NULL, ",", &save))
+    {
+        while (*directive == ' ' || *directive == '\t')
+            directive++;
+        /* no-cache and private with field names are taken as a whole */
+        if (!strncasecmp(directive, "no-store", 8)
+                || !strncasecmp(directive, "no-cache", 8))
+        {
+            headers->no_store = 1;
+        }
+        else if (!strncasecmp(directive, "private", 7)) {
+            headers->private = 1;
+        }
+        else if (!strncasecmp(directive, "public", 6)
+                || !strncasecmp(directive, "must-revalidate", 15))
+        {
+            headers->public = 1;
+        }
+        else if (!strncasecmp(directive, "max-age=", 8)) {
+            headers->max_age = parse_seconds(directive + 8);
+        }
+        else if (!strncasecmp(directive, "s-maxage=", 9)) {
+            headers->s_maxage = parse_seconds(directive + 9);
+        }
+    }
+}
+
+/* A delta-seconds value, quoted or not, capped at FRESH_MAX_LIFETIME, or
+   0 if it is not one */
+static long parse_seconds(const char *value) {
+    long seconds = 0;
+
+    if (*value == '"')
+        value++;
+    if (*value < '0' || *value > '9')
+        return 0;
+    for (; *value >= '0' && *value <= '9'; value++) {
+        if (seconds < FRESH_MAX_LIFETIME)
+            seconds = seconds * 10 + (*value - '0');
+    }
+    return seconds < FRESH_MAX_LIFETIME ? seconds : FRESH_MAX_LIFETIME;
+}
+
+/* An HTTP-date in any of its three formats, or -1 */
+static time_t parse_http_date(const char *value) {
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",    /* IMF-fixdate */
+        "%A, %d-%b-%y %H:%M:%S GMT",    /* RFC 850 */
+        "%a %b %e %H:%M:%S %Y",         /* asctime() */
+    };
+    struct tm tm;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(value, formats[i], &tm) != NULL)
+            return timegm(&tm);
+    }
+    return -1;
+}
+
+/* Whether a status may be cached with a heuristic lifetime */
+static int heuristic_status(int status) {
+    switch (status) {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ cache_fresh.h for proxy lab
+ ----------------------
+ Contains the freshness model of the cached responses and the timer
+ wheel that reclaims them once they expire.
+ See "cache_fresh.c" for the design.
+ */
+
+#ifndef __CACHE_FRESH_H__
+#define __CACHE_FRESH_H__
+
+#include <time.h>
+
+#define FRESH_WHEEL_SLOTS   4096    /* Seconds of the wheel, power of 2 */
+#define FRESH_DEFAULT_TTL   300     /* Lifetime of responses with none */
+#define FRESH_HEURISTIC_PERCENT 10  /* Of the time since Last-Modified */
+#define FRESH_HEURISTIC_MAX (24 * 3600)     /* Longest heuristic lifetime */
+#define FRESH_MAX_LIFETIME  (365 * 24 * 3600)   /* Longest of any */
+
+/* Return values of fresh_parse() */
+#define FRESH_STORE         0   /* Cacheable, *expires is set */
+#define FRESH_NOT_HTTP      1   /* No status line, or headers too long */
+#define FRESH_STATUS        2   /* Status not cacheable without freshness */
+#define FRESH_NO_STORE      3   /* no-store, no-cache */
+#define FRESH_PRIVATE       4   /* For the client alone */
+#define FRESH_COOKIE        5   /* Sets a cookie */
+#define FRESH_VARY          6   /* Vary: *, never the same response */
+#define FRESH_STALE         7   /* Expired on arrival */
+#define FRESH_AUTHORIZED    8   /* Authorized request, not marked shared */
+
+/* True if a cache item is past its freshness lifetime at now */
+#define ITEM_EXPIRED(item, now) \
+    ((item)->expires != 0 && (item)->expires <= (now))
+
+struct Cache_Item;
+struct Cache_Shard;
+struct Cache_List;
+
+extern unsigned int fresh_default_ttl;
+
+
+/*
+ * Function prototypes
+ */
+void fresh_init(struct Cache_List *cache_list);
+int fresh_parse(const char *response, size_t length, time_t now,
+        int authorized, time_t *expires);
+const char *fresh_reason(int rc);
+void wheel_add(struct Cache_Shard *shard, struct Cache_Item *item);
+void wheel_remove(struct Cache_Shard *shard, struct Cache_Item *item);
+unsigned int wheel_advance(struct Cache_Shard *shard, time_t now);
+
+#endif /* __CACHE_FRESH_H__ */
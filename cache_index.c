@@ -0,0 +1,313 @@
+/*
+ cache_index.c for proxy lab
+ ----------------------
+ Contains the hash index of the cache items by URI.
+
+   About cache index design
+ ----------------------
+    search_cache_item() used to walk the whole cache list and strcmp()
+ every URI while holding the cache lock, which costs O(n) per request
+ once the cache holds many small objects. The list is still kept for
+ the LRU order, and this index finds an item by its URI in constant time.
+
+    The index is an open-addressing table in the style of the Swiss
+ table. Every URI gets a 64-bit hash, kept in its cache item. The low 7
+ bits (H2) are a fingerprint stored in a control byte per slot; the
+ other bits (H1) choose where probing starts. A control byte is either
+ a fingerprint (0 to 127), EMPTY or DELETED; both of the latter have the
+ sign bit set. Slots are probed by groups of INDEX_GROUP control bytes:
+ with SSE2 a group is loaded into one register and compared against the
+ fingerprint at once, giving a bit mask of the candidate slots, so a
+ lookup usually compares a single URI. A group holding an EMPTY slot
+ ends the probe. Groups are visited in triangular order, which reaches
+ every group of a power-of-2 table exactly once.
+
+    A removed item leaves a DELETED tombstone, unless its group still has
+ an EMPTY slot (then no probe can have passed through the group, and
+ the slot becomes EMPTY again). The table grows to twice its capacity
+ when full and deleted slots reach 7/8 of it, or is rebuilt in place
+ when most of them are tombstones.
+
+    Without SSE2 the group compare falls back to a plain loop over the
+ 16 control bytes, with the same table layout.
+
+    index_find() takes no lock: cache hits look items up while a writer
+ holding the shard lock inserts or removes others. A writer stores the
+ item pointer of a slot before its control byte, and a reader loads the
+ pointer after matching the byte, so a matched slot holds either NULL
+ (the item is being removed, skipped) or an item whose URI and hash are
+ complete. Rehashing never edits a table that readers may walk: it fills
+ a new Index_Table, publishes it with one pointer store, and retires the
+ old one through the epochs of "epoch.c", as the cache does with evicted
+ items. A lookup racing with the replacement of an item may miss it,
+ which is only a cache miss.
+ */
+
+#include "cache.h"
+#include "cache_index.h"
+#include "epoch.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CTRL_EMPTY      ((int8_t) -128)
+#define CTRL_DELETED    ((int8_t) -2)
+
+#define H1(hash)        ((hash) >> 7)
+#define H2(hash)        ((int8_t) ((hash) & 0x7f))
+
+
+/*
+ * Function prototypes
+ */
+static Index_Table *table_alloc(uint64_t capacity);
+static void table_free(void *arg);
+static void index_rehash(Cache_Index *index, uint64_t capacity);
+static uint64_t find_free_slot(Index_Table *table, uint64_t hash);
+static uint64_t find_item_slot(Index_Table *table, struct Cache_Item *item,
+        uint64_t hash);
+static void set_slot(Index_Table *table, uint64_t slot, int8_t ctrl,
+        Cache_Item *item);
+static inline unsigned int group_match(const int8_t *group, int8_t value);
+static inline unsigned int group_free(const int8_t *group);
+
+
+
+/* 64-bit hash of a URI: FNV-1a, then a final mix so that every bit,
+   including the 7 fingerprint bits, depends on the whole string */
+uint64_t index_hash(const char *uri) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*uri) {
+        hash = (hash ^ (unsigned char) *uri++) * 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* Initialize an empty index with room for about capacity items */
+void index_init(Cache_Index *index, uint64_t capacity) {
+    uint64_t slots = INDEX_MIN_SLOTS;
+
+    while (slots * 7 / 8 < capacity) {
+        slots *= 2;
+    }
+    index->table = table_alloc(slots);
+    index->count = 0;
+    index->deleted = 0;
+}
+
+/* Free the table, not the items. No reader may use the index anymore */
+void index_free(Cache_Index *index) {
+    table_free(index->table);
+    index->table = NULL;
+    index->count = index->deleted = 0;
+}
+
+/* Find the item of uri, or NULL. hash is index_hash(uri). Lock-free, but
+   must run inside an epoch if writers may run concurrently */
+Cache_Item *index_find(Cache_Index *index, const char *uri, uint64_t hash) {
+    Index_Table *table = __atomic_load_n(&index->table, __ATOMIC_ACQUIRE);
+    uint64_t mask = table->capacity / INDEX_GROUP - 1;
+    uint64_t group = H1(hash) & mask, i, slot;
+    unsigned int match;
+    int8_t *ctrl;
+    Cache_Item *item;
+
+    for (i = 0; i <= mask; i++) {
+        ctrl = table->ctrl + group * INDEX_GROUP;
+        match = group_match(ctrl, H2(hash));
+        while (match) {
+            slot = group * INDEX_GROUP + __builtin_ctz(match);
+            item = __atomic_load_n(&table->slots[slot], __ATOMIC_ACQUIRE);
+            if (item && item->hash == hash && !strcmp(item->uri, uri))
+                return item;
+            match &= match - 1;
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) {
+            return NULL;
+        }
+        group = (group + i + 1) & mask;     /* Triangular probing */
+    }
+    return NULL;
+}
+
+/* Add an item whose URI is not in the index yet. item->hash must be set.
+   Writers are serialized by the caller */
+void index_insert(Cache_Index *index, Cache_Item *item) {
+    Index_Table *table = index->table;
+    uint64_t slot;
+
+    if ((index->count + index->deleted + 1) * 8 > table->capacity * 7) {
+        /* Grow if really full, otherwise just clear the tombstones */
+        index_rehash(index, (index->count + 1) * 16 > table->capacity * 7 ?
+                table->capacity * 2 : table->capacity);
+        table = index->table;
+    }
+
+    slot = find_free_slot(table, item->hash);
+    if (table->ctrl[slot] == CTRL_DELETED) {
+        index->deleted--;
+    }
+    set_slot(table, slot, H2(item->hash), item);
+    index->count++;
+}
+
+/* Remove an item from the index. Writers are serialized by the caller */
+void index_remove(Cache_Index *index, Cache_Item *item) {
+    Index_Table *table = index->table;
+    uint64_t slot = find_item_slot(table, item, item->hash);
+    int8_t *ctrl;
+
+    if (slot == table->capacity) {
+        return;     /* Not indexed */
+    }
+    /* No probe went past a group with an empty slot */
+    ctrl = table->ctrl + slot / INDEX_GROUP * INDEX_GROUP;
+    if (group_match(ctrl, CTRL_EMPTY)) {
+        set_slot(table, slot, CTRL_EMPTY, NULL);
+    }
+    else {
+        set_slot(table, slot, CTRL_DELETED, NULL);
+        index->deleted++;
+    }
+    index->count--;
+}
+
+/* Tell if item is indexed, hash being the index_hash() of its URI. Only
+   compares pointers, so item may have been freed. Called by the writer */
+int index_contains(Cache_Index *index, Cache_Item *item, uint64_t hash) {
+    return find_item_slot(index->table, item, hash) != index->table->capacity;
+}
+
+/* Slot of item, or capacity if it is not in the table */
+static uint64_t find_item_slot(Index_Table *table, Cache_Item *item,
+        uint64_t hash)
+{
+    uint64_t mask = table->capacity / INDEX_GROUP - 1;
+    uint64_t group = H1(hash) & mask, i, slot;
+    unsigned int match;
+    int8_t *ctrl;
+
+    for (i = 0; i <= mask; i++) {
+        ctrl = table->ctrl + group * INDEX_GROUP;
+        match = group_match(ctrl, H2(hash));
+        while (match) {
+            slot = group * INDEX_GROUP + __builtin_ctz(match);
+            if (table->slots[slot] == item)
+                return slot;
+            match &= match - 1;
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) {
+            break;
+        }
+        group = (group + i + 1) & mask;
+    }
+    return table->capacity;
+}
+
+/* Allocate an empty table of capacity slots */
+static Index_Table *table_alloc(uint64_t capacity) {
+    Index_Table *table = Malloc(sizeof(Index_Table));
+    int rc;
+
+    /* Groups are loaded with aligned 16-byte loads */
+    if ((rc = posix_memalign((void **) &table->ctrl, INDEX_GROUP,
+            capacity)) != 0)
+    {
+        posix_error(rc, "posix_memalign error");
+    }
+    memset(table->ctrl, CTRL_EMPTY, capacity);
+    table->slots = Calloc(capacity, sizeof(Cache_Item *));
+    table->capacity = capacity;
+    return table;
+}
+
+static void table_free(void *arg) {
+    Index_Table *table = (Index_Table *) arg;
+
+    free(table->ctrl);
+    free(table->slots);
+    Free(table);
+}
+
+/* Move all items to a new table of capacity slots, then publish it */
+static void index_rehash(Cache_Index *index, uint64_t capacity) {
+    Index_Table *old = index->table, *table = table_alloc(capacity);
+    uint64_t i, slot;
+
+    for (i = 0; i < old->capacity; i++) {
+        if (old->ctrl[i] >= 0) {
+            slot = find_free_slot(table, old->slots[i]->hash);
+            table->ctrl[slot] = H2(old->slots[i]->hash);
+            table->slots[slot] = old->slots[i];
+        }
+    }
+    __atomic_store_n(&index->table, table, __ATOMIC_RELEASE);
+    index->deleted = 0;
+    epoch_retire(old, table_free);
+}
+
+/* First empty or deleted slot on the probe sequence of hash */
+static uint64_t find_free_slot(Index_Table *table, uint64_t hash) {
+    uint64_t mask = table->capacity / INDEX_GROUP - 1;
+    uint64_t group = H1(hash) & mask, i;
+    unsigned int free_mask;
+
+    for (i = 0; i <= mask; i++) {
+        if ((free_mask = group_free(table->ctrl + group * INDEX_GROUP)) != 0)
+            return group * INDEX_GROUP + __builtin_ctz(free_mask);
+        group = (group + i + 1) & mask;
+    }
+    /* Unreachable: the table is never allowed to fill up */
+    app_error("Cache index is full");
+    return 0;
+}
+
+/* Fill or clear a slot for concurrent readers: a reader that matches the
+   new control byte finds the new item pointer, or NULL */
+static void set_slot(Index_Table *table, uint64_t slot, int8_t ctrl,
+        Cache_Item *item)
+{
+    __atomic_store_n(&table->slots[slot], item, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->ctrl[slot], ctrl, __ATOMIC_RELEASE);
+}
+
+/* Bit mask of the control bytes of a group equal to value */
+static inline unsigned int group_match(const int8_t *group, int8_t value) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128((const __m128i *) group);
+    return (unsigned int) _mm_movemask_epi8(
+            _mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
+#else
+    unsigned int mask = 0;
+    int i;
+
+    for (i = 0; i < INDEX_GROUP; i++) {
+        if (group[i] == value)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+/* Bit mask of the empty or deleted slots of a group (sign bit set) */
+static inline unsigned int group_free(const int8_t *group) {
+#ifdef __SSE2__
+    return (unsigned int) _mm_movemask_epi8(
+            _mm_load_si128((const __m128i *) group));
+#else
+    unsigned int mask = 0;
+    int i;
+
+    for (i = 0; i < INDEX_GROUP; i++) {
+        if (group[i] < 0)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
@@ -0,0 +1,48 @@
+/*
+ cache_index.h for proxy lab
+ ----------------------
+ Contains the hash index of the cache items by URI.
+ See "cache_index.c" for the design of the table.
+ */
+
+#ifndef __CACHE_INDEX_H__
+#define __CACHE_INDEX_H__
+
+#include <stdint.h>
+
+#define INDEX_GROUP      16     /* Control bytes probed at once */
+#define INDEX_MIN_SLOTS  64     /* Initial capacity (power of 2) */
+
+struct Cache_Item;
+
+/* Index_Table that tracks the slots of a Cache_Index. Replaced as a whole
+   when the index grows, so that readers always see a consistent table */
+typedef struct Index_Table {
+    uint64_t capacity;          /* Slots, a power of 2 */
+    int8_t *ctrl;               /* One control byte per slot */
+    struct Cache_Item **slots;
+} Index_Table;
+
+/* Cache_Index that maps URIs to their cache items. index_find() may run
+   concurrently with one writer, inside an epoch (see "epoch.c") */
+typedef struct Cache_Index {
+    Index_Table *table;
+    uint64_t count;             /* Full slots */
+    uint64_t deleted;           /* Tombstones */
+} Cache_Index;
+
+
+/*
+ * Function prototypes
+ */
+uint64_t index_hash(const char *uri);
+void index_init(Cache_Index *index, uint64_t capacity);
+void index_free(Cache_Index *index);
+struct Cache_Item *index_find(Cache_Index *index, const char *uri,
+        uint64_t hash);
+void index_insert(Cache_Index *index, struct Cache_Item *item);
+void index_remove(Cache_Index *index, struct Cache_Item *item);
+int index_contains(Cache_Index *index, struct Cache_Item *item,
+        uint64_t hash);
+
+#endif /* __CACHE_INDEX_H__ */
@@ -0,0 +1,170 @@
+/*
+ cache_l1.c for proxy lab
+ ----------------------
+ Contains the per-thread L1 of the hottest cache items.
+
+   About L1 design
+ ----------------------
+    A few objects (the front page, the logo, the style sheets) make up
+ most of the hits. Each of their hits entered an epoch, whose record the
+ reclaiming writers scan, and probed the index of the shard, whose table
+ every thread reads and the writers change. Each thread now keeps its
+ own direct-mapped table of L1_SLOTS items, found by their URI hash, and
+ search_and_pin() looks there first.
+
+    The L1 pins the items it holds, so an item found there is valid
+ without any epoch. An item enters the L1 of a thread on a shared hit,
+ once it has been hit L1_MIN_HITS times, and takes its slot over an item
+ hit less often, or no longer cached.
+
+    An evicted or replaced item must stop being served from the L1s. Every
+ shard counts its removals in a generation counter, written only by the
+ writer of the shard, and each entry remembers the generation it was last
+ checked at. An entry of the current generation is served as is. Once the
+ generation moved on, the entry checks that its item still belongs to the
+ shard (the item is pinned, so it can still be read), and takes the new
+ generation, or is dropped. Between removals, an L1 hit thus only reads
+ the generation, a line of the shard that changes once per eviction, and
+ the item it sends anyway.
+
+    The pins of the L1 keep the items it holds allocated after their
+ eviction. So a lookup that finds the generation of its entry moved on
+ sweeps the whole L1 of its thread, and unpins every item no longer cached, not
+ only the one it looked up: the slots the thread does not look up again
+ do not hold their evicted items. Only a thread that stops looking items
+ up keeps its pins, until it exits and its L1 is released.
+ */
+
+#include "cache.h"
+#include "cache_l1.h"
+
+/*
+ *  Global/shared variables
+ */
+static pthread_key_t l1_key;
+static pthread_once_t l1_once = PTHREAD_ONCE_INIT;
+static __thread L1_Entry *l1_table = NULL;
+
+
+/*
+ * Function prototypes
+ */
+static L1_Entry *l1_entry(uint64_t hash, int create);
+static void l1_sweep(void);
+static void create_l1_key(void);
+static void release_l1(void *arg);
+
+
+
+/* The item of uri in the L1 of this thread, still cached in shard, or
+   NULL. The item is not pinned for the caller */
+Cache_Item *l1_find(Cache_Shard *shard, const char *uri, uint64_t hash) {
+    L1_Entry *entry = l1_entry(hash, 0);
+    unsigned int generation;
+
+    if (entry == NULL || entry->item == NULL || entry->hash != hash
+            || strcmp(entry->item->uri, uri))
+    {
+        return NULL;
+    }
+
+    generation = __atomic_load_n(&shard->generation, __ATOMIC_ACQUIRE);
+    if (entry->generation != generation) {
+        /* Some item left the shard: drop those the L1 still holds, this
+         * one included if it is one of them */
+        l1_sweep();
+        if (entry->item == NULL) {
+            return NULL;
+        }
+        entry->generation = generation;
+    }
+    return entry->item;
+}
+
+/* Unpin the items of the L1 of this thread that are no longer cached */
+static void l1_sweep(void) {
+    L1_Entry *entry;
+    int i;
+
+    for (i = 0; i < L1_SLOTS; i++) {
+        entry = &l1_table[i];
+        if (entry->item != NULL
+                && __atomic_load_n(&entry->item->shard, __ATOMIC_ACQUIRE)
+                == NULL)
+        {
+            unpin_cache_item(entry->item);
+            entry->item = NULL;
+        }
+    }
+}
+
+/* Consider an item just hit in shard, and pinned by the caller, for the
+   L1 of this thread. Chunked items stay out: an evicted one would keep
+   its pages from the slab until the L1 drops it */
+void l1_offer(Cache_Shard *shard, Cache_Item *item) {
+    L1_Entry *entry;
+    unsigned int hits = __atomic_load_n(&item->hits, __ATOMIC_RELAXED);
+
+    if (hits < L1_MIN_HITS || item->chunks != NULL
+            || (entry = l1_entry(item->hash, 1)) == NULL)
+    {
+        return;
+    }
+    if (entry->item == item) {
+        return;
+    }
+    if (entry->item != NULL) {
+        /* Keep the hotter one */
+        if (__atomic_load_n(&entry->item->shard, __ATOMIC_RELAXED) != NULL
+                && __atomic_load_n(&entry->item->hits, __ATOMIC_RELAXED)
+                >= hits)
+        {
+            return;
+        }
+        unpin_cache_item(entry->item);
+    }
+
+    /* Read the generation before the item is checked again */
+    entry->generation = __atomic_load_n(&shard->generation,
+            __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&item->shard, __ATOMIC_ACQUIRE) != shard) {
+        entry->item = NULL;
+        return;
+    }
+    __atomic_add_fetch(&item->refcount, 1, __ATOMIC_RELAXED);
+    entry->item = item;
+    entry->hash = item->hash;
+}
+
+/* Slot of hash in the L1 of this thread, allocated first if create */
+static L1_Entry *l1_entry(uint64_t hash, int create) {
+    if (l1_table == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        pthread_once(&l1_once, create_l1_key);
+        l1_table = Calloc(L1_SLOTS, sizeof(L1_Entry));
+        pthread_setspecific(l1_key, l1_table);
+    }
+    return &l1_table[(hash >> 32) & (L1_SLOTS - 1)];
+}
+
+static void create_l1_key(void) {
+    int rc;
+
+    if ((rc = pthread_key_create(&l1_key, release_l1)) != 0) {
+        posix_error(rc, "pthread_key_create error");
+    }
+}
+
+/* Thread exit: drop the pins of its L1 */
+static void release_l1(void *arg) {
+    L1_Entry *table = (L1_Entry *) arg;
+    int i;
+
+    for (i = 0; i < L1_SLOTS; i++) {
+        if (table[i].item != NULL)
+            unpin_cache_item(table[i].item);
+    }
+    Free(table);
+}
@@ -0,0 +1,34 @@
+/*
+ cache_l1.h for proxy lab
+ ----------------------
+ Contains the per-thread L1 of the hottest cache items.
+ See "cache_l1.c" for the design.
+ */
+
+#ifndef __CACHE_L1_H__
+#define __CACHE_L1_H__
+
+#include <stdint.h>
+
+#define L1_SLOTS        32      /* Items per thread, a power of 2 */
+#define L1_MIN_HITS     2       /* Shared hits before an item may enter */
+
+struct Cache_Item;
+struct Cache_Shard;
+
+/* L1_Entry that tracks an item held by the L1 of a thread */
+typedef struct L1_Entry {
+    struct Cache_Item *item;    /* Pinned by the L1, or NULL */
+    uint64_t hash;              /* index_hash() of its URI */
+    unsigned int generation;    /* Of its shard when last checked */
+} L1_Entry;
+
+
+/*
+ * Function prototypes
+ */
+struct Cache_Item *l1_find(struct Cache_Shard *shard, const char *uri,
+        uint64_t hash);
+void l1_offer(struct Cache_Shard *shard, struct Cache_Item *item);
+
+#endif /* __CACHE_L1_H__ */
@@ -0,0 +1,758 @@
+/*
+ cache_policy.c for proxy lab
+ ----------------------
+ Contains the eviction policies of the cache shards.
+
+   About cache policy design
+ ----------------------
+    The cache used to hardcode its eviction order. Each shard now has a
+ Cache_Policy, chosen by name when the cache is initialized, which keeps
+ the items of the shard in up to two Cache_Queues, picks the victim when
+ the shard is full, and may react to hits. Hits pin their item without
+ any lock and set its referenced flag (see "cache.c"), so all policies
+ but LRU learn about hits from that flag alone, lazily, when they look
+ for a victim: a hit never writes a list pointer.
+
+    lru     The original policy: a hit moves the item to the head of the
+            list, the tail is evicted. Hits used to lock the shard each
+            to relink the list; now, as in Caffeine, a hit records its
+            item into one of READ_BUFFER_STRIPES ring buffers of the
+            shard, picked by thread, and whoever holds the shard mutex
+            applies the buffered hits in a batch: a hit that fills its buffer to
+            READ_BUFFER_DRAIN tries the mutex, and the eviction always
+            drains first. A hit finding its buffer full, or racing for a
+            slot, is dropped; LRU only needs most of them. The order is
+            thus LRU up to the hits still buffered, while a hit takes the
+            mutex about once per READ_BUFFER_DRAIN hits, and never waits
+            for it. A buffered item is not pinned, so that it does not
+            hold memory once evicted: the drain only moves the items that
+            the index of the shard still holds, comparing pointers.
+
+    clock   One list used as the clock. A referenced tail item gets a
+            second chance: its flag is cleared and it moves to the head.
+
+    sieve   One FIFO list that is never reordered. A hand walks from the
+            tail towards the head, clearing the flags of referenced items
+            and stopping at the first unreferenced one, which is evicted;
+            the hand stays there for the next eviction. New items enter
+            at the head, so one-hit items of a scan go away quickly while
+            hot items stay wherever they are.
+
+    slru    Segmented LRU: new items enter a probation list; a referenced
+            item at the probation tail is promoted to a protected list
+            holding up to SLRU_PROTECTED_PERCENT of the shard, whose
+            overflow is demoted back to probation. Unreferenced items are
+            evicted from the probation tail, so a scan only ever churns
+            probation.
+
+    arc     ARC in its CLOCK form (CAR), since hits only set the flag.
+            T1 holds the items seen once, T2 those referenced since they
+            were cached. The shard remembers the URI hashes of recent
+            victims in two ghost lists, B1 for T1 and B2 for T2. A miss
+            on a URI in B1 means T1 was too small, and raises the target
+            size of T1; one in B2 lowers it, and the item enters T2. The
+            victim comes from T1 while T1 is over its target: its
+            referenced tail items move to T2, the others are evicted.
+            Sizes are counted in bytes, as the objects vary in size.
+
+    gdsf    GreedyDual-Size-Frequency, which weighs what an item saves
+            against the room it takes: every item records its hits and
+            how long the origin took to send it (fetch_us), the cost of
+            a miss on it. Its priority is L + hits * cost / size, and the
+            item of lowest priority is evicted, from a min-heap instead
+            of the queues. L, the inflation, is the priority of the last
+            victim, so that items that stopped being hit eventually age
+            out. This maximizes the hits per cached byte (hit ratio).
+
+    gdsf-bytes  The same with priority L + hits * cost, which keeps the
+            items that save the most bytes and latency regardless of
+            their size (byte hit ratio).
+
+    Items are always evicted through victim() and destroy_cache_item(),
+ which calls remove(); items removed for other reasons (replaced, or
+ evicted by the slab rebalancing) go through remove() as well, so the
+ policies keep no dangling pointer. victim() gives second chances, moves
+ the SIEVE hand, records the ARC ghost and raises the GDSF inflation, all
+ of which assume that its victim goes; the TinyLFU admission, which may
+ keep it, asks peek() instead: the first item victim() would find
+ unreferenced, without clearing any flag or moving any item. Only LRU
+ and GDSF change something, the hits they have yet to apply, which they
+ apply the same way whether or not an item is evicted afterwards.
+ */
+
+#include "cache.h"
+
+/*
+ * Function prototypes
+ */
+static void queue_init(Cache_Shard *shard);
+static void queue_insert(Cache_Shard *shard, Cache_Item *item);
+static void queue_unlink(Cache_Shard *shard, Cache_Item *item);
+static void move_to_head(Cache_Shard *shard, Cache_Item *item, int queue);
+static int test_and_clear(Cache_Item *item);
+static void lru_init(Cache_Shard *shard);
+static void lru_hit(Cache_Shard *shard, Cache_Item *item);
+static void lru_drain(Cache_Shard *shard);
+static Cache_Item *lru_victim(Cache_Shard *shard);
+static Cache_Item *clock_victim(Cache_Shard *shard);
+static Cache_Item *clock_peek(Cache_Shard *shard);
+static Cache_Item *first_unreferenced(Cache_Queue *queue);
+static void sieve_remove(Cache_Shard *shard, Cache_Item *item);
+static Cache_Item *sieve_victim(Cache_Shard *shard);
+static Cache_Item *sieve_peek(Cache_Shard *shard);
+static Cache_Item *slru_victim(Cache_Shard *shard);
+static Cache_Item *slru_peek(Cache_Shard *shard);
+static void arc_insert(Cache_Shard *shard, Cache_Item *item);
+static Cache_Item *arc_victim(Cache_Shard *shard);
+static Cache_Item *arc_peek(Cache_Shard *shard);
+static Cache_Ghost *ghost_find(Ghost_Lists *ghosts, uint64_t hash);
+static void ghost_add(Ghost_Lists *ghosts, int list, Cache_Item *item);
+static void ghost_drop(Ghost_Lists *ghosts, Cache_Ghost *ghost);
+static double gdsf_value(Cache_Item *item, int per_byte);
+static void gdsf_insert(Cache_Shard *shard, Cache_Item *item);
+static void gdsf_bytes_insert(Cache_Shard *shard, Cache_Item *item);
+static void gdsf_push(Cache_Shard *shard, Cache_Item *item, int per_byte);
+static void gdsf_remove(Cache_Shard *shard, Cache_Item *item);
+static Cache_Item *gdsf_victim(Cache_Shard *shard);
+static Cache_Item *gdsf_bytes_victim(Cache_Shard *shard);
+static Cache_Item *gdsf_pop_victim(Cache_Shard *shard, int per_byte);
+static Cache_Item *gdsf_peek(Cache_Shard *shard);
+static Cache_Item *gdsf_bytes_peek(Cache_Shard *shard);
+static Cache_Item *gdsf_reprice(Cache_Shard *shard, int per_byte);
+static void heap_set(Cache_Shard *shard, unsigned int index,
+        Cache_Item *item);
+static void heap_sift_up(Cache_Shard *shard, unsigned int index);
+static void heap_sift_down(Cache_Shard *shard, unsigned int index);
+
+/*
+ *  Global/shared variables
+ */
+const Cache_Policy cache_policies[] = {
+    {"lru", lru_init, queue_insert, queue_unlink, lru_hit, lru_victim,
+            lru_victim},
+    {"clock", queue_init, queue_insert, queue_unlink, NULL, clock_victim,
+            clock_peek},
+    {"sieve", queue_init, queue_insert, sieve_remove, NULL, sieve_victim,
+            sieve_peek},
+    {"slru", queue_init, queue_insert, queue_unlink, NULL, slru_victim,
+            slru_peek},
+    {"arc", queue_init, arc_insert, queue_unlink, NULL, arc_victim,
+            arc_peek},
+    {"gdsf", queue_init, gdsf_insert, gdsf_remove, NULL, gdsf_victim,
+            gdsf_peek},
+    {"gdsf-bytes", queue_init, gdsf_bytes_insert, gdsf_remove, NULL,
+            gdsf_bytes_victim, gdsf_bytes_peek},
+    {NULL}
+};
+
+
+
+/* The policy of this name, or NULL if there is none */
+const Cache_Policy *find_cache_policy(const char *name) {
+    const Cache_Policy *policy;
+
+    for (policy = cache_policies; policy->name != NULL; policy++) {
+        if (!strcmp(policy->name, name))
+            return policy;
+    }
+    return NULL;
+}
+
+/* Insert an item at the head of a queue */
+void queue_push_head(Cache_Queue *queue, Cache_Item *item) {
+    item->prev_item = NULL;
+    item->next_item = queue->head;
+    if (queue->head != NULL)
+        queue->head->prev_item = item;
+    else
+        queue->tail = item;
+    queue->head = item;
+    queue->count++;
+    queue->size += item->chunk_size;
+}
+
+/* Remove an item from its queue */
+void queue_remove(Cache_Queue *queue, Cache_Item *item) {
+    if (item->prev_item != NULL)
+        item->prev_item->next_item = item->next_item;
+    else
+        queue->head = item->next_item;
+    if (item->next_item != NULL)
+        item->next_item->prev_item = item->prev_item;
+    else
+        queue->tail = item->prev_item;
+    item->next_item = NULL;
+    item->prev_item = NULL;
+    queue->count--;
+    queue->size -= item->chunk_size;
+}
+
+/* Empty queues and no policy state */
+static void queue_init(Cache_Shard *shard) {
+    memset(shard->queues, 0, sizeof(shard->queues));
+    shard->read_buffers = NULL;
+    memset(&shard->ghosts, 0, sizeof(shard->ghosts));
+    shard->hand = NULL;
+    shard->target = 0;
+    shard->heap = NULL;
+    shard->heap_count = 0;
+    shard->heap_size = 0;
+    shard->inflation = 0;
+}
+
+/* New items enter the head of the first queue */
+static void queue_insert(Cache_Shard *shard, Cache_Item *item) {
+    item->queue = 0;
+    queue_push_head(&shard->queues[0], item);
+}
+
+static void queue_unlink(Cache_Shard *shard, Cache_Item *item) {
+    queue_remove(&shard->queues[item->queue], item);
+}
+
+/* Move an item to the head of a queue, maybe another one */
+static void move_to_head(Cache_Shard *shard, Cache_Item *item, int queue) {
+    queue_remove(&shard->queues[item->queue], item);
+    item->queue = queue;
+    queue_push_head(&shard->queues[queue], item);
+}
+
+/* Clear the referenced flag of an item, returning its former value.
+   Hits may set it again at any time */
+static int test_and_clear(Cache_Item *item) {
+    if (!__atomic_load_n(&item->referenced, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    __atomic_store_n(&item->referenced, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+
+/******************************************
+ * LRU
+ ******************************************/
+
+/* Stripe of the read buffers used by this thread */
+static __thread int read_stripe = -1;
+static unsigned int next_read_stripe = 0;
+
+static void lru_init(Cache_Shard *shard) {
+    int rc;
+
+    queue_init(shard);
+    if ((rc = posix_memalign((void **) &shard->read_buffers,
+            __alignof__(Read_Buffer),
+            READ_BUFFER_STRIPES * sizeof(Read_Buffer))) != 0)
+    {
+        posix_error(rc, "posix_memalign error");
+    }
+    memset(shard->read_buffers, 0, READ_BUFFER_STRIPES * sizeof(Read_Buffer));
+}
+
+/* Buffer the hit, and drain the buffers if this one is filling up and
+   the shard is not busy */
+static void lru_hit(Cache_Shard *shard, Cache_Item *item) {
+    Read_Buffer *buffer;
+    unsigned int writes, reads;
+
+    if (read_stripe < 0) {
+        read_stripe = __atomic_fetch_add(&next_read_stripe, 1,
+                __ATOMIC_RELAXED) % READ_BUFFER_STRIPES;
+    }
+    buffer = &shard->read_buffers[read_stripe];
+
+    writes = __atomic_load_n(&buffer->writes, __ATOMIC_RELAXED);
+    reads = __atomic_load_n(&buffer->reads, __ATOMIC_ACQUIRE);
+    if (writes - reads < READ_BUFFER_SIZE
+            && __atomic_compare_exchange_n(&buffer->writes, &writes,
+                    writes + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        /* The slot is ours: drains stop at it until it is filled */
+        __atomic_store_n(&buffer->hashes[writes % READ_BUFFER_SIZE],
+                item->hash, __ATOMIC_RELAXED);
+        __atomic_store_n(&buffer->slots[writes % READ_BUFFER_SIZE], item,
+                __ATOMIC_RELEASE);
+        writes++;
+    }
+    /* else the buffer is full, or another thread took the slot: drop it */
+
+    if (writes - reads >= READ_BUFFER_DRAIN
+            && pthread_mutex_trylock(&shard->mutex) == 0)
+    {
+        lru_drain(shard);
+        Pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+/* Move the items of the buffered hits to the head, in the order of each
+   buffer, unless they were evicted meanwhile (and maybe freed). Called
+   with the shard locked */
+static void lru_drain(Cache_Shard *shard) {
+    Read_Buffer *buffer;
+    Cache_Item *item;
+    unsigned int reads, writes;
+    int i;
+
+    for (i = 0; i < READ_BUFFER_STRIPES; i++) {
+        buffer = &shard->read_buffers[i];
+        reads = buffer->reads;
+        writes = __atomic_load_n(&buffer->writes, __ATOMIC_RELAXED);
+        for ( ; reads != writes; reads++) {
+            item = __atomic_exchange_n(&buffer->slots[reads % READ_BUFFER_SIZE],
+                    NULL, __ATOMIC_ACQUIRE);
+            if (item == NULL)
+                break;          /* Taken, not filled yet */
+            if (index_contains(&shard->index, item, __atomic_load_n(
+                    &buffer->hashes[reads % READ_BUFFER_SIZE],
+                    __ATOMIC_RELAXED)))
+            {
+                move_to_head(shard, item, 0);
+            }
+        }
+        __atomic_store_n(&buffer->reads, reads, __ATOMIC_RELEASE);
+    }
+}
+
+/* Also its peek(): the drain only applies hits that happened */
+static Cache_Item *lru_victim(Cache_Shard *shard) {
+    lru_drain(shard);
+    return shard->queues[0].tail;
+}
+
+
+/******************************************
+ * CLOCK
+ ******************************************/
+
+/* Referenced items at the tail get a second chance at the head */
+static Cache_Item *clock_victim(Cache_Shard *shard) {
+    Cache_Queue *queue = &shard->queues[0];
+    unsigned int chances = queue->count;
+
+    /* Hits may set the flags meanwhile, so give at most one round */
+    while (chances-- > 0 && test_and_clear(queue->tail)) {
+        move_to_head(shard, queue->tail, 0);
+    }
+    return queue->tail;
+}
+
+static Cache_Item *clock_peek(Cache_Shard *shard) {
+    return first_unreferenced(&shard->queues[0]);
+}
+
+/* The unreferenced item closest to the tail of a queue, or the tail if
+   all of them are referenced */
+static Cache_Item *first_unreferenced(Cache_Queue *queue) {
+    Cache_Item *item;
+
+    for (item = queue->tail; item != NULL; item = item->prev_item) {
+        if (!__atomic_load_n(&item->referenced, __ATOMIC_RELAXED))
+            return item;
+    }
+    return queue->tail;
+}
+
+
+/******************************************
+ * SIEVE
+ ******************************************/
+
+/* The hand moves on from an item that goes away */
+static void sieve_remove(Cache_Shard *shard, Cache_Item *item) {
+    if (shard->hand == item) {
+        shard->hand = item->prev_item;
+    }
+    queue_remove(&shard->queues[0], item);
+}
+
+static Cache_Item *sieve_victim(Cache_Shard *shard) {
+    Cache_Queue *queue = &shard->queues[0];
+    Cache_Item *item = shard->hand ? shard->hand : queue->tail;
+    unsigned int chances = queue->count;
+
+    /* Towards the head, wrapping around to the tail */
+    while (chances-- > 0 && test_and_clear(item)) {
+        item = item->prev_item ? item->prev_item : queue->tail;
+    }
+    /* sieve_remove() moves the hand past it */
+    shard->hand = item;
+    return item;
+}
+
+static Cache_Item *sieve_peek(Cache_Shard *shard) {
+    Cache_Queue *queue = &shard->queues[0];
+    Cache_Item *start = shard->hand ? shard->hand : queue->tail;
+    Cache_Item *item = start;
+    unsigned int chances = queue->count;
+
+    while (chances-- > 0
+            && __atomic_load_n(&item->referenced, __ATOMIC_RELAXED))
+    {
+        item = item->prev_item ? item->prev_item : queue->tail;
+    }
+    return item;
+}
+
+
+/******************************************
+ * SLRU
+ ******************************************/
+
+/* queues[0] is probation, queues[1] is protected */
+static Cache_Item *slru_victim(Cache_Shard *shard) {
+    Cache_Queue *probation = &shard->queues[0];
+    Cache_Queue *protected = &shard->queues[1];
+    unsigned int protected_max = (uint64_t) shard->max_size
+            * SLRU_PROTECTED_PERCENT / 100;
+    unsigned int chances = 2 * (probation->count + protected->count);
+    Cache_Item *item;
+
+    while (chances-- > 0) {
+        if (probation->tail == NULL) {
+            /* All protected: a CLOCK of its own */
+            if (!test_and_clear(protected->tail))
+                return protected->tail;
+            move_to_head(shard, protected->tail, 1);
+            continue;
+        }
+
+        item = probation->tail;
+        if (!test_and_clear(item)) {
+            return item;
+        }
+        /* Hit while on probation: promote it, demoting the overflow */
+        move_to_head(shard, item, 1);
+        while (protected->size > protected_max && protected->tail != item
+                && chances-- > 0)
+        {
+            if (test_and_clear(protected->tail))
+                move_to_head(shard, protected->tail, 1);
+            else
+                move_to_head(shard, protected->tail, 0);
+        }
+    }
+    return probation->tail ? probation->tail : protected->tail;
+}
+
+/* Referenced probation items would be promoted, not evicted */
+static Cache_Item *slru_peek(Cache_Shard *shard) {
+    Cache_Item *item = first_unreferenced(&shard->queues[0]);
+    Cache_Item *protected;
+
+    if (item != NULL && !__atomic_load_n(&item->referenced, __ATOMIC_RELAXED))
+        return item;
+    protected = first_unreferenced(&shard->queues[1]);
+    return protected ? protected : item;
+}
+
+
+/******************************************
+ * ARC (CAR)
+ ******************************************/
+
+/* queues[0] is T1, queues[1] is T2, shard->target the bytes aimed for
+   in T1 */
+static void arc_insert(Cache_Shard *shard, Cache_Item *item) {
+    Ghost_Lists *ghosts = &shard->ghosts;
+    Cache_Ghost *ghost = ghost_find(ghosts, item->hash);
+    unsigned int capacity = shard->max_size;
+    uint64_t delta;
+
+    if (ghost == NULL) {
+        item->queue = 0;
+    }
+    else {
+        /* Evicted too early: grow the list it was evicted from, by at
+           most the shard (the product overflows an unsigned int for
+           large items and skewed ghost lists) */
+        if (ghost->list == 0) {
+            delta = (uint64_t) item->chunk_size
+                    * ((ghosts->size[1] > ghosts->size[0]) ?
+                    ghosts->size[1] / ghosts->size[0] : 1);
+            if (delta > capacity)
+                delta = capacity;
+            shard->target = (shard->target + delta < capacity) ?
+                    shard->target + delta : capacity;
+        }
+        else {
+            delta = (uint64_t) item->chunk_size
+                    * ((ghosts->size[0] > ghosts->size[1]) ?
+                    ghosts->size[0] / ghosts->size[1] : 1);
+            if (delta > capacity)
+                delta = capacity;
+            shard->target = (shard->target > delta) ?
+                    shard->target - delta : 0;
+        }
+        ghost_drop(ghosts, ghost);
+        item->queue = 1;
+    }
+    queue_push_head(&shard->queues[item->queue], item);
+
+    /* T1 and B1 hold at most the shard, all four lists twice that */
+    while (ghosts->tail[0] != NULL
+            && shard->queues[0].size + ghosts->size[0] > capacity)
+    {
+        ghost_drop(ghosts, ghosts->tail[0]);
+    }
+    while (ghosts->tail[1] != NULL
+            && shard->queues[0].size + shard->queues[1].size
+            + ghosts->size[0] + ghosts->size[1] > 2 * capacity)
+    {
+        ghost_drop(ghosts, ghosts->tail[1]);
+    }
+}
+
+static Cache_Item *arc_victim(Cache_Shard *shard) {
+    Cache_Queue *t1 = &shard->queues[0], *t2 = &shard->queues[1];
+    unsigned int chances = 2 * (t1->count + t2->count);
+    Cache_Item *item;
+    int from;
+
+    while (chances-- > 0) {
+        from = (t1->tail != NULL && (t1->size > shard->target
+                || t2->tail == NULL)) ? 0 : 1;
+        item = shard->queues[from].tail;
+        if (!test_and_clear(item)) {
+            ghost_add(&shard->ghosts, from, item);
+            return item;
+        }
+        /* Referenced: it belongs to T2 from now on */
+        move_to_head(shard, item, 1);
+    }
+    item = t1->tail ? t1->tail : t2->tail;
+    ghost_add(&shard->ghosts, item->queue, item);
+    return item;
+}
+
+/* From the list arc_victim() starts with, the other one if all its items
+   are referenced */
+static Cache_Item *arc_peek(Cache_Shard *shard) {
+    Cache_Queue *t1 = &shard->queues[0], *t2 = &shard->queues[1];
+    int from = (t1->tail != NULL && (t1->size > shard->target
+            || t2->tail == NULL)) ? 0 : 1;
+    Cache_Item *item = first_unreferenced(&shard->queues[from]);
+
+    if (item == NULL || __atomic_load_n(&item->referenced, __ATOMIC_RELAXED))
+        item = first_unreferenced(&shard->queues[1 - from]);
+    if (item == NULL)
+        item = t1->tail ? t1->tail : t2->tail;
+    return item;
+}
+
+/* The ghost of a URI hash, or NULL */
+static Cache_Ghost *ghost_find(Ghost_Lists *ghosts, uint64_t hash) {
+    Cache_Ghost *ghost;
+
+    if (ghosts->bucket_count == 0) {
+        return NULL;
+    }
+    for (ghost = ghosts->buckets[hash & (ghosts->bucket_count - 1)];
+            ghost != NULL; ghost = ghost->chain)
+    {
+        if (ghost->hash == hash)
+            return ghost;
+    }
+    return NULL;
+}
+
+/* Remember an item that is being evicted, at the head of a ghost list */
+static void ghost_add(Ghost_Lists *ghosts, int list, Cache_Item *item) {
+    Cache_Ghost *ghost, *next, **buckets;
+    unsigned int i, bucket_count;
+
+    if ((ghost = ghost_find(ghosts, item->hash)) != NULL) {
+        ghost_drop(ghosts, ghost);
+    }
+
+    /* Keep the chains short: at most one ghost per bucket on average */
+    if (ghosts->count + 1 > ghosts->bucket_count) {
+        bucket_count = ghosts->bucket_count ? 2 * ghosts->bucket_count : 64;
+        buckets = Calloc(bucket_count, sizeof(Cache_Ghost *));
+        for (i = 0; i < ghosts->bucket_count; i++) {
+            for (ghost = ghosts->buckets[i]; ghost != NULL; ghost = next) {
+                next = ghost->chain;
+                ghost->chain = buckets[ghost->hash & (bucket_count - 1)];
+                buckets[ghost->hash & (bucket_count - 1)] = ghost;
+            }
+        }
+        if (ghosts->buckets != NULL)
+            Free(ghosts->buckets);
+        ghosts->buckets = buckets;
+        ghosts->bucket_count = bucket_count;
+    }
+
+    ghost = Malloc(sizeof(Cache_Ghost));
+    ghost->hash = item->hash;
+    ghost->size = item->chunk_size;
+    ghost->list = list;
+    ghost->prev = NULL;
+    ghost->next = ghosts->head[list];
+    if (ghosts->head[list] != NULL)
+        ghosts->head[list]->prev = ghost;
+    else
+        ghosts->tail[list] = ghost;
+    ghosts->head[list] = ghost;
+    ghosts->size[list] += ghost->size;
+    ghost->chain = ghosts->buckets[ghost->hash & (ghosts->bucket_count - 1)];
+    ghosts->buckets[ghost->hash & (ghosts->bucket_count - 1)] = ghost;
+    ghosts->count++;
+}
+
+/* Forget a ghost */
+static void ghost_drop(Ghost_Lists *ghosts, Cache_Ghost *ghost) {
+    Cache_Ghost **chainp;
+
+    chainp = &ghosts->buckets[ghost->hash & (ghosts->bucket_count - 1)];
+    while (*chainp != ghost) {
+        chainp = &(*chainp)->chain;
+    }
+    *chainp = ghost->chain;
+
+    if (ghost->prev != NULL)
+        ghost->prev->next = ghost->next;
+    else
+        ghosts->head[ghost->list] = ghost->next;
+    if (ghost->next != NULL)
+        ghost->next->prev = ghost->prev;
+    else
+        ghosts->tail[ghost->list] = ghost->prev;
+    ghosts->size[ghost->list] -= ghost->size;
+    ghosts->count--;
+    Free(ghost);
+}
+
+
+/******************************************
+ * GDSF
+ ******************************************/
+
+/* What keeping the item is worth: its refetch cost times its frequency,
+   per byte it takes if per_byte */
+static double gdsf_value(Cache_Item *item, int per_byte) {
+    double frequency = 1 + __atomic_load_n(&item->hits, __ATOMIC_RELAXED);
+    double cost = item->fetch_us ? item->fetch_us : 1;
+
+    if (per_byte) {
+        return frequency * cost / item->chunk_size;
+    }
+    return frequency * cost;
+}
+
+static void gdsf_insert(Cache_Shard *shard, Cache_Item *item) {
+    gdsf_push(shard, item, 1);
+}
+
+static void gdsf_bytes_insert(Cache_Shard *shard, Cache_Item *item) {
+    gdsf_push(shard, item, 0);
+}
+
+/* Add an item to the heap, the heap growing as needed */
+static void gdsf_push(Cache_Shard *shard, Cache_Item *item, int per_byte) {
+    if (shard->heap_count == shard->heap_size) {
+        shard->heap_size = shard->heap_size ? 2 * shard->heap_size : 64;
+        shard->heap = Realloc(shard->heap,
+                shard->heap_size * sizeof(Cache_Item *));
+    }
+    item->queue = 0;
+    item->priority = shard->inflation + gdsf_value(item, per_byte);
+    heap_set(shard, shard->heap_count++, item);
+    heap_sift_up(shard, item->heap_index);
+}
+
+/* Fill the hole with the last item, and move that one into place */
+static void gdsf_remove(Cache_Shard *shard, Cache_Item *item) {
+    unsigned int index = item->heap_index;
+    Cache_Item *last = shard->heap[--shard->heap_count];
+
+    if (last != item) {
+        heap_set(shard, index, last);
+        heap_sift_up(shard, index);
+        heap_sift_down(shard, last->heap_index);
+    }
+}
+
+static Cache_Item *gdsf_victim(Cache_Shard *shard) {
+    return gdsf_pop_victim(shard, 1);
+}
+
+static Cache_Item *gdsf_bytes_victim(Cache_Shard *shard) {
+    return gdsf_pop_victim(shard, 0);
+}
+
+/* The victim, the item of lowest priority, which sets the inflation */
+static Cache_Item *gdsf_pop_victim(Cache_Shard *shard, int per_byte) {
+    Cache_Item *item = gdsf_reprice(shard, per_byte);
+
+    if (item != NULL) {
+        shard->inflation = item->priority;
+    }
+    return item;
+}
+
+/* Also their peek(): the repricing only applies hits that happened */
+static Cache_Item *gdsf_peek(Cache_Shard *shard) {
+    return gdsf_reprice(shard, 1);
+}
+
+static Cache_Item *gdsf_bytes_peek(Cache_Shard *shard) {
+    return gdsf_reprice(shard, 0);
+}
+
+/* The item of lowest priority. Hits do not touch the heap, so an item
+   referenced since its priority was computed gets it recomputed from its
+   hits and sinks into place; each item is redone at most once. Left in
+   the heap, gdsf_remove() takes it out */
+static Cache_Item *gdsf_reprice(Cache_Shard *shard, int per_byte) {
+    Cache_Item *item;
+    unsigned int chances = shard->heap_count;
+
+    if (shard->heap_count == 0) {
+        return NULL;
+    }
+    while (chances-- > 0 && test_and_clear(shard->heap[0])) {
+        item = shard->heap[0];
+        item->priority = shard->inflation + gdsf_value(item, per_byte);
+        heap_sift_down(shard, 0);
+    }
+    return shard->heap[0];
+}
+
+static void heap_set(Cache_Shard *shard, unsigned int index,
+        Cache_Item *item)
+{
+    shard->heap[index] = item;
+    item->heap_index = index;
+}
+
+static void heap_sift_up(Cache_Shard *shard, unsigned int index) {
+    Cache_Item *item = shard->heap[index];
+    unsigned int parent;
+
+    while (index > 0) {
+        parent = (index - 1) / 2;
+        if (shard->heap[parent]->priority <= item->priority)
+            break;
+        heap_set(shard, index, shard->heap[parent]);
+        index = parent;
+    }
+    heap_set(shard, index, item);
+}
+
+static void heap_sift_down(Cache_Shard *shard, unsigned int index) {
+    Cache_Item *item = shard->heap[index];
+    unsigned int child;
+
+    while ((child = 2 * index + 1) < shard->heap_count) {
+        if (child + 1 < shard->heap_count
+                && shard->heap[child + 1]->priority
+                < shard->heap[child]->priority)
+        {
+            child++;
+        }
+        if (item->priority <= shard->heap[child]->priority)
+            break;
+        heap_set(shard, index, shard->heap[child]);
+        index = child;
+    }
+    heap_set(shard, index, item);
+}
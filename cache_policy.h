@@ -0,0 +1,92 @@
+/*
+ cache_policy.h for proxy lab
+ ----------------------
+ Contains the eviction policies of the cache shards.
+ See "cache_policy.c" for the design of each policy.
+ */
+
+#ifndef __CACHE_POLICY_H__
+#define __CACHE_POLICY_H__
+
+#include <stdint.h>
+
+#define CACHE_DEFAULT_POLICY    "clock"
+#define SLRU_PROTECTED_PERCENT  80      /* Share of a shard kept for items
+                                           hit since they were cached */
+#define READ_BUFFER_STRIPES     8       /* LRU hit buffers per shard */
+#define READ_BUFFER_SIZE        64      /* Hits per buffer, a power of 2 */
+#define READ_BUFFER_DRAIN       32      /* Hits buffered before a drain */
+
+struct Cache_Item;
+struct Cache_Shard;
+
+/* Cache_Queue that tracks one list of cache items, newest at the head */
+typedef struct Cache_Queue {
+    struct Cache_Item *head;
+    struct Cache_Item *tail;
+    unsigned int count;
+    unsigned int size;          /* Chunk bytes of its items */
+} Cache_Queue;
+
+/* Cache_Ghost that remembers an item evicted by ARC, by the hash of its
+   URI only */
+typedef struct Cache_Ghost {
+    uint64_t hash;
+    unsigned int size;
+    int list;                   /* 0 or 1 */
+    struct Cache_Ghost *next;   /* Towards the tail of its list */
+    struct Cache_Ghost *prev;
+    struct Cache_Ghost *chain;  /* Next ghost of the same bucket */
+} Cache_Ghost;
+
+/* Ghost_Lists that tracks the ghosts of a shard, in two LRU lists and a
+   hash table */
+typedef struct Ghost_Lists {
+    Cache_Ghost *head[2];
+    Cache_Ghost *tail[2];
+    unsigned int size[2];       /* Bytes of the items they remember */
+    unsigned int count;
+    unsigned int bucket_count;  /* Power of 2, or 0 */
+    Cache_Ghost **buckets;
+} Ghost_Lists;
+
+/* Read_Buffer that tracks the LRU hits of some threads not applied to the
+   list yet. Lossy: hits are dropped when it is full */
+typedef struct Read_Buffer {
+    unsigned int writes;        /* Slots taken by hits */
+    unsigned int reads;         /* Slots drained, under the shard mutex */
+    struct Cache_Item *slots[READ_BUFFER_SIZE];
+    uint64_t hashes[READ_BUFFER_SIZE];  /* Of the URIs of the slots */
+} __attribute__((aligned(64))) Read_Buffer;
+
+/*
+ *  Cache_Policy that tracks the operations of an eviction policy. All of
+ *  them but hit() are called with the shard locked. hit() is called
+ *  after a hit pinned the item and set its referenced flag, without any
+ *  lock; it is NULL for the policies that only need the flag. victim()
+ *  may reorder the items and update the state of the policy, as the
+ *  victim it returns is about to be evicted; peek() returns the item it
+ *  would pick, for the admission to weigh, and changes nothing but the
+ *  hits still to apply.
+ */
+typedef struct Cache_Policy {
+    const char *name;
+    void (*init)(struct Cache_Shard *shard);
+    void (*insert)(struct Cache_Shard *shard, struct Cache_Item *item);
+    void (*remove)(struct Cache_Shard *shard, struct Cache_Item *item);
+    void (*hit)(struct Cache_Shard *shard, struct Cache_Item *item);
+    struct Cache_Item *(*victim)(struct Cache_Shard *shard);
+    struct Cache_Item *(*peek)(struct Cache_Shard *shard);
+} Cache_Policy;
+
+extern const Cache_Policy cache_policies[];
+
+
+/*
+ * Function prototypes
+ */
+const Cache_Policy *find_cache_policy(const char *name);
+void queue_push_head(Cache_Queue *queue, struct Cache_Item *item);
+void queue_remove(Cache_Queue *queue, struct Cache_Item *item);
+
+#endif /* __CACHE_POLICY_H__ */
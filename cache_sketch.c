@@ -0,0 +1,148 @@
+/*
+ cache_sketch.c for proxy lab
+ ----------------------
+ Contains the frequency sketch of the TinyLFU cache admission.
+
+   About sketch design
+ ----------------------
+    The cache used to admit every response that fits in MAX_OBJECT_SIZE,
+ so objects requested only once kept pushing hot ones out. Each shard
+ now counts how often its URIs are requested, and a new object is only
+ cached if it was requested more often than the object it would evict
+ (see insert_cache_item()). This is the TinyLFU admission filter.
+
+    The counts are kept approximately, in a count-min sketch: SKETCH_DEPTH
+ rows of counters, each row indexed by a different hash of the URI hash.
+ A request increments the counter of the URI in every row, and the
+ estimate is the smallest of them, which can only overcount (when other
+ URIs share all its counters). Counters saturate at SKETCH_MAX_COUNT.
+
+    Most URIs are requested once. A doorkeeper Bloom filter in front of
+ the sketch absorbs the first request of a URI: only the following ones
+ reach the counters, which thus stay small and accurate for the URIs that
+ matter. The estimate adds one for a URI in the doorkeeper.
+
+    Every sample_size records, the sketch ages: all counters are halved
+ and the doorkeeper is cleared, so that the counts follow the recent
+ popularity rather than the whole history.
+
+    Hits record their URI without taking any lock, so the counters, the
+ doorkeeper and the record count are read and written with relaxed
+ atomics. A lost increment or an increment racing with the aging only
+ makes an estimate slightly off, which an admission filter tolerates.
+ */
+
+#include "csapp.h"
+#include "cache_sketch.h"
+
+/* Multipliers that derive the hash of each row from the URI hash */
+static const uint64_t row_seeds[SKETCH_DEPTH] = {
+    0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+    0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+};
+
+/*
+ * Function prototypes
+ */
+static inline unsigned int row_index(Cache_Sketch *sketch, int row,
+        uint64_t hash);
+static int doorkeeper_test_and_set(Cache_Sketch *sketch, uint64_t hash,
+        int set);
+static void sketch_age(Cache_Sketch *sketch);
+
+
+
+/* Size a sketch for about items cached objects */
+void sketch_init(Cache_Sketch *sketch, unsigned int items) {
+    sketch->width = 64;
+    sketch->width_bits = 6;
+    while (sketch->width < items) {
+        sketch->width *= 2;
+        sketch->width_bits++;
+    }
+    sketch->counters = Calloc(SKETCH_DEPTH * sketch->width, 1);
+    sketch->doorkeeper = Calloc(16 * sketch->width / 64, sizeof(uint64_t));
+    sketch->records = 0;
+    sketch->sample_size = SKETCH_SAMPLE * sketch->width;
+}
+
+/* Record a request for the URI of this index_hash() */
+void sketch_record(Cache_Sketch *sketch, uint64_t hash) {
+    uint8_t *counter;
+    int row;
+
+    /* The first request only goes into the doorkeeper */
+    if (doorkeeper_test_and_set(sketch, hash, 1)) {
+        for (row = 0; row < SKETCH_DEPTH; row++) {
+            counter = &sketch->counters[row * sketch->width
+                    + row_index(sketch, row, hash)];
+            if (__atomic_load_n(counter, __ATOMIC_RELAXED) < SKETCH_MAX_COUNT)
+                __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (__atomic_add_fetch(&sketch->records, 1, __ATOMIC_RELAXED)
+            == sketch->sample_size)
+    {
+        sketch_age(sketch);
+    }
+}
+
+/* Estimated number of recent requests for the URI of this index_hash() */
+unsigned int sketch_estimate(Cache_Sketch *sketch, uint64_t hash) {
+    unsigned int count, min = SKETCH_MAX_COUNT;
+    int row;
+
+    for (row = 0; row < SKETCH_DEPTH; row++) {
+        count = __atomic_load_n(&sketch->counters[row * sketch->width
+                + row_index(sketch, row, hash)], __ATOMIC_RELAXED);
+        if (count < min)
+            min = count;
+    }
+    return min + doorkeeper_test_and_set(sketch, hash, 0);
+}
+
+/* Counter of a URI hash in a row: the high bits of a multiplicative
+   hash, different for every row */
+static inline unsigned int row_index(Cache_Sketch *sketch, int row,
+        uint64_t hash)
+{
+    return (unsigned int) ((hash * row_seeds[row])
+            >> (64 - sketch->width_bits));
+}
+
+/* Tell if a URI hash is in the doorkeeper, adding it if set. Uses two bits
+   out of 16 * width, taken from both halves of the hash */
+static int doorkeeper_test_and_set(Cache_Sketch *sketch, uint64_t hash,
+        int set)
+{
+    uint64_t bits = 16 * (uint64_t) sketch->width;
+    uint64_t bit1 = hash & (bits - 1), bit2 = (hash >> 32) & (bits - 1);
+    uint64_t mask1 = 1ULL << (bit1 % 64), mask2 = 1ULL << (bit2 % 64);
+    uint64_t *word1 = &sketch->doorkeeper[bit1 / 64];
+    uint64_t *word2 = &sketch->doorkeeper[bit2 / 64];
+    int present;
+
+    present = (__atomic_load_n(word1, __ATOMIC_RELAXED) & mask1)
+            && (__atomic_load_n(word2, __ATOMIC_RELAXED) & mask2);
+    if (set && !present) {
+        __atomic_or_fetch(word1, mask1, __ATOMIC_RELAXED);
+        __atomic_or_fetch(word2, mask2, __ATOMIC_RELAXED);
+    }
+    return present;
+}
+
+/* Halve all counters and clear the doorkeeper */
+static void sketch_age(Cache_Sketch *sketch) {
+    unsigned int i;
+    uint8_t count;
+
+    for (i = 0; i < SKETCH_DEPTH * sketch->width; i++) {
+        count = __atomic_load_n(&sketch->counters[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&sketch->counters[i], count / 2, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < 16 * sketch->width / 64; i++) {
+        __atomic_store_n(&sketch->doorkeeper[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&sketch->records, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,36 @@
+/*
+ cache_sketch.h for proxy lab
+ ----------------------
+ Contains the frequency sketch of the TinyLFU cache admission.
+ See "cache_sketch.c" for the design.
+ */
+
+#ifndef __CACHE_SKETCH_H__
+#define __CACHE_SKETCH_H__
+
+#include <stdint.h>
+
+#define SKETCH_DEPTH        4       /* Rows of counters, one hash each */
+#define SKETCH_MAX_COUNT    15      /* Counters saturate, as 4-bit ones */
+#define SKETCH_ITEM_BYTES   1024    /* Expected bytes per cached object */
+#define SKETCH_SAMPLE       10      /* Records per counter between agings */
+
+/* Cache_Sketch that tracks how often recent URIs were requested */
+typedef struct Cache_Sketch {
+    unsigned int width;         /* Counters per row, a power of 2 */
+    unsigned int width_bits;    /* log2(width) */
+    uint8_t *counters;          /* SKETCH_DEPTH rows */
+    uint64_t *doorkeeper;       /* Bloom filter of 16 * width bits */
+    unsigned int records;       /* Since the last aging */
+    unsigned int sample_size;   /* Records between agings */
+} Cache_Sketch;
+
+
+/*
+ * Function prototypes
+ */
+void sketch_init(Cache_Sketch *sketch, unsigned int items);
+void sketch_record(Cache_Sketch *sketch, uint64_t hash);
+unsigned int sketch_estimate(Cache_Sketch *sketch, uint64_t hash);
+
+#endif /* __CACHE_SKETCH_H__ */
@@ -0,0 +1,435 @@
+/*
+ cache_snapshot.c for proxy lab
+ ----------------------
+ Contains the snapshots of the memory cache, for warm restarts.
+
+   About snapshot design
+ ----------------------
+    The cache lived in memory only, so every restart began with an empty
+ cache and sent all its clients to the origins at once. With
+ "--snapshot", a thread writes the whole memory cache to a snapshot file
+ every few seconds (SNAPSHOT_INTERVAL by default), and the next start of
+ the proxy loads it back.
+
+    A snapshot is a Snapshot_Header followed by one record per object,
+ the Disk_Record of the disk tier (see "cache_disk.c") followed by the
+ URI and the content, checksum included. The shards are written one at a
+ time: each is locked only to pin its items (see pin_shard_items()), and
+ they are written from the pins, in the order of the policy, the items
+ to evict last first. The snapshot goes to a temporary file, which is
+ synced and then renamed over the last one: a crash at any point leaves
+ either the old snapshot or the new one whole, never a mix. What changed
+ since the last snapshot is lost with the proxy.
+
+    On startup, the snapshot is mapped, and only the record headers are
+ read to build an index of the URIs it holds, the Warm_Entrys; the proxy
+ then serves at once. A miss in memory looks the URI up there and
+ caches the object from the map (see snapshot_load()), so the first
+ clients do not wait for the rest. Meanwhile the thread caches the other
+ records, starting from the end of the file, so that the objects to
+ evict last are inserted last and the order of the policy comes back.
+ Each entry is claimed once, by whichever load comes first: once a miss
+ claimed it, the object is cached or fetched from the origin again, and
+ the thread does not cache the old copy over it. Once every record is
+ loaded, the map is dropped and the snapshots begin.
+
+    A snapshot that cannot be used (a bad header, or no snapshot) starts
+ the cache cold. A record whose checksum does not match is skipped, and
+ the scan stops at the first header that does not make sense. The
+ records past their freshness lifetime (see "cache_fresh.c") are not
+ loaded.
+ */
+
+#include "cache.h"
+#include "cache_disk.h"
+#include "cache_snapshot.h"
+
+/*
+ *  Global/shared variables
+ */
+Cache_Snapshot cache_snapshot;
+
+
+/*
+ * Function prototypes
+ */
+static int map_snapshot(Cache_Snapshot *snap);
+static void index_entry(Cache_Snapshot *snap, char *uri, size_t offset,
+        Disk_Record *record);
+static Warm_Entry *find_entry(Cache_Snapshot *snap, char *uri,
+        uint64_t hash);
+static Cache_Item *load_entry(Cache_Snapshot *snap, Warm_Entry *entry);
+static void *snapshot_thread(void *args);
+static void unmap_snapshot(Cache_Snapshot *snap);
+static int write_snapshot(Cache_Snapshot *snap);
+static int write_item(FILE *fp, Cache_Item *item, uint64_t sequence);
+static int sync_dir(const char *path);
+static uint64_t now_ns(void);
+
+
+
+/* Load the snapshot at path, if there is one, and write one there every
+   interval seconds. Returns -1 if the snapshot cannot be read */
+int snapshot_init(Cache_List *cache_list, const char *path,
+        unsigned int interval)
+{
+    Cache_Snapshot *snap = &cache_snapshot;
+    pthread_t tid;
+
+    snap->path = strdup(path);
+    snap->interval = interval;
+    snap->cache_list = cache_list;
+    Pthread_rwlock_init(&snap->lock, NULL);
+    if (map_snapshot(snap) < 0) {
+        return -1;
+    }
+    snap->pending = snap->entry_count > 0;
+    snap->enabled = 1;
+
+    Pthread_create(&tid, NULL, snapshot_thread, NULL);
+    Pthread_detach(tid);
+
+    printf("{ Snapshot: %s, %u objects to load, every %u s }\n\n", path,
+            snap->entry_count, interval);
+    return 0;
+}
+
+/* Read the object of uri from the snapshot loaded into a new cache item,
+   not cached yet, or return NULL if the snapshot does not have it or
+   has it loaded already */
+Cache_Item *snapshot_load(char *uri, uint64_t hash) {
+    Cache_Snapshot *snap = &cache_snapshot;
+    Warm_Entry *entry;
+    Cache_Item *item = NULL;
+
+    Pthread_rwlock_rdlock(&snap->lock);
+    if (snap->map != NULL && (entry = find_entry(snap, uri, hash)) != NULL
+            && !__atomic_exchange_n(&entry->loaded, 1, __ATOMIC_ACQ_REL))
+    {
+        item = load_entry(snap, entry);
+    }
+    Pthread_rwlock_unlock(&snap->lock);
+
+    if (item != NULL) {
+        __atomic_add_fetch(&snap->served, 1, __ATOMIC_RELAXED);
+        printf("\tResponse content (%u bytes) for URI: %s has been read "
+                "from the snapshot.\n\n", item->content_length, uri);
+    }
+    return item;
+}
+
+/* Map the snapshot file and index its records. No file is an empty
+   snapshot, and so is a file that is not a snapshot */
+static int map_snapshot(Cache_Snapshot *snap) {
+    Snapshot_Header header;
+    Disk_Record record;
+    char uri[MAXLINE];
+    struct stat st;
+    size_t offset, length;
+    uint64_t i;
+    int fd;
+
+    if ((fd = open(snap->path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t) st.st_size < sizeof(header)
+            || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || header.magic != SNAPSHOT_MAGIC
+            || header.version != SNAPSHOT_VERSION
+            || header.bytes != (uint64_t) st.st_size
+            || header.records > header.bytes / sizeof(Disk_Record))
+    {
+        fprintf(stderr, "snapshot: %s is not a whole snapshot, "
+                "starting cold\n", snap->path);
+        close(fd);
+        return 0;
+    }
+    snap->map_size = st.st_size;
+    snap->map = mmap(NULL, snap->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snap->map == MAP_FAILED) {
+        snap->map = NULL;
+        return -1;
+    }
+    /* All of it is about to be read */
+    madvise(snap->map, snap->map_size, MADV_WILLNEED);
+
+    snap->bucket_count = 1024;
+    while (snap->bucket_count < header.records) {
+        snap->bucket_count *= 2;
+    }
+    snap->buckets = Calloc(snap->bucket_count, sizeof(Warm_Entry *));
+    snap->entries = Calloc(header.records ? header.records : 1,
+            sizeof(Warm_Entry));
+
+    offset = sizeof(header);
+    for (i = 0; i < header.records
+            && offset + sizeof(record) <= snap->map_size; i++)
+    {
+        memcpy(&record, snap->map + offset, sizeof(record));
+        length = disk_record_size(&record, snap->map_size - offset);
+        if (length == 0) {
+            fprintf(stderr, "snapshot: bad record at %zu of %s\n", offset,
+                    snap->path);
+            break;
+        }
+        memcpy(uri, snap->map + offset + sizeof(record), record.uri_length);
+        uri[record.uri_length] = '\0';
+        index_entry(snap, uri, offset, &record);
+        offset += length;
+    }
+    return 0;
+}
+
+/* Add a record of the snapshot to its index. A URI only has one */
+static void index_entry(Cache_Snapshot *snap, char *uri, size_t offset,
+        Disk_Record *record)
+{
+    Warm_Entry *entry, **bucket;
+
+    if (index_hash(uri) != record->hash || ITEM_EXPIRED(record, time(NULL))
+            || find_entry(snap, uri, record->hash) != NULL)
+    {
+        return;
+    }
+    entry = &snap->entries[snap->entry_count++];
+    entry->hash = record->hash;
+    entry->offset = offset;
+    entry->uri_length = record->uri_length;
+    bucket = &snap->buckets[(record->hash >> 16)
+            & (snap->bucket_count - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+}
+
+/* Entry of uri in the index of the snapshot loaded, or NULL */
+static Warm_Entry *find_entry(Cache_Snapshot *snap, char *uri,
+        uint64_t hash)
+{
+    Warm_Entry *entry;
+    size_t uri_length = strlen(uri);
+
+    entry = snap->buckets[(hash >> 16) & (snap->bucket_count - 1)];
+    for (; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->uri_length == uri_length
+                && !memcmp(snap->map + entry->offset + sizeof(Disk_Record),
+                uri, uri_length))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Copy the record of an entry into a new cache item, or return NULL if
+   it is corrupt or the cache has no room. Called with the lock held */
+static Cache_Item *load_entry(Cache_Snapshot *snap, Warm_Entry *entry) {
+    Disk_Record record;
+    Cache_Item *item;
+    char uri[MAXLINE], *from, *part;
+    size_t length;
+    uint32_t checksum;
+    unsigned int i;
+
+    from = snap->map + entry->offset;
+    memcpy(&record, from, sizeof(record));
+    from += sizeof(record);
+    memcpy(uri, from, record.uri_length);
+    uri[record.uri_length] = '\0';
+    from += record.uri_length;
+    /* Expired since the snapshot was mapped */
+    if (ITEM_EXPIRED(&record, time(NULL))
+            || (item = alloc_cache_item(uri, record.content_length)) == NULL)
+    {
+        return NULL;
+    }
+
+    checksum = disk_checksum(DISK_CHECKSUM_SEED, uri, record.uri_length);
+    for (i = 0; (part = item_segment(item, i, &length)) != NULL; i++) {
+        memcpy(part, from, length);
+        checksum = disk_checksum(checksum, part, length);
+        from += length;
+    }
+    if (checksum != record.checksum) {
+        fprintf(stderr, "snapshot: bad record for %s\n", uri);
+        __atomic_add_fetch(&snap->bad, 1, __ATOMIC_RELAXED);
+        destroy_cache_item(NULL, item);
+        return NULL;
+    }
+    item->fetch_us = record.fetch_us;
+    item->expires = record.expires;
+    __atomic_add_fetch(&snap->loaded, 1, __ATOMIC_RELAXED);
+    return item;
+}
+
+/* Thread loading the snapshot mapped, then writing one periodically */
+static void *snapshot_thread(void *args) {
+    Cache_Snapshot *snap = &cache_snapshot;
+    Warm_Entry *entry;
+    Cache_Item *item;
+    unsigned int i;
+
+    /* Objects to evict first go in first */
+    for (i = snap->entry_count; i-- > 0; ) {
+        entry = &snap->entries[i];
+        if (__atomic_exchange_n(&entry->loaded, 1, __ATOMIC_ACQ_REL))
+            continue;
+        /* Keep the lock short, misses wait for it */
+        Pthread_rwlock_rdlock(&snap->lock);
+        item = load_entry(snap, entry);
+        Pthread_rwlock_unlock(&snap->lock);
+        if (item != NULL) {
+            insert_cache_item(snap->cache_list, item);
+        }
+    }
+    if (snap->map != NULL) {
+        unmap_snapshot(snap);
+        printf("{ Warm restart: %lu of %u objects loaded, %lu on demand, "
+                "%lu bad }\n\n", snap->loaded, snap->entry_count,
+                snap->served, snap->bad);
+    }
+
+    while (1) {
+        sleep(snap->interval);
+        write_snapshot(snap);
+    }
+    return NULL;
+}
+
+/* Drop the snapshot loaded, once no miss reads it */
+static void unmap_snapshot(Cache_Snapshot *snap) {
+    Pthread_rwlock_wrlock(&snap->lock);
+    __atomic_store_n(&snap->pending, 0, __ATOMIC_RELEASE);
+    munmap(snap->map, snap->map_size);
+    snap->map = NULL;
+    Free(snap->entries);
+    Free(snap->buckets);
+    snap->entries = NULL;
+    snap->buckets = NULL;
+    Pthread_rwlock_unlock(&snap->lock);
+}
+
+/* Write the whole cache to a new snapshot, then put it in place of the
+   last one. Returns -1 and keeps the last one on error */
+static int write_snapshot(Cache_Snapshot *snap) {
+    Cache_List *cache_list = snap->cache_list;
+    Snapshot_Header header;
+    Cache_Item **items;
+    char tmp[MAXLINE];
+    unsigned int s, i, count;
+    int rc = 0;
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", snap->path);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "snapshot: cannot create %s: %s\n", tmp,
+                strerror(errno));
+        return -1;
+    }
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.created = now_ns();
+    header.records = 0;
+    header.bytes = sizeof(header);
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        rc = -1;
+    }
+
+    for (s = 0; rc == 0 && s < cache_list->shard_count; s++) {
+        items = pin_shard_items(&cache_list->shards[s], &count);
+        for (i = 0; i < count; i++) {
+            if (rc == 0 && write_item(fp, items[i], header.created) == 0) {
+                header.records++;
+                header.bytes += sizeof(Disk_Record)
+                        + strlen(items[i]->uri) + items[i]->content_length;
+            }
+            else {
+                rc = -1;
+            }
+            unpin_cache_item(items[i]);
+        }
+        Free(items);
+    }
+
+    /* The header tells the snapshot is whole: it goes last */
+    if (rc == 0 && (fseek(fp, 0, SEEK_SET) < 0
+            || fwrite(&header, sizeof(header), 1, fp) != 1
+            || fflush(fp) == EOF || fsync(fileno(fp)) < 0))
+    {
+        rc = -1;
+    }
+    if (fclose(fp) == EOF) {
+        rc = -1;
+    }
+    if (rc == 0 && (rename(tmp, snap->path) < 0 || sync_dir(snap->path) < 0))
+    {
+        rc = -1;
+    }
+    if (rc < 0) {
+        fprintf(stderr, "snapshot: cannot write %s: %s\n", tmp,
+                strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    printf("{ Snapshot: %lu objects in %lu bytes written to %s }\n\n",
+            (unsigned long) header.records, (unsigned long) header.bytes,
+            snap->path);
+    return 0;
+}
+
+/* Append the record of a cache item to a snapshot */
+static int write_item(FILE *fp, Cache_Item *item, uint64_t sequence) {
+    Disk_Record record;
+    size_t length;
+    char *part;
+    unsigned int i;
+
+    disk_record_init(&record, item);
+    record.sequence = sequence;
+    if (fwrite(&record, sizeof(record), 1, fp) != 1
+            || fwrite(item->uri, 1, record.uri_length, fp)
+            != record.uri_length)
+    {
+        return -1;
+    }
+    for (i = 0; (part = item_segment(item, i, &length)) != NULL; i++) {
+        if (fwrite(part, 1, length, fp) != length)
+            return -1;
+    }
+    return 0;
+}
+
+/* Make the rename of the file at path durable */
+static int sync_dir(const char *path) {
+    char dir[MAXLINE], *slash;
+    int fd, rc;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    if ((slash = strrchr(dir, '/')) == NULL) {
+        strcpy(dir, ".");
+    }
+    else if (slash == dir) {
+        dir[1] = '\0';
+    }
+    else {
+        *slash = '\0';
+    }
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
@@ -0,0 +1,67 @@
+/*
+ cache_snapshot.h for proxy lab
+ ----------------------
+ Contains the snapshots of the memory cache, for warm restarts.
+ See "cache_snapshot.c" for the design.
+ */
+
+#ifndef __CACHE_SNAPSHOT_H__
+#define __CACHE_SNAPSHOT_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC      0x53435850  /* "PXCS" */
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_INTERVAL   60          /* Default seconds between them */
+
+struct Cache_Item;
+struct Cache_List;
+
+/* Snapshot_Header that tracks what a snapshot file holds. Its records, a
+   Disk_Record each followed by the URI and the content, come next */
+typedef struct Snapshot_Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t created;           /* In ns since the epoch */
+    uint64_t records;
+    uint64_t bytes;             /* Of the whole file */
+} Snapshot_Header;
+
+/* Warm_Entry that tracks a record of the snapshot loaded at startup */
+typedef struct Warm_Entry {
+    uint64_t hash;
+    size_t offset;              /* Of the record in the mapped file */
+    unsigned int uri_length;
+    int loaded;                 /* Claimed by a load already */
+    struct Warm_Entry *next;    /* In the bucket of the index */
+} Warm_Entry;
+
+/* Cache_Snapshot that tracks the snapshots of the cache */
+typedef struct Cache_Snapshot {
+    int enabled;
+    int pending;                /* Records still to load from the map */
+    char *path;
+    unsigned int interval;      /* Seconds between snapshots */
+    struct Cache_List *cache_list;
+    pthread_rwlock_t lock;      /* Held to write while unmapping */
+    char *map;                  /* The snapshot loaded, or NULL */
+    size_t map_size;
+    Warm_Entry *entries;        /* In the order of the file */
+    unsigned int entry_count;
+    Warm_Entry **buckets;
+    unsigned int bucket_count;  /* Power of 2 */
+    unsigned long loaded, served, bad;
+} Cache_Snapshot;
+
+extern Cache_Snapshot cache_snapshot;
+
+
+/*
+ * Function prototypes
+ */
+int snapshot_init(struct Cache_List *cache_list, const char *path,
+        unsigned int interval);
+struct Cache_Item *snapshot_load(char *uri, uint64_t hash);
+
+#endif /* __CACHE_SNAPSHOT_H__ */
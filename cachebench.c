@@ -0,0 +1,417 @@
+/*
+ cachebench.c for proxy lab
+ ----------------------
+ A micro-benchmark of the cache lookup, comparing the hash index of
+ "cache_index.c" with the linear scan of the cache list it replaced.
+
+    usage: cachebench [-n lookups] [-s max items] [-l max linear items]
+                      [-t max threads] [-p policy] [-H hot items]
+                      [-r requests]
+
+    For 1000 items, then ten times more each round up to the max items,
+ it builds that many cache items with distinct URIs, indexes them, and
+ times lookups of random URIs, half of them cached and half not. The
+ linear scan walks a list of the same items with strcmp(), as
+ search_cache_item() used to; it is only timed up to the max linear
+ items since it gets slow quickly. The lookup keys are separate copies of
+ the URIs, so that every compare reads the strings.
+
+    With -t, it then measures the hit throughput of search_and_pin() on a
+ cache of HIT_ITEMS small objects evicted by policy (the default one if
+ not given), from 1 thread up to max threads (doubling), every thread
+ pinning random cached URIs among the first hot items (all of them if
+ not given), reading a byte of their content and unpinning them. Each
+ run is timed without and with the per-thread L1 (see "cache_l1.c"). The
+ cache logs every hit, so stdout goes to /dev/null meanwhile.
+
+    With -r, it replays a trace of that many requests against a cache of
+ each eviction policy (see "cache_policy.c"), without and with the
+ TinyLFU admission (see "cache_sketch.c"). RATIO_HOT objects of 512 bytes
+ to RATIO_MAX_SIZE, about ten times the cache, get Zipf-like popularity;
+ every RATIO_SCAN_PERIOD requests, a scan requests RATIO_SCAN_LENGTH
+ objects that are never requested again. Each object takes its own time
+ to fetch, up to RATIO_MAX_FETCH_US, regardless of its size. Misses are
+ added to the cache with that time, as the proxy does. It prints the hit
+ ratio, the byte hit ratio and the share of the fetch time saved by
+ hits. Each policy runs in a child process, with a cache of its own.
+ */
+
+#include "cache.h"
+#include "epoch.h"
+
+#define URI_FORMAT "www.example%d.com:80/static/img/%08d.png"
+#define HIT_ITEMS   256         /* Objects cached for the hit benchmark */
+#define HIT_SIZE    1024        /* Bytes per object */
+#define RATIO_MAX_SIZE (16 * 1024)  /* Bytes of the largest object of the
+                                       ratio trace */
+#define RATIO_MAX_FETCH_US 50000    /* Slowest fetch of the ratio trace */
+#define RATIO_HOT   2048        /* Objects requested again and again */
+#define RATIO_SCAN_PERIOD 2000  /* Requests between the starts of scans */
+#define RATIO_SCAN_LENGTH 512   /* Requests of a scan */
+
+/* Hit_Thread that tracks one thread of the hit benchmark */
+typedef struct Hit_Thread {
+    pthread_t tid;
+    int lookups;
+    int hot;                    /* Distinct URIs looked up */
+    unsigned int seed;
+    int hits;
+} Hit_Thread;
+
+/* Ratio_Result that tracks what the hits of a trace replay saved */
+typedef struct Ratio_Result {
+    double hits, bytes, fetch_us;
+} Ratio_Result;
+
+static Cache_List hit_cache;
+static char **hit_uris;
+
+static void bench_hits(int max_threads, int lookups,
+        const Cache_Policy *policy, int hot);
+static double run_hit_threads(Hit_Thread *threads, int n, int lookups,
+        int hot, int *hits);
+static void bench_ratios(int requests);
+static void policy_ratio(const Cache_Policy *policy, int admission,
+        int requests, Ratio_Result *result);
+static void *hit_thread(void *arg);
+static char **make_uris(int count);
+static double now_ns(void);
+static void usage(char *prog);
+
+
+
+int main(int argc, char **argv) {
+    int lookups = 1000000, max_items = 1000000, max_linear = 10000;
+    int max_threads = 0, requests = 0, hot = HIT_ITEMS;
+    const Cache_Policy *policy = NULL;
+    int items, i, c, found;
+    unsigned int seed = 1;
+    Cache_Index index;
+    Cache_Item *cache_items, *item;
+    char **uris, **keys;
+    int *order;
+    double start, index_ns, linear_ns;
+
+    while ((c = getopt(argc, argv, "n:s:l:t:p:H:r:h")) != -1) {
+        switch (c) {
+        case 'n':
+            lookups = atoi(optarg);
+            break;
+        case 's':
+            max_items = atoi(optarg);
+            break;
+        case 'l':
+            max_linear = atoi(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'p':
+            if ((policy = find_cache_policy(optarg)) == NULL)
+                usage(argv[0]);
+            break;
+        case 'H':
+            hot = atoi(optarg);
+            break;
+        case 'r':
+            requests = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (lookups <= 0 || max_items < 1000 || hot <= 0 || hot > HIT_ITEMS) {
+        usage(argv[0]);
+    }
+
+    printf("%10s %14s %14s %10s\n", "items", "index ns/op", "linear ns/op",
+            "index MB");
+    for (items = 1000; items <= max_items; items *= 10) {
+        /* Cached URIs, then as many URIs that are not cached */
+        uris = make_uris(items);
+        keys = make_uris(2 * items);
+        cache_items = Calloc(items, sizeof(Cache_Item));
+        for (i = 0; i < items; i++) {
+            cache_items[i].uri = uris[i];
+            cache_items[i].hash = index_hash(uris[i]);
+            cache_items[i].next_item = (i + 1 < items) ?
+                    &cache_items[i + 1] : NULL;
+        }
+        order = Malloc(lookups * sizeof(int));
+        for (i = 0; i < lookups; i++) {
+            order[i] = rand_r(&seed) % (2 * items);
+        }
+
+        index_init(&index, 0);
+        for (i = 0; i < items; i++) {
+            index_insert(&index, &cache_items[i]);
+        }
+
+        /* Hash index, hashing included as in search_and_pin() */
+        found = 0;
+        start = now_ns();
+        for (i = 0; i < lookups; i++) {
+            found += (index_find(&index, keys[order[i]],
+                    index_hash(keys[order[i]])) != NULL);
+        }
+        index_ns = (now_ns() - start) / lookups;
+        if (found == 0 || found == lookups) {
+            app_error("cachebench: unexpected lookup results");
+        }
+
+        /* Linear scan of the list, on fewer lookups */
+        linear_ns = -1;
+        if (items <= max_linear) {
+            int n = lookups / 100 + 1;
+            start = now_ns();
+            for (i = 0; i < n; i++) {
+                for (item = cache_items; item; item = item->next_item) {
+                    if (strcmp(item->uri, keys[order[i]]) == 0)
+                        break;
+                }
+                found += (item != NULL);
+            }
+            linear_ns = (now_ns() - start) / n;
+        }
+
+        if (linear_ns < 0) {
+            printf("%10d %14.1f %14s %10.1f\n", items, index_ns, "-",
+                    index.table->capacity * (1 + sizeof(Cache_Item *)) / 1048576.0);
+        } else {
+            printf("%10d %14.1f %14.1f %10.1f\n", items, index_ns, linear_ns,
+                    index.table->capacity * (1 + sizeof(Cache_Item *)) / 1048576.0);
+        }
+
+        index_free(&index);
+        for (i = 0; i < items; i++) {
+            free(uris[i]);
+        }
+        for (i = 0; i < 2 * items; i++) {
+            free(keys[i]);
+        }
+        Free(uris);
+        Free(keys);
+        Free(cache_items);
+        Free(order);
+    }
+
+    if (max_threads > 0) {
+        bench_hits(max_threads, lookups, policy, hot);
+    }
+    if (requests > 0) {
+        bench_ratios(requests);
+    }
+    return 0;
+}
+
+/* Hit throughput of the cache for 1 to max_threads threads, hitting hot
+   items, without and with the L1 */
+static void bench_hits(int max_threads, int lookups,
+        const Cache_Policy *policy, int hot)
+{
+    char content[HIT_SIZE];
+    Hit_Thread *threads;
+    int i, n, hits, saved_stdout, nullfd;
+    double shared_rate, l1_rate;
+
+    if ((saved_stdout = dup(STDOUT_FILENO)) < 0) {
+        unix_error("dup error");
+    }
+    nullfd = Open("/dev/null", O_WRONLY, 0);
+
+    memset(content, 'x', sizeof(content));
+    init_cache_list(&hit_cache, policy, 1);
+    hit_uris = make_uris(HIT_ITEMS);
+    fflush(stdout);
+    Dup2(nullfd, STDOUT_FILENO);
+    for (i = 0; i < HIT_ITEMS; i++) {
+        add_cache_item(&hit_cache, hit_uris[i], content, sizeof(content), 0);
+    }
+    fflush(stdout);
+    Dup2(saved_stdout, STDOUT_FILENO);
+
+    printf("\n%10s %14s %14s %10s   (%u shards, %s, %d hot)\n",
+            "threads", "hits/s", "with L1", "hit rate",
+            hit_cache.shard_count, hit_cache.shards[0].policy->name, hot);
+    threads = Calloc(max_threads, sizeof(Hit_Thread));
+    for (n = 1; n <= max_threads; n *= 2) {
+        fflush(stdout);
+        Dup2(nullfd, STDOUT_FILENO);
+        hit_cache.l1 = 0;
+        shared_rate = run_hit_threads(threads, n, lookups, hot, &hits);
+        hit_cache.l1 = 1;
+        l1_rate = run_hit_threads(threads, n, lookups, hot, &hits);
+        fflush(stdout);
+        Dup2(saved_stdout, STDOUT_FILENO);
+
+        printf("%10d %14.0f %14.0f %9.1f%%\n", n, shared_rate, l1_rate,
+                100.0 * hits / (lookups / n * n));
+    }
+    Free(threads);
+    Close(nullfd);
+    Close(saved_stdout);
+}
+
+/* Run n hit threads, sharing the lookups. Returns the hits per second */
+static double run_hit_threads(Hit_Thread *threads, int n, int lookups,
+        int hot, int *hits)
+{
+    double start = now_ns();
+    int i;
+
+    for (i = 0; i < n; i++) {
+        threads[i].lookups = lookups / n;
+        threads[i].hot = hot;
+        threads[i].seed = i + 1;
+        threads[i].hits = 0;
+        Pthread_create(&threads[i].tid, NULL, hit_thread, &threads[i]);
+    }
+    *hits = 0;
+    for (i = 0; i < n; i++) {
+        Pthread_join(threads[i].tid, NULL);
+        *hits += threads[i].hits;
+    }
+    return *hits / (now_ns() - start) * 1e9;
+}
+
+/* One thread of the hit benchmark */
+static void *hit_thread(void *arg) {
+    Hit_Thread *thread = (Hit_Thread *) arg;
+    Cache_Item *hit;
+    int i;
+
+    for (i = 0; i < thread->lookups; i++) {
+        if ((hit = search_and_pin(&hit_cache,
+                hit_uris[rand_r(&thread->seed) % thread->hot])) != NULL)
+        {
+            thread->hits += (hit->content[0] == 'x');
+            unpin_cache_item(hit);
+        }
+    }
+    return NULL;
+}
+
+/* Hit, byte hit and fetch time ratios of every eviction policy on a
+   trace with scans */
+static void bench_ratios(int requests) {
+    const Cache_Policy *policy;
+    Ratio_Result plain, tinylfu;
+
+    printf("\n(%d requests, scans of %d every %d)\n", requests,
+            RATIO_SCAN_LENGTH, RATIO_SCAN_PERIOD);
+    printf("%10s %8s %8s %8s   %8s %8s %8s\n", "", "hits", "bytes",
+            "fetch", "hits", "bytes", "fetch");
+    for (policy = cache_policies; policy->name != NULL; policy++) {
+        policy_ratio(policy, 0, requests, &plain);
+        policy_ratio(policy, 1, requests, &tinylfu);
+        printf("%10s %7.1f%% %7.1f%% %7.1f%%   %7.1f%% %7.1f%% %7.1f%%\n",
+                policy->name, plain.hits, plain.bytes, plain.fetch_us,
+                tinylfu.hits, tinylfu.bytes, tinylfu.fetch_us);
+    }
+    printf("%10s %26s   %26s\n", "", "(no admission)", "(with TinyLFU)");
+}
+
+/* Replay the trace in a child process with a new cache of policy, with
+   or without the TinyLFU admission. The result is in percents */
+static void policy_ratio(const Cache_Policy *policy, int admission,
+        int requests, Ratio_Result *result)
+{
+    int fds[2], i, k, nullfd, status;
+    unsigned int seed = 1, size, fetch_us;
+    double weight, total = 0, *cumulative, draw;
+    char uri[MAXLINE], content[RATIO_MAX_SIZE];
+    Ratio_Result saved = {0, 0, 0}, all = {0, 0, 0};
+    Cache_Item *hit;
+    pid_t pid;
+
+    if (pipe(fds) < 0) {
+        unix_error("pipe error");
+    }
+    if ((pid = Fork()) > 0) {
+        Close(fds[1]);
+        if (read(fds[0], result, sizeof(*result)) != sizeof(*result)) {
+            app_error("cachebench: policy run failed");
+        }
+        Close(fds[0]);
+        Waitpid(pid, &status, 0);
+        return;
+    }
+
+    /* Zipf-like popularity of the hot objects: rank k has weight 1/k */
+    cumulative = Malloc(RATIO_HOT * sizeof(double));
+    for (k = 0; k < RATIO_HOT; k++) {
+        weight = 1.0 / (k + 1);
+        total += weight;
+        cumulative[k] = total;
+    }
+    memset(content, 'x', sizeof(content));
+    /* The items the parent retired belong to the slab about to be reset */
+    epoch_reclaim();
+    init_cache_list(&hit_cache, policy, admission);
+
+    nullfd = Open("/dev/null", O_WRONLY, 0);
+    Dup2(nullfd, STDOUT_FILENO);
+    for (i = 0; i < requests; i++) {
+        if (i % RATIO_SCAN_PERIOD < RATIO_SCAN_LENGTH) {
+            /* Scan: each object once */
+            snprintf(uri, sizeof(uri), "scan.example.com:80/%d", i);
+            k = i;
+        }
+        else {
+            draw = (double) rand_r(&seed) / RAND_MAX * total;
+            for (k = 0; k < RATIO_HOT - 1 && cumulative[k] < draw; k++)
+                ;
+            snprintf(uri, sizeof(uri), "hot.example.com:80/%d", k);
+        }
+        /* Sizes and fetch times that do not follow the popularity */
+        size = RATIO_MAX_SIZE >> (k * 7 % 6);
+        fetch_us = RATIO_MAX_FETCH_US / 50 * (1 + k * 13 % 50);
+        all.hits++;
+        all.bytes += size;
+        all.fetch_us += fetch_us;
+        if ((hit = search_and_pin(&hit_cache, uri)) != NULL) {
+            saved.hits++;
+            saved.bytes += size;
+            saved.fetch_us += fetch_us;
+            unpin_cache_item(hit);
+        }
+        else {
+            add_cache_item(&hit_cache, uri, content, size, fetch_us);
+        }
+    }
+    saved.hits = 100 * saved.hits / all.hits;
+    saved.bytes = 100 * saved.bytes / all.bytes;
+    saved.fetch_us = 100 * saved.fetch_us / all.fetch_us;
+    if (write(fds[1], &saved, sizeof(saved)) != sizeof(saved)) {
+        unix_error("write error");
+    }
+    exit(0);
+}
+
+/* Make count distinct URIs */
+static char **make_uris(int count) {
+    char **uris = Malloc(count * sizeof(char *));
+    char buf[MAXLINE];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        snprintf(buf, sizeof(buf), URI_FORMAT, i % 97, i);
+        uris[i] = strdup(buf);
+    }
+    return uris;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-n lookups] [-s max items (>= 1000)] "
+            "[-l max linear items] [-t max threads]\n"
+            "       [-p policy] [-H hot items (<= %d)] [-r requests]\n",
+            prog, HIT_ITEMS);
+    exit(1);
+}
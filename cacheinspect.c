@@ -0,0 +1,279 @@
+/*
+ cacheinspect.c for proxy lab
+ ----------------------
+ An offline inspection tool of the files the cache keeps on disk: the
+ snapshots of "--snapshot" (see "cache_snapshot.c") and the segment files
+ of "--disk-cache" (see "cache_disk.c").
+
+    usage: cacheinspect [-v] [-q] file...
+
+    Both kinds of files are made of the same records, a Disk_Record
+ followed by the URI and the content; a snapshot starts with a
+ Snapshot_Header, and the kind is told by the magic number that begins
+ the file. It lists the records of every file given, with their offset,
+ their length, the time they were written at, the time their origin took
+ to send them and their URI, then a summary.
+
+    A record is stale if another one of the files given has the same URI
+ and was written later: the proxy would serve the later one. It is
+ expired if its freshness lifetime is over (see "cache_fresh.c"): the
+ proxy would not load it. With -v,
+ the content of every record is read and its checksum checked, as the
+ proxy does when it loads the record. A header that does not make sense
+ ends its file, as it ends the recovery of a segment; the rest of the
+ file is reported as a torn tail. With -q, only the summary is printed.
+
+    It exits with 1 if any record is bad or any file has a torn tail, and
+ with 2 if a file cannot be read.
+ */
+
+#include "cache.h"
+#include "cache_disk.h"
+#include "cache_snapshot.h"
+
+#define INSPECT_BUFFER (64 * 1024)  /* Bytes of content read at a time */
+
+/* Inspect_Record that tracks a record found in one of the files */
+typedef struct Inspect_Record {
+    const char *file;
+    size_t offset;
+    size_t length;
+    Disk_Record header;
+    char *uri;
+    int bad;                    /* Checksum mismatch, with -v */
+    int stale;                  /* A later record has the same URI */
+    int expired;                /* Past its freshness lifetime */
+    struct Inspect_Record *next;    /* Same bucket, by URI hash */
+} Inspect_Record;
+
+/*
+ *  Global/shared variables
+ */
+static Inspect_Record *records = NULL;
+static size_t record_count = 0, record_size = 0;
+static int verify = 0;
+
+
+/*
+ * Function prototypes
+ */
+static int inspect_file(const char *path);
+static int check_content(FILE *fp, Inspect_Record *record);
+static void mark_stale(void);
+static void print_record(Inspect_Record *record);
+static void usage(char *prog);
+
+
+
+int main(int argc, char **argv) {
+    int quiet = 0, c, status = 0, rc;
+    unsigned long bad = 0, stale = 0, expired = 0;
+    uint64_t bytes = 0;
+    size_t i;
+
+    while ((c = getopt(argc, argv, "vqh")) != -1) {
+        switch (c) {
+        case 'v':
+            verify = 1;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+
+    for (; optind < argc; optind++) {
+        if ((rc = inspect_file(argv[optind])) > status)
+            status = rc;
+    }
+    mark_stale();
+
+    if (!quiet) {
+        printf("%-24s %10s %10s %-19s %9s %-7s %s\n", "FILE", "OFFSET",
+                "LENGTH", "WRITTEN", "FETCH_US", "STATE", "URI");
+    }
+    for (i = 0; i < record_count; i++) {
+        if (!quiet)
+            print_record(&records[i]);
+        bytes += records[i].header.content_length;
+        bad += records[i].bad;
+        stale += records[i].stale;
+        expired += records[i].expired;
+    }
+    printf("%zu records, %llu bytes of content, %lu bad%s, %lu stale, "
+            "%lu expired\n", record_count, (unsigned long long) bytes, bad,
+            verify ? "" : " (not verified)", stale, expired);
+    if (bad > 0 && status == 0)
+        status = 1;
+    return status;
+}
+
+/* Read the records of a snapshot or segment file. Returns 0, 1 if the
+   file has a torn tail or 2 if it cannot be read */
+static int inspect_file(const char *path) {
+    Snapshot_Header header;
+    Inspect_Record *record;
+    struct stat st;
+    size_t offset = 0, length;
+    uint32_t magic;
+    uint64_t count = 0;
+    char uri[MAXLINE];
+    FILE *fp;
+    int rc = 0;
+
+    if ((fp = fopen(path, "r")) == NULL || fstat(fileno(fp), &st) < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        if (fp != NULL)
+            fclose(fp);
+        return 2;
+    }
+    if (st.st_size == 0) {
+        printf("%s: empty segment\n", path);
+        fclose(fp);
+        return 0;
+    }
+    if (fread(&magic, sizeof(magic), 1, fp) != 1
+            || (magic != SNAPSHOT_MAGIC && magic != DISK_RECORD_MAGIC))
+    {
+        fprintf(stderr, "%s: neither a snapshot nor a segment file\n", path);
+        fclose(fp);
+        return 2;
+    }
+    rewind(fp);
+
+    if (magic == SNAPSHOT_MAGIC) {
+        if (fread(&header, sizeof(header), 1, fp) != 1
+                || header.version != SNAPSHOT_VERSION)
+        {
+            fprintf(stderr, "%s: unknown snapshot version\n", path);
+            fclose(fp);
+            return 2;
+        }
+        printf("%s: snapshot of %llu records, %llu bytes, created %llu.%09llu"
+                "%s\n", path, (unsigned long long) header.records,
+                (unsigned long long) header.bytes,
+                (unsigned long long) (header.created / 1000000000),
+                (unsigned long long) (header.created % 1000000000),
+                header.bytes == (uint64_t) st.st_size ? "" : " (not whole)");
+        offset = sizeof(header);
+    }
+    else {
+        printf("%s: segment of %zu bytes\n", path, (size_t) st.st_size);
+    }
+
+    while (offset < (size_t) st.st_size) {
+        if (record_count == record_size) {
+            record_size = record_size ? 2 * record_size : 1024;
+            records = Realloc(records, record_size * sizeof(Inspect_Record));
+        }
+        record = &records[record_count];
+        memset(record, 0, sizeof(*record));
+        if (fseek(fp, offset, SEEK_SET) < 0
+                || fread(&record->header, sizeof(Disk_Record), 1, fp) != 1
+                || (length = disk_record_size(&record->header,
+                (size_t) st.st_size - offset)) == 0
+                || fread(uri, 1, record->header.uri_length, fp)
+                != record->header.uri_length)
+        {
+            printf("%s: torn tail of %zu bytes at %zu\n", path,
+                    (size_t) st.st_size - offset, offset);
+            rc = 1;
+            break;
+        }
+        uri[record->header.uri_length] = '\0';
+        record->file = path;
+        record->offset = offset;
+        record->length = length;
+        record->uri = strdup(uri);
+        record->expired = ITEM_EXPIRED(&record->header, time(NULL));
+        if (verify && check_content(fp, record) < 0) {
+            record->bad = 1;
+        }
+        record_count++;
+        count++;
+        offset += length;
+    }
+    if (magic == SNAPSHOT_MAGIC && count != header.records) {
+        printf("%s: %llu records found\n", path, (unsigned long long) count);
+    }
+    fclose(fp);
+    return rc;
+}
+
+/* Read the content of a record, after its URI, and check its checksum
+   and the hash of its URI. Returns -1 if either is wrong */
+static int check_content(FILE *fp, Inspect_Record *record) {
+    char buf[INSPECT_BUFFER];
+    uint32_t checksum;
+    size_t left = record->header.content_length, n;
+
+    if (index_hash(record->uri) != record->header.hash) {
+        return -1;
+    }
+    checksum = disk_checksum(DISK_CHECKSUM_SEED, record->uri,
+            record->header.uri_length);
+    while (left > 0) {
+        n = left < sizeof(buf) ? left : sizeof(buf);
+        if (fread(buf, 1, n, fp) != n)
+            return -1;
+        checksum = disk_checksum(checksum, buf, n);
+        left -= n;
+    }
+    return (checksum == record->header.checksum) ? 0 : -1;
+}
+
+/* Mark the records of a URI that has a later one */
+static void mark_stale(void) {
+    Inspect_Record **buckets, *record, *other;
+    size_t bucket_count = 1024, i;
+
+    while (bucket_count < record_count) {
+        bucket_count *= 2;
+    }
+    buckets = Calloc(bucket_count, sizeof(Inspect_Record *));
+    for (i = 0; i < record_count; i++) {
+        record = &records[i];
+        for (other = buckets[record->header.hash & (bucket_count - 1)];
+                other != NULL; other = other->next)
+        {
+            if (other->header.hash != record->header.hash
+                    || strcmp(other->uri, record->uri))
+            {
+                continue;
+            }
+            if (other->header.sequence < record->header.sequence)
+                other->stale = 1;
+            else
+                record->stale = 1;
+        }
+        record->next = buckets[record->header.hash & (bucket_count - 1)];
+        buckets[record->header.hash & (bucket_count - 1)] = record;
+    }
+    Free(buckets);
+}
+
+static void print_record(Inspect_Record *record) {
+    char written[32];
+    time_t sec = (time_t) (record->header.sequence / 1000000000);
+    struct tm tm;
+
+    strftime(written, sizeof(written), "%Y-%m-%d %H:%M:%S",
+            localtime_r(&sec, &tm));
+    printf("%-24s %10zu %10zu %-19s %9u %-7s %s\n", record->file,
+            record->offset, record->length, written,
+            record->header.fetch_us,
+            record->bad ? "BAD" : record->stale ? "stale"
+            : record->expired ? "expired" : "ok",
+            record->uri);
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-v] [-q] file...\n", prog);
+    fprintf(stderr, "  -v    check the checksum of every record\n");
+    fprintf(stderr, "  -q    print the summary only\n");
+    exit(2);
+}
@@ -3,6 +3,16 @@
 
 /* Updated with a reentrant open_clientfd_r function */
 
+/* I/O hooks of the Rio package and open_clientfd_r (see csapp.h) */
+ssize_t (*rio_read_hook)(int fd, void *buf, size_t n) = read;
+ssize_t (*rio_write_hook)(int fd, const void *buf, size_t n) = write;
+ssize_t (*rio_sendfile_hook)(int out_fd, int in_fd, off_t *offset, 
+        size_t n) = sendfile;
+int (*connect_hook)(int fd, const struct sockaddr *addr, 
+        socklen_t addrlen) = connect;
+int (*resolve_hook)(char *hostname, struct in_addr *addrs, 
+        int max_addrs) = resolve_host;
+
 /************************** 
  * Error-handling functions
  **************************/
@@ -541,7 +551,7 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
     char *bufp = usrbuf;
 
     while (nleft > 0) {
-	if ((nread = read(fd, bufp, nleft)) < 0) {
+	if ((nread = rio_read_hook(fd, bufp, nleft)) < 0) {
 	    if (errno == EINTR) /* interrupted by sig handler return */
 		nread = 0;      /* and call read() again */
 	    else
@@ -567,7 +577,7 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
     char *bufp = usrbuf;
 
     while (nleft > 0) {
-	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
+	if ((nwritten = rio_write_hook(fd, bufp, nleft)) <= 0) {
 	    if (errno == EINTR)  /* interrupted by sig handler return */
 		nwritten = 0;    /* and call write() again */
 	    else
@@ -580,6 +590,26 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_sendfilen - robustly send n bytes of in_fd from offset (unbuffered)
+ */
+ssize_t rio_sendfilen(int out_fd, int in_fd, off_t offset, size_t n) 
+{
+    size_t nleft = n;
+    ssize_t nsent;
+
+    while (nleft > 0) {
+	if ((nsent = rio_sendfile_hook(out_fd, in_fd, &offset, nleft)) <= 0) {
+	    if (errno == EINTR)  /* interrupted by sig handler return */
+		nsent = 0;       /* and call sendfile() again */
+	    else
+		return -1;       /* errorno set by sendfile() */
+	}
+	nleft -= nsent;
+    }
+    return n;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -595,7 +625,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
+	rp->rio_cnt = rio_read_hook(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
 	if (rp->rio_cnt < 0) {
 	    if (errno != EINTR) /* interrupted by sig handler return */
@@ -704,6 +734,15 @@ ssize_t Rio_writen(int fd, void *usrbuf, size_t n)
     return rc;
 }
 
+ssize_t Rio_sendfilen(int out_fd, int in_fd, off_t offset, size_t n) 
+{
+    ssize_t rc;
+
+    if ((rc = (rio_sendfilen(out_fd, in_fd, offset, n))) != n)
+        unix_error_nexit("Rio_sendfilen error");
+    return rc;
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -766,43 +805,60 @@ int open_clientfd(char *hostname, int port)
 /* $end open_clientfd */
 
 /*
- * open_clientfd_r - thread-safe version of open_clientfd
+ * resolve_host - look up the IPv4 addresses of hostname with 
+ *     getaddrinfo(). Stores at most max_addrs of them in addrs and 
+ *     returns their number, or -1 if the name does not resolve.
  */
-int open_clientfd_r(char *hostname, int port) {
-    int clientfd;
-    struct addrinfo *addlist, *p;
-    char port_str[MAXLINE];
-    int rv;
-
-    /* Create the socket descriptor */
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+int resolve_host(char *hostname, struct in_addr *addrs, int max_addrs) {
+    struct addrinfo hints, *addlist, *p;
+    int naddrs = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(hostname, NULL, &hints, &addlist) != 0) {
         return -1;
     }
+    for (p = addlist; p && naddrs < max_addrs; p = p->ai_next) {
+        addrs[naddrs++] = ((struct sockaddr_in *) p->ai_addr)->sin_addr;
+    }
+    freeaddrinfo(addlist);
+    return naddrs > 0 ? naddrs : -1;
+}
+
+/*
+ * open_clientfd_r - thread-safe version of open_clientfd
+ *     The name is resolved before any socket is created, so nothing is 
+ *     left open on a DNS error, and each address is tried with a socket 
+ *     of its own.
+ */
+int open_clientfd_r(char *hostname, int port) {
+    int clientfd, naddrs, i;
+    struct in_addr addrs[RESOLVE_MAX_ADDRS];
+    struct sockaddr_in serveraddr;
 
-    /* Get a list of addrinfo structs */
-    sprintf(port_str, "%d", port);
-    if ((rv = getaddrinfo(hostname, port_str, NULL, &addlist)) != 0) {
+    /* Get the server's addresses */
+    if ((naddrs = resolve_hook(hostname, addrs, RESOLVE_MAX_ADDRS)) <= 0) {
         return -2;
     }
-  
-    /* Walk the list, using each addrinfo to try to connect */
-    for (p = addlist; p; p = p->ai_next) {
-        if (p->ai_family == AF_INET) {
-            if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0) {
-                break; /* success */
-            }
-        }
-    } 
 
-    /* Clean up */
-    freeaddrinfo(addlist);
-    if (!p) { /* all connects failed */
+    /* Try each address in turn until one connects */
+    for (i = 0; i < naddrs; i++) {
+        if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            return -1;
+        }
+        bzero((char *) &serveraddr, sizeof(serveraddr));
+        serveraddr.sin_family = AF_INET;
+        serveraddr.sin_addr = addrs[i];
+        serveraddr.sin_port = htons(port);
+        if (connect_hook(clientfd, (SA *) &serveraddr, 
+                sizeof(serveraddr)) == 0) 
+        {
+            return clientfd; /* success */
+        }
         close(clientfd);
-        return -1;
-    }
-    else { /* one of the connects succeeded */
-        return clientfd;
     }
+    return -1; /* all connects failed */
 }
 
 /*  
@@ -840,6 +896,53 @@ int open_listenfd(int port)
 }
 /* $end open_listenfd */
 
+/*
+ * open_listenfd_reuseport - open and return a listening socket on port
+ *     that shares the port with other SO_REUSEPORT listeners, so the 
+ *     kernel spreads incoming connections across them. TCP_DEFER_ACCEPT 
+ *     delays accept() until request bytes have arrived.
+ *     Returns -1 and sets errno on Unix error.
+ */
+int open_listenfd_reuseport(int port) 
+{
+    int listenfd, optval=1, defer=5;
+    struct sockaddr_in serveraddr;
+  
+    /* Create a socket descriptor */
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	return -1;
+ 
+    /* Let every listener bind the same port */
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, 
+		   (const void *)&optval , sizeof(int)) < 0
+        || setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, 
+		   (const void *)&optval , sizeof(int)) < 0)
+    {
+        close(listenfd);
+	return -1;
+    }
+
+    /* Only wake accept() once the client sent data (seconds to wait) */
+    if (setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, 
+		   (const void *)&defer , sizeof(int)) < 0)
+    {
+        close(listenfd);
+	return -1;
+    }
+
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET; 
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY); 
+    serveraddr.sin_port = htons((unsigned short)port); 
+    if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0
+        || listen(listenfd, LISTENQ) < 0)
+    {
+        close(listenfd);
+	return -1;
+    }
+    return listenfd;
+}
+
 /******************************************
  * Wrappers for the client/server helper routines 
  ******************************************/
@@ -874,6 +977,30 @@ int Open_listenfd(int port)
 	unix_error("Open_listenfd error");
     return rc;
 }
+
+int Open_listenfd_reuseport(int port) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
+/*
+ * raise_fd_limit - allow as many open descriptors as the hard limit 
+ *     permits. Prints a unix-style error without exiting on failure.
+ */
+void raise_fd_limit(void) 
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+	    unix_error_nexit("setrlimit error");
+    }
+}
 /* $end csapp.c */
 
 
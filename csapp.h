@@ -22,7 +22,10 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
 
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -143,9 +146,28 @@ void Sem_init(sem_t *sem, int pshared, unsigned int value);
 void P(sem_t *sem);
 void V(sem_t *sem);
 
+/* I/O hooks used by the Rio package and open_clientfd_r. They default 
+   to read(), write(), sendfile() and connect(); the fiber engine replaces 
+   them with versions that yield the fiber instead of blocking (see 
+   fiber.c) */
+extern ssize_t (*rio_read_hook)(int fd, void *buf, size_t n);
+extern ssize_t (*rio_write_hook)(int fd, const void *buf, size_t n);
+extern ssize_t (*rio_sendfile_hook)(int out_fd, int in_fd, off_t *offset, 
+        size_t n);
+extern int (*connect_hook)(int fd, const struct sockaddr *addr, 
+        socklen_t addrlen);
+
+/* Name lookup used by open_clientfd_r and the event engines. It defaults 
+   to resolve_host(), a plain getaddrinfo(); the caching resolver replaces 
+   it (see resolver.c) */
+#define RESOLVE_MAX_ADDRS 8
+extern int (*resolve_hook)(char *hostname, struct in_addr *addrs, 
+        int max_addrs);
+
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_sendfilen(int out_fd, int in_fd, off_t offset, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
@@ -153,6 +175,7 @@ ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t Rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t Rio_sendfilen(int out_fd, int in_fd, off_t offset, size_t n);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
@@ -167,12 +190,18 @@ ssize_t Rio_Readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Client/server helper functions */
 int open_clientfd(char *hostname, int portno);
 int open_clientfd_r(char *hostname, int portno);
+int resolve_host(char *hostname, struct in_addr *addrs, int max_addrs);
 int open_listenfd(int portno);
+int open_listenfd_reuseport(int portno);
 
 /* Wrappers for client/server helper functions */
 int Open_clientfd(char *hostname, int port);
 int Open_clientfd_r(char *hostname, int port);
 int Open_listenfd(int port); 
+int Open_listenfd_reuseport(int port);
+
+/* Process limits */
+void raise_fd_limit(void);
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
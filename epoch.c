@@ -0,0 +1,184 @@
+/*
+ epoch.c for proxy lab
+ ----------------------
+ Contains epoch-based reclamation for the lock-free cache read path.
+
+   About epoch design
+ ----------------------
+    A cache hit reads the index and the cache item without taking any
+ lock, so a writer that evicts an item cannot free it right away: a
+ reader may still be copying it. Writers unlink the item, then retire it
+ here, and it is freed once no reader can still hold it.
+
+    There is a global epoch counter, starting at 1. Every thread that
+ reads gets an Epoch_Record, found through a thread-local pointer and
+ kept in a global list that only grows; the record of an exited thread
+ is reused by the next new thread. epoch_enter() stores the current
+ global epoch in the record of the thread, and epoch_exit() stores 0.
+ Both are a single store and a fence, and readers share no cache line.
+
+    epoch_retire() tags the object with the global epoch and advances
+ it. A reader that entered a later epoch started after the object was
+ unlinked, so it cannot find it. Every EPOCH_RECLAIM_BATCH retirements,
+ the retiring thread reads the global epoch, then scans the records for
+ the oldest epoch still entered, and frees the objects retired before
+ both. A reader the scan misses entered after the global epoch was read,
+ so only the objects retired by then are out of its reach. A reader that
+ stays inside a section only delays the freeing, it never blocks a writer.
+
+    A read-side section must not block or yield: fibers never switch
+ inside one, since the epoch belongs to the OS thread.
+ */
+
+#include "epoch.h"
+
+/*
+ *  Global/shared variables
+ */
+static uint64_t global_epoch = 1;
+static Epoch_Record *records = NULL;
+static Epoch_Retired *retired = NULL;
+static unsigned int retired_count = 0;
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+static __thread Epoch_Record *self = NULL;
+
+
+/*
+ * Function prototypes
+ */
+static Epoch_Record *register_thread(void);
+static void create_record_key(void);
+static void release_record(void *arg);
+
+
+
+/* Enter a read-side critical section */
+void epoch_enter(void) {
+    Epoch_Record *rec = self ? self : register_thread();
+
+    __atomic_store_n(&rec->epoch,
+            __atomic_load_n(&global_epoch, __ATOMIC_RELAXED),
+            __ATOMIC_RELAXED);
+    /* The epoch must be visible before any shared read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Leave the read-side critical section */
+void epoch_exit(void) {
+    __atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Free ptr with free_fn once no reader may hold it. ptr must already be
+   unreachable for new readers */
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    Epoch_Retired *node = Malloc(sizeof(Epoch_Retired));
+    int reclaim;
+
+    node->ptr = ptr;
+    node->free_fn = free_fn;
+    node->epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&retired_mutex);
+    node->next = retired;
+    retired = node;
+    reclaim = (++retired_count >= EPOCH_RECLAIM_BATCH);
+    pthread_mutex_unlock(&retired_mutex);
+
+    if (reclaim) {
+        epoch_reclaim();
+    }
+}
+
+/* Free the retired objects that no reader can hold anymore */
+void epoch_reclaim(void) {
+    Epoch_Record *rec;
+    Epoch_Retired **nodep, *node, *ready = NULL;
+    uint64_t min_epoch, epoch;
+
+    /* Only the objects retired before the scan: a reader it misses may
+       have entered since, and found one retired after */
+    min_epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    /* Pairs with the fence of epoch_enter() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec;
+            rec = rec->next)
+    {
+        epoch = __atomic_load_n(&rec->epoch, __ATOMIC_ACQUIRE);
+        if (epoch != 0 && epoch < min_epoch)
+            min_epoch = epoch;
+    }
+
+    pthread_mutex_lock(&retired_mutex);
+    nodep = &retired;
+    while ((node = *nodep) != NULL) {
+        if (node->epoch < min_epoch) {
+            *nodep = node->next;
+            node->next = ready;
+            ready = node;
+            retired_count--;
+        }
+        else {
+            nodep = &node->next;
+        }
+    }
+    pthread_mutex_unlock(&retired_mutex);
+
+    while ((node = ready) != NULL) {
+        ready = node->next;
+        node->free_fn(node->ptr);
+        Free(node);
+    }
+}
+
+/* Give the calling thread a record, reusing the one of an exited thread
+   if there is one */
+static Epoch_Record *register_thread(void) {
+    Epoch_Record *rec;
+    int free_rec, rc;
+
+    pthread_once(&record_once, create_record_key);
+
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec;
+            rec = rec->next)
+    {
+        free_rec = 0;
+        if (__atomic_compare_exchange_n(&rec->in_use, &free_rec, 1, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+    if (rec == NULL) {
+        if ((rc = posix_memalign((void **) &rec, sizeof(Epoch_Record),
+                sizeof(Epoch_Record))) != 0)
+        {
+            posix_error(rc, "posix_memalign error");
+        }
+        rec->epoch = 0;
+        rec->in_use = 1;
+        rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &rec->next, rec, 0,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(record_key, rec);
+    self = rec;
+    return rec;
+}
+
+static void create_record_key(void) {
+    int rc;
+
+    if ((rc = pthread_key_create(&record_key, release_record)) != 0) {
+        posix_error(rc, "pthread_key_create error");
+    }
+}
+
+/* Thread exit: hand the record over to the next new thread */
+static void release_record(void *arg) {
+    Epoch_Record *rec = (Epoch_Record *) arg;
+
+    __atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
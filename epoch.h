@@ -0,0 +1,41 @@
+/*
+ epoch.h for proxy lab
+ ----------------------
+ Contains epoch-based reclamation, which lets threads read shared
+ structures without locks while writers unlink and retire parts of them.
+ See "epoch.c" for the design.
+ */
+
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+#define EPOCH_RECLAIM_BATCH 8   /* Retired objects between reclaim passes */
+
+/* Epoch_Record that tracks the read-side critical section of one thread */
+typedef struct Epoch_Record {
+    uint64_t epoch;             /* Epoch entered, 0 when outside */
+    int in_use;                 /* Owned by a live thread */
+    struct Epoch_Record *next;
+} __attribute__((aligned(64))) Epoch_Record;
+
+/* Epoch_Retired that tracks an unlinked object waiting to be freed */
+typedef struct Epoch_Retired {
+    void *ptr;
+    void (*free_fn)(void *);
+    uint64_t epoch;             /* Epoch it was retired in */
+    struct Epoch_Retired *next;
+} Epoch_Retired;
+
+
+/*
+ * Function prototypes
+ */
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+void epoch_reclaim(void);
+
+#endif /* __EPOCH_H__ */
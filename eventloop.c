@@ -0,0 +1,743 @@
+/*
+ eventloop.c for proxy lab
+ ----------------------
+ Contains the event-driven (epoll) engine, selected with "-e epoll".
+
+   About event loop design
+ ----------------------
+    Instead of creating one thread per client, this engine runs a few
+ event loop threads (one per core by default). Each loop owns an epoll
+ instance and watches the shared listening socket with EPOLLEXCLUSIVE, so
+ only one loop is woken for each incoming connection. With "--reuseport",
+ every loop has its own SO_REUSEPORT listener instead and is pinned to a
+ core, so the kernel spreads new connections over the loops and accept()
+ is no longer shared at all. A connection stays
+ on the loop that accepted it for its whole life, so the per-connection
+ state never needs locking.
+
+    Every connection is driven through a small state machine:
+
+    CONN_READ_REQUEST   Reading the request header block from the client.
+    CONN_CONNECTING     Non-blocking connect() to the server in progress.
+    CONN_SEND_REQUEST   Writing the rebuilt request to the server.
+    CONN_RELAY          Reading the response from the server, writing it
+                        to the client and filling the cache on the way.
+    CONN_SEND_HIT       Writing a cached response to the client.
+    CONN_LINGER         Waiting for the client to acknowledge a cached
+                        response sent with sendfile(), for up to
+                        HIT_LINGER_SEC.
+
+    Socket I/O is always attempted first; only when a read or write would
+ block does the connection register interest in that descriptor and give
+ the loop back to epoll_wait(). Requests are parsed with the same helpers
+ as the blocking handler (see "proxy.h").
+
+    A connection only holds a small Conn structure while it is idle. The
+ header buffer and the relay buffer are allocated when a state needs
+ them and freed as soon as it is done with them, so memory stays flat
+ however many clients are connected. A response that may be cached is
+ read straight into slab pages of the cache (see reserve_cache_fill()),
+ and sent from there; they become its cache item once it ends, or are
+ given back as soon as it turns out not to be cached, by its headers or
+ by its size.
+
+    With a memfd cache (see "slab.c"), hits are sent with sendfile(). The
+ socket then references the pages of the cache until the client
+ acknowledges them, so the hit stays pinned until the send queue of the
+ socket is empty, which a timerfd of the connection checks every
+ HIT_LINGER_POLL_MS. A connection closed before that, or still not
+ acknowledged after HIT_LINGER_SEC, is reset, which drops what is still
+ queued.
+
+    Note: the server name is resolved through the caching resolver (see
+ "resolver.c"). A name it has not cached yet is still looked up by the
+ loop thread itself, which blocks the loop for that time.
+ */
+
+#define _GNU_SOURCE     /* For accept4() */
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <linux/sockios.h>
+#include "proxy.h"
+#include "eventloop.h"
+#include "threadpool.h"
+
+#define MAX_EVENTS      256         /* Events handled per epoll_wait() */
+#define ACCEPT_BATCH    64          /* Connections accepted per wake-up */
+#define HEADER_BUFSIZE  1024        /* Initial size of the header buffer */
+#define MAX_HEADER_SIZE (4 * MAXLINE)   /* Largest request header block */
+#define RELAY_BUFSIZE   (2 * MAXBUF)    /* Bytes relayed per read() */
+
+/* Return values of the state handlers */
+#define STEP_NEXT   0       /* State changed, keep going */
+#define STEP_AGAIN  1       /* Waiting for a descriptor to become ready */
+#define STEP_CLOSE  2       /* Done or failed, close the connection */
+
+typedef enum {
+    CONN_READ_REQUEST,
+    CONN_CONNECTING,
+    CONN_SEND_REQUEST,
+    CONN_RELAY,
+    CONN_SEND_HIT,
+    CONN_LINGER,
+    CONN_CLOSED
+} Conn_State;
+
+struct Conn;
+struct Event_Loop;
+
+/* Io_Handle that is registered in epoll for one descriptor */
+typedef struct Io_Handle {
+    int fd;
+    unsigned int events;    /* Currently registered epoll events */
+    struct Conn *conn;      /* Owning connection, NULL for the listener */
+} Io_Handle;
+
+/* Conn that tracks one client connection on its event loop */
+typedef struct Conn {
+    Conn_State state;
+    unsigned int conn_id;
+    Io_Handle client;
+    Io_Handle server;
+    Io_Handle timer;        /* timerfd ticking while it lingers, or -1 */
+
+    char *inbuf;            /* Request header block read so far */
+    size_t in_len, in_cap;
+
+    char *uri;              /* Cache item ID */
+    char *host;
+    char *hostname;
+    int port;
+    char *request;          /* Rebuilt request forwarded to server */
+    size_t request_len, request_off;
+    int cache_request;      /* CACHE_REQ_* flags of the request */
+
+    char *outbuf;           /* Bytes pending to the client */
+    size_t out_len, out_off;
+    Cache_Item *hit;        /* Pinned cache item of outbuf, or NULL */
+    unsigned int hit_segment;   /* item_segment() of hit in outbuf */
+    int lingered;           /* The client acknowledged the whole hit */
+    long long linger_deadline;  /* When it stops waiting for that */
+    char *relay;            /* Relay buffer for the response */
+    Cache_Fill fill;        /* Slab pages the response is received into */
+    int cacheable;
+    long long fetch_start_ns;   /* When the server was asked */
+
+    unsigned int byte_count;
+    struct Conn *next_closed;
+} Conn;
+
+/* Event_Loop that tracks one loop thread */
+typedef struct Event_Loop {
+    int id;
+    int epfd;
+    pthread_t tid;
+    Io_Handle listener;
+    int pinned;                     /* Pin the loop thread to a core */
+    unsigned int conn_count;        /* Connections owned by this loop */
+    unsigned int next_conn_id;
+    Conn *closed;                   /* Connections to free after a batch */
+} Event_Loop;
+
+
+/*
+ * Function prototypes
+ */
+static void *loop_thread(void *args);
+static void accept_connections(Event_Loop *loop);
+static void conn_step(Event_Loop *loop, Conn *conn);
+static int do_read_request(Event_Loop *loop, Conn *conn);
+static int conn_parse_request(Event_Loop *loop, Conn *conn);
+static int start_connect(Event_Loop *loop, Conn *conn);
+static int do_connecting(Event_Loop *loop, Conn *conn);
+static int do_send_request(Event_Loop *loop, Conn *conn);
+static int do_relay(Event_Loop *loop, Conn *conn);
+static int do_send_hit(Event_Loop *loop, Conn *conn);
+static int do_linger(Event_Loop *loop, Conn *conn);
+static int flush_output(Event_Loop *loop, Conn *conn);
+static void watch(Event_Loop *loop, Io_Handle *handle, unsigned int events);
+static void conn_close(Event_Loop *loop, Conn *conn);
+static void free_closed(Event_Loop *loop);
+
+
+
+/*
+ *  Start nloops event loops. With a single listener all loops share it;
+ *  otherwise loop i owns listenfds[i] and is pinned to a core. The calling
+ *  thread runs the first loop, so this function never returns.
+ */
+void eventloop_run(int *listenfds, int nlisteners, int nloops) {
+    Event_Loop *loops;
+    struct epoll_event ev;
+    int i, fd;
+
+    raise_fd_limit();
+    for (i = 0; i < nlisteners; i++) {
+        fd = listenfds[i];
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+            unix_error("fcntl error");
+    }
+
+    loops = Calloc(nloops, sizeof(Event_Loop));
+    for (i = 0; i < nloops; i++) {
+        loops[i].id = i;
+        loops[i].pinned = (nlisteners > 1);
+        if ((loops[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            unix_error("epoll_create1 error");
+
+        loops[i].listener.fd = listenfds[i % nlisteners];
+        loops[i].listener.events = EPOLLIN;
+        loops[i].listener.conn = NULL;
+        ev.events = (nlisteners > 1) ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &loops[i].listener;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].listener.fd, 
+                &ev) < 0)
+        {
+            unix_error("epoll_ctl error");
+        }
+    }
+
+    printf("{ Event-driven engine: %d event loop(s), %d listener(s) }\n\n", 
+            nloops, nlisteners);
+
+    for (i = 1; i < nloops; i++) {
+        Pthread_create(&loops[i].tid, NULL, loop_thread, &loops[i]);
+    }
+    loop_thread(&loops[0]);
+}
+
+/* Event loop thread routine */
+static void *loop_thread(void *args) {
+    Event_Loop *loop = (Event_Loop *) args;
+    struct epoll_event events[MAX_EVENTS];
+    Io_Handle *handle;
+    Conn *conn;
+    int i, n;
+
+    if (loop->pinned) {
+        pin_to_core(loop->id);
+    }
+
+    while (1) {
+        if ((n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR) continue;
+            unix_error("epoll_wait error");
+        }
+
+        for (i = 0; i < n; i++) {
+            handle = (Io_Handle *) events[i].data.ptr;
+            if (handle->conn == NULL) {
+                accept_connections(loop);
+                continue;
+            }
+
+            conn = handle->conn;
+            if (conn->state == CONN_CLOSED) {
+                continue;   /* Closed by an earlier event in this batch */
+            }
+            /* Error or hang-up on a descriptor we are not waiting on */
+            if ((events[i].events & (EPOLLERR | EPOLLHUP))
+                    && handle->events == 0)
+            {
+                conn_close(loop, conn);
+                continue;
+            }
+            conn_step(loop, conn);
+        }
+        free_closed(loop);
+    }
+    return NULL;
+}
+
+/* Accept a batch of pending connections from the listening socket */
+static void accept_connections(Event_Loop *loop) {
+    struct epoll_event ev;
+    Conn *conn;
+    int i, connfd;
+
+    for (i = 0; i < ACCEPT_BATCH; i++) {
+        if ((connfd = accept4(loop->listener.fd, NULL, NULL,
+                SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                unix_error_nexit("Accept error");
+            return;
+        }
+
+        if ((conn = calloc(1, sizeof(Conn))) == NULL) {
+            close(connfd);
+            return;
+        }
+        conn->state = CONN_READ_REQUEST;
+        conn->conn_id = ++loop->next_conn_id;
+        conn->client.fd = connfd;
+        conn->client.events = EPOLLIN;
+        conn->client.conn = conn;
+        conn->server.fd = -1;
+        conn->server.conn = conn;
+        conn->timer.fd = -1;
+        conn->timer.conn = conn;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conn->client;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            unix_error_nexit("epoll_ctl error");
+            close(connfd);
+            free(conn);
+            continue;
+        }
+
+        loop->conn_count++;
+        printf("{ [%d:%u] Client connected. \tConnections on loop: %u }\n\n",
+                loop->id, conn->conn_id, loop->conn_count);
+
+        conn_step(loop, conn);  /* The request may already be there */
+    }
+}
+
+/* Run the state machine of a connection until it has to wait */
+static void conn_step(Event_Loop *loop, Conn *conn) {
+    int rc = STEP_NEXT;
+
+    while (rc == STEP_NEXT) {
+        switch (conn->state) {
+        case CONN_READ_REQUEST:
+            rc = do_read_request(loop, conn);
+            break;
+        case CONN_CONNECTING:
+            rc = do_connecting(loop, conn);
+            break;
+        case CONN_SEND_REQUEST:
+            rc = do_send_request(loop, conn);
+            break;
+        case CONN_RELAY:
+            rc = do_relay(loop, conn);
+            break;
+        case CONN_SEND_HIT:
+            rc = do_send_hit(loop, conn);
+            break;
+        case CONN_LINGER:
+            rc = do_linger(loop, conn);
+            break;
+        default:
+            return;
+        }
+    }
+    if (rc == STEP_CLOSE) {
+        conn_close(loop, conn);
+    }
+}
+
+/* CONN_READ_REQUEST: accumulate the request header block */
+static int do_read_request(Event_Loop *loop, Conn *conn) {
+    ssize_t n;
+    size_t from;
+    char *newbuf;
+
+    while (1) {
+        /* Keep one byte for the null terminator */
+        if (conn->in_len + 1 >= conn->in_cap) {
+            if (conn->in_cap >= MAX_HEADER_SIZE) {
+                printf("\t(Request header too large!)\n");
+                return STEP_CLOSE;
+            }
+            conn->in_cap = conn->in_cap ? 2 * conn->in_cap : HEADER_BUFSIZE;
+            if ((newbuf = realloc(conn->inbuf, conn->in_cap)) == NULL)
+                return STEP_CLOSE;
+            conn->inbuf = newbuf;
+        }
+
+        n = read(conn->client.fd, conn->inbuf + conn->in_len,
+                conn->in_cap - conn->in_len - 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(loop, &conn->client, EPOLLIN);
+                return STEP_AGAIN;
+            }
+            return STEP_CLOSE;
+        }
+        if (n == 0) {
+            /* Client finished sending, parse whatever has arrived */
+            if (conn->in_len == 0) return STEP_CLOSE;
+            break;
+        }
+
+        /* Only look for the blank line in the bytes just read */
+        from = (conn->in_len > 3) ? conn->in_len - 3 : 0;
+        conn->in_len += n;
+        conn->inbuf[conn->in_len] = '\0';
+        if (strstr(conn->inbuf + from, "\r\n\r\n")) break;
+    }
+
+    return conn_parse_request(loop, conn);
+}
+
+/* Parse the header block, then look up the cache */
+static int conn_parse_request(Event_Loop *loop, Conn *conn) {
+    Http_Request req;
+
+    if (parse_request_block(&req, conn->inbuf, conn->client.fd) 
+            != REQUEST_OK)
+    {
+        return STEP_CLOSE;
+    }
+
+    free(conn->inbuf);
+    conn->inbuf = NULL;
+    conn->in_len = conn->in_cap = 0;
+
+    if ((conn->uri = strdup(req.uri)) == NULL
+            || (conn->host = strdup(req.host)) == NULL
+            || (conn->hostname = strdup(req.hostname)) == NULL
+            || (conn->request = strdup(req.new_request)) == NULL)
+    {
+        return STEP_CLOSE;
+    }
+    conn->port = req.port;
+    conn->request_len = strlen(conn->request);
+    conn->cache_request = req.cache_request;
+
+    /* Search uri in cache */
+    if ((conn->hit = search_and_pin(&cache_list, conn->uri)) != NULL) {
+        printf("URI: %s\nCache Hit!\n\n", conn->uri);
+        /* Sent from the cache memory, unpinned when the conn is freed */
+        conn->hit_segment = 0;
+        conn->outbuf = item_segment(conn->hit, 0, &conn->out_len);
+        conn->out_off = 0;
+        conn->byte_count = 0;
+        conn->state = CONN_SEND_HIT;
+        return STEP_NEXT;
+    }
+
+    printf("URI: %s\nCache Miss.\n\n", conn->uri);
+    return start_connect(loop, conn);
+}
+
+/* Resolve the server and start a non-blocking connect() */
+static int start_connect(Event_Loop *loop, Conn *conn) {
+    struct in_addr addrs[RESOLVE_MAX_ADDRS];
+    struct sockaddr_in serveraddr;
+    struct epoll_event ev;
+    int fd = -1, naddrs, i;
+
+    conn->fetch_start_ns = monotonic_ns();
+    if ((naddrs = resolve_hook(conn->hostname, addrs, 
+            RESOLVE_MAX_ADDRS)) <= 0) 
+    {
+        printf("DNS error! Hostname: %s\tPort: %d\n",
+                conn->hostname, conn->port);
+        clienterror(conn->client.fd, conn->host, "400", "Bad Request",
+                "This webpage is not available, because DNS lookup failed");
+        return STEP_CLOSE;
+    }
+
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(conn->port);
+    for (i = 0; i < naddrs; i++) {
+        if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK
+                | SOCK_CLOEXEC, 0)) < 0)
+        {
+            continue;
+        }
+        serveraddr.sin_addr = addrs[i];
+        if (connect(fd, (SA *) &serveraddr, sizeof(serveraddr)) == 0
+                || errno == EINPROGRESS)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+
+    if (fd < 0) {
+        printf("To-server socket connection error!\n");
+        printf("Hostname: %s\tPort: %d\n", conn->hostname, conn->port);
+        return STEP_CLOSE;
+    }
+
+    conn->server.fd = fd;
+    conn->server.events = EPOLLOUT;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = &conn->server;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        unix_error_nexit("epoll_ctl error");
+        return STEP_CLOSE;
+    }
+    watch(loop, &conn->client, 0);
+
+    conn->state = CONN_CONNECTING;
+    return STEP_AGAIN;
+}
+
+/* CONN_CONNECTING: the server socket became writable */
+static int do_connecting(Event_Loop *loop, Conn *conn) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(conn->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0
+            || err != 0)
+    {
+        printf("To-server socket connection error!\n");
+        printf("Hostname: %s\tPort: %d\n", conn->hostname, conn->port);
+        return STEP_CLOSE;
+    }
+
+    printf("New request:\n");
+    printf("%s", conn->request);    /* Print the new HTTP request */
+
+    conn->state = CONN_SEND_REQUEST;
+    return STEP_NEXT;
+}
+
+/* CONN_SEND_REQUEST: write the rebuilt request to the server */
+static int do_send_request(Event_Loop *loop, Conn *conn) {
+    ssize_t n;
+
+    while (conn->request_off < conn->request_len) {
+        n = write(conn->server.fd, conn->request + conn->request_off,
+                conn->request_len - conn->request_off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(loop, &conn->server, EPOLLOUT);
+                return STEP_AGAIN;
+            }
+            return STEP_CLOSE;
+        }
+        conn->request_off += n;
+    }
+    printf("{ Forwarded request to server. Ready to read response. }\n");
+
+    free(conn->request);
+    conn->request = NULL;
+    if ((conn->relay = malloc(RELAY_BUFSIZE)) == NULL) return STEP_CLOSE;
+    conn->cacheable = 1;
+    conn->state = CONN_RELAY;
+    return STEP_NEXT;
+}
+
+/* CONN_RELAY: move response bytes from the server to the client, 
+   receiving them straight into the pages of the cache fill while the 
+   response may be cached */
+static int do_relay(Event_Loop *loop, Conn *conn) {
+    Cache_Item *item;
+    size_t room;
+    ssize_t n;
+    char *dst;
+    int rc;
+
+    while (1) {
+        /* Finish writing the last chunk before reading the next one */
+        if ((rc = flush_output(loop, conn)) != STEP_NEXT) return rc;
+
+        /* Larger than the object size, or no room in the cache */
+        if (conn->cacheable
+                && (dst = reserve_cache_fill(&conn->fill, &room)) == NULL)
+        {
+            conn->cacheable = 0;
+        }
+        if (!conn->cacheable) {
+            free_cache_fill(&conn->fill);
+            dst = conn->relay;
+            room = RELAY_BUFSIZE;
+        }
+        else if (room > RELAY_BUFSIZE) {
+            room = RELAY_BUFSIZE;
+        }
+
+        n = read(conn->server.fd, dst, room);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(loop, &conn->client, 0);
+                watch(loop, &conn->server, EPOLLIN);
+                return STEP_AGAIN;
+            }
+            return STEP_CLOSE;
+        }
+        if (n == 0) break;  /* End of response */
+
+        /* The pages are given back once this chunk is sent */
+        if (conn->cacheable) {
+            conn->fill.length += n;
+            conn->cacheable = admit_cache_fill(&cache_list, &conn->fill,
+                    conn->uri, conn->cache_request);
+        }
+
+        conn->outbuf = dst;
+        conn->out_len = n;
+        conn->out_off = 0;
+        conn->byte_count += n;
+    }
+
+    if (conn->cacheable && (item = build_filled_item(&conn->fill, 
+            conn->uri)) != NULL) 
+    {
+        /* Insert into cache */
+        item->fetch_us = (monotonic_ns() - conn->fetch_start_ns) / 1000;
+        insert_cache_item(&cache_list, item);
+    }
+    printf("\n(%d bytes have been transmited as response.)\n",
+            conn->byte_count);
+    return STEP_CLOSE;
+}
+
+/* CONN_SEND_HIT: write the cached response to the client, one segment 
+   of the item after the other */
+static int do_send_hit(Event_Loop *loop, Conn *conn) {
+    int rc;
+
+    while (conn->outbuf != NULL) {
+        if ((rc = flush_output(loop, conn)) != STEP_NEXT) return rc;
+        conn->byte_count += conn->out_len;
+        conn->outbuf = item_segment(conn->hit, ++conn->hit_segment,
+                &conn->out_len);
+        conn->out_off = 0;
+    }
+    printf("\n(%d bytes have been transmited as response.)\n",
+            conn->byte_count);
+    if (slab_fd() >= 0) {
+        conn->linger_deadline = monotonic_ns() 
+                + HIT_LINGER_SEC * 1000000000LL;
+        conn->state = CONN_LINGER;
+        return STEP_NEXT;
+    }
+    return STEP_CLOSE;
+}
+
+/* CONN_LINGER: wait until the client has acknowledged a hit sent with 
+   sendfile(), so its pages are no longer in the socket: the send queue 
+   (SIOCOUTQ) is checked on every tick of a timerfd. Past the deadline, 
+   conn_close() resets the connection instead */
+static int do_linger(Event_Loop *loop, Conn *conn) {
+    struct itimerspec tick = {{0, HIT_LINGER_POLL_MS * 1000000},
+            {0, HIT_LINGER_POLL_MS * 1000000}};
+    struct epoll_event ev;
+    uint64_t ticks;
+    int queued;
+
+    if (ioctl(conn->client.fd, SIOCOUTQ, &queued) < 0) {
+        return STEP_CLOSE;
+    }
+    if (queued == 0) {
+        conn->lingered = 1;
+        return STEP_CLOSE;
+    }
+    if (monotonic_ns() >= conn->linger_deadline) {
+        return STEP_CLOSE;
+    }
+
+    if (conn->timer.fd < 0) {
+        if ((conn->timer.fd = timerfd_create(CLOCK_MONOTONIC,
+                TFD_NONBLOCK | TFD_CLOEXEC)) < 0
+                || timerfd_settime(conn->timer.fd, 0, &tick, NULL) < 0)
+        {
+            return STEP_CLOSE;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conn->timer;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->timer.fd, &ev) < 0) {
+            return STEP_CLOSE;
+        }
+        conn->timer.events = EPOLLIN;
+        watch(loop, &conn->client, 0);
+    }
+    else if (read(conn->timer.fd, &ticks, sizeof(ticks)) < 0
+            && errno != EAGAIN)
+    {
+        return STEP_CLOSE;
+    }
+    return STEP_AGAIN;
+}
+
+/* Write pending output to the client, from the memfd of the cache for a 
+   hit if it has one. Returns STEP_NEXT once drained */
+static int flush_output(Event_Loop *loop, Conn *conn) {
+    int arena_fd = (conn->hit != NULL) ? slab_fd() : -1;
+    off_t offset;
+    ssize_t n;
+
+    while (conn->out_off < conn->out_len) {
+        if (arena_fd >= 0) {
+            offset = slab_offset(conn->outbuf) + conn->out_off;
+            n = sendfile(conn->client.fd, arena_fd, &offset,
+                    conn->out_len - conn->out_off);
+        }
+        else {
+            n = write(conn->client.fd, conn->outbuf + conn->out_off,
+                    conn->out_len - conn->out_off);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (conn->server.fd >= 0) watch(loop, &conn->server, 0);
+                watch(loop, &conn->client, EPOLLOUT);
+                return STEP_AGAIN;
+            }
+            return STEP_CLOSE;
+        }
+        conn->out_off += n;
+    }
+    return STEP_NEXT;
+}
+
+/* Change the epoll events registered for a descriptor if needed */
+static void watch(Event_Loop *loop, Io_Handle *handle, unsigned int events) {
+    struct epoll_event ev;
+
+    if (handle->events == events) return;
+    ev.events = events;
+    ev.data.ptr = handle;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, handle->fd, &ev) < 0) {
+        unix_error_nexit("epoll_ctl error");
+        return;
+    }
+    handle->events = events;
+}
+
+/* Close the connection; its memory is freed after the current batch */
+static void conn_close(Event_Loop *loop, Conn *conn) {
+    struct linger reset = {1, 0};
+
+    /* Pages of a hit sent with sendfile() may still be queued */
+    if (conn->hit != NULL && slab_fd() >= 0 && !conn->lingered
+            && conn->client.fd >= 0)
+    {
+        setsockopt(conn->client.fd, SOL_SOCKET, SO_LINGER, &reset,
+                sizeof(reset));
+    }
+    /* Closing a descriptor also removes it from the epoll set */
+    if (conn->server.fd >= 0) close(conn->server.fd);
+    if (conn->client.fd >= 0) close(conn->client.fd);
+    if (conn->timer.fd >= 0) close(conn->timer.fd);
+    conn->server.fd = conn->client.fd = conn->timer.fd = -1;
+    conn->state = CONN_CLOSED;
+
+    conn->next_closed = loop->closed;
+    loop->closed = conn;
+    loop->conn_count--;
+    printf("{ [%d:%u] Connection closed. \tConnections on loop: %u }\n\n",
+            loop->id, conn->conn_id, loop->conn_count);
+}
+
+/* Free the connections closed during the last batch of events */
+static void free_closed(Event_Loop *loop) {
+    Conn *conn;
+
+    while ((conn = loop->closed) != NULL) {
+        loop->closed = conn->next_closed;
+        if (conn->hit) unpin_cache_item(conn->hit);
+        free(conn->inbuf);
+        free(conn->uri);
+        free(conn->host);
+        free(conn->hostname);
+        free(conn->request);
+        free(conn->relay);
+        free_cache_fill(&conn->fill);
+        free(conn);
+    }
+}
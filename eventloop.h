@@ -0,0 +1,18 @@
+/*
+ eventloop.h for proxy lab
+ ----------------------
+ Contains the entry point of the event-driven (epoll) engine.
+ See "eventloop.c" for the design of the event loops.
+ */
+
+#ifndef __EVENTLOOP_H__
+#define __EVENTLOOP_H__
+
+#include "csapp.h"
+
+/*
+ * Function prototypes
+ */
+void eventloop_run(int *listenfds, int nlisteners, int nloops);
+
+#endif /* __EVENTLOOP_H__ */
@@ -0,0 +1,388 @@
+/*
+ fiber.c for proxy lab
+ ----------------------
+ Contains the fiber runtime used by the "-e fiber" engine.
+
+   About fiber design
+ ----------------------
+    The thread engine runs the sequential handler (serve_client() and
+ the functions it calls) on one OS thread per connection, so every
+ connection costs a full thread stack and a kernel thread. The event
+ engines avoid that, but only by rewriting the handler as callbacks.
+
+    This runtime keeps the sequential handler as it is and runs it on
+ fibers instead: user-space threads with their own small stack,
+ multiplexed M:N over one scheduler thread per core. A connection is
+ placed on a scheduler round-robin and stays there until it is closed.
+
+    Each fiber stack is mmap'd with MAP_NORESERVE and a PROT_NONE guard
+ page below it, so a stack overflow faults instead of corrupting another
+ fiber, and only the pages a fiber actually touches use memory. Finished
+ fibers are kept on a free list with their stack for the next connection.
+
+    The Rio package and open_clientfd_r() do their I/O through the hooks
+ in csapp.c, which this runtime replaces with fiber-aware versions. The
+ sockets of a fiber are non-blocking: when read(), write(), sendfile() or
+ connect() would block, the fiber registers the descriptor with its scheduler's
+ epoll set (EPOLLONESHOT) and switches back to the scheduler. The
+ scheduler runs the ready fibers in FIFO order, then waits in
+ epoll_wait() and makes ready the fibers whose descriptors fired. Outside
+ a fiber the hooks behave exactly like the plain system calls.
+
+    Note: anything else that blocks (a contended cache lock, or a DNS
+ lookup the resolver has not cached) blocks the whole scheduler thread
+ for that time, so handler code must not hold a lock across Rio calls.
+ */
+
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "proxy.h"
+#include "fiber.h"
+
+#define MIN_FIBER_STACK (64 * 1024)
+#define FREE_FIBERS     256         /* Finished fibers kept per scheduler */
+#define FIBER_EVENTS    256         /* Events taken per epoll_wait() */
+
+
+/*
+ * Function prototypes
+ */
+static void *sched_thread(void *args);
+static void take_requests(Fiber_Sched *sched);
+static Fiber *fiber_create(Fiber_Sched *sched, int connfd, int conn_id);
+static void fiber_release(Fiber_Sched *sched, Fiber *fiber);
+static void fiber_entry(unsigned int hi, unsigned int lo);
+static void ready_push(Fiber_Sched *sched, Fiber *fiber);
+static int fiber_wait(Fiber *fiber, int fd, unsigned int events);
+static ssize_t fiber_read(int fd, void *buf, size_t n);
+static ssize_t fiber_write(int fd, const void *buf, size_t n);
+static ssize_t fiber_sendfile(int out_fd, int in_fd, off_t *offset,
+        size_t n);
+static int fiber_connect(int fd, const struct sockaddr *addr,
+        socklen_t addrlen);
+
+/* Fiber running on the current thread, NULL on the scheduler itself */
+static __thread Fiber *current_fiber = NULL;
+static size_t page_size;
+
+
+
+/*
+ *  Start nscheds scheduler threads running handler on fibers, and switch
+ *  the Rio I/O hooks to their fiber-aware versions.
+ */
+Fiber_Runtime *fiber_runtime_create(pool_handler_t *handler, int nscheds,
+        size_t stack_size)
+{
+    Fiber_Runtime *rt;
+    Fiber_Sched *sched;
+    struct epoll_event ev;
+    pthread_t tid;
+    int i;
+
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
+    if (stack_size < MIN_FIBER_STACK) {
+        printf("Fiber stack size raised to %d KB\n", MIN_FIBER_STACK / 1024);
+        stack_size = MIN_FIBER_STACK;
+    }
+    stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+
+    rt = Calloc(1, sizeof(Fiber_Runtime));
+    rt->scheds = Calloc(nscheds, sizeof(Fiber_Sched));
+    rt->nscheds = nscheds;
+    rt->handler = handler;
+    rt->stack_size = stack_size;
+    atomic_init(&rt->next_sched, 0);
+
+    raise_fd_limit();
+    rio_read_hook = fiber_read;
+    rio_write_hook = fiber_write;
+    rio_sendfile_hook = fiber_sendfile;
+    connect_hook = fiber_connect;
+
+    for (i = 0; i < nscheds; i++) {
+        sched = &rt->scheds[i];
+        sched->id = i;
+        sched->rt = rt;
+        Pthread_mutex_init(&sched->inbox_mutex, NULL);
+        if ((sched->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            unix_error("epoll_create1 error");
+        if ((sched->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+            unix_error("eventfd error");
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;     /* NULL marks the wakeup descriptor */
+        if (epoll_ctl(sched->epfd, EPOLL_CTL_ADD, sched->wakefd, &ev) < 0)
+            unix_error("epoll_ctl error");
+        Pthread_create(&tid, NULL, sched_thread, sched);
+    }
+
+    printf("{ Fiber runtime: %d scheduler(s), %zu KB stacks }\n\n",
+            nscheds, stack_size / 1024);
+    return rt;
+}
+
+/* Queue an accepted connection to be served on a new fiber */
+void fiber_submit(Fiber_Runtime *rt, int connfd, int conn_id) {
+    Fiber_Sched *sched;
+    Fiber_Request *req;
+    uint64_t one = 1;
+
+    sched = &rt->scheds[atomic_fetch_add(&rt->next_sched, 1) % rt->nscheds];
+    req = Malloc(sizeof(Fiber_Request));
+    req->connfd = connfd;
+    req->conn_id = conn_id;
+    req->next = NULL;
+
+    Pthread_mutex_lock(&sched->inbox_mutex);
+    if (sched->inbox_tail)
+        sched->inbox_tail->next = req;
+    else
+        sched->inbox_head = req;
+    sched->inbox_tail = req;
+    Pthread_mutex_unlock(&sched->inbox_mutex);
+
+    if (write(sched->wakefd, &one, sizeof(one)) < 0)
+        unix_error_nexit("eventfd write error");
+}
+
+/* Scheduler thread routine: run ready fibers, then wait for I/O */
+static void *sched_thread(void *args) {
+    Fiber_Sched *sched = (Fiber_Sched *) args;
+    struct epoll_event events[FIBER_EVENTS];
+    Fiber *fiber;
+    int i, n;
+
+    Pthread_detach(pthread_self());
+    if (sched->rt->nscheds > 1) {
+        pin_to_core(sched->id);
+    }
+
+    while (1) {
+        while ((fiber = sched->ready_head) != NULL) {
+            if ((sched->ready_head = fiber->next) == NULL)
+                sched->ready_tail = NULL;
+
+            current_fiber = fiber;
+            swapcontext(&sched->ctx, &fiber->ctx);
+            current_fiber = NULL;
+            if (fiber->done)
+                fiber_release(sched, fiber);
+        }
+
+        if ((n = epoll_wait(sched->epfd, events, FIBER_EVENTS, -1)) < 0) {
+            if (errno != EINTR)
+                unix_error_nexit("epoll_wait error");
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                take_requests(sched);
+            else
+                ready_push(sched, (Fiber *) events[i].data.ptr);
+        }
+    }
+    return NULL;
+}
+
+/* Start a fiber for every connection queued to this scheduler */
+static void take_requests(Fiber_Sched *sched) {
+    Fiber_Request *req, *next;
+    Fiber *fiber;
+    uint64_t count;
+
+    if (read(sched->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        unix_error_nexit("eventfd read error");
+
+    Pthread_mutex_lock(&sched->inbox_mutex);
+    req = sched->inbox_head;
+    sched->inbox_head = sched->inbox_tail = NULL;
+    Pthread_mutex_unlock(&sched->inbox_mutex);
+
+    for (; req; req = next) {
+        next = req->next;
+        if ((fiber = fiber_create(sched, req->connfd, req->conn_id)) != NULL)
+            ready_push(sched, fiber);
+        else
+            close(req->connfd);
+        Free(req);
+    }
+}
+
+/* Set up a fiber to run the handler, reusing a finished one if possible */
+static Fiber *fiber_create(Fiber_Sched *sched, int connfd, int conn_id) {
+    Fiber *fiber;
+    size_t size = sched->rt->stack_size;
+    uintptr_t ptr;
+
+    if ((fiber = sched->free_fibers) != NULL) {
+        sched->free_fibers = fiber->next;
+        sched->free_count--;
+    }
+    else {
+        if ((fiber = calloc(1, sizeof(Fiber))) == NULL)
+            return NULL;
+        fiber->stack = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                -1, 0);
+        if (fiber->stack == MAP_FAILED) {
+            unix_error_nexit("Fiber stack mmap error");
+            free(fiber);
+            return NULL;
+        }
+        /* Guard page at the low end, stacks grow down */
+        if (mprotect(fiber->stack, page_size, PROT_NONE) < 0)
+            unix_error_nexit("Fiber guard page error");
+    }
+
+    fiber->sched = sched;
+    fiber->next = NULL;
+    fiber->connfd = connfd;
+    fiber->conn_id = conn_id;
+    fiber->armed_fd = -1;
+    fiber->done = 0;
+    if (fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK) < 0)
+        unix_error_nexit("fcntl error");
+
+    getcontext(&fiber->ctx);
+    fiber->ctx.uc_stack.ss_sp = fiber->stack + page_size;
+    fiber->ctx.uc_stack.ss_size = size;
+    fiber->ctx.uc_link = &sched->ctx;
+    /* makecontext() only passes int arguments, so split the pointer */
+    ptr = (uintptr_t) fiber;
+    makecontext(&fiber->ctx, (void (*)(void)) fiber_entry, 2,
+            (unsigned int) (ptr >> 32), (unsigned int) ptr);
+
+    sched->fiber_count++;
+    return fiber;
+}
+
+/* Keep a finished fiber for reuse, or free it with its stack */
+static void fiber_release(Fiber_Sched *sched, Fiber *fiber) {
+    sched->fiber_count--;
+    if (sched->free_count < FREE_FIBERS) {
+        fiber->next = sched->free_fibers;
+        sched->free_fibers = fiber;
+        sched->free_count++;
+        return;
+    }
+    munmap(fiber->stack, sched->rt->stack_size + page_size);
+    free(fiber);
+}
+
+/* First function run on a fiber; returning resumes the scheduler */
+static void fiber_entry(unsigned int hi, unsigned int lo) {
+    Fiber *fiber = (Fiber *) (((uintptr_t) hi << 32) | lo);
+
+    fiber->sched->rt->handler(fiber->connfd, fiber->conn_id);
+    fiber->done = 1;
+}
+
+static void ready_push(Fiber_Sched *sched, Fiber *fiber) {
+    fiber->next = NULL;
+    if (sched->ready_tail)
+        sched->ready_tail->next = fiber;
+    else
+        sched->ready_head = fiber;
+    sched->ready_tail = fiber;
+}
+
+/*
+ *  Park the fiber until fd is ready for events, running other fibers
+ *  meanwhile. Returns 0 when woken up, -1 if fd cannot be watched.
+ */
+static int fiber_wait(Fiber *fiber, int fd, unsigned int events) {
+    struct epoll_event ev;
+    int op, rc;
+
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = fiber;
+    /* A closed descriptor leaves the epoll set, and a number can be
+     * reused, so fall back to the other operation when needed */
+    op = (fd == fiber->armed_fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if ((rc = epoll_ctl(fiber->sched->epfd, op, fd, &ev)) < 0) {
+        if (errno == EEXIST)
+            rc = epoll_ctl(fiber->sched->epfd, EPOLL_CTL_MOD, fd, &ev);
+        else if (errno == ENOENT)
+            rc = epoll_ctl(fiber->sched->epfd, EPOLL_CTL_ADD, fd, &ev);
+        if (rc < 0)
+            return -1;
+    }
+    fiber->armed_fd = fd;
+
+    swapcontext(&fiber->ctx, &fiber->sched->ctx);
+    return 0;
+}
+
+/* read() hook: yield instead of blocking */
+static ssize_t fiber_read(int fd, void *buf, size_t n) {
+    Fiber *fiber = current_fiber;
+    ssize_t rc;
+
+    while ((rc = read(fd, buf, n)) < 0 && fiber != NULL
+            && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        if (fiber_wait(fiber, fd, EPOLLIN) < 0)
+            return -1;
+    }
+    return rc;
+}
+
+/* write() hook: yield instead of blocking */
+static ssize_t fiber_write(int fd, const void *buf, size_t n) {
+    Fiber *fiber = current_fiber;
+    ssize_t rc;
+
+    while ((rc = write(fd, buf, n)) < 0 && fiber != NULL
+            && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        if (fiber_wait(fiber, fd, EPOLLOUT) < 0)
+            return -1;
+    }
+    return rc;
+}
+
+/* sendfile() hook: yield instead of blocking */
+static ssize_t fiber_sendfile(int out_fd, int in_fd, off_t *offset,
+        size_t n)
+{
+    Fiber *fiber = current_fiber;
+    ssize_t rc;
+
+    while ((rc = sendfile(out_fd, in_fd, offset, n)) < 0 && fiber != NULL
+            && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        if (fiber_wait(fiber, out_fd, EPOLLOUT) < 0)
+            return -1;
+    }
+    return rc;
+}
+
+/* connect() hook: make the socket non-blocking and yield until done */
+static int fiber_connect(int fd, const struct sockaddr *addr,
+        socklen_t addrlen)
+{
+    Fiber *fiber = current_fiber;
+    socklen_t len = sizeof(int);
+    int err;
+
+    if (fiber == NULL) {
+        return connect(fd, addr, addrlen);
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+        return -1;
+    if (connect(fd, addr, addrlen) == 0)
+        return 0;
+    if (errno != EINPROGRESS)
+        return -1;
+
+    if (fiber_wait(fiber, fd, EPOLLOUT) < 0)
+        return -1;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        return -1;
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
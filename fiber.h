@@ -0,0 +1,71 @@
+/*
+ fiber.h for proxy lab
+ ----------------------
+ Contains the fiber runtime used by the "-e fiber" engine.
+ See "fiber.c" for the design of the fibers and their schedulers.
+ */
+
+#ifndef __FIBER_H__
+#define __FIBER_H__
+
+#include <ucontext.h>
+#include <stdatomic.h>
+#include "csapp.h"
+#include "threadpool.h"
+
+/* Fiber that runs the handler for one connection on its own stack */
+typedef struct Fiber {
+    ucontext_t ctx;
+    char *stack;                /* mmap'd, with a guard page below */
+    struct Fiber_Sched *sched;
+    struct Fiber *next;         /* Link in the ready or free list */
+    int connfd;
+    int conn_id;
+    int armed_fd;               /* Last descriptor added to the epoll set */
+    int done;
+} Fiber;
+
+/* Fiber_Request that carries an accepted connection to a scheduler */
+typedef struct Fiber_Request {
+    int connfd;
+    int conn_id;
+    struct Fiber_Request *next;
+} Fiber_Request;
+
+/* Fiber_Sched that runs the fibers of one core */
+typedef struct Fiber_Sched {
+    int id;
+    int epfd;                   /* Descriptors the fibers wait on */
+    int wakefd;                 /* eventfd posted when requests arrive */
+    ucontext_t ctx;             /* Context the fibers switch back to */
+    struct Fiber_Runtime *rt;
+
+    Fiber *ready_head;          /* Fibers ready to run, in FIFO order */
+    Fiber *ready_tail;
+    Fiber *free_fibers;         /* Finished fibers kept with their stack */
+    int free_count;
+    unsigned int fiber_count;   /* Live fibers on this scheduler */
+
+    pthread_mutex_t inbox_mutex;
+    Fiber_Request *inbox_head;
+    Fiber_Request *inbox_tail;
+} Fiber_Sched;
+
+/* Fiber_Runtime that tracks all schedulers */
+typedef struct Fiber_Runtime {
+    Fiber_Sched *scheds;
+    int nscheds;
+    atomic_uint next_sched;     /* Round-robin placement of connections */
+    pool_handler_t *handler;
+    size_t stack_size;
+} Fiber_Runtime;
+
+
+/*
+ * Function prototypes
+ */
+Fiber_Runtime *fiber_runtime_create(pool_handler_t *handler, int nscheds,
+        size_t stack_size);
+void fiber_submit(Fiber_Runtime *rt, int connfd, int conn_id);
+
+#endif /* __FIBER_H__ */
@@ -0,0 +1,204 @@
+/*
+ freshtest.c for proxy lab
+ ----------------------
+ Behavior test of fresh_parse(), the freshness model of the cache (see
+ "cache_fresh.c").
+
+    usage: freshtest
+
+    fresh_parse() is a pure function of the response headers and of the
+ time they were received at (and of whether the request carried an
+ Authorization header), so each case is a response and what it
+ should return for it at NOW: the reason it is not cached, or for how
+ many seconds it is fresh. NOW is the date of the examples of RFC 7231,
+ Sun, 06 Nov 1994 08:49:37 GMT, which the header dates are written
+ around. It prints the cases that fail, and exits with 1 if any did.
+ */
+
+#include "cache.h"
+
+#define NOW         784111777   /* Sun, 06 Nov 1994 08:49:37 GMT */
+#define ANY         -1          /* Lifetime not checked */
+
+/* Fresh_Case that tracks one response and what fresh_parse() returns */
+typedef struct Fresh_Case {
+    const char *name;
+    const char *response;
+    int rc;
+    long lifetime;              /* Seconds from NOW it expires in */
+    int authorized;             /* The request had Authorization */
+} Fresh_Case;
+
+static const Fresh_Case cases[] = {
+    {"max-age",
+        "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n\r\n",
+        FRESH_STORE, 60},
+    {"s-maxage over max-age",
+        "HTTP/1.1 200 OK\r\nCache-Control: max-age=60, s-maxage=120\r\n\r\n",
+        FRESH_STORE, 120},
+    {"header names in any case",
+        "HTTP/1.1 200 OK\r\ncache-control: MAX-AGE=30\r\n\r\n",
+        FRESH_STORE, 30},
+    {"quoted max-age",
+        "HTTP/1.1 200 OK\r\nCache-Control: max-age=\"45\"\r\n\r\n",
+        FRESH_STORE, 45},
+    {"bare line ends",
+        "HTTP/1.0 200 OK\nCache-Control: max-age=10\n\n",
+        FRESH_STORE, 10},
+    {"max-age over Expires",
+        "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+        "Expires: Sun, 06 Nov 1994 08:51:17 GMT\r\n\r\n",
+        FRESH_STORE, 60},
+    {"Expires",
+        "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "Expires: Sun, 06 Nov 1994 08:51:17 GMT\r\n\r\n",
+        FRESH_STORE, 100},
+    {"Expires after an older Date",
+        "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:27 GMT\r\n"
+        "Expires: Sun, 06 Nov 1994 08:51:17 GMT\r\n\r\n",
+        FRESH_STORE, 100},
+    {"RFC 850 Expires",
+        "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "Expires: Sunday, 06-Nov-94 08:51:17 GMT\r\n\r\n",
+        FRESH_STORE, 100},
+    {"asctime() Expires",
+        "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "Expires: Sun Nov  6 08:51:17 1994\r\n\r\n",
+        FRESH_STORE, 100},
+    {"Expires not a date",
+        "HTTP/1.1 200 OK\r\nExpires: 0\r\n\r\n",
+        FRESH_STALE, ANY},
+    {"Date takes the age off",
+        "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:27 GMT\r\n"
+        "Cache-Control: max-age=60\r\n\r\n",
+        FRESH_STORE, 50},
+    {"Date in the future is ignored",
+        "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 09:49:37 GMT\r\n"
+        "Cache-Control: max-age=60\r\n\r\n",
+        FRESH_STORE, 60},
+    {"Age takes the age off",
+        "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nAge: 15\r\n\r\n",
+        FRESH_STORE, 45},
+    {"older than max-age",
+        "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nAge: 100\r\n\r\n",
+        FRESH_STALE, ANY},
+    {"heuristic from Last-Modified",
+        "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "Last-Modified: Sun, 06 Nov 1994 06:02:57 GMT\r\n\r\n",
+        FRESH_STORE, 1000},
+    {"heuristic capped",
+        "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "Last-Modified: Sun, 06 Nov 1983 08:49:37 GMT\r\n\r\n",
+        FRESH_STORE, FRESH_HEURISTIC_MAX},
+    {"default lifetime",
+        "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n",
+        FRESH_STORE, FRESH_DEFAULT_TTL},
+    {"heuristic 301",
+        "HTTP/1.1 301 Moved Permanently\r\n\r\n",
+        FRESH_STORE, FRESH_DEFAULT_TTL},
+    {"error without freshness",
+        "HTTP/1.1 404 Not Found\r\n\r\n",
+        FRESH_STATUS, ANY},
+    {"error with max-age",
+        "HTTP/1.1 404 Not Found\r\nCache-Control: max-age=5\r\n\r\n",
+        FRESH_STORE, 5},
+    {"status not cacheable by default",
+        "HTTP/1.1 302 Found\r\n\r\n",
+        FRESH_STATUS, ANY},
+    {"partial content",
+        "HTTP/1.1 206 Partial Content\r\nCache-Control: max-age=60\r\n\r\n",
+        FRESH_STATUS, ANY},
+    {"not modified",
+        "HTTP/1.1 304 Not Modified\r\nCache-Control: max-age=60\r\n\r\n",
+        FRESH_STATUS, ANY},
+    {"interim",
+        "HTTP/1.1 100 Continue\r\n\r\n",
+        FRESH_STATUS, ANY},
+    {"no-store",
+        "HTTP/1.1 200 OK\r\nCache-Control: max-age=60, no-store\r\n\r\n",
+        FRESH_NO_STORE, ANY},
+    {"no-cache",
+        "HTTP/1.1 200 OK\r\nCache-Control: no-cache\r\n\r\n",
+        FRESH_NO_STORE, ANY},
+    {"Cache-Control over several headers",
+        "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+        "Cache-Control: no-store\r\n\r\n",
+        FRESH_NO_STORE, ANY},
+    {"Pragma without Cache-Control",
+        "HTTP/1.1 200 OK\r\nPragma: no-cache\r\n\r\n",
+        FRESH_NO_STORE, ANY},
+    {"Pragma with Cache-Control",
+        "HTTP/1.1 200 OK\r\nPragma: no-cache\r\n"
+        "Cache-Control: max-age=60\r\n\r\n",
+        FRESH_STORE, 60},
+    {"private",
+        "HTTP/1.1 200 OK\r\nCache-Control: private, max-age=60\r\n\r\n",
+        FRESH_PRIVATE, ANY},
+    {"Set-Cookie",
+        "HTTP/1.1 200 OK\r\nSet-Cookie: id=1\r\n"
+        "Cache-Control: max-age=60\r\n\r\n",
+        FRESH_COOKIE, ANY},
+    {"Vary: *",
+        "HTTP/1.1 200 OK\r\nVary: *\r\nCache-Control: max-age=60\r\n\r\n",
+        FRESH_VARY, ANY},
+    {"Vary on a header",
+        "HTTP/1.1 200 OK\r\nVary: Accept-Encoding\r\n"
+        "Cache-Control: max-age=60\r\n\r\n",
+        FRESH_STORE, 60},
+    {"Authorization",
+        "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n\r\n",
+        FRESH_AUTHORIZED, ANY, 1},
+    {"Authorization with public",
+        "HTTP/1.1 200 OK\r\nCache-Control: public, max-age=60\r\n\r\n",
+        FRESH_STORE, 60, 1},
+    {"Authorization with s-maxage",
+        "HTTP/1.1 200 OK\r\nCache-Control: s-maxage=60\r\n\r\n",
+        FRESH_STORE, 60, 1},
+    {"Authorization with must-revalidate",
+        "HTTP/1.1 200 OK\r\nCache-Control: must-revalidate, max-age=60\r\n"
+        "\r\n",
+        FRESH_STORE, 60, 1},
+    {"Authorization with Expires alone",
+        "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "Expires: Sun, 06 Nov 1994 08:51:17 GMT\r\n\r\n",
+        FRESH_AUTHORIZED, ANY, 1},
+    {"headers not ended",
+        "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n",
+        FRESH_NOT_HTTP, ANY},
+    {"no status line",
+        "<html>hello</html>\r\n\r\n",
+        FRESH_NOT_HTTP, ANY},
+    {"status not a number",
+        "HTTP/1.1 2x0 OK\r\n\r\n",
+        FRESH_NOT_HTTP, ANY},
+};
+
+
+
+int main(int argc, char **argv) {
+    const Fresh_Case *c;
+    unsigned int i, failed = 0, count = sizeof(cases) / sizeof(cases[0]);
+    time_t expires;
+    int rc;
+
+    for (i = 0; i < count; i++) {
+        c = &cases[i];
+        expires = 0;
+        rc = fresh_parse(c->response, strlen(c->response), NOW,
+                c->authorized, &expires);
+        if (rc != c->rc) {
+            printf("FAIL %s: %s, expected %s\n", c->name, fresh_reason(rc),
+                    fresh_reason(c->rc));
+            failed++;
+        }
+        else if (rc == FRESH_STORE && c->lifetime != ANY
+                && expires - NOW != c->lifetime)
+        {
+            printf("FAIL %s: fresh for %ld s, expected %ld s\n", c->name,
+                    (long) (expires - NOW), c->lifetime);
+            failed++;
+        }
+    }
+    printf("%u of %u cases passed\n", count - failed, count);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,365 @@
+/*
+ inflight.c for proxy lab
+ ----------------------
+ Contains request coalescing: the table of origin fetches in flight.
+
+   About request coalescing design
+ ----------------------
+    Originally, when several clients asked for the same uncached URI at
+ once, each of them missed in the cache, fetched the object from the
+ origin on its own connection, and then added its own copy to the cache.
+ A new popular object thus hit the origin once per waiting client.
+
+    Now the first miss on a URI registers a fetch in a chained hash table
+ keyed by the cache URI and becomes its leader. The misses that find the
+ fetch there attach to it as followers instead of contacting the origin.
+ The leader relays the response to its own client as before, and also
+ appends every part it relays to the fetch (see relay_flush() in
+ "upstream.c"). Followers send each part to their client as soon as it
+ is appended, so they get the response progressively, not after the
+ leader is done. A fetch is removed from the table when the leader ends
+ it, after the response was added to the cache, so later misses find
+ the cached object instead.
+
+    The response is kept in blocks of INFLIGHT_BLOCK bytes that never
+ move, so followers copy from them without holding the table mutex; the
+ blocks are freed with the fetch when the leader and all followers are
+ done with it. A response that grows past max_object_size (the runtime
+ limit, see "cache.h") will not be cached, so the fetch leaves the table
+ then; if nobody follows it at that point, its blocks are dropped and
+ the leader just streams.
+
+    Every follower waits on an eventfd of its own, which the leader posts
+ after each append. Waiting is a read() through rio_read_hook, so a
+ follower on a fiber yields to the leader instead of blocking its
+ scheduler. If the leader's client goes away, the leader keeps fetching
+ as long as someone follows. If the fetch fails before a follower sent
+ anything, the follower fetches the object itself.
+
+    Only the misses whose response is the same for every client share a
+ fetch: a request that carries an Authorization, a Cookie or a Range
+ header fetches alone (see parse_header_line() in "proxy.c"). Likewise,
+ once the leader has the response headers and the cache would not store
+ them (a private response, one that sets a cookie, ...), it detaches the
+ fetch with inflight_detach() before relaying any byte: the fetch leaves
+ the table, and its followers fetch the object themselves.
+ */
+
+#include <sys/eventfd.h>
+#include <poll.h>
+#include "proxy.h"
+#include "inflight.h"
+
+/*
+ *  Global/shared variables
+ */
+Inflight_Table inflight_table;
+
+
+/*
+ * Function prototypes
+ */
+static Inflight_Fetch *find_fetch(char *uri, unsigned int *bucket);
+static void unlink_fetch(Inflight_Fetch *fetch);
+static void notify_readers(Inflight_Fetch *fetch);
+static void release_fetch(Inflight_Fetch *fetch);
+static int reader_wait(Inflight_Reader *reader, int timeout_ms);
+
+
+
+/* Enable coalescing. Until this is called every miss fetches alone. */
+void inflight_init(void) {
+    Pthread_mutex_init(&inflight_table.mutex, NULL);
+    inflight_table.enabled = 1;
+    printf("{ Request coalescing enabled }\n\n");
+}
+
+/*
+ *  Start serving a miss on uri. Either registers a new fetch and makes
+ *  the caller its leader (*fetch is set), or attaches reader to the
+ *  fetch already in flight. Returns INFLIGHT_LEADER, INFLIGHT_FOLLOWER,
+ *  or INFLIGHT_OFF if the caller should fetch alone.
+ */
+int inflight_begin(char *uri, int clientfd, Inflight_Fetch **fetch,
+        Inflight_Reader *reader)
+{
+    Inflight_Fetch *found;
+    unsigned int bucket;
+    int efd;
+
+    *fetch = NULL;
+    if (!inflight_table.enabled) {
+        return INFLIGHT_OFF;
+    }
+
+    Pthread_mutex_lock(&inflight_table.mutex);
+    if ((found = find_fetch(uri, &bucket)) != NULL) {
+        /* Follow it */
+        if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            Pthread_mutex_unlock(&inflight_table.mutex);
+            unix_error_nexit("eventfd error");
+            return INFLIGHT_OFF;
+        }
+        reader->fetch = found;
+        reader->clientfd = clientfd;
+        reader->efd = efd;
+        reader->pos = 0;
+        reader->next = found->readers;
+        found->readers = reader;
+        found->refcount++;
+        Pthread_mutex_unlock(&inflight_table.mutex);
+        return INFLIGHT_FOLLOWER;
+    }
+
+    /* Lead a new fetch */
+    found = Calloc(1, sizeof(Inflight_Fetch));
+    found->uri = strdup(uri);
+    found->state = FETCH_RUNNING;
+    found->linked = 1;
+    found->buffered = 1;
+    found->refcount = 1;
+    found->next = inflight_table.buckets[bucket];
+    inflight_table.buckets[bucket] = found;
+    Pthread_mutex_unlock(&inflight_table.mutex);
+
+    *fetch = found;
+    return INFLIGHT_LEADER;
+}
+
+/* Leader: publish n more bytes of response to the followers */
+void inflight_append(Inflight_Fetch *fetch, char *data, size_t n) {
+    size_t offset, part;
+
+    Pthread_mutex_lock(&inflight_table.mutex);
+    if (fetch->buffered && fetch->len + n > max_object_size) {
+        /* Too big to be cached: let later misses fetch on their own, and
+         * stop buffering unless someone already follows */
+        unlink_fetch(fetch);
+        if (fetch->readers == NULL) {
+            fetch->buffered = 0;
+        }
+    }
+    if (!fetch->buffered) {
+        fetch->len += n;
+        Pthread_mutex_unlock(&inflight_table.mutex);
+        return;
+    }
+
+    while (n > 0) {
+        offset = fetch->len % INFLIGHT_BLOCK;
+        if (offset == 0) {
+            /* Start a new block */
+            if (fetch->nblocks == fetch->max_blocks) {
+                fetch->max_blocks = fetch->max_blocks ?
+                        2 * fetch->max_blocks : 4;
+                fetch->blocks = realloc(fetch->blocks,
+                        fetch->max_blocks * sizeof(char *));
+            }
+            fetch->blocks[fetch->nblocks++] = Malloc(INFLIGHT_BLOCK);
+        }
+        part = (INFLIGHT_BLOCK - offset < n) ? INFLIGHT_BLOCK - offset : n;
+        memcpy(fetch->blocks[fetch->nblocks - 1] + offset, data, part);
+        fetch->len += part;
+        data += part;
+        n -= part;
+    }
+    notify_readers(fetch);
+    Pthread_mutex_unlock(&inflight_table.mutex);
+}
+
+/* Leader: tell if anyone follows the fetch */
+int inflight_followed(Inflight_Fetch *fetch) {
+    int followed;
+
+    Pthread_mutex_lock(&inflight_table.mutex);
+    followed = (fetch->readers != NULL && fetch->state != FETCH_DETACHED);
+    Pthread_mutex_unlock(&inflight_table.mutex);
+    return followed;
+}
+
+/* Leader: the response is not to be shared. Unless some of it was
+   published already, the fetch leaves the table, stops buffering, and
+   its followers fetch on their own */
+void inflight_detach(Inflight_Fetch *fetch) {
+    Pthread_mutex_lock(&inflight_table.mutex);
+    if (fetch->len == 0 && fetch->state == FETCH_RUNNING) {
+        fetch->state = FETCH_DETACHED;
+        fetch->buffered = 0;
+        unlink_fetch(fetch);
+        notify_readers(fetch);
+    }
+    Pthread_mutex_unlock(&inflight_table.mutex);
+}
+
+/* Leader: end the fetch, successfully or not, and let go of it */
+void inflight_end(Inflight_Fetch *fetch, int ok) {
+    Pthread_mutex_lock(&inflight_table.mutex);
+    if (fetch->state != FETCH_DETACHED) {
+        fetch->state = ok ? FETCH_DONE : FETCH_FAILED;
+    }
+    unlink_fetch(fetch);
+    notify_readers(fetch);
+    release_fetch(fetch);
+    Pthread_mutex_unlock(&inflight_table.mutex);
+}
+
+/*
+ *  Follower: send the next part of the response available to the client,
+ *  waiting up to timeout_ms (-1 for no limit) for the leader if there is
+ *  none yet. Returns INFLIGHT_MORE, INFLIGHT_DONE, INFLIGHT_ERROR, or
+ *  INFLIGHT_RETRY when the fetch failed or was detached before anything
+ *  was sent.
+ */
+int inflight_follow_step(Inflight_Reader *reader, int timeout_ms) {
+    Inflight_Fetch *fetch = reader->fetch;
+    char *data = NULL;
+    size_t offset, n = 0;
+    int state;
+
+    Pthread_mutex_lock(&inflight_table.mutex);
+    state = fetch->state;
+    if (state != FETCH_DETACHED && reader->pos < fetch->len) {
+        offset = reader->pos % INFLIGHT_BLOCK;
+        data = fetch->blocks[reader->pos / INFLIGHT_BLOCK] + offset;
+        n = INFLIGHT_BLOCK - offset;
+        if (n > fetch->len - reader->pos)
+            n = fetch->len - reader->pos;
+    }
+    Pthread_mutex_unlock(&inflight_table.mutex);
+
+    if (n > 0) {
+        if (Rio_writen(reader->clientfd, data, n) == -1) {
+            return INFLIGHT_ERROR;
+        }
+        reader->pos += n;
+        return INFLIGHT_MORE;
+    }
+    if (state == FETCH_DONE) {
+        return INFLIGHT_DONE;
+    }
+    if (state == FETCH_FAILED || state == FETCH_DETACHED) {
+        return (reader->pos == 0) ? INFLIGHT_RETRY : INFLIGHT_ERROR;
+    }
+    return (reader_wait(reader, timeout_ms) == -1) ? 
+            INFLIGHT_ERROR : INFLIGHT_MORE;
+}
+
+/* Follower: stream the whole response, then leave the fetch */
+int inflight_follow(Inflight_Reader *reader, unsigned int *byte_count) {
+    int rc;
+
+    while ((rc = inflight_follow_step(reader, -1)) == INFLIGHT_MORE)
+        ;
+    *byte_count = reader->pos;
+    inflight_leave(reader);
+    return rc;
+}
+
+/* Follower: detach from the fetch */
+void inflight_leave(Inflight_Reader *reader) {
+    Inflight_Reader **readerp;
+
+    Pthread_mutex_lock(&inflight_table.mutex);
+    for (readerp = &reader->fetch->readers; *readerp;
+            readerp = &(*readerp)->next)
+    {
+        if (*readerp == reader) {
+            *readerp = reader->next;
+            break;
+        }
+    }
+    release_fetch(reader->fetch);
+    Pthread_mutex_unlock(&inflight_table.mutex);
+
+    close(reader->efd);
+    reader->fetch = NULL;
+}
+
+/* Look up the fetch of uri and its bucket. Called with the mutex held */
+static Inflight_Fetch *find_fetch(char *uri, unsigned int *bucket) {
+    Inflight_Fetch *fetch;
+    unsigned int hash = 2166136261u;    /* FNV-1a */
+    char *ptr;
+
+    for (ptr = uri; *ptr; ptr++) {
+        hash = (hash ^ (unsigned char) *ptr) * 16777619u;
+    }
+    *bucket = hash % INFLIGHT_BUCKETS;
+
+    for (fetch = inflight_table.buckets[*bucket]; fetch; fetch = fetch->next) {
+        if (!strcmp(fetch->uri, uri))
+            return fetch;
+    }
+    return NULL;
+}
+
+/* Remove a fetch from the table. Called with the mutex held */
+static void unlink_fetch(Inflight_Fetch *fetch) {
+    Inflight_Fetch **fetchp;
+    unsigned int bucket;
+
+    if (!fetch->linked) {
+        return;
+    }
+    find_fetch(fetch->uri, &bucket);
+    for (fetchp = &inflight_table.buckets[bucket]; *fetchp;
+            fetchp = &(*fetchp)->next)
+    {
+        if (*fetchp == fetch) {
+            *fetchp = fetch->next;
+            break;
+        }
+    }
+    fetch->linked = 0;
+}
+
+/* Wake the followers. Called with the mutex held */
+static void notify_readers(Inflight_Fetch *fetch) {
+    Inflight_Reader *reader;
+    uint64_t one = 1;
+
+    for (reader = fetch->readers; reader; reader = reader->next) {
+        if (write(reader->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            unix_error_nexit("eventfd write error");
+        }
+    }
+}
+
+/* Drop one reference, freeing the fetch with the last one. Called with
+   the mutex held */
+static void release_fetch(Inflight_Fetch *fetch) {
+    int i;
+
+    if (--fetch->refcount > 0) {
+        return;
+    }
+    for (i = 0; i < fetch->nblocks; i++) {
+        Free(fetch->blocks[i]);
+    }
+    free(fetch->blocks);
+    free(fetch->uri);
+    Free(fetch);
+}
+
+/* Wait until the leader posts the eventfd of reader, or for timeout_ms */
+static int reader_wait(Inflight_Reader *reader, int timeout_ms) {
+    struct pollfd pfd;
+    uint64_t count;
+    int rc;
+
+    /* On a fiber the read yields until the eventfd is posted; elsewhere
+     * it fails with EAGAIN and poll() does the waiting */
+    while (rio_read_hook(reader->efd, &count, sizeof(count)) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            return -1;
+        pfd.fd = reader->efd;
+        pfd.events = POLLIN;
+        if ((rc = poll(&pfd, 1, timeout_ms)) == 0)
+            break;      /* Timed out */
+        if (rc < 0 && errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ inflight.h for proxy lab
+ ----------------------
+ Contains the table of origin fetches in flight, shared by the concurrent
+ misses on the same URI.
+ See "inflight.c" for the design of request coalescing.
+ */
+
+#ifndef __INFLIGHT_H__
+#define __INFLIGHT_H__
+
+#include "csapp.h"
+
+#define INFLIGHT_BUCKETS 256        /* Hash buckets of the fetch table */
+#define INFLIGHT_BLOCK   (64 * 1024)    /* Response bytes per buffer block */
+
+/* States of an Inflight_Fetch */
+#define FETCH_RUNNING   0
+#define FETCH_DONE      1
+#define FETCH_FAILED    2
+#define FETCH_DETACHED  3   /* Not to be shared, followers fetch alone */
+
+/* Inflight_Reader that tracks one follower streaming a fetch */
+typedef struct Inflight_Reader {
+    struct Inflight_Fetch *fetch;
+    int clientfd;
+    int efd;                    /* eventfd posted when the fetch progresses */
+    size_t pos;                 /* Bytes sent to the client so far */
+    struct Inflight_Reader *next;
+} Inflight_Reader;
+
+/* Inflight_Fetch that tracks the response of one origin fetch */
+typedef struct Inflight_Fetch {
+    char *uri;
+    char **blocks;              /* Response bytes, INFLIGHT_BLOCK per block */
+    int nblocks;
+    int max_blocks;
+    size_t len;                 /* Bytes of response so far */
+    int state;
+    int linked;                 /* Still in the table, new misses attach */
+    int buffered;               /* Bytes are kept for the followers */
+    int refcount;               /* The leader and the followers */
+    Inflight_Reader *readers;
+    struct Inflight_Fetch *next;
+} Inflight_Fetch;
+
+/* Inflight_Table that tracks all fetches in flight */
+typedef struct Inflight_Table {
+    pthread_mutex_t mutex;
+    Inflight_Fetch *buckets[INFLIGHT_BUCKETS];
+    int enabled;
+} Inflight_Table;
+
+/* Return values of inflight_begin() */
+#define INFLIGHT_OFF        0   /* Fetch alone */
+#define INFLIGHT_LEADER     1   /* Fetch and publish with inflight_append() */
+#define INFLIGHT_FOLLOWER   2   /* Stream the leader's fetch */
+
+/* Return values of inflight_follow_step() and inflight_follow() */
+#define INFLIGHT_MORE       1   /* Call again for the next part */
+#define INFLIGHT_DONE       0
+#define INFLIGHT_ERROR     -1
+#define INFLIGHT_RETRY     -2   /* Fetch failed before any byte was sent */
+
+extern Inflight_Table inflight_table;
+
+
+/*
+ * Function prototypes
+ */
+void inflight_init(void);
+int inflight_begin(char *uri, int clientfd, Inflight_Fetch **fetch,
+        Inflight_Reader *reader);
+void inflight_append(Inflight_Fetch *fetch, char *data, size_t n);
+int inflight_followed(Inflight_Fetch *fetch);
+void inflight_detach(Inflight_Fetch *fetch);
+void inflight_end(Inflight_Fetch *fetch, int ok);
+
+int inflight_follow_step(Inflight_Reader *reader, int timeout_ms);
+int inflight_follow(Inflight_Reader *reader, unsigned int *byte_count);
+void inflight_leave(Inflight_Reader *reader);
+
+#endif /* __INFLIGHT_H__ */
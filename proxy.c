@@ -24,11 +24,73 @@
  a request is found to have a corresponding cached response content in 
  this proxy, in order to improve the browsing speed, the proxy would 
  directly used the cached content to reply the requesting client, without 
- forwarding the request to the original server and get the content again.
+ forwarding the request to the original server and get the content again. 
+
+    Both sizes can be set with "--cache-size" and "--max-object-size", on 
+ the command line or in a config file ("--config"); objects larger than a 
+ slab page are stored in chunks. With "--disk-cache", the objects evicted 
+ from memory are kept in a log-structured store on disk (see 
+ "cache_disk.c"), which outlives the proxy. With "--snapshot", the memory 
+ cache is written to a file periodically and loaded back on the next 
+ start, so that a restart does not send every client to the origins (see 
+ "cache_snapshot.c"). With "--memfd-cache", the cache memory is a memfd, 
+ and the epoll and fiber engines send hits with sendfile() from it (see 
+ "slab.c"). The option has no effect on the thread, pool, steal and 
+ uring engines, which write hits from the map, and is ignored there.
+
+    Only the responses that HTTP allows a shared cache to store are 
+ cached, and only served while fresh (see "cache_fresh.c"). With 
+ "--no-freshness", every response is cached until evicted, but those to 
+ requests that carried an Authorization or a Range header, which are 
+ never cached; "--default-ttl" sets the lifetime of the responses that 
+ give no freshness information.
 
     This proxy also supports multithreading. It creates a separate thread 
  to serve each request from the same or different client(s). By serving 
  these requests concurrenly, it improves the browsing speed. 
+
+    Alternatively, the proxy can run on a few event loops instead of one
+ thread per connection ("-e epoll", see "eventloop.c" for detail). Each
+ loop drives its connections through a non-blocking state machine, so a
+ large number of concurrent clients costs a handful of threads and a
+ small heap structure per connection instead of a full thread stack.
+
+    On kernels with io_uring, "-e uring" runs the same kind of loops on 
+ io_uring instead of epoll (see "uring.c"): socket I/O is queued and 
+ completed in batches, so a loop makes one system call per batch instead 
+ of one per read or write.
+
+    Connections can also be served by a bounded pool of prethreaded 
+ workers ("-e pool", see "threadpool.c"). With "--reuseport", the proxy 
+ opens one SO_REUSEPORT listener per core, each with its own acceptor 
+ pinned to that core, so accepting is spread over the cores by the kernel.
+
+    Except with the event-driven engines, cache misses are forwarded as 
+ HTTP/1.1 on persistent server connections kept in a pool per 
+ hostname:port (see "upstream.c"), so repeated misses to the same server 
+ skip the DNS lookup and the TCP handshake. The client still gets the 
+ response as an HTTP/1.0 client would, ended by closing its connection.
+
+    With "-e steal", the blocking handler is split into continuation 
+ tasks (parse, connect, relay, cache insert) run by a work-stealing 
+ scheduler (see "sched.c"): workers that run out of tasks steal queued 
+ connections from workers stuck behind slow servers.
+
+    With "-e fiber", the blocking handler itself runs unchanged on fibers 
+ with small mmap'd stacks, a few per-core schedulers multiplexing them 
+ (see "fiber.c"). The Rio functions yield the fiber instead of blocking.
+
+    Except with the event-driven engines, concurrent misses on the same 
+ URI are coalesced into one fetch (see "inflight.c"): the first one 
+ fetches from the origin, and the others stream its response as it 
+ arrives instead of opening their own server connections. Requests with 
+ an Authorization, a Cookie or a Range header, and responses the cache 
+ may not store, are not shared.
+
+    Server names are resolved by a caching resolver shared by all 
+ engines (see "resolver.c"), which honors DNS TTLs, remembers names that 
+ do not exist, lets one lookup of a name run at a time and refreshes hot 
+ names before they expire.
     
     Note: some macro constants or global variables are defined or declared 
 in cache.h
@@ -49,8 +111,10 @@ in cache.h
     
     Pthread_rwlock is a handy reliable reader-writer lock available in the 
  pthread.h library. It gives writers priority over readers but effectively 
- prevents starvation. This proxy uses pthread_rwlock to synchronize cache 
- accesses.
+ prevents starvation. The cache needs neither for its hits: it is split 
+ into shards, each with a mutex that only its writers take, and hits look 
+ the index up inside an epoch (see "epoch.c") and pin the item they find, 
+ without any lock (see "cache.h").
 
 ---------------------------------------------------------------------------
     There were several small modifications to csapp.c and csapp.h:
@@ -65,16 +129,45 @@ in cache.h
     3. Function wrappers Rio_readn(), Rio_writen(), Rio_readnb(), 
   Rio_readlineb(), Open_clientfd_r(), Malloc() were modified to use 
   unix_error_nexit();
+
+    4. The Rio package and open_clientfd_r() call read(), write() and 
+  connect() through hooks, so that the fiber engine can make them yield.
+
+    5. open_clientfd_r() resolves the name before creating a socket (it 
+  used to leak the socket on DNS errors), tries every address with a new 
+  socket, and looks names up through a hook used by the resolver.
+
+    6. rio_sendfilen() and Rio_sendfilen() send bytes of a file with 
+  sendfile(), also through a hook, for the hits from a memfd cache.
+
+    7. raise_fd_limit() lifts the soft limit of open descriptors to the 
+  hard one, for the engines with many connections and the disk cache.
  */
 
 
 
 #define _GNU_SOURCE     /* For using non-standard function strcasestr() */
+#include <getopt.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <linux/sockios.h>
 #include "csapp.h"
 #include "cache.h"
+#include "cache_disk.h"
+#include "cache_snapshot.h"
+#include "proxy.h"
+#include "eventloop.h"
+#include "threadpool.h"
+#include "uring.h"
+#include "sched.h"
+#include "fiber.h"
+#include "upstream.h"
+#include "resolver.h"
+#include "inflight.h"
 
 /* Macro constants */
-#define DEFAULT_PORT 80;    /* Defualt port number for forwading request */
 #define MAX_THREAD_ID 100   /* Maximum ID of background threads */
     /* Note: 
      *
@@ -91,6 +184,35 @@ in cache.h
      * concurrent threads.
      */      
 
+/* Concurrency engines selectable with -e */
+#define ENGINE_THREAD 0     /* One thread per connection (default) */
+#define ENGINE_EPOLL  1     /* Event loops, see eventloop.c */
+#define ENGINE_POOL   2     /* Prethreaded workers, see threadpool.c */
+#define ENGINE_URING  3     /* io_uring loops, see uring.c */
+#define ENGINE_STEAL  4     /* Work-stealing tasks, see sched.c */
+#define ENGINE_FIBER  5     /* Fibers on per-core schedulers, see fiber.c */
+
+#define RELAY_CHUNK   (2 * MAXBUF)  /* Bytes relayed by one relay task */
+#define FOLLOW_WAIT_MS 10           /* Longest wait of one follow task */
+
+/* Conn_Task that carries one connection through the continuation phases
+   of the work-stealing engine */
+typedef struct Conn_Task {
+    Sched_Task task;            /* Must be first, runs the next phase */
+    int clientfd;
+    int serverfd;
+    int thread_id;
+    rio_t rio_client;
+    rio_t rio_server;
+    Http_Request req;
+    char *usrbuf;               /* MAX_OBJECT_SIZE bytes */
+    unsigned int byte_count;
+    int reused;                 /* Server connection came from the pool */
+    Response_Relay relay;
+    Inflight_Fetch *fetch;      /* Fetch this connection leads, or NULL */
+    Inflight_Reader reader;     /* Fetch this connection follows */
+} Conn_Task;
+
 
 /*
  *  Constants
@@ -102,8 +224,42 @@ static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,\
 application/xml;q=0.9,*/*;q=0.8\r\n";
 static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
 static const char *connection_hdr = "Connection: close\r\n";
+static const char *keep_alive_hdr = "Connection: keep-alive\r\n";
 static const char *proxy_conn_hdr = "Proxy-Connection: close\r\n";
 
+/* Command line options */
+static const struct option long_options[] = {
+    {"engine", required_argument, NULL, 'e'},
+    {"loops",  required_argument, NULL, 'l'},
+    {"workers", required_argument, NULL, 'w'},
+    {"stack-size", required_argument, NULL, 's'},
+    {"queue-depth", required_argument, NULL, 'q'},
+    {"scale-latency", required_argument, NULL, 'L'},
+    {"reuseport", optional_argument, NULL, 'r'},
+    {"upstream-idle", required_argument, NULL, 'U'},
+    {"upstream-max", required_argument, NULL, 'M'},
+    {"upstream-timeout", required_argument, NULL, 'T'},
+    {"dns-server", required_argument, NULL, 'D'},
+    {"dns-hosts", required_argument, NULL, 'H'},
+    {"dns-negative-ttl", required_argument, NULL, 'N'},
+    {"no-coalesce", no_argument, NULL, 'C'},
+    {"cache-policy", required_argument, NULL, 'P'},
+    {"no-admission", no_argument, NULL, 'A'},
+    {"no-l1", no_argument, NULL, '1'},
+    {"cache-size", required_argument, NULL, 'c'},
+    {"max-object-size", required_argument, NULL, 'o'},
+    {"config", required_argument, NULL, 'f'},
+    {"disk-cache", required_argument, NULL, 'd'},
+    {"disk-size", required_argument, NULL, 'Z'},
+    {"snapshot", required_argument, NULL, 'S'},
+    {"snapshot-interval", required_argument, NULL, 'I'},
+    {"memfd-cache", no_argument, NULL, 'm'},
+    {"no-freshness", no_argument, NULL, 'X'},
+    {"default-ttl", required_argument, NULL, 't'},
+    {"help",   no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
 
 
 /*
@@ -113,31 +269,72 @@ Cache_List cache_list;
 unsigned int thread_count = 0;      /* Number of running background threads */
 pthread_mutex_t thread_count_mutex;
 
+/* Startup configuration, filled in from the command line */
+static int engine = ENGINE_THREAD;
+static int loop_count = 0;          /* 0 means one event loop per core */
+static int pool_min_workers = 0;    /* 0 means one worker per core */
+static int pool_max_workers = 0;    /* 0 means 16 workers per core */
+static int pool_stack_kb = 0;       /* 0 means 512, or 256 for fibers */
+static int pool_queue_depth = 1024;
+static int pool_scale_latency_ms = 20;
+static int reuseport = 0;           /* One SO_REUSEPORT listener per core */
+static int listener_count = 0;      /* 0 means one listener per acceptor */
+static int upstream_idle = 8;       /* 0 disables the upstream pool */
+static int upstream_max = 0;        /* 0 means no per-host cap */
+static int upstream_timeout = 30;
+static char *dns_server = NULL;     /* NULL means from /etc/resolv.conf */
+static char *dns_hosts = NULL;      /* NULL means /etc/hosts */
+static int dns_negative_ttl = 10;
+static int coalesce = 1;            /* Concurrent misses share one fetch */
+static const Cache_Policy *cache_policy = NULL; /* NULL means the default */
+static int admission = 1;           /* TinyLFU filters the new objects */
+static int l1 = -1;                 /* Per-thread L1 of the hottest items,
+                                       -1 for the default of the engine */
+static char *disk_dir = NULL;       /* NULL means no disk tier */
+static size_t disk_size = DISK_DEFAULT_SIZE;
+static char *snapshot_path = NULL;  /* NULL means no snapshots */
+static int snapshot_interval = SNAPSHOT_INTERVAL;
+static int freshness = 1;           /* Cache what HTTP allows, while fresh */
+
+static int *listenfds;
+static Thread_Pool *pool = NULL;
+static Scheduler *sched = NULL;
+static Fiber_Runtime *fibers = NULL;
+
 /*
  *  Function Prototypes
  */
 char *strcasestr(const char *haystack, const char *needle); /* GNU function */
 
+void *acceptor_thread(void *args);
 void *proxy_thread(void *args);
-
-int read_and_parse_request(rio_t *rio_client, int *clientfd, int *serverfd, 
-        char *buf, char *uir, char *host, char* new_request_buf);
-
-
+void serve_client(int clientfd, int thread_id);
+static void task_parse(Sched_Task *task, int worker_id);
+static void task_connect(Sched_Task *task, int worker_id);
+static void task_relay(Sched_Task *task, int worker_id);
+static void task_follow(Sched_Task *task, int worker_id);
+static void task_cache_insert(Sched_Task *task, int worker_id);
+static void task_finish(Conn_Task *conn, int print_bytes);
+
+int read_and_parse_request(rio_t *rio_client, int clientfd, 
+        Http_Request *req);
 int forward_request_to_server(rio_t *rio_server, int *serverfd, 
-        int clientfd, char *host, char *hostname, int port, 
-        char *new_request_buf);
+        int clientfd, Http_Request *req);
+int fetch_from_server(Http_Request *req, int clientfd,
+        unsigned int *byte_count, Inflight_Fetch *fetch);
 int cache_and_forward_response(rio_t *rio_server, int clientfd, 
-        char *usrbuf, char *uri, unsigned int *bytecount);
-int separate_host_port(char *host, char *hostname, int *hostport);
-void clienterror(int fd, char *cause, char *errnum, 
-        char *shortmsg, char *longmsg);
+        Http_Request *req, unsigned int *byte_count, int *reusable,
+        Inflight_Fetch *fetch, long long start_ns);
+static int append_request(Http_Request *req, const char *str);
+static int send_cache_item(int clientfd, Cache_Item *hit);
+static void linger_client(int clientfd, int sent);
 void close_fd(int *serverfd, int *clientfd, int thread_id);
-/* Wrappers for the pthread_mutex_* functions */
-int Pthread_mutex_init(pthread_mutex_t *mutex,
-        const pthread_mutexattr_t *attr);
-int Pthread_mutex_lock(pthread_mutex_t *mutex);
-int Pthread_mutex_unlock(pthread_mutex_t *mutex);
+void parse_options(int argc, char **argv, int *port);
+static void set_option(int c, char *arg, char *prog);
+static void read_config(char *path, char *prog);
+static void trim_end(char *s);
+static int parse_size(const char *arg, size_t *size);
+void usage(char *prog);
 
 
 
@@ -147,33 +344,141 @@ int Pthread_mutex_unlock(pthread_mutex_t *mutex);
  */
 int main(int argc, char **argv)
 {
-    int listenfd, *connfd, port, clientlen, thread_id;
-    struct sockaddr_in clientaddr;
+    int port, i, cores;
+    pthread_t tid;
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    parse_options(argc, argv, &port);
+
+    /* Ignore SIGPIPE signals */
+    Signal(SIGPIPE, SIG_IGN);
+    init_cache_list(&cache_list, cache_policy, admission);   /* safe to call */
+    cache_list.l1 = l1;
+    if (freshness) {
+        fresh_init(&cache_list);
+    }
+    printf("{ Cache: %zu bytes, objects up to %zu, %u shards, "
+            "%s eviction%s%s%s%s }\n\n", max_cache_size, max_object_size,
+            cache_list.shard_count, cache_list.shards[0].policy->name,
+            admission ? ", TinyLFU admission" : "",
+            l1 ? ", per-thread L1" : "",
+            slab_fd() >= 0 ? ", memfd arena" : "",
+            freshness ? ", HTTP freshness" : "");
+    if (disk_dir != NULL && disk_init(disk_dir, disk_size) == -1) {
+        fprintf(stderr, "cannot create the disk cache in %s: %s\n",
+                disk_dir, strerror(errno));
         exit(1);
     }
-    port = atoi(argv[1]);
-    if (port <0 || port > 65535) {
-        fprintf(stderr, "legal port number : 0 to 65535\n");
+    if (snapshot_path != NULL && snapshot_init(&cache_list, snapshot_path, 
+            snapshot_interval) == -1)
+    {
+        fprintf(stderr, "cannot read the snapshot %s: %s\n",
+                snapshot_path, strerror(errno));
         exit(1);
     }
 
-    /* Ignore SIGPIPE signals */
-    Signal(SIGPIPE, SIG_IGN);
-    init_cache_list(&cache_list);   /* safe to call */
-
     Pthread_mutex_init(&thread_count_mutex, 0);   
-    Pthread_rwlock_init(&cache_rwlock, NULL);
 
-    listenfd = Open_listenfd(port);
+    /* Server names of all engines go through the caching resolver */
+    if (resolver_init(dns_hosts, dns_server, dns_negative_ttl) < 0) {
+        fprintf(stderr, "bad DNS server address: %s\n", dns_server);
+        exit(1);
+    }
+
+    cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (loop_count <= 0)
+        loop_count = cores;
+
+    /* One listener, or one SO_REUSEPORT listener per acceptor */
+    if (reuseport) {
+        if (listener_count <= 0)
+            listener_count = (engine == ENGINE_EPOLL 
+                    || engine == ENGINE_URING) ? loop_count : cores;
+        if (engine == ENGINE_EPOLL || engine == ENGINE_URING)
+            loop_count = listener_count;
+    }
+    else {
+        listener_count = 1;
+    }
+    listenfds = (int *) Malloc(listener_count * sizeof(int));
+    for (i = 0; i < listener_count; i++) {
+        listenfds[i] = reuseport ? Open_listenfd_reuseport(port) 
+                : Open_listenfd(port);
+    }
 
     printf("\n=================================================\n");
     printf("Welcome using this proxy! Listening on port %d\n", port);
     printf("-------------------------------------------------\n\n");
 
+    /* Event-driven engines never return */
+    if (engine == ENGINE_URING) {
+        if (uring_supported()) {
+            uring_run(listenfds, listener_count, loop_count);
+        }
+        printf("io_uring is not available, using the epoll engine.\n\n");
+        engine = ENGINE_EPOLL;
+    }
+    if (engine == ENGINE_EPOLL) {
+        eventloop_run(listenfds, listener_count, loop_count);
+    }
+
+    /* Persistent server connections for the blocking handler */
+    if (upstream_idle > 0) {
+        upstream_init(upstream_idle, UPSTREAM_MAX_IDLE, upstream_max, 
+                upstream_timeout);
+    }
+
+    /* Concurrent misses on the same URI share one fetch */
+    if (coalesce) {
+        inflight_init();
+    }
+
+    if (pool_stack_kb <= 0)
+        pool_stack_kb = (engine == ENGINE_FIBER) ? 256 : 512;
+
+    if (engine == ENGINE_POOL) {
+        if (pool_min_workers <= 0)
+            pool_min_workers = cores;
+        if (pool_max_workers <= 0)
+            pool_max_workers = 16 * cores;
+        pool = threadpool_create(serve_client, pool_min_workers, 
+                pool_max_workers, (size_t) pool_stack_kb * 1024,
+                pool_queue_depth, pool_scale_latency_ms);
+    }
+
+    if (engine == ENGINE_STEAL) {
+        if (pool_min_workers <= 0)
+            pool_min_workers = 4 * cores;
+        sched = sched_create(pool_min_workers, (size_t) pool_stack_kb * 1024);
+    }
+
+    if (engine == ENGINE_FIBER) {
+        fibers = fiber_runtime_create(serve_client, loop_count, 
+                (size_t) pool_stack_kb * 1024);
+    }
+
+    /* Extra acceptors for the other SO_REUSEPORT listeners */
+    for (i = 1; i < listener_count; i++) {
+        Pthread_create(&tid, NULL, acceptor_thread, (void *)(long) i);
+    }
+    acceptor_thread((void *) 0);
+    return 0;
+}
+
+/*
+ *  Acceptor routine: accept clients on one listener and hand them to the
+ *  engine. With SO_REUSEPORT listeners each acceptor is pinned to a core.
+ */
+void *acceptor_thread(void *args) {
+    int index = (int)(long) args;
+    int listenfd = listenfds[index];
+    int connfd, *connargs, clientlen, thread_id;
+    struct sockaddr_in clientaddr;
+
+    if (listener_count > 1) {
+        pin_to_core(index);
+    }
+
     thread_id = 0;
     while (1) {
         /* Asigned a nominal thread ID for the next thread */
@@ -182,28 +487,67 @@ int main(int argc, char **argv)
 
         clientlen = sizeof(clientaddr);
 
-        while ((connfd = (int *) Malloc(2 * sizeof(int))) == NULL) {
-            sleep(1);   /* If run out of memory, wait for threads to free */
-        }
-        while ((*connfd = accept(listenfd, (SA *)&clientaddr, 
+        while ((connfd = accept(listenfd, (SA *)&clientaddr, 
                 (socklen_t *)&clientlen)) < 0)
         {
             /* Print the error and keep trying */
-            unix_error("Accept error");
+            unix_error_nexit("Accept error");
+        }
+
+        /* Thread pool serves the client with one of its workers */
+        if (engine == ENGINE_POOL) {
+            /* If the queue is full, wait for a worker to take a client; 
+             * new clients wait in the listen backlog meanwhile */
+            while (threadpool_submit(pool, connfd) == -1) {
+                usleep(1000);
+            }
+            continue;
         }
-        *(connfd + 1) = thread_id;
+
+        /* Fiber engine runs the handler on a fiber */
+        if (engine == ENGINE_FIBER) {
+            fiber_submit(fibers, connfd, thread_id);
+            continue;
+        }
+
+        /* Work-stealing engine starts with the parse phase */
+        if (engine == ENGINE_STEAL) {
+            Conn_Task *conn;
+            while ((conn = (Conn_Task *) Malloc(sizeof(Conn_Task))) == NULL)
+                sleep(1);
+            conn->task.run = task_parse;
+            conn->clientfd = connfd;
+            conn->serverfd = -1;
+            conn->thread_id = thread_id;
+            conn->usrbuf = NULL;
+            conn->relay.item = NULL;
+            conn->relay.filling = 0;
+            conn->byte_count = 0;
+            conn->fetch = NULL;
+            conn->reader.fetch = NULL;
+            sched_submit(sched, &conn->task);
+            continue;
+        }
+
+        while ((connargs = (int *) Malloc(2 * sizeof(int))) == NULL) {
+            sleep(1);   /* If run out of memory, wait for threads to free */
+        }
+        *connargs = connfd;
+        *(connargs + 1) = thread_id;
 
         /* Sequential proxy does not create any thread */
-        // proxy_thread(connfd);
+        // proxy_thread(connargs);
 
         /* Concurrent proxy creates a thread to serve each client request */
         pthread_t tid;
-        while (pthread_create(&tid, NULL, proxy_thread, (void *)connfd) != 0) {
+        while (pthread_create(&tid, NULL, proxy_thread, (void *)connargs) 
+                != 0) 
+        {
             /* Keep trying until successfully creating a thread */
             printf("pthread_create failed, will try again.\n");
         }
     }
-    return 0;
+    return NULL;
 }
 
 /*
@@ -217,14 +561,23 @@ void *proxy_thread(void *args) {
     int thread_id = *((int *)args + 1);
     Free(args);
 
-    /* Thread Body */
+    serve_client(clientfd, thread_id);
+    return NULL;
+}
+
+/*
+ *  Serve one client request from start to end with blocking I/O, then 
+ *  close the connection(s).
+ */
+void serve_client(int clientfd, int thread_id) {
     rio_t rio_client;
-    rio_t rio_server;
-    int serverfd = -1, port;
-    char buf[MAXLINE], uri[MAXLINE];
-    char host[MAXLINE], hostname[MAXLINE], uri_suffix[MAXLINE];
-    char new_request_buf[MAXLINE], usrbuf[MAX_OBJECT_SIZE];
+    int serverfd = -1;
+    Http_Request req;
     unsigned int byte_count = 0;
+    int rc;
+    Cache_Item *hit = NULL;
+    Inflight_Fetch *fetch;
+    Inflight_Reader reader;
 
     Pthread_mutex_lock(&thread_count_mutex);
     thread_count++;
@@ -232,223 +585,641 @@ void *proxy_thread(void *args) {
     printf("{ [%d] Client connected. \tCurrent Background threads: %d }\n\n", 
             thread_id, thread_count);
 
-
-
     Rio_readinitb(&rio_client, clientfd);   /* Safe to call */
 
-    read_and_parse_request(&rio_client, &clientfd, &serverfd, buf, uir, host, 
-            new_request_buf);
-
-    /* URI string with port number as the cache sitem ID */
-    sprintf(uri, "%s:%d%s", hostname, port, uri_suffix);
+    if (read_and_parse_request(&rio_client, clientfd, &req) == -1) {
+        close_fd(&serverfd, &clientfd, thread_id);
+        return;
+    }
 
     /* Search uri in cache */
     /* If cache hit */
-    if (search_and_get(&cache_list, uri, usrbuf, &byte_count) != -1) {
-        printf("URI: %s\nCache Hit!\n\n", uri);
-
-        /* Send response from cache */
-        if (Rio_writen(clientfd, usrbuf, byte_count) == -1) {
+    if ((hit = search_and_pin(&cache_list, req.uri)) != NULL) {
+        printf("URI: %s\nCache Hit!\n\n", req.uri);
+
+        /* Send response straight from the cache, unpinned once the 
+         * socket is closed */
+        byte_count = hit->content_length;
+        rc = send_cache_item(clientfd, hit);
+        if (rc == -1) {
             close_fd(&serverfd, &clientfd, thread_id);
-            return NULL;
+            unpin_cache_item(hit);
+            return;
         }
     }
     /* If cache miss */
     else {
-        printf("URI: %s\nCache Miss.\n\n", uri);
+        printf("URI: %s\nCache Miss.\n\n", req.uri);
 
-        if (forward_request_to_server(&rio_server, &serverfd, clientfd, host, 
-                hostname, port, new_request_buf) == -1) 
+        /* Another client is fetching this uri: stream its response, 
+         * unless the request is for this client alone */
+        fetch = NULL;
+        if (req.coalesce && inflight_begin(req.uri, clientfd, &fetch, 
+                &reader) == INFLIGHT_FOLLOWER)
         {
+            printf("URI: %s\nJoined the fetch in flight.\n\n", req.uri);
+            if ((rc = inflight_follow(&reader, &byte_count)) 
+                    == INFLIGHT_RETRY) 
+            {
+                /* It failed, or turned out not to be shared, before 
+                 * sending anything: fetch alone */
+                printf("URI: %s\nFetch in flight failed or detached, "
+                        "retrying.\n\n", req.uri);
+                rc = fetch_from_server(&req, clientfd, &byte_count, NULL);
+            }
+        }
+        else {
+            rc = fetch_from_server(&req, clientfd, &byte_count, fetch);
+        }
+        if (rc != 0) {
             close_fd(&serverfd, &clientfd, thread_id);
-            return NULL;
+            return;
         }
-
-        cache_and_forward_response(&rio_server, clientfd, usrbuf, uri,
-                &byte_count);
     }
 
     printf("\n(%d bytes have been transmited as response.)\n", byte_count);
     close_fd(&serverfd, &clientfd, thread_id);
-    return NULL;
+    if (hit != NULL) {
+        unpin_cache_item(hit);
+    }
 }
 
-int read_and_parse_request(rio_t *rio_client, int *clientfd, int *serverfd, 
-        char *buf, char *uir, char *host, char* new_request_buf)
+/*
+ *  Fetch the response of req from the server, relay it to the client and
+ *  cache it, publishing it to the followers of fetch if not NULL (the 
+ *  fetch is ended here). Returns 0 on success, -1 on error.
+ */
+int fetch_from_server(Http_Request *req, int clientfd,
+        unsigned int *byte_count, Inflight_Fetch *fetch)
 {
-    char *ptr;
-    char version[MAXLINE], method[MAXLINE];
-    int has_host_hdr = 0;
+    rio_t rio_server;
+    int serverfd = -1;
+    int reused, reusable, rc;
+    long long start_ns;
+
+    while (1) {
+        start_ns = monotonic_ns();
+        if ((reused = forward_request_to_server(&rio_server, &serverfd, 
+                clientfd, req)) == -1) 
+        {
+            if (fetch) inflight_end(fetch, 0);
+            return -1;
+        }
+        rc = cache_and_forward_response(&rio_server, clientfd, req, 
+                byte_count, &reusable, fetch, start_ns);
+
+        /* A pooled connection closed by the server before it got the
+         * request: retry on a new connection */
+        if (rc == RELAY_NO_RESPONSE && reused) {
+            upstream_release(req->hostname, req->port, serverfd, 0);
+            serverfd = -1;
+            continue;
+        }
+        break;
+    }
+
+    /* Keep the server connection if the response ended cleanly */
+    upstream_release(req->hostname, req->port, serverfd, 
+            rc == 0 && reusable);
+    if (fetch) inflight_end(fetch, rc == 0);
+    return (rc == 0) ? 0 : -1;
+}
+
+/*
+ *  Continuation phases of the work-stealing engine. They run the same
+ *  steps as serve_client(), but each phase ends by submitting the next
+ *  one as a new task, so an idle worker can steal the connection between
+ *  phases (and between relayed chunks).
+ */
+
+/* Parse phase: read the request, then serve a hit or go to connect */
+static void task_parse(Sched_Task *task, int worker_id) {
+    Conn_Task *conn = (Conn_Task *) task;
+    Cache_Item *hit;
+    int rc;
+
+    Pthread_mutex_lock(&thread_count_mutex);
+    thread_count++;
+    Pthread_mutex_unlock(&thread_count_mutex);
+    printf("{ [%d] Client connected on worker %d. \tCurrent tasks: %d }\n\n",
+            conn->thread_id, worker_id, thread_count);
+
+    Rio_readinitb(&conn->rio_client, conn->clientfd);
+    if (read_and_parse_request(&conn->rio_client, conn->clientfd, 
+            &conn->req) == -1) 
+    {
+        task_finish(conn, 0);
+        return;
+    }
+
+    /* Search uri in cache */
+    if ((hit = search_and_pin(&cache_list, conn->req.uri)) != NULL) {
+        printf("URI: %s\nCache Hit!\n\n", conn->req.uri);
+        conn->byte_count = hit->content_length;
+        rc = send_cache_item(conn->clientfd, hit);
+        task_finish(conn, rc != -1);
+        unpin_cache_item(hit);  /* Once the socket is closed */
+        return;
+    }
+
+    printf("URI: %s\nCache Miss.\n\n", conn->req.uri);
+    if ((conn->usrbuf = (char *) Malloc(MAX_OBJECT_SIZE)) == NULL) {
+        task_finish(conn, 0);
+        return;
+    }
+
+    /* Another client is fetching this uri: stream its response, unless 
+     * the request is for this client alone */
+    if (conn->req.coalesce && inflight_begin(conn->req.uri, 
+            conn->clientfd, &conn->fetch, &conn->reader) 
+            == INFLIGHT_FOLLOWER)
+    {
+        printf("URI: %s\nJoined the fetch in flight.\n\n", conn->req.uri);
+        conn->task.run = task_follow;
+    }
+    else {
+        conn->task.run = task_connect;
+    }
+    sched_submit(sched, &conn->task);
+}
+
+/* Connect phase: get a server connection and forward the request */
+static void task_connect(Sched_Task *task, int worker_id) {
+    Conn_Task *conn = (Conn_Task *) task;
+    long long start_ns = monotonic_ns();
+
+    if ((conn->reused = forward_request_to_server(&conn->rio_server, 
+            &conn->serverfd, conn->clientfd, &conn->req)) == -1) 
+    {
+        task_finish(conn, 0);
+        return;
+    }
+    relay_init(&conn->relay, &conn->rio_server, conn->clientfd, 
+            conn->usrbuf);
+    conn->relay.uri = conn->req.uri;
+    conn->relay.request = conn->req.cache_request;
+    conn->relay.start_ns = start_ns;
+    conn->relay.fetch = conn->fetch;
+    conn->task.run = task_relay;
+    sched_submit(sched, &conn->task);
+}
+
+/* Relay phase: pass one part of response on, keeping a copy to cache */
+static void task_relay(Sched_Task *task, int worker_id) {
+    Conn_Task *conn = (Conn_Task *) task;
+    int rc;
+
+    switch ((rc = relay_step(&conn->relay))) {
+    case RELAY_MORE:
+        sched_submit(sched, &conn->task);
+        return;
+
+    case RELAY_DONE:
+        /* End of response, keep the server connection if possible */
+        conn->byte_count = conn->relay.byte_count;
+        upstream_release(conn->req.hostname, conn->req.port, 
+                conn->serverfd, conn->relay.keep_alive);
+        conn->serverfd = -1;
+        if (conn->relay.cacheable && conn->byte_count > 0) {
+            conn->task.run = task_cache_insert;
+            sched_submit(sched, &conn->task);
+        }
+        else {
+            if (conn->fetch) {
+                inflight_end(conn->fetch, 1);
+                conn->fetch = NULL;
+            }
+            task_finish(conn, 1);
+        }
+        return;
+
+    default:
+        upstream_release(conn->req.hostname, conn->req.port, 
+                conn->serverfd, 0);
+        conn->serverfd = -1;
+        if (rc == RELAY_NO_RESPONSE && conn->reused) {
+            /* Pooled connection was closed by the server: retry */
+            relay_free(&conn->relay);
+            conn->task.run = task_connect;
+            sched_submit(sched, &conn->task);
+            return;
+        }
+        task_finish(conn, 0);
+    }
+}
+
+/* Cache insert phase: the whole response fits in the object size */
+static void task_cache_insert(Sched_Task *task, int worker_id) {
+    Conn_Task *conn = (Conn_Task *) task;
+
+    relay_cache(&conn->relay);
+    /* Misses from now on find it in the cache */
+    if (conn->fetch) {
+        inflight_end(conn->fetch, 1);
+        conn->fetch = NULL;
+    }
+    task_finish(conn, 1);
+}
+
+/*
+ *  Follow phase: send the part of a coalesced fetch available so far. 
+ *  The wait for the leader is bounded, so that a worker is never stuck 
+ *  behind a leader whose relay task is queued.
+ */
+static void task_follow(Sched_Task *task, int worker_id) {
+    Conn_Task *conn = (Conn_Task *) task;
+    int rc;
+
+    switch ((rc = inflight_follow_step(&conn->reader, FOLLOW_WAIT_MS))) {
+    case INFLIGHT_MORE:
+        sched_submit(sched, &conn->task);
+        return;
+
+    case INFLIGHT_RETRY:
+        /* It failed, or turned out not to be shared, before sending 
+         * anything: fetch alone */
+        inflight_leave(&conn->reader);
+        printf("URI: %s\nFetch in flight failed or detached, "
+                "retrying.\n\n", conn->req.uri);
+        conn->task.run = task_connect;
+        sched_submit(sched, &conn->task);
+        return;
+
+    default:
+        conn->byte_count = conn->reader.pos;
+        task_finish(conn, rc == INFLIGHT_DONE);
+    }
+}
+
+/* Close the connection(s) and free the task */
+static void task_finish(Conn_Task *conn, int print_bytes) {
+    if (conn->fetch) {
+        inflight_end(conn->fetch, 0);
+        conn->fetch = NULL;
+    }
+    if (conn->reader.fetch) {
+        inflight_leave(&conn->reader);
+    }
+    if (conn->serverfd >= 0) {
+        upstream_release(conn->req.hostname, conn->req.port, 
+                conn->serverfd, 0);
+        conn->serverfd = -1;
+    }
+    if (print_bytes) {
+        printf("\n(%d bytes have been transmited as response.)\n", 
+                conn->byte_count);
+    }
+    close_fd(&conn->serverfd, &conn->clientfd, conn->thread_id);
+    relay_free(&conn->relay);
+    if (conn->usrbuf) Free(conn->usrbuf);
+    Free(conn);
+}
+
+/*
+ *  Read the request line and headers from the client and rebuild the 
+ *  request to be forwarded. Returns 0 on success, -1 on error.
+ */
+int read_and_parse_request(rio_t *rio_client, int clientfd, 
+        Http_Request *req)
+{
+    char buf[MAXLINE];
+    int k, rc;
 
     /* Read the HTTP request line (the first line) */
-    if (Rio_readlineb(rio_client, buf, MAXLINE) == -1) {
-        close_fd(&serverfd, clientfd, thread_id);
-        return NULL;
+    if (Rio_readlineb(rio_client, buf, MAXLINE) <= 0) {
+        return -1;
+    }
+    if ((rc = parse_request_line(req, buf)) != REQUEST_OK) {
+        if (rc == REQUEST_NOT_IMPL) {
+            clienterror(clientfd, req->method, "501", "Not Implemented",
+                    "Proxy does not implement this method");
+        }
+        return -1;
+    }
+
+    /* Read other request header lines */
+    while ((k = Rio_readlineb(rio_client, buf, MAXLINE)) != 0) {
+        if (k == -1) {
+            return -1;
+        }
+        if ((rc = parse_header_line(req, buf)) == REQUEST_HEADERS_END) {
+            break;
+        }
+        if (rc == REQUEST_ERROR) {
+            return -1;
+        }
     }
+
+    return finish_request(req);
+}
+
+/*
+ *  Parse the HTTP request line (the first line) and start reasembling the
+ *  request. Returns REQUEST_OK, REQUEST_ERROR or REQUEST_NOT_IMPL.
+ */
+int parse_request_line(Http_Request *req, char *line) {
+    char *ptr;
+    char uri[MAXLINE], version[MAXLINE];
+
+    req->method[0] = '\0';
+    req->host[0] = '\0';
+    req->hostname[0] = '\0';
+    req->new_request[0] = '\0';
+    strcpy(req->uri_suffix, "/");
+    req->port = DEFAULT_PORT;
+    req->has_host_hdr = 0;
+    req->cache_request = 0;
+    req->coalesce = 1;
+
     printf("Orignal request:\n");
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    printf("%s", line);
+    if (sscanf(line, "%s %s %s", req->method, uri, version) != 3) {
+        return REQUEST_ERROR;
+    }
 
     /* Ignore non-GET methods */
-    if (strcmp(method, "GET")) {
-        printf("Unable to handle method type: %s\n\n", method);
-        clienterror(*clientfd, host, "501", "Not Implemented",
-                "Proxy does not implement this method");
-        close_fd(&serverfd, clientfd, thread_id);
-        return NULL;
+    if (strcmp(req->method, "GET")) {
+        printf("Unable to handle method type: %s\n\n", req->method);
+        return REQUEST_NOT_IMPL;
     }
 
     /* Extract host from URI */
     if ((ptr = strstr(uri, "://"))) {
-        strcpy(host, ptr + 3);
+        strcpy(req->host, ptr + 3);
     } else {
-        strcpy(host, uri);
+        strcpy(req->host, uri);
     }
-    if ((ptr = strstr(host, "/"))) {
-        strcpy(uri_suffix, ptr);    /* Extract the uri suffix */
+    if ((ptr = strstr(req->host, "/"))) {
+        strcpy(req->uri_suffix, ptr);   /* Extract the uri suffix */
         *ptr = '\0';            /* cut suffix of URL to get host string */
     }
     printf("\t(Host extracted: %s)\n", 
-            (strcmp(host, "\0")) ? host : "[Null]");
+            (strcmp(req->host, "\0")) ? req->host : "[Null]");
     
     /* Start reasembling the HTTP request */
 
-    /* Reasemble HTTP/1.0 GET request line */
-    strcpy(new_request_buf, "GET ");
-    strcat(new_request_buf, uri_suffix);
-    strcat(new_request_buf, " HTTP/1.0\r\n");
+    /* Reasemble GET request line, HTTP/1.1 for pooled connections */
+    if (append_request(req, "GET ") == -1 
+            || append_request(req, req->uri_suffix) == -1
+            || append_request(req, upstream_pool.enabled ? 
+                " HTTP/1.1\r\n" : " HTTP/1.0\r\n") == -1)
+    {
+        return REQUEST_ERROR;
+    }
 
     /* Separate the hostname and hostport */
-    if (separate_host_port(host, hostname, &port) == -1) {
-        close_fd(&serverfd, clientfd, thread_id);
-        return NULL;
+    if (separate_host_port(req->host, req->hostname, &req->port) == -1) {
+        return REQUEST_ERROR;
     }
+    return REQUEST_OK;
+}
 
-    /* Read other request header lines */
-    while ((k = Rio_readlineb(rio_client, buf, MAXLINE)) != 0) {
-        if (k == -1) {
-            close_fd(&serverfd, clientfd, thread_id);
-            return NULL;
-        }
+/*
+ *  Parse one request header line. Returns REQUEST_HEADERS_END on the blank
+ *  line that ends the headers, otherwise REQUEST_OK or REQUEST_ERROR.
+ */
+int parse_header_line(Http_Request *req, char *line) {
+    char *ptr;
 
-        if (!strcmp(buf, "\r\n")) {
-            printf("%s", buf);
-            break;
-        }
+    printf("%s", line);
+    if (!strcmp(line, "\r\n")) {
+        return REQUEST_HEADERS_END;
+    }
         
-        /* 
-         * Replace orignal "User-Agent:", "Accept:", "Accept-Encoding:", 
-         * "Proxy-Connection:" and "Connection:" headers; keep "Host:" and 
-         * other headers
-         */
-        if (strstr(buf, "Host: ")) {
-            printf("%s", buf);
-            strcat(new_request_buf, buf);   /* Keep original host header */
-            has_host_hdr = 1;
-
-            ptr = buf + strlen("Host: ");
-            strcpy(host, ptr);
-            if ((ptr = strstr(host, "\r\n"))) *ptr = '\0';
-
-            /* Separate the hostname and hostport */
-            if (separate_host_port(host, hostname, &port) == -1) {
-                close_fd(&serverfd, clientfd, thread_id);
-                return NULL;
-            }
-        } else if (strstr(buf, "User-Agent: ")) {
-            printf("%s", buf);              /* Print and discard */
-        } else if (strstr(buf, "Accept: ")) {
-            printf("%s", buf);              /* Print and discard */
-        } else if (strstr(buf, "Accept-Encoding: ")) {
-            printf("%s", buf);              /* Print and discard */
-        } else if (strstr(buf, "Proxy-Connection: ")) {
-            printf("%s", buf);              /* Print and discard */
-        } else if (strstr(buf, "Connection: ")) {
-            printf("%s", buf);              /* Print and discard */
-        } else {
-            printf("%s", buf);
-            strcat(new_request_buf, buf);   /* Keep orther original headers */
+    /* 
+     * Replace orignal "User-Agent:", "Accept:", "Accept-Encoding:", 
+     * "Proxy-Connection:" and "Connection:" headers; keep "Host:" and 
+     * other headers
+     */
+    if (strstr(line, "Host: ")) {
+        /* Keep original host header */
+        if (append_request(req, line) == -1) return REQUEST_ERROR;
+        req->has_host_hdr = 1;
+
+        ptr = line + strlen("Host: ");
+        strcpy(req->host, ptr);
+        if ((ptr = strstr(req->host, "\r\n"))) *ptr = '\0';
+
+        /* Separate the hostname and hostport */
+        if (separate_host_port(req->host, req->hostname, &req->port) == -1) {
+            return REQUEST_ERROR;
+        }
+    } else if (strstr(line, "User-Agent: ")) {
+        /* Discard */
+    } else if (strstr(line, "Accept: ")) {
+        /* Discard */
+    } else if (strstr(line, "Accept-Encoding: ")) {
+        /* Discard */
+    } else if (strstr(line, "Proxy-Connection: ")) {
+        /* Discard */
+    } else if (strstr(line, "Connection: ")) {
+        /* Discard */
+    } else {
+        /* Keep orther original headers, noting those that limit caching
+         * the response, or sharing it with another client in flight */
+        if (!strncasecmp(line, "Authorization:", 14)) {
+            req->cache_request |= CACHE_REQ_AUTHORIZATION;
+            req->coalesce = 0;
+        } else if (!strncasecmp(line, "Range:", 6)) {
+            req->cache_request |= CACHE_REQ_RANGE;
+            req->coalesce = 0;
+        } else if (!strncasecmp(line, "Cookie:", 7)) {
+            req->coalesce = 0;
         }
+        if (append_request(req, line) == -1) return REQUEST_ERROR;
     }
+    return REQUEST_OK;
+}
+
+/*
+ *  Finish reasembling the request after the last header line and build the
+ *  cache item ID. Returns REQUEST_OK or REQUEST_ERROR.
+ */
+int finish_request(Http_Request *req) {
     /* Supply a host header if it didn't exist in the orignal request */
-    if (!has_host_hdr) {
+    if (!req->has_host_hdr) {
         /* If no host header and no host found in the URI */
-        if (!strcmp(host, "\0")) {
-            close_fd(&serverfd, clientfd, thread_id);
-            return NULL;
+        if (!strcmp(req->host, "\0")) {
+            return REQUEST_ERROR;
+        }
+        if (append_request(req, "Host: ") == -1
+                || append_request(req, req->host) == -1
+                || append_request(req, "\r\n") == -1)
+        {
+            return REQUEST_ERROR;
         }
-        strcat(new_request_buf, "Host: ");
-        strcat(new_request_buf, host);
-        strcat(new_request_buf, "\r\n");
     }
     /* Compulsorily use the following headers */
-    strcat(new_request_buf, user_agent_hdr);
-    strcat(new_request_buf, accept_hdr);
-    strcat(new_request_buf, accept_encoding_hdr);
-    strcat(new_request_buf, connection_hdr);
-    strcat(new_request_buf, proxy_conn_hdr);
-    strcat(new_request_buf, "\r\n");
-    
+    if (append_request(req, user_agent_hdr) == -1
+            || append_request(req, accept_hdr) == -1
+            || append_request(req, accept_encoding_hdr) == -1)
+    {
+        return REQUEST_ERROR;
+    }
+    /* Keep pooled server connections open, otherwise ask to close */
+    if (upstream_pool.enabled) {
+        if (append_request(req, keep_alive_hdr) == -1)
+            return REQUEST_ERROR;
+    }
+    else if (append_request(req, connection_hdr) == -1
+            || append_request(req, proxy_conn_hdr) == -1)
+    {
+        return REQUEST_ERROR;
+    }
+    if (append_request(req, "\r\n") == -1) {
+        return REQUEST_ERROR;
+    }
     /* Finished reasembling the HTTP request */
+
+    /* URI string with port number as the cache item ID */
+    if (snprintf(req->uri, MAXLINE, "%s:%d%s", req->hostname, req->port, 
+            req->uri_suffix) >= MAXLINE)
+    {
+        return REQUEST_ERROR;
+    }
+    return REQUEST_OK;
 }
 
-int forward_request_to_server(rio_t *rio_server, int *serverfd, 
-        int clientfd, char *host, char *hostname, int port, 
-        char *new_request_buf) 
-{
-    /* Open a client socket with the server */
-    if ((*serverfd = Open_clientfd_r(hostname, port)) < 0) {
-        if (*serverfd == -2) {
-            printf("DNS error! ");
-            clienterror(clientfd, host, "400", "Bad Request",
-            "This webpage is not available, because DNS lookup failed");
+/*
+ *  Parse a whole request header block, as accumulated by the event-driven
+ *  engines, one line at a time. Replies 501 to clientfd for unsupported 
+ *  methods. Returns REQUEST_OK, REQUEST_ERROR or REQUEST_NOT_IMPL.
+ */
+int parse_request_block(Http_Request *req, char *block, int clientfd) {
+    char line[MAXLINE];
+    char *ptr = block, *eol;
+    size_t len;
+    int rc, first = 1;
+
+    while (*ptr != '\0') {
+        if ((eol = strchr(ptr, '\n')) == NULL) {
+            eol = ptr + strlen(ptr) - 1;    /* Last, unterminated line */
         }
-        else {
-            printf("To-server socket connection error!\n");
+        if ((len = eol - ptr + 1) >= MAXLINE) return REQUEST_ERROR;
+        memcpy(line, ptr, len);
+        line[len] = '\0';
+        ptr = eol + 1;
+
+        if (first) {
+            first = 0;
+            if ((rc = parse_request_line(req, line)) != REQUEST_OK) {
+                if (rc == REQUEST_NOT_IMPL) {
+                    clienterror(clientfd, req->method, "501", 
+                            "Not Implemented",
+                            "Proxy does not implement this method");
+                }
+                return rc;
+            }
+        }
+        else if ((rc = parse_header_line(req, line)) == REQUEST_HEADERS_END) {
+            break;
+        }
+        else if (rc == REQUEST_ERROR) {
+            return rc;
         }
-        printf("Hostname: %s\tPort: %d\n", hostname, port);
-        return -1;
     }
-    Rio_readinitb(rio_server, *serverfd);   /* Safe to call */
+    if (first) return REQUEST_ERROR;
+    return finish_request(req);
+}
 
-    printf("New request:\n");
-    printf("%s", new_request_buf);    /* Print the new HTTP request */
+/* Append a string to the rebuilt request, failing if it would overflow */
+static int append_request(Http_Request *req, const char *str) {
+    size_t used = strlen(req->new_request);
 
-    /* Forward the request to server */
-    if (Rio_writen(*serverfd, new_request_buf, strlen(new_request_buf)) 
-            == -1) 
-    {
+    if (used + strlen(str) >= MAXLINE) {
+        printf("\t(Request too long!)\n");
         return -1;
     }
-
-    printf("{ Forwarded request to server. Ready to read response. }\n");
+    strcpy(req->new_request + used, str);
     return 0;
 }
 
-int cache_and_forward_response(rio_t *rio_server, int clientfd, 
-    char *usrbuf, char *uri, unsigned int *byte_count) 
+/*
+ *  Get a server connection (from the upstream pool when enabled) and 
+ *  forward the request. Returns 1 if a pooled connection was reused, 0 
+ *  for a new connection, or -1 on error with no connection left open.
+ */
+int forward_request_to_server(rio_t *rio_server, int *serverfd, 
+        int clientfd, Http_Request *req) 
 {
-    int k = 0;
-    unsigned int cnt = 0;
+    int reused;
 
-    while ((k = Rio_readnb(rio_server, usrbuf, MAX_OBJECT_SIZE)) > 0) {
-        /* If the total response length fits in object size limit */ 
-        if (cnt == 0 && k < MAX_OBJECT_SIZE) {
-            /* Insert into cache */
-            add_cache_item(&cache_list, uri, usrbuf, k);
+    while (1) {
+        /* Open a client socket with the server */
+        if ((*serverfd = upstream_acquire(req->hostname, req->port, 
+                &reused)) < 0) 
+        {
+            if (*serverfd == -2) {
+                printf("DNS error! ");
+                clienterror(clientfd, req->host, "400", "Bad Request",
+                "This webpage is not available, because DNS lookup failed");
+            }
+            else {
+                printf("To-server socket connection error!\n");
+            }
+            printf("Hostname: %s\tPort: %d\n", req->hostname, req->port);
+            *serverfd = -1;
+            return -1;
         }
+        Rio_readinitb(rio_server, *serverfd);   /* Safe to call */
+
+        printf("New request%s:\n", reused ? " (reused connection)" : "");
+        printf("%s", req->new_request);    /* Print the new HTTP request */
 
-        if (Rio_writen(clientfd, usrbuf, k) == -1) return -1;
-        byte_count += k;
-        cnt++;
-        /* Use printf("%s", usrbuf); here to print the response content */
+        /* Forward the request to server */
+        if (Rio_writen(*serverfd, req->new_request, 
+                strlen(req->new_request)) != -1) 
+        {
+            break;
+        }
+        upstream_release(req->hostname, req->port, *serverfd, 0);
+        *serverfd = -1;
+        if (!reused) {
+            return -1;
+        }
+        /* The pooled connection was closed meanwhile, try another one */
     }
-    if (k < 0) {
-        return -1;
+
+    printf("{ Forwarded request to server. Ready to read response. }\n");
+    return reused;
+}
+
+/*
+ *  Relay the response to req to the client (and the followers of fetch), and
+ *  cache it if the whole response fits in the object size. Returns 0 on 
+ *  success, -1 on error, or RELAY_NO_RESPONSE if the server closed before
+ *  responding. *reusable tells if the server connection can be kept.
+ *  start_ns is when the request was forwarded, to time the fetch.
+ */
+int cache_and_forward_response(rio_t *rio_server, int clientfd, 
+    Http_Request *req, unsigned int *byte_count, int *reusable,
+    Inflight_Fetch *fetch, long long start_ns) 
+{
+    Response_Relay relay;
+    char *usrbuf = Malloc(MAX_OBJECT_SIZE);
+    int rc;
+
+    /* A response of known size is received into the cache item */
+    relay_init(&relay, rio_server, clientfd, usrbuf);
+    relay.uri = req->uri;
+    relay.request = req->cache_request;
+    relay.start_ns = start_ns;
+    relay.fetch = fetch;
+    while ((rc = relay_step(&relay)) == RELAY_MORE)
+        ;
+    *byte_count = relay.byte_count;
+    *reusable = relay.keep_alive;
+
+    /* If the total response length fits in object size limit */ 
+    if (rc == RELAY_DONE && relay.cacheable && relay.byte_count > 0) {
+        relay_cache(&relay);
     }
-    else {
-        return 0;
+    relay_free(&relay);
+    Free(usrbuf);
+    if (rc != RELAY_DONE) {
+        return (rc == RELAY_NO_RESPONSE) ? rc : -1;
     }
+    return 0;
 }
 
 
@@ -478,23 +1249,97 @@ int separate_host_port(char *host, char *hostname, int *hostport) {
 void clienterror(int fd, char *cause, char *errnum, 
         char *shortmsg, char *longmsg) 
 {
-    char buf[MAXLINE], body[MAXBUF];
+    char buf[MAXLINE + MAXBUF], body[MAXBUF];
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The proxy server</em>\r\n", body);
+    snprintf(body, MAXBUF, "<html><title>Proxy Error</title>"
+            "<body bgcolor=""ffffff"">\r\n"
+            "%s: %s\r\n"
+            "<p>%s: %.1024s\r\n"
+            "<hr><em>The proxy server</em>\r\n", 
+            errnum, shortmsg, longmsg, cause);
 
     /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    sprintf(buf, "%sContent-type: text/html\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n\r\n", buf, (int)strlen(body));
-    sprintf(buf, "%s%s", buf, body);
+    snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\n"
+            "Content-type: text/html\r\n"
+            "Content-length: %d\r\n\r\n%s", 
+            errnum, shortmsg, (int)strlen(body), body);
     Rio_writen(fd, buf, strlen(buf));
 }
 
+/* Write a pinned cache item to the client, segment by segment. Only a 
+ * fiber sends it with sendfile(): lingering then yields, while it would 
+ * hold a thread, pool worker or steal worker for up to HIT_LINGER_SEC */
+static int send_cache_item(int clientfd, Cache_Item *hit) {
+    unsigned int i;
+    size_t length;
+    char *segment;
+    int arena_fd = (engine == ENGINE_FIBER) ? slab_fd() : -1, rc = 0;
+
+    for (i = 0; (segment = item_segment(hit, i, &length)) != NULL; i++) {
+        if (arena_fd < 0) {
+            rc = Rio_writen(clientfd, segment, length);
+        }
+        else {
+            /* The kernel takes the pages of the memfd, no copy */
+            rc = Rio_sendfilen(clientfd, arena_fd, slab_offset(segment),
+                    length);
+        }
+        if (rc == -1)
+            break;
+    }
+    if (arena_fd >= 0) {
+        linger_client(clientfd, rc != -1);
+    }
+    return (rc == -1) ? -1 : 0;
+}
+
+/*
+ *  After sendfile(), the socket keeps referencing the pages of the arena 
+ *  until the client acknowledges them, so they must not be reused, and 
+ *  the hit not unpinned, before. If the response was sent, wait until 
+ *  nothing is left in the send queue of the socket (SIOCOUTQ counts the 
+ *  bytes not acknowledged yet), checking it on every tick of a timerfd, 
+ *  whose read yields the fiber. Otherwise, or if it is not empty after 
+ *  HIT_LINGER_SEC, the socket is set to reset the connection when closed, 
+ *  which drops the queued data. The hit can be unpinned once clientfd is 
+ *  closed.
+ */
+static void linger_client(int clientfd, int sent) {
+    struct itimerspec tick = {{0, HIT_LINGER_POLL_MS * 1000000},
+            {0, HIT_LINGER_POLL_MS * 1000000}};
+    struct linger reset = {1, 0};
+    struct pollfd pfd;
+    long long deadline = monotonic_ns() + HIT_LINGER_SEC * 1000000000LL;
+    uint64_t ticks;
+    int queued = -1, tfd = -1;
+
+    if (sent && (tfd = timerfd_create(CLOCK_MONOTONIC, 
+            TFD_NONBLOCK | TFD_CLOEXEC)) >= 0
+            && timerfd_settime(tfd, 0, &tick, NULL) == 0)
+    {
+        pfd.fd = tfd;
+        pfd.events = POLLIN;
+        while (ioctl(clientfd, SIOCOUTQ, &queued) == 0 && queued > 0
+                && monotonic_ns() < deadline)
+        {
+            /* Outside a fiber the read fails with EAGAIN, poll() waits */
+            if (rio_read_hook(tfd, &ticks, sizeof(ticks)) < 0 
+                    && errno != EINTR
+                    && (errno != EAGAIN || poll(&pfd, 1, -1) < 0))
+            {
+                break;
+            }
+        }
+    }
+    if (tfd >= 0) {
+        close(tfd);
+    }
+    if (queued != 0) {
+        setsockopt(clientfd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    }
+}
+
 /* Close any opened file descriptors (connections) in the current thread */
 void close_fd(int *serverfd, int *clientfd, int thread_id) {
     if (*serverfd >= 0) Close(*serverfd);
@@ -508,26 +1353,398 @@ void close_fd(int *serverfd, int *clientfd, int thread_id) {
             thread_id, thread_count);
 }
 
-/******************************************
- * Wrappers for the pthread_mutex_* functions 
- ******************************************/
+/* Parse the command line into the startup configuration */
+void parse_options(int argc, char **argv, int *port) {
+    int c;
 
-int Pthread_mutex_init(pthread_mutex_t *mutex,
-        const pthread_mutexattr_t *attr)
-{
-    int i = pthread_mutex_init(mutex, attr);
-    if (i != 0) unix_error("Pthread_mutex_init error");
-    return i;
+    while ((c = getopt_long(argc, argv, "e:l:w:s:q:r::h", long_options, 
+            NULL)) != -1) 
+    {
+        set_option(c, optarg, argv[0]);
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    *port = atoi(argv[optind]);
+    if (*port <0 || *port > 65535) {
+        fprintf(stderr, "legal port number : 0 to 65535\n");
+        exit(1);
+    }
+    if (max_object_size > max_cache_size) {
+        fprintf(stderr, "max object size must not exceed the cache size\n");
+        usage(argv[0]);
+    }
+    /* The L1 pays off on the long-lived workers of these engines; a
+     * thread of the thread engine serves one connection, and its L1 would
+     * only keep pins until it exits */
+    if (l1 < 0) {
+        l1 = (engine == ENGINE_POOL || engine == ENGINE_STEAL
+                || engine == ENGINE_FIBER || engine == ENGINE_EPOLL);
+    }
+    /* The other engines write hits from the map */
+    if (cache_memfd && engine != ENGINE_EPOLL && engine != ENGINE_FIBER) {
+        fprintf(stderr, "--memfd-cache has no effect with this engine, "
+                "ignored\n");
+        cache_memfd = 0;
+    }
+}
+
+/* Apply one option, from the command line or the config file */
+static void set_option(int c, char *arg, char *prog) {
+    switch (c) {
+    case 'e':
+        if (!strcmp(arg, "thread")) {
+            engine = ENGINE_THREAD;
+        } else if (!strcmp(arg, "epoll")) {
+            engine = ENGINE_EPOLL;
+        } else if (!strcmp(arg, "pool")) {
+            engine = ENGINE_POOL;
+        } else if (!strcmp(arg, "uring")) {
+            engine = ENGINE_URING;
+        } else if (!strcmp(arg, "steal")) {
+            engine = ENGINE_STEAL;
+        } else if (!strcmp(arg, "fiber")) {
+            engine = ENGINE_FIBER;
+        } else {
+            fprintf(stderr, "unknown engine: %s\n", arg);
+            usage(prog);
+        }
+        break;
+    case 'l':
+        if ((loop_count = atoi(arg)) <= 0) {
+            fprintf(stderr, "number of loops must be positive\n");
+            usage(prog);
+        }
+        break;
+    case 'w':
+        /* MIN or MIN:MAX */
+        pool_min_workers = atoi(arg);
+        pool_max_workers = strchr(arg, ':') ? 
+                atoi(strchr(arg, ':') + 1) : pool_min_workers;
+        if (pool_min_workers <= 0 || pool_max_workers < pool_min_workers) {
+            fprintf(stderr, "workers must be MIN or MIN:MAX, "
+                    "with 0 < MIN <= MAX\n");
+            usage(prog);
+        }
+        break;
+    case 's':
+        if ((pool_stack_kb = atoi(arg)) <= 0) {
+            fprintf(stderr, "stack size must be positive\n");
+            usage(prog);
+        }
+        break;
+    case 'q':
+        if ((pool_queue_depth = atoi(arg)) <= 0) {
+            fprintf(stderr, "queue depth must be positive\n");
+            usage(prog);
+        }
+        break;
+    case 'r':
+        reuseport = 1;
+        if (arg && (listener_count = atoi(arg)) <= 0) {
+            fprintf(stderr, "number of listeners must be positive\n");
+            usage(prog);
+        }
+        break;
+    case 'U':
+        if ((upstream_idle = atoi(arg)) < 0) {
+            fprintf(stderr, "upstream idle limit must not be negative\n");
+            usage(prog);
+        }
+        break;
+    case 'M':
+        if ((upstream_max = atoi(arg)) < 0) {
+            fprintf(stderr, "upstream cap must not be negative\n");
+            usage(prog);
+        }
+        break;
+    case 'T':
+        if ((upstream_timeout = atoi(arg)) <= 0) {
+            fprintf(stderr, "upstream timeout must be positive\n");
+            usage(prog);
+        }
+        break;
+    case 'D':
+        dns_server = arg;
+        break;
+    case 'H':
+        dns_hosts = arg;
+        break;
+    case 'N':
+        if ((dns_negative_ttl = atoi(arg)) < 0) {
+            fprintf(stderr, "negative TTL must not be negative\n");
+            usage(prog);
+        }
+        break;
+    case 'C':
+        coalesce = 0;
+        break;
+    case 'A':
+        admission = 0;
+        break;
+    case '1':
+        l1 = 0;
+        break;
+    case 'P':
+        if ((cache_policy = find_cache_policy(arg)) == NULL) {
+            fprintf(stderr, "unknown cache policy: %s\n", arg);
+            usage(prog);
+        }
+        break;
+    case 'L':
+        if ((pool_scale_latency_ms = atoi(arg)) <= 0) {
+            fprintf(stderr, "scale latency must be positive\n");
+            usage(prog);
+        }
+        break;
+    case 'c':
+        if (parse_size(arg, &max_cache_size) == -1
+                || max_cache_size < SLAB_PAGE_SIZE
+                || max_cache_size > CACHE_SIZE_LIMIT)
+        {
+            fprintf(stderr, "cache size must be from 128K to 16G\n");
+            usage(prog);
+        }
+        break;
+    case 'o':
+        if (parse_size(arg, &max_object_size) == -1
+                || max_object_size == 0
+                || max_object_size > OBJECT_SIZE_LIMIT)
+        {
+            fprintf(stderr, "max object size must be from 1 to 1G\n");
+            usage(prog);
+        }
+        break;
+    case 'f':
+        read_config(arg, prog);
+        break;
+    case 'd':
+        disk_dir = arg;
+        break;
+    case 'Z':
+        if (parse_size(arg, &disk_size) == -1
+                || disk_size < DISK_MIN_SEGMENTS * (size_t) SLAB_PAGE_SIZE)
+        {
+            fprintf(stderr, "disk size must be from 512K to 16T\n");
+            usage(prog);
+        }
+        break;
+    case 'S':
+        snapshot_path = arg;
+        break;
+    case 'm':
+        cache_memfd = 1;
+        break;
+    case 'I':
+        if ((snapshot_interval = atoi(arg)) <= 0) {
+            fprintf(stderr, "snapshot interval must be positive\n");
+            usage(prog);
+        }
+        break;
+    case 'X':
+        freshness = 0;
+        break;
+    case 't':
+        if (atoi(arg) < 0) {
+            fprintf(stderr, "default TTL must not be negative\n");
+            usage(prog);
+        }
+        fresh_default_ttl = atoi(arg);
+        break;
+    default:
+        usage(prog);
+    }
 }
 
-int Pthread_mutex_lock(pthread_mutex_t *mutex) {
-    int i = pthread_mutex_lock(mutex);
-    if (i != 0) unix_error("Pthread_mutex_lock error");
-    return i;
+/*
+ *  Read the options of a config file: one "name = value" per line, or
+ *  "name" alone for the options without value, where name is the long
+ *  option name. Blank lines and text after '#' are ignored.
+ */
+static void read_config(char *path, char *prog) {
+    char line[MAXLINE], *name, *value, *end;
+    const struct option *opt;
+    int lineno = 0;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "cannot open config file %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((end = strchr(line, '#')) != NULL)
+            *end = '\0';
+        name = line + strspn(line, " \t");
+        if ((value = strchr(name, '=')) != NULL) {
+            *value++ = '\0';
+            value += strspn(value, " \t");
+            trim_end(value);
+        }
+        trim_end(name);
+        if (*name == '\0')
+            continue;
+
+        for (opt = long_options; opt->name != NULL; opt++) {
+            if (!strcmp(opt->name, name))
+                break;
+        }
+        if (opt->name == NULL || opt->val == 'f' || opt->val == 'h'
+                || (opt->has_arg == required_argument
+                && (value == NULL || *value == '\0'))
+                || (opt->has_arg == no_argument && value != NULL))
+        {
+            fprintf(stderr, "%s:%d: bad option: %s\n", path, lineno, name);
+            exit(1);
+        }
+        /* Options keep pointers to their values */
+        set_option(opt->val, (value != NULL && *value != '\0') ?
+                strdup(value) : NULL, prog);
+    }
+    fclose(fp);
+}
+
+/* Strip the trailing white space of s */
+static void trim_end(char *s) {
+    size_t n = strlen(s);
+
+    while (n > 0 && isspace((unsigned char) s[n - 1]))
+        s[--n] = '\0';
+}
+
+/* Parse a byte count with an optional K, M, G or T suffix, up to 
+   DISK_SIZE_LIMIT. Returns -1 if malformed */
+static int parse_size(const char *arg, size_t *size) {
+    unsigned long long value;
+    const char *suffixes = "KMGT";
+    char *end;
+    int shift = 0;
+
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    if (end == arg || errno != 0) {
+        return -1;
+    }
+    if (*end != '\0' && strchr(suffixes, toupper((unsigned char) *end))) {
+        shift = 10 * (strchr(suffixes, toupper((unsigned char) *end))
+                - suffixes + 1);
+        end++;
+    }
+    if (*end != '\0' || value > (DISK_SIZE_LIMIT >> shift)) {
+        return -1;
+    }
+    value <<= shift;
+    *size = value;
+    return 0;
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "usage: %s [options] <port>\n", prog);
+    fprintf(stderr, "  -e, --engine=ENGINE   concurrency engine: "
+            "thread (default), epoll, pool,\n"
+            "                        uring, steal, fiber\n");
+    fprintf(stderr, "  -l, --loops=N         number of event loops for "
+            "the epoll and uring\n"
+            "                        engines, or fiber schedulers (default: "
+            "one per\n"
+            "                        core)\n");
+    fprintf(stderr, "  -w, --workers=MIN[:MAX]  worker threads for the pool "
+            "engine\n"
+            "                        (default: one per core, up to 16 per "
+            "core);\n"
+            "                        the steal engine runs MIN workers "
+            "(default:\n"
+            "                        4 per core)\n");
+    fprintf(stderr, "  -s, --stack-size=KB   stack size of a pool or steal "
+            "worker (default: 512),\n"
+            "                        or of a fiber (default: 256)\n");
+    fprintf(stderr, "  -q, --queue-depth=N   connections queued for the pool "
+            "(default: 1024)\n");
+    fprintf(stderr, "      --scale-latency=MS  queue wait that adds pool "
+            "workers (default: 20)\n");
+    fprintf(stderr, "  -r, --reuseport[=N]   N SO_REUSEPORT listeners, each "
+            "with an acceptor\n"
+            "                        pinned to a core (default: one per "
+            "core,\n"
+            "                        or one per loop for the epoll and uring\n"
+            "                        engines)\n");
+    fprintf(stderr, "      --upstream-idle=N  idle server connections kept "
+            "per host\n"
+            "                        (default: 8, 0 disables persistent "
+            "connections)\n");
+    fprintf(stderr, "      --upstream-max=N  cap on server connections per "
+            "host (default:\n"
+            "                        none)\n");
+    fprintf(stderr, "      --upstream-timeout=SEC  close idle server "
+            "connections after SEC\n"
+            "                        seconds (default: 30)\n");
+    fprintf(stderr, "      --dns-server=IP[:PORT]  name server to query "
+            "(default: those of\n"
+            "                        /etc/resolv.conf)\n");
+    fprintf(stderr, "      --dns-hosts=FILE  hosts file consulted before DNS "
+            "(default:\n"
+            "                        /etc/hosts)\n");
+    fprintf(stderr, "      --dns-negative-ttl=SEC  cache names that do not "
+            "exist for SEC\n"
+            "                        seconds (default: 10)\n");
+    fprintf(stderr, "      --no-coalesce     fetch concurrent misses on the "
+            "same URI separately\n");
+    fprintf(stderr, "      --cache-policy=POLICY  cache eviction: lru, "
+            "clock (default),\n"
+            "                        sieve, slru, arc, gdsf (by hits per "
+            "byte),\n"
+            "                        gdsf-bytes (by bytes saved)\n");
+    fprintf(stderr, "      --no-admission    cache every response that fits, "
+            "without the\n"
+            "                        TinyLFU frequency filter\n");
+    fprintf(stderr, "      --no-l1           look every hit up in the shared "
+            "cache, without\n"
+            "                        the per-thread L1 of the hottest items "
+            "(on by\n"
+            "                        default for the pool, steal, fiber and "
+            "epoll\n"
+            "                        engines)\n");
+    fprintf(stderr, "      --cache-size=BYTES  memory of the cache, with an "
+            "optional K, M or G\n"
+            "                        suffix (default: 1049000)\n");
+    fprintf(stderr, "      --max-object-size=BYTES  largest object cached "
+            "(default: 102400)\n");
+    fprintf(stderr, "      --config=FILE     read options from FILE, one "
+            "\"name = value\" per\n"
+            "                        line with the long option names\n");
+    fprintf(stderr, "      --disk-cache=DIR  keep the objects evicted from "
+            "memory in segment\n"
+            "                        files in DIR\n");
+    fprintf(stderr, "      --disk-size=BYTES  size of the disk cache "
+            "(default: 1G)\n");
+    fprintf(stderr, "      --snapshot=FILE   write the memory cache to FILE "
+            "periodically, and\n"
+            "                        load it back on startup\n");
+    fprintf(stderr, "      --snapshot-interval=SEC  seconds between "
+            "snapshots (default: 60)\n");
+    fprintf(stderr, "      --memfd-cache     keep the cache in a memfd and "
+            "send hits from it\n"
+            "                        with sendfile() (epoll and fiber "
+            "engines only, no\n"
+            "                        effect on the others)\n");
+    fprintf(stderr, "      --no-freshness    cache every response, and serve "
+            "it until it is\n"
+            "                        evicted, whatever its headers say\n");
+    fprintf(stderr, "      --default-ttl=SEC  lifetime of the responses "
+            "that give no freshness\n"
+            "                        information (default: 300)\n");
+    exit(1);
 }
 
-int Pthread_mutex_unlock(pthread_mutex_t *mutex) {
-    int i = pthread_mutex_unlock(mutex);
-    if (i != 0) unix_error("Pthread_mutex_unlock error");
-    return i;
-}
\ No newline at end of file
+/* Pin the calling thread to core (index % number of cores) */
+void pin_to_core(int index) {
+    cpu_set_t set;
+    int rc, cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&set);
+    CPU_SET(index % cores, &set);
+    if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+        fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(rc));
+}
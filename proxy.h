@@ -0,0 +1,70 @@
+/*
+ proxy.h for proxy lab
+ ----------------------
+ Designer: Guanting Liu
+ Andrew ID: guantinl
+ Date: April 28, 2014
+ ----------------------
+ Contains the request structure and the request parsing functions shared
+ by the blocking handler in proxy.c and the concurrency engines built on
+ top of it (see "eventloop.c").
+
+    A request is parsed one line at a time: parse_request_line() takes
+ the first line, parse_header_line() takes every following header line,
+ and finish_request() completes the rebuilt HTTP/1.0 request once the
+ blank line has been seen. This way the blocking handler can feed lines
+ straight from Rio_readlineb(), while the event-driven engine feeds them
+ from the header block it has accumulated without blocking.
+ */
+
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define DEFAULT_PORT 80     /* Defualt port number for forwading request */
+
+/* After a hit sent with sendfile(), the longest wait for the client to 
+ * acknowledge it, and how often the send queue is checked meanwhile */
+#define HIT_LINGER_SEC      5
+#define HIT_LINGER_POLL_MS  10
+
+/* Http_Request that tracks a client request while it is being rebuilt */
+typedef struct Http_Request {
+    char method[MAXLINE];
+    char uri[MAXLINE];          /* Cache item ID: hostname:port/suffix */
+    char host[MAXLINE];         /* Host string, may carry the port */
+    char hostname[MAXLINE];
+    char uri_suffix[MAXLINE];
+    char new_request[MAXLINE];  /* Rebuilt request forwarded to server */
+    int port;
+    int has_host_hdr;
+    int cache_request;          /* CACHE_REQ_* flags of its headers */
+    int coalesce;               /* May share the fetch of another miss */
+} Http_Request;
+
+/* Return values of the request parsing functions */
+#define REQUEST_OK           0
+#define REQUEST_ERROR       -1  /* Malformed request, drop the client */
+#define REQUEST_NOT_IMPL    -2  /* Unsupported method, reply with 501 */
+#define REQUEST_HEADERS_END  1  /* Blank line seen by parse_header_line() */
+
+/*
+ *  Global/shared variables (defined in proxy.c)
+ */
+extern Cache_List cache_list;
+
+/*
+ *  Function Prototypes
+ */
+int parse_request_line(Http_Request *req, char *line);
+int parse_header_line(Http_Request *req, char *line);
+int finish_request(Http_Request *req);
+int parse_request_block(Http_Request *req, char *block, int clientfd);
+int separate_host_port(char *host, char *hostname, int *hostport);
+void clienterror(int fd, char *cause, char *errnum,
+        char *shortmsg, char *longmsg);
+void pin_to_core(int index);
+
+#endif /* __PROXY_H__ */
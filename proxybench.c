@@ -0,0 +1,164 @@
+/*
+ proxybench.c for proxy lab
+ ----------------------
+ A small closed-loop load generator used to compare the engines of the
+ proxy (see "bench.sh").
+
+    usage: proxybench [-c conns] [-n requests] <proxy host> <proxy port> <url>
+
+    Each of the conns client threads repeatedly opens a connection to the
+ proxy, sends "GET <url> HTTP/1.0", reads the response until the proxy
+ closes the connection, and records how long the exchange took. Once
+ all requests are done it prints the throughput, the latency percentiles
+ and the number of failed requests, so the same run can be repeated
+ against each engine.
+ */
+
+#include "csapp.h"
+
+/* Bench_Client that tracks the results of one client thread */
+typedef struct Bench_Client {
+    int id;
+    int requests;           /* Requests this client has to send */
+    int errors;
+    long long bytes;
+    double *latency_ms;     /* Latency of each successful request */
+    int done;
+} Bench_Client;
+
+static char *proxy_host;
+static int proxy_port;
+static char request[MAXLINE];
+
+
+/*
+ * Function prototypes
+ */
+static void *client_thread(void *args);
+static int compare_double(const void *a, const void *b);
+static double now_ms(void);
+static void usage(char *prog);
+
+
+
+int main(int argc, char **argv) {
+    int conns = 16, total = 1000, c, i, j, done = 0, errors = 0;
+    Bench_Client *clients;
+    pthread_t *tids;
+    double *all, start, elapsed;
+    long long bytes = 0;
+
+    while ((c = getopt(argc, argv, "c:n:h")) != -1) {
+        switch (c) {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'n':
+            total = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 3 || conns <= 0 || total < conns) {
+        usage(argv[0]);
+    }
+    proxy_host = argv[optind];
+    proxy_port = atoi(argv[optind + 1]);
+    snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\n\r\n",
+            argv[optind + 2]);
+    Signal(SIGPIPE, SIG_IGN);
+
+    clients = Calloc(conns, sizeof(Bench_Client));
+    tids = Calloc(conns, sizeof(pthread_t));
+    start = now_ms();
+    for (i = 0; i < conns; i++) {
+        clients[i].id = i;
+        clients[i].requests = total / conns + (i < total % conns);
+        clients[i].latency_ms = Calloc(clients[i].requests, sizeof(double));
+        Pthread_create(&tids[i], NULL, client_thread, &clients[i]);
+    }
+    for (i = 0; i < conns; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+    elapsed = now_ms() - start;
+
+    /* Merge the latencies of all clients */
+    all = Calloc(total, sizeof(double));
+    for (i = 0; i < conns; i++) {
+        for (j = 0; j < clients[i].done; j++) {
+            all[done++] = clients[i].latency_ms[j];
+        }
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+    }
+    qsort(all, done, sizeof(double), compare_double);
+
+    printf("requests: %d ok, %d failed, %d connections\n",
+            done, errors, conns);
+    printf("time:     %.1f ms\n", elapsed);
+    printf("rate:     %.1f req/s, %.2f MB/s\n", done * 1000.0 / elapsed,
+            bytes / 1048576.0 * 1000.0 / elapsed);
+    if (done > 0) {
+        printf("latency:  p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, "
+                "max %.2f ms\n", all[done / 2], all[done * 90 / 100],
+                all[done * 99 / 100], all[done - 1]);
+    }
+    return errors ? 1 : 0;
+}
+
+/* Client thread routine: one request per connection, back to back */
+static void *client_thread(void *args) {
+    Bench_Client *client = (Bench_Client *) args;
+    char buf[MAXBUF];
+    double start;
+    ssize_t n;
+    long long bytes;
+    int i, fd;
+
+    for (i = 0; i < client->requests; i++) {
+        start = now_ms();
+        if ((fd = open_clientfd_r(proxy_host, proxy_port)) < 0) {
+            client->errors++;
+            continue;
+        }
+        if (rio_writen(fd, request, strlen(request)) < 0) {
+            client->errors++;
+            close(fd);
+            continue;
+        }
+        bytes = 0;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            bytes += n;
+        }
+        close(fd);
+
+        if (n < 0 || bytes == 0) {
+            client->errors++;
+            continue;
+        }
+        client->bytes += bytes;
+        client->latency_ms[client->done++] = now_ms() - start;
+    }
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Monotonic time in milliseconds */
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-c conns] [-n requests] "
+            "<proxy host> <proxy port> <url>\n", prog);
+    exit(1);
+}
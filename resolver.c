@@ -0,0 +1,469 @@
+/*
+ resolver.c for proxy lab
+ ----------------------
+ Contains the caching resolver used for the server names of all engines.
+
+   About resolver design
+ ----------------------
+    Originally every cache miss called getaddrinfo(), so each request to
+ a server paid for a full lookup, and a slow name server stalled every
+ thread asking for the same name at once. The resolver keeps the answers
+ in a small chained hash table keyed by name, and is installed as the
+ resolve_hook of csapp.c, so open_clientfd_r() and the event engines go
+ through it.
+
+    A name is looked up in the hosts file first (/etc/hosts unless given
+ with --dns-hosts), then with a DNS query for its A records. The answer
+ is cached for the smallest TTL of its records, kept between
+ RESOLVER_MIN_TTL and RESOLVER_MAX_TTL; names from the hosts file are
+ cached for RESOLVER_DEFAULT_TTL. The DNS query goes to the name servers
+ of /etc/resolv.conf, or to the one given with --dns-server, which makes
+ it easy to test against a local stub server. When no name server
+ answers at all and none was given, getaddrinfo() is asked instead, so
+ the other sources of nsswitch.conf still work. A name that does not
+ exist is remembered as a negative entry for the negative TTL.
+
+    Concurrent lookups of the same name are done once: the first lookup
+ marks the entry pending and resolves it without the lock, and the
+ others wait on the entry's condition variable for its answer.
+
+    A refresh thread looks at the table every second. Hot entries, that
+ were hit since they were last resolved, are resolved again shortly
+ before they expire, so a name in steady use never makes a request wait
+ for DNS. While it is refreshed, the entry keeps serving the old answer,
+ and the old answer is kept if the name server fails. Entries that
+ expired without being hit are dropped.
+ */
+
+#include <resolv.h>
+#include <arpa/nameser.h>
+#include "proxy.h"
+#include "resolver.h"
+#include "threadpool.h"
+
+#define RESOLVER_DEFAULT_TTL    60      /* Seconds, hosts file and fallback */
+#define RESOLVER_MIN_TTL        1
+#define RESOLVER_MAX_TTL        3600
+#define REFRESH_PERIOD_SEC      1
+#define REFRESH_AHEAD_SEC       2       /* Refresh at least this early */
+#define REFRESH_BATCH           64      /* Entries refreshed per table pass */
+#define DNS_ANSWER_SIZE         4096
+
+/* Results of resolve_name() besides a number of addresses */
+#define RESOLVE_NOTFOUND        -1      /* The name does not exist */
+#define RESOLVE_FAILED          -2      /* No name server answered */
+
+#define SEC_NS                  1000000000LL
+
+/*
+ *  Global/shared variables
+ */
+Resolver resolver;
+
+
+/*
+ * Function prototypes
+ */
+static Resolver_Entry *find_entry(char *hostname, int create);
+static void entry_store(Resolver_Entry *entry, struct in_addr *addrs,
+        int naddrs, int ttl);
+static int entry_copy(Resolver_Entry *entry, struct in_addr *addrs,
+        int max_addrs);
+static int resolve_name(char *hostname, struct in_addr *addrs,
+        int max_addrs, int *ttl);
+static int hosts_lookup(char *hostname, struct in_addr *addrs,
+        int max_addrs);
+static int dns_query(char *hostname, struct in_addr *addrs, int max_addrs,
+        int *ttl);
+static void *refresh_thread(void *args);
+static void create_state_key(void);
+static void release_state(void *arg);
+
+/* Query state of the current thread, set up on its first DNS query and
+   released at thread exit */
+static __thread res_state dns_state = NULL;
+static pthread_key_t state_key;
+static pthread_once_t state_once = PTHREAD_ONCE_INIT;
+
+
+
+/*
+ *  Start the resolver and install it as the resolve_hook. server is
+ *  "IP[:PORT]", or NULL for the name servers of /etc/resolv.conf.
+ *  Returns -1 if server is not a valid address.
+ */
+int resolver_init(char *hosts_file, char *server, int negative_ttl) {
+    char addr[INET_ADDRSTRLEN], *colon;
+    pthread_t tid;
+    int port = NS_DEFAULTPORT;
+
+    memset(&resolver.server, 0, sizeof(resolver.server));
+    if (server) {
+        strncpy(addr, server, sizeof(addr) - 1);
+        addr[sizeof(addr) - 1] = '\0';
+        if ((colon = strchr(addr, ':')) != NULL) {
+            *colon = '\0';
+            port = atoi(colon + 1);
+        }
+        if (port <= 0 || port > 65535 || inet_pton(AF_INET, addr,
+                &resolver.server.sin_addr) != 1)
+        {
+            return -1;
+        }
+        resolver.server.sin_family = AF_INET;
+        resolver.server.sin_port = htons(port);
+    }
+
+    Pthread_mutex_init(&resolver.mutex, NULL);
+    resolver.hosts_file = hosts_file ? hosts_file : "/etc/hosts";
+    resolver.default_ttl = RESOLVER_DEFAULT_TTL;
+    resolver.negative_ttl = negative_ttl;
+    resolve_hook = resolver_lookup;
+
+    Pthread_create(&tid, NULL, refresh_thread, NULL);
+    Pthread_detach(tid);
+
+    printf("{ Resolver: hosts file %s, name server %s, %d s negative TTL }"
+            "\n\n", resolver.hosts_file, server ? server : "from resolv.conf",
+            negative_ttl);
+    return 0;
+}
+
+/*
+ *  Look up the IPv4 addresses of hostname through the cache. Stores at
+ *  most max_addrs of them in addrs and returns their number, or -1 if the
+ *  name does not resolve (as resolve_host).
+ */
+int resolver_lookup(char *hostname, struct in_addr *addrs, int max_addrs) {
+    Resolver_Entry *entry;
+    struct in_addr found[RESOLVE_MAX_ADDRS];
+    long long now;
+    int naddrs, ttl;
+
+    /* Numeric addresses need no lookup */
+    if (max_addrs > 0 && inet_pton(AF_INET, hostname, &addrs[0]) == 1) {
+        return 1;
+    }
+
+    Pthread_mutex_lock(&resolver.mutex);
+    if ((entry = find_entry(hostname, 1)) == NULL) {
+        /* Table full: resolve without caching */
+        Pthread_mutex_unlock(&resolver.mutex);
+        if ((naddrs = resolve_name(hostname, found, RESOLVE_MAX_ADDRS,
+                &ttl)) <= 0)
+        {
+            return -1;
+        }
+        naddrs = naddrs < max_addrs ? naddrs : max_addrs;
+        memcpy(addrs, found, naddrs * sizeof(struct in_addr));
+        return naddrs;
+    }
+
+    /* Wait for the lookup that is already resolving this name */
+    while (entry->state == ENTRY_PENDING) {
+        entry->waiters++;
+        pthread_cond_wait(&entry->resolved, &resolver.mutex);
+        entry->waiters--;
+    }
+
+    now = monotonic_ns();
+    if (entry->state != ENTRY_EMPTY && now < entry->expires_ns) {
+        entry->used_ns = now;
+        naddrs = entry_copy(entry, addrs, max_addrs);
+        Pthread_mutex_unlock(&resolver.mutex);
+        return naddrs;
+    }
+
+    /* Missing or expired: resolve it while the other lookups wait */
+    entry->state = ENTRY_PENDING;
+    Pthread_mutex_unlock(&resolver.mutex);
+
+    naddrs = resolve_name(hostname, found, RESOLVE_MAX_ADDRS, &ttl);
+    if (naddrs > 0) {
+        printf("DNS lookup: %s has %d address(es), TTL %d s\n",
+                hostname, naddrs, ttl);
+    } else {
+        printf("DNS lookup: %s not found\n", hostname);
+    }
+
+    Pthread_mutex_lock(&resolver.mutex);
+    entry_store(entry, found, naddrs, ttl);
+    pthread_cond_broadcast(&entry->resolved);
+    naddrs = entry_copy(entry, addrs, max_addrs);
+    Pthread_mutex_unlock(&resolver.mutex);
+    return naddrs;
+}
+
+/* Look up an entry, optionally adding it unless the table is full.
+   Called with the resolver mutex held */
+static Resolver_Entry *find_entry(char *hostname, int create) {
+    Resolver_Entry *entry;
+    unsigned int hash = 2166136261u;    /* FNV-1a */
+    char *ptr;
+
+    for (ptr = hostname; *ptr; ptr++) {
+        hash = (hash ^ (unsigned char) tolower(*ptr)) * 16777619u;
+    }
+    hash %= RESOLVER_BUCKETS;
+
+    for (entry = resolver.buckets[hash]; entry; entry = entry->next) {
+        if (!strcasecmp(entry->hostname, hostname))
+            return entry;
+    }
+    if (!create || resolver.entry_count >= RESOLVER_MAX_ENTRIES) {
+        return NULL;
+    }
+
+    entry = Calloc(1, sizeof(Resolver_Entry));
+    entry->hostname = strdup(hostname);
+    entry->state = ENTRY_EMPTY;
+    pthread_cond_init(&entry->resolved, NULL);
+    entry->next = resolver.buckets[hash];
+    resolver.buckets[hash] = entry;
+    resolver.entry_count++;
+    return entry;
+}
+
+/* Keep the result of resolve_name(). Called with the resolver mutex held */
+static void entry_store(Resolver_Entry *entry, struct in_addr *addrs,
+        int naddrs, int ttl)
+{
+    if (naddrs > 0) {
+        memcpy(entry->addrs, addrs, naddrs * sizeof(struct in_addr));
+        entry->naddrs = naddrs;
+        entry->state = ENTRY_VALID;
+    }
+    else {
+        entry->naddrs = 0;
+        entry->state = ENTRY_NEGATIVE;
+    }
+    if (ttl < RESOLVER_MIN_TTL)
+        ttl = RESOLVER_MIN_TTL;
+    if (ttl > RESOLVER_MAX_TTL)
+        ttl = RESOLVER_MAX_TTL;
+
+    entry->ttl = ttl;
+    entry->resolved_ns = monotonic_ns();
+    entry->expires_ns = entry->resolved_ns + ttl * SEC_NS;
+    entry->used_ns = entry->resolved_ns;    /* Not hot until hit again */
+}
+
+/* Copy the addresses of an entry, or return -1 for a negative entry */
+static int entry_copy(Resolver_Entry *entry, struct in_addr *addrs,
+        int max_addrs)
+{
+    int naddrs;
+
+    if (entry->state != ENTRY_VALID) {
+        return -1;
+    }
+    naddrs = entry->naddrs < max_addrs ? entry->naddrs : max_addrs;
+    memcpy(addrs, entry->addrs, naddrs * sizeof(struct in_addr));
+    return naddrs;
+}
+
+/*
+ *  Resolve hostname without the cache: the hosts file, then DNS, then
+ *  getaddrinfo() if no name server answered. Returns the number of
+ *  addresses, RESOLVE_NOTFOUND or RESOLVE_FAILED, and sets *ttl to how
+ *  long the result is valid.
+ */
+static int resolve_name(char *hostname, struct in_addr *addrs,
+        int max_addrs, int *ttl)
+{
+    int naddrs;
+
+    *ttl = resolver.default_ttl;
+    if ((naddrs = hosts_lookup(hostname, addrs, max_addrs)) > 0) {
+        return naddrs;
+    }
+
+    naddrs = dns_query(hostname, addrs, max_addrs, ttl);
+    if (naddrs == RESOLVE_FAILED && resolver.server.sin_port == 0) {
+        *ttl = resolver.default_ttl;
+        if ((naddrs = resolve_host(hostname, addrs, max_addrs)) <= 0)
+            naddrs = RESOLVE_NOTFOUND;
+    }
+    if (naddrs <= 0) {
+        *ttl = resolver.negative_ttl;
+    }
+    return naddrs;
+}
+
+/* Find the IPv4 addresses of hostname in the hosts file */
+static int hosts_lookup(char *hostname, struct in_addr *addrs,
+        int max_addrs)
+{
+    FILE *fp;
+    char line[MAXLINE], *name, *saveptr, *comment;
+    struct in_addr addr;
+    int naddrs = 0;
+
+    if ((fp = fopen(resolver.hosts_file, "r")) == NULL) {
+        return 0;
+    }
+    while (naddrs < max_addrs && fgets(line, sizeof(line), fp) != NULL) {
+        if ((comment = strchr(line, '#')) != NULL)
+            *comment = '\0';
+
+        /* An address followed by its names; IPv6 lines are skipped */
+        name = strtok_r(line, " \t\r\n", &saveptr);
+        if (name == NULL || inet_pton(AF_INET, name, &addr) != 1)
+            continue;
+        while ((name = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+            if (!strcasecmp(name, hostname)) {
+                addrs[naddrs++] = addr;
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    return naddrs;
+}
+
+/* Query the A records of hostname, setting *ttl to their smallest TTL */
+static int dns_query(char *hostname, struct in_addr *addrs, int max_addrs,
+        int *ttl)
+{
+    unsigned char answer[DNS_ANSWER_SIZE];
+    unsigned int min_ttl = RESOLVER_MAX_TTL;
+    ns_msg msg;
+    ns_rr rr;
+    int len, i, naddrs = 0;
+
+    if (dns_state == NULL) {
+        dns_state = Calloc(1, sizeof(struct __res_state));
+        if (res_ninit(dns_state) < 0) {
+            Free(dns_state);
+            dns_state = NULL;
+            return RESOLVE_FAILED;
+        }
+        if (resolver.server.sin_port != 0) {
+            dns_state->nscount = 1;
+            dns_state->nsaddr_list[0] = resolver.server;
+        }
+        pthread_once(&state_once, create_state_key);
+        pthread_setspecific(state_key, dns_state);
+    }
+
+    if ((len = res_nsearch(dns_state, hostname, ns_c_in, ns_t_a, answer,
+            sizeof(answer))) < 0)
+    {
+        if (dns_state->res_h_errno == HOST_NOT_FOUND
+                || dns_state->res_h_errno == NO_DATA)
+        {
+            return RESOLVE_NOTFOUND;
+        }
+        return RESOLVE_FAILED;
+    }
+    if (ns_initparse(answer, len, &msg) < 0) {
+        return RESOLVE_FAILED;
+    }
+
+    /* The answer may start with CNAME records, all of which count
+       toward the TTL */
+    for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+            break;
+        if (ns_rr_ttl(rr) < min_ttl)
+            min_ttl = ns_rr_ttl(rr);
+        if (ns_rr_type(rr) == ns_t_a && ns_rr_rdlen(rr) == 4
+                && naddrs < max_addrs)
+        {
+            memcpy(&addrs[naddrs++], ns_rr_rdata(rr), 4);
+        }
+    }
+    if (naddrs == 0) {
+        return RESOLVE_NOTFOUND;
+    }
+    *ttl = (int) min_ttl;
+    return naddrs;
+}
+
+static void create_state_key(void) {
+    int rc;
+
+    if ((rc = pthread_key_create(&state_key, release_state)) != 0) {
+        posix_error(rc, "pthread_key_create error");
+    }
+}
+
+/* Thread exit: close the query state of the thread */
+static void release_state(void *arg) {
+    res_state state = (res_state) arg;
+
+    res_nclose(state);
+    Free(state);
+}
+
+/* Refresh thread routine: resolve hot entries again before they expire,
+   drop the expired ones nobody uses */
+static void *refresh_thread(void *args) {
+    Resolver_Entry **entryp, *entry, *batch[REFRESH_BATCH];
+    struct in_addr found[RESOLVE_MAX_ADDRS];
+    long long now, ahead;
+    int i, n, naddrs, ttl;
+
+    while (1) {
+        sleep(REFRESH_PERIOD_SEC);
+        now = monotonic_ns();
+        n = 0;
+
+        Pthread_mutex_lock(&resolver.mutex);
+        for (i = 0; i < RESOLVER_BUCKETS; i++) {
+            entryp = &resolver.buckets[i];
+            while ((entry = *entryp) != NULL) {
+                if (entry->state == ENTRY_PENDING || entry->refreshing
+                        || entry->waiters > 0)
+                {
+                    entryp = &entry->next;
+                    continue;
+                }
+
+                /* Refresh within a fifth of the TTL of expiring */
+                ahead = entry->ttl / 5 * SEC_NS;
+                if (ahead < REFRESH_AHEAD_SEC * SEC_NS)
+                    ahead = REFRESH_AHEAD_SEC * SEC_NS;
+                if (entry->state == ENTRY_VALID && n < REFRESH_BATCH
+                        && entry->used_ns > entry->resolved_ns
+                        && entry->expires_ns - now <= ahead)
+                {
+                    entry->refreshing = 1;
+                    batch[n++] = entry;
+                    entryp = &entry->next;
+                }
+                else if (now >= entry->expires_ns) {
+                    *entryp = entry->next;
+                    pthread_cond_destroy(&entry->resolved);
+                    free(entry->hostname);
+                    Free(entry);
+                    resolver.entry_count--;
+                }
+                else {
+                    entryp = &entry->next;
+                }
+            }
+        }
+        Pthread_mutex_unlock(&resolver.mutex);
+
+        /* Entries being refreshed are never dropped, so the pointers
+           stay valid without the lock */
+        for (i = 0; i < n; i++) {
+            entry = batch[i];
+            naddrs = resolve_name(entry->hostname, found, RESOLVE_MAX_ADDRS,
+                    &ttl);
+
+            Pthread_mutex_lock(&resolver.mutex);
+            /* A lookup may have found it expired and resolved it itself;
+               keep the old answer when the name server failed */
+            if (entry->state != ENTRY_PENDING && naddrs != RESOLVE_FAILED) {
+                entry_store(entry, found, naddrs, ttl);
+            }
+            entry->refreshing = 0;
+            Pthread_mutex_unlock(&resolver.mutex);
+            printf("DNS refresh: %s, %d address(es), TTL %d s\n",
+                    entry->hostname, naddrs > 0 ? naddrs : 0, ttl);
+        }
+    }
+    return NULL;
+}
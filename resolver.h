@@ -0,0 +1,60 @@
+/*
+ resolver.h for proxy lab
+ ----------------------
+ Contains the caching resolver of server names.
+ See "resolver.c" for the design of the cache and its refresh.
+ */
+
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include "csapp.h"
+
+#define RESOLVER_BUCKETS     256    /* Hash buckets of the name table */
+#define RESOLVER_MAX_ENTRIES 4096   /* Names cached at the same time */
+
+/* States of a Resolver_Entry */
+#define ENTRY_EMPTY     0           /* Never resolved, or expired */
+#define ENTRY_PENDING   1           /* A lookup is resolving it */
+#define ENTRY_VALID     2
+#define ENTRY_NEGATIVE  3           /* The name does not exist */
+
+/* Resolver_Entry that tracks the addresses of one name */
+typedef struct Resolver_Entry {
+    char *hostname;
+    struct in_addr addrs[RESOLVE_MAX_ADDRS];
+    int naddrs;
+    int state;
+    int ttl;                    /* Seconds the last answer was valid for */
+    long long expires_ns;
+    long long resolved_ns;
+    long long used_ns;          /* Last lookup that hit */
+    int refreshing;             /* The refresh thread is resolving it */
+    int waiters;                /* Lookups waiting for it to resolve */
+    pthread_cond_t resolved;    /* Broadcast when a lookup completes */
+    struct Resolver_Entry *next;
+} Resolver_Entry;
+
+/* Resolver that tracks all cached names */
+typedef struct Resolver {
+    pthread_mutex_t mutex;
+    Resolver_Entry *buckets[RESOLVER_BUCKETS];
+    int entry_count;
+
+    char *hosts_file;           /* Consulted before DNS */
+    struct sockaddr_in server;  /* Name server, or none (sin_port 0) to
+                                   use the ones of /etc/resolv.conf */
+    int default_ttl;            /* For answers that carry no TTL */
+    int negative_ttl;
+} Resolver;
+
+extern Resolver resolver;
+
+
+/*
+ * Function prototypes
+ */
+int resolver_init(char *hosts_file, char *server, int negative_ttl);
+int resolver_lookup(char *hostname, struct in_addr *addrs, int max_addrs);
+
+#endif /* __RESOLVER_H__ */
@@ -0,0 +1,306 @@
+/*
+ sched.c for proxy lab
+ ----------------------
+ Contains the work-stealing scheduler used by the "-e steal" engine.
+
+   About work-stealing design
+ ----------------------
+    In the pool engine a connection is served from start to end by the
+ worker that took it. When a few origins are slow, the workers serving
+ them block while the connections queued behind them wait, even if
+ other cores have nothing to do.
+
+    Here a connection is split into continuation tasks, one per phase of
+ the blocking handler (parse, connect, relay and cache insert, see
+ "proxy.c"). Each phase runs to its end and then submits the next phase
+ as a new task, so a connection gives its worker back between phases and
+ between relayed chunks.
+
+    Every worker owns a deque of tasks (after Chase and Lev, with the C11
+ memory orders of Le et al.). The owner pushes and pops at the bottom
+ without locking, so a connection usually keeps running on the core that
+ has its data in cache. A worker that runs out of tasks first takes new
+ connections from the shared injection queue fed by the acceptors, then
+ steals the oldest task at the top of another worker's deque, starting
+ from a random victim. A steal is a single compare-and-swap on the top
+ index. Workers that find nothing sleep on a semaphore which is posted
+ whenever a task is submitted while someone is idle.
+
+    A deque doubles its array when it fills up. Thieves may still be
+ reading the old array, so it is kept on a list and never freed; the
+ arrays of a deque add up to less than twice the largest one.
+ */
+
+#include "proxy.h"
+#include "sched.h"
+
+#define DEQUE_SIZE      64      /* Initial deque capacity (power of 2) */
+#define IDLE_WAIT_NS    (100 * 1000000)     /* Longest sleep when idle */
+
+
+/*
+ * Function prototypes
+ */
+static void deque_init(Sched_Deque *deque);
+static void deque_push(Sched_Deque *deque, Sched_Task *task);
+static Sched_Task *deque_take(Sched_Deque *deque);
+static Sched_Task *deque_steal(Sched_Deque *deque);
+static Sched_Array *array_create(long size);
+static Sched_Task *inject_pop(Scheduler *sched);
+static Sched_Task *steal_task(Sched_Worker *self);
+static Sched_Task *find_task(Sched_Worker *self);
+static void *worker_thread(void *args);
+
+/* Worker running on the current thread, NULL outside the workers */
+static __thread Sched_Worker *current_worker = NULL;
+
+
+
+/* Create a scheduler running nworkers worker threads */
+Scheduler *sched_create(int nworkers, size_t stack_size) {
+    Scheduler *sched;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int i, rc;
+
+    sched = Calloc(1, sizeof(Scheduler));
+    if ((rc = posix_memalign((void **) &sched->workers, CACHE_LINE,
+            nworkers * sizeof(Sched_Worker))) != 0)
+    {
+        posix_error(rc, "posix_memalign error");
+    }
+    memset(sched->workers, 0, nworkers * sizeof(Sched_Worker));
+    sched->nworkers = nworkers;
+    Pthread_mutex_init(&sched->inject_mutex, NULL);
+    atomic_init(&sched->injected, 0);
+    atomic_init(&sched->idle_workers, 0);
+    Sem_init(&sched->wake, 0, 0);
+
+    for (i = 0; i < nworkers; i++) {
+        deque_init(&sched->workers[i].deque);
+        sched->workers[i].sched = sched;
+        sched->workers[i].id = i + 1;
+        sched->workers[i].seed = (unsigned int) (i + 1) * 2654435761u;
+    }
+
+    if ((rc = pthread_attr_init(&attr)) != 0
+            || (rc = pthread_attr_setdetachstate(&attr,
+                PTHREAD_CREATE_DETACHED)) != 0
+            || (rc = pthread_attr_setstacksize(&attr, stack_size)) != 0)
+    {
+        posix_error(rc, "pthread_attr error");
+    }
+    for (i = 0; i < nworkers; i++) {
+        if ((rc = pthread_create(&tid, &attr, worker_thread,
+                &sched->workers[i])) != 0)
+        {
+            posix_error(rc, "Unable to start the scheduler workers");
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    printf("{ Work-stealing scheduler: %d workers, %zu KB stacks }\n\n",
+            nworkers, stack_size / 1024);
+    return sched;
+}
+
+/*
+ *  Submit a task. On a worker it goes to the bottom of that worker's own
+ *  deque; from any other thread it goes to the injection queue.
+ */
+void sched_submit(Scheduler *sched, Sched_Task *task) {
+    if (current_worker != NULL && current_worker->sched == sched) {
+        deque_push(&current_worker->deque, task);
+    }
+    else {
+        task->next = NULL;
+        Pthread_mutex_lock(&sched->inject_mutex);
+        if (sched->inject_tail)
+            sched->inject_tail->next = task;
+        else
+            sched->inject_head = task;
+        sched->inject_tail = task;
+        atomic_fetch_add(&sched->injected, 1);
+        Pthread_mutex_unlock(&sched->inject_mutex);
+    }
+
+    /* Wake a sleeping worker to take or steal it */
+    if (atomic_load(&sched->idle_workers) > 0) {
+        V(&sched->wake);
+    }
+}
+
+static void deque_init(Sched_Deque *deque) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, array_create(DEQUE_SIZE));
+}
+
+static Sched_Array *array_create(long size) {
+    Sched_Array *array;
+
+    array = Malloc(sizeof(Sched_Array) + size * sizeof(Sched_Task *));
+    array->size = size;
+    array->prev = NULL;
+    return array;
+}
+
+/* Owner only: push a task at the bottom, growing the array if full */
+static void deque_push(Sched_Deque *deque, Sched_Task *task) {
+    long b, t, i;
+    Sched_Array *array, *bigger;
+
+    b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+    if (b - t > array->size - 1) {
+        bigger = array_create(array->size * 2);
+        for (i = t; i < b; i++) {
+            atomic_store_explicit(&bigger->tasks[i & (bigger->size - 1)],
+                    atomic_load_explicit(&array->tasks[i & (array->size - 1)],
+                        memory_order_relaxed), memory_order_relaxed);
+        }
+        bigger->prev = array;
+        atomic_store_explicit(&deque->array, bigger, memory_order_release);
+        array = bigger;
+    }
+
+    atomic_store_explicit(&array->tasks[b & (array->size - 1)], task,
+            memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+}
+
+/* Owner only: pop the newest task at the bottom, or NULL if empty */
+static Sched_Task *deque_take(Sched_Deque *deque) {
+    long b, t;
+    Sched_Array *array;
+    Sched_Task *task = NULL;
+
+    b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t <= b) {
+        task = atomic_load_explicit(&array->tasks[b & (array->size - 1)],
+                memory_order_relaxed);
+        if (t == b) {
+            /* Last task: race the thieves for it */
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &t,
+                    t + 1, memory_order_seq_cst, memory_order_relaxed))
+            {
+                task = NULL;
+            }
+            atomic_store_explicit(&deque->bottom, b + 1,
+                    memory_order_relaxed);
+        }
+    }
+    else {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/* Any thread: steal the oldest task at the top, or NULL */
+static Sched_Task *deque_steal(Sched_Deque *deque) {
+    long b, t;
+    Sched_Array *array;
+    Sched_Task *task;
+
+    t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+
+    array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    task = atomic_load_explicit(&array->tasks[t & (array->size - 1)],
+            memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+    {
+        return NULL;    /* Lost the race to the owner or another thief */
+    }
+    return task;
+}
+
+/* Take the oldest task of the injection queue, or NULL */
+static Sched_Task *inject_pop(Scheduler *sched) {
+    Sched_Task *task;
+
+    if (atomic_load(&sched->injected) == 0) {
+        return NULL;
+    }
+    Pthread_mutex_lock(&sched->inject_mutex);
+    if ((task = sched->inject_head) != NULL) {
+        if ((sched->inject_head = task->next) == NULL)
+            sched->inject_tail = NULL;
+        atomic_fetch_sub(&sched->injected, 1);
+    }
+    Pthread_mutex_unlock(&sched->inject_mutex);
+    return task;
+}
+
+/* Try every other worker once, starting from a random one */
+static Sched_Task *steal_task(Sched_Worker *self) {
+    Scheduler *sched = self->sched;
+    Sched_Task *task;
+    int start, i;
+
+    if (sched->nworkers < 2) {
+        return NULL;
+    }
+    start = rand_r(&self->seed) % sched->nworkers;
+    for (i = 0; i < sched->nworkers; i++) {
+        Sched_Worker *victim = &sched->workers[(start + i) % sched->nworkers];
+        if (victim == self) continue;
+        if ((task = deque_steal(&victim->deque)) != NULL)
+            return task;
+    }
+    return NULL;
+}
+
+/* Own deque first, then new connections, then other workers */
+static Sched_Task *find_task(Sched_Worker *self) {
+    Sched_Task *task;
+
+    if ((task = deque_take(&self->deque)) != NULL)
+        return task;
+    if ((task = inject_pop(self->sched)) != NULL)
+        return task;
+    return steal_task(self);
+}
+
+/* Worker thread routine */
+static void *worker_thread(void *args) {
+    Sched_Worker *self = (Sched_Worker *) args;
+    Scheduler *sched = self->sched;
+    Sched_Task *task;
+    struct timespec deadline;
+
+    current_worker = self;
+    while (1) {
+        if ((task = find_task(self)) == NULL) {
+            /* Announce we are idle, then look once more so that a task
+             * submitted meanwhile is not missed */
+            atomic_fetch_add(&sched->idle_workers, 1);
+            if ((task = find_task(self)) == NULL) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += IDLE_WAIT_NS;
+                if (deadline.tv_nsec >= 1000000000) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                sem_timedwait(&sched->wake, &deadline);
+            }
+            atomic_fetch_sub(&sched->idle_workers, 1);
+            if (task == NULL) continue;
+        }
+        task->run(task, self->id);
+    }
+    return NULL;
+}
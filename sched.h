@@ -0,0 +1,67 @@
+/*
+ sched.h for proxy lab
+ ----------------------
+ Contains the work-stealing scheduler used by the "-e steal" engine.
+ See "sched.c" for the design of the scheduler.
+ */
+
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <stdatomic.h>
+#include "csapp.h"
+#include "threadpool.h"
+
+/* Sched_Task that is run by a worker. Embed it as the first member of a
+   larger structure to carry the state of a continuation. */
+typedef struct Sched_Task {
+    void (*run)(struct Sched_Task *task, int worker_id);
+    struct Sched_Task *next;    /* Link in the injection queue */
+} Sched_Task;
+
+/* Sched_Array that holds the tasks of a deque, indexed modulo size */
+typedef struct Sched_Array {
+    long size;                  /* Power of 2 */
+    struct Sched_Array *prev;   /* Smaller array it replaced */
+    _Atomic(Sched_Task *) tasks[];
+} Sched_Array;
+
+/* Sched_Deque that the owner pushes and pops at the bottom, and that
+   other workers steal from at the top */
+typedef struct Sched_Deque {
+    _Alignas(CACHE_LINE) atomic_long top;
+    _Alignas(CACHE_LINE) atomic_long bottom;
+    _Atomic(Sched_Array *) array;
+} Sched_Deque;
+
+/* Sched_Worker that tracks one worker thread and its deque */
+typedef struct Sched_Worker {
+    Sched_Deque deque;
+    struct Scheduler *sched;
+    int id;
+    unsigned int seed;          /* Picks the first victim to steal from */
+} Sched_Worker;
+
+/* Scheduler that tracks the workers and the injection queue */
+typedef struct Scheduler {
+    Sched_Worker *workers;
+    int nworkers;
+
+    /* Tasks submitted from outside the workers (new connections) */
+    pthread_mutex_t inject_mutex;
+    Sched_Task *inject_head;
+    Sched_Task *inject_tail;
+    atomic_int injected;        /* Number of tasks in the queue */
+
+    atomic_int idle_workers;
+    sem_t wake;                 /* Posted when work arrives for idlers */
+} Scheduler;
+
+
+/*
+ * Function prototypes
+ */
+Scheduler *sched_create(int nworkers, size_t stack_size);
+void sched_submit(Scheduler *sched, Sched_Task *task);
+
+#endif /* __SCHED_H__ */
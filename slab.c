@@ -0,0 +1,398 @@
+/*
+ slab.c for proxy lab
+ ----------------------
+ Contains the slab allocator that holds the cached objects.
+
+   About slab design
+ ----------------------
+    Each cached object used to be a few separate malloc() blocks. Objects
+ of all sizes came and went in the heap, which fragmented it, and the
+ memory held by the proxy drifted far above MAX_CACHE_SIZE. Now a cache
+ item, its URI and its content are a single chunk of this allocator, in
+ the style of memcached.
+
+    The allocator owns one arena of the cache size, mapped once and cut
+ into pages of SLAB_PAGE_SIZE bytes; nothing else is ever allocated for
+ objects, so the memory of the cache cannot exceed the arena. A page is
+ either in the free page pool or given to a size class, and cut into
+ chunks of that class. The chunk sizes grow by SLAB_GROWTH from
+ SLAB_MIN_CHUNK up to a whole page, so a chunk wastes at most about a
+ fifth of its size. An allocation takes a chunk of the smallest class
+ that fits, from a page of the class with a free chunk, or cuts a page
+ from the pool for the class. A page whose chunks are all freed returns
+ to the pool at once, so the pages follow the object sizes in use.
+
+    The accounting is exact: the cache charges every object the size of
+ its chunk, and slab_stats() reports the bytes asked for, the bytes of
+ the chunks handed out, and the pages in use.
+
+    Pages only return to the pool once empty, so a class can hold pages
+ that are mostly free while another class has none left, typically after
+ the mix of object sizes shifted. When an allocation fails,
+ slab_rebalance() moves a page: it picks the page with the fewest bytes
+ handed out, stops allocating from it, and has the cache evict the items
+ on it. Evicted items are freed through the epochs of "epoch.c" once no
+ hit holds them; if they all are by the end of the rebalancing, the page
+ returns to the pool for the class in need. A page still holding a
+ pinned item is given back to its class. The chunks of a draining page
+ are never handed out, so the cache can still look at a chunk freed
+ meanwhile.
+
+    The free chunks of a page are chained through their second word, and
+ the first word of a chunk is zero while it is free and when it is handed
+ out: the cache keeps there the shard of the item, which the rebalancing
+ reads to tell a cached item from one being built or freed. A bitmap per
+ page tells which chunks are handed out. One mutex guards the allocator;
+ it is taken once per cached or evicted object, never on a hit.
+
+    The arena can also be a memfd, mapped shared, rather than anonymous 
+ memory (see slab_init()). The chunks are then also pages of a file, at 
+ the offset slab_offset() tells, so that the proxy can send a cached 
+ object with sendfile() from slab_fd() instead of write() from the map: 
+ the kernel takes the pages of its page cache instead of copying the 
+ bytes into the socket.
+ */
+
+#define _GNU_SOURCE     /* For memfd_create() */
+#include <sys/mman.h>
+#include "slab.h"
+#include "epoch.h"
+
+/* Link of a free chunk to the next one */
+#define NEXT_FREE(chunk)    (((void **) (chunk))[1])
+
+/*
+ *  Global/shared variables
+ */
+static pthread_mutex_t slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *arena = NULL;
+static int arena_fd = -1;           /* The memfd of the arena, or -1 */
+static Slab_Page *pages;
+static Slab_Page *free_pages;       /* Pool of pages of no class */
+static Slab_Class classes[SLAB_MAX_CLASSES];
+static int class_count;
+static Slab_Stats stats;
+
+
+/*
+ * Function prototypes
+ */
+static int class_of(size_t size);
+static void cut_page(Slab_Page *page, int class_id);
+static void release_page(Slab_Page *page);
+static void link_partial(Slab_Page *page);
+static void unlink_partial(Slab_Page *page);
+
+
+
+/* Map an arena of limit bytes (rounded down to whole pages, at least
+   one), from a memfd if memfd is set and the kernel has them, and set up
+   the size classes. Called before any thread; called again, it starts
+   over with a new arena, and the chunks of the old one must not be
+   freed any more */
+void slab_init(size_t limit, int memfd) {
+    size_t size = SLAB_MIN_CHUNK;
+    unsigned int i, page_count;
+
+    /* Nothing of a previous arena: its pages are left to their items */
+    memset(classes, 0, sizeof(classes));
+    memset(&stats, 0, sizeof(stats));
+    arena_fd = -1;
+
+    page_count = limit / SLAB_PAGE_SIZE;
+    if (page_count == 0) {
+        page_count = 1;
+    }
+    stats.limit = (size_t) page_count * SLAB_PAGE_SIZE;
+    stats.pages = page_count;
+
+    if (memfd && ((arena_fd = memfd_create("proxy-cache", MFD_CLOEXEC)) < 0
+            || ftruncate(arena_fd, stats.limit) < 0))
+    {
+        unix_error_nexit("memfd error, using anonymous memory");
+        if (arena_fd >= 0)
+            close(arena_fd);
+        arena_fd = -1;
+    }
+
+    /* Physical memory is only used as pages get cut */
+    if (arena_fd >= 0) {
+        arena = mmap(NULL, stats.limit, PROT_READ | PROT_WRITE, MAP_SHARED,
+                arena_fd, 0);
+    }
+    else {
+        arena = mmap(NULL, stats.limit, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (arena == MAP_FAILED) {
+        unix_error("mmap error");
+    }
+    pages = Calloc(page_count, sizeof(Slab_Page));
+    free_pages = NULL;
+    for (i = page_count; i-- > 0; ) {
+        pages[i].class_id = -1;
+        pages[i].allocated = Calloc(SLAB_PAGE_SIZE / SLAB_MIN_CHUNK / 8, 1);
+        pages[i].next = free_pages;
+        free_pages = &pages[i];
+    }
+
+    /* Chunk sizes grow by SLAB_GROWTH, the last class is a whole page */
+    class_count = 0;
+    while (size < SLAB_PAGE_SIZE / 2 && class_count < SLAB_MAX_CLASSES - 1) {
+        classes[class_count].chunk_size = size;
+        classes[class_count].per_page = SLAB_PAGE_SIZE / size;
+        class_count++;
+        size = (size_t) (size * SLAB_GROWTH);
+        size = (size + SLAB_CHUNK_ALIGN - 1)
+                & ~(size_t) (SLAB_CHUNK_ALIGN - 1);
+    }
+    classes[class_count].chunk_size = SLAB_PAGE_SIZE;
+    classes[class_count].per_page = 1;
+    class_count++;
+}
+
+/* Bytes of the arena */
+size_t slab_limit(void) {
+    return stats.limit;
+}
+
+/* The memfd the arena is mapped from, or -1 if it is anonymous memory */
+int slab_fd(void) {
+    return arena_fd;
+}
+
+/* Offset in slab_fd() of an address of the arena */
+off_t slab_offset(const void *ptr) {
+    return (const char *) ptr - arena;
+}
+
+/* Size of the chunk that holds size bytes, or 0 if size is too large */
+size_t slab_chunk_size(size_t size) {
+    int class_id = class_of(size);
+
+    return (class_id < 0) ? 0 : classes[class_id].chunk_size;
+}
+
+/* Allocate a chunk of at least size bytes. Returns NULL if size is too
+   large, or if no chunk of its class nor any free page is left */
+void *slab_alloc(size_t size) {
+    int class_id = class_of(size);
+    Slab_Class *cls;
+    Slab_Page *page;
+    char *chunk;
+    unsigned int index;
+
+    if (class_id < 0) {
+        return NULL;
+    }
+    cls = &classes[class_id];
+
+    pthread_mutex_lock(&slab_mutex);
+    if ((page = cls->partial) == NULL) {
+        if ((page = free_pages) == NULL) {
+            pthread_mutex_unlock(&slab_mutex);
+            return NULL;
+        }
+        free_pages = page->next;
+        cut_page(page, class_id);
+    }
+
+    chunk = page->free_chunks;
+    page->free_chunks = NEXT_FREE(chunk);
+    NEXT_FREE(chunk) = NULL;
+    if (page->free_chunks == NULL) {
+        unlink_partial(page);
+    }
+    index = (chunk - arena) % SLAB_PAGE_SIZE / cls->chunk_size;
+    page->allocated[index / 8] |= 1 << (index % 8);
+    page->used++;
+    cls->used++;
+    stats.chunk_bytes += cls->chunk_size;
+    stats.requested_bytes += size;
+    pthread_mutex_unlock(&slab_mutex);
+
+    return chunk;
+}
+
+/* Free a chunk allocated for size bytes */
+void slab_free(void *ptr, size_t size) {
+    Slab_Page *page = &pages[((char *) ptr - arena) / SLAB_PAGE_SIZE];
+    Slab_Class *cls;
+    unsigned int index;
+
+    pthread_mutex_lock(&slab_mutex);
+    cls = &classes[page->class_id];
+    index = ((char *) ptr - arena) % SLAB_PAGE_SIZE / cls->chunk_size;
+    page->allocated[index / 8] &= ~(1 << (index % 8));
+    *(void **) ptr = NULL;
+    NEXT_FREE(ptr) = page->free_chunks;
+    page->free_chunks = ptr;
+    page->used--;
+    cls->used--;
+    stats.chunk_bytes -= cls->chunk_size;
+    stats.requested_bytes -= size;
+
+    if (page->draining) {
+        /* slab_rebalance() decides once it is done with the page */
+    }
+    else if (page->used == 0) {
+        /* Empty: back to the pool, for any class */
+        release_page(page);
+    }
+    else if (page->prevp == NULL) {
+        /* Was full */
+        link_partial(page);
+    }
+    pthread_mutex_unlock(&slab_mutex);
+}
+
+/*
+ *  Try to free a page for the class of size, whose allocation failed.
+ *  Picks the page with the fewest bytes handed out, and calls evict() on
+ *  each of its chunks in use, without the allocator lock held. evict()
+ *  must unlink the object of the chunk and retire it through the epochs
+ *  (or do nothing if it is not cached). The chunks of the page are not
+ *  reused meanwhile, even once freed. The page returns to the pool if
+ *  all its objects were freed by then.
+ */
+void slab_rebalance(size_t size, void (*evict)(void *chunk)) {
+    Slab_Page *page, *victim = NULL;
+    size_t bytes, victim_bytes = (size_t) -1;
+    unsigned int i, count = 0, per_page;
+    char **chunks;
+
+    if (class_of(size) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&slab_mutex);
+    for (i = 0; i < stats.pages; i++) {
+        page = &pages[i];
+        if (page->class_id < 0 || page->draining)
+            continue;
+        bytes = (size_t) page->used * classes[page->class_id].chunk_size;
+        if (bytes < victim_bytes) {
+            victim = page;
+            victim_bytes = bytes;
+        }
+    }
+    if (victim == NULL) {
+        pthread_mutex_unlock(&slab_mutex);
+        return;
+    }
+
+    /* Allocate no more from it, and list the chunks in use */
+    victim->draining = 1;
+    unlink_partial(victim);
+    per_page = classes[victim->class_id].per_page;
+    chunks = Malloc(per_page * sizeof(char *));
+    for (i = 0; i < per_page; i++) {
+        if (victim->allocated[i / 8] & (1 << (i % 8)))
+            chunks[count++] = arena + (victim - pages) * SLAB_PAGE_SIZE
+                    + i * classes[victim->class_id].chunk_size;
+    }
+    pthread_mutex_unlock(&slab_mutex);
+
+    /* The chunks are not handed out again while the page drains */
+    for (i = 0; i < count; i++) {
+        evict(chunks[i]);
+    }
+    Free(chunks);
+    epoch_reclaim();
+
+    pthread_mutex_lock(&slab_mutex);
+    victim->draining = 0;
+    if (victim->used == 0) {
+        /* Emptied: to the pool, for the class in need */
+        release_page(victim);
+        stats.moves++;
+    }
+    else {
+        /* Some objects are still held: give the page back to its class */
+        if (victim->free_chunks != NULL)
+            link_partial(victim);
+    }
+    pthread_mutex_unlock(&slab_mutex);
+}
+
+/* Copy the current statistics */
+void slab_stats(Slab_Stats *out) {
+    pthread_mutex_lock(&slab_mutex);
+    *out = stats;
+    pthread_mutex_unlock(&slab_mutex);
+}
+
+/* Class of the smallest chunks that hold size bytes, or -1 */
+static int class_of(size_t size) {
+    int lo = 0, hi = class_count - 1, mid;
+
+    if (size > SLAB_PAGE_SIZE) {
+        return -1;
+    }
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (classes[mid].chunk_size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Cut a page of the pool into chunks of a class. Called with the mutex
+   held */
+static void cut_page(Slab_Page *page, int class_id) {
+    Slab_Class *cls = &classes[class_id];
+    char *base = arena + (page - pages) * SLAB_PAGE_SIZE;
+    unsigned int i;
+
+    page->class_id = class_id;
+    page->used = 0;
+    page->draining = 0;
+    page->free_chunks = NULL;
+    for (i = cls->per_page; i-- > 0; ) {
+        *(void **) (base + i * cls->chunk_size) = NULL;
+        NEXT_FREE(base + i * cls->chunk_size) = page->free_chunks;
+        page->free_chunks = base + i * cls->chunk_size;
+    }
+    memset(page->allocated, 0, SLAB_PAGE_SIZE / SLAB_MIN_CHUNK / 8);
+    page->prevp = NULL;
+    link_partial(page);
+    cls->pages++;
+    stats.pages_used++;
+}
+
+/* Return an empty page to the pool. Called with the mutex held */
+static void release_page(Slab_Page *page) {
+    unlink_partial(page);
+    classes[page->class_id].pages--;
+    stats.pages_used--;
+    page->class_id = -1;
+    page->next = free_pages;
+    free_pages = page;
+}
+
+/* Add a page to the partial list of its class. Called with the mutex
+   held */
+static void link_partial(Slab_Page *page) {
+    Slab_Class *cls = &classes[page->class_id];
+
+    page->next = cls->partial;
+    if (cls->partial != NULL)
+        cls->partial->prevp = &page->next;
+    cls->partial = page;
+    page->prevp = &cls->partial;
+}
+
+/* Remove a page from the partial list of its class, if it is there.
+   Called with the mutex held */
+static void unlink_partial(Slab_Page *page) {
+    if (page->prevp == NULL) {
+        return;
+    }
+    *page->prevp = page->next;
+    if (page->next != NULL)
+        page->next->prevp = page->prevp;
+    page->next = NULL;
+    page->prevp = NULL;
+}
@@ -0,0 +1,64 @@
+/*
+ slab.h for proxy lab
+ ----------------------
+ Contains the slab allocator that holds the cached objects.
+ See "slab.c" for the design.
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+#define SLAB_PAGE_SIZE  (128 * 1024)    /* Largest chunk, power of 2 */
+#define SLAB_MIN_CHUNK  128             /* Smallest chunk */
+#define SLAB_GROWTH     1.25            /* Chunk size factor between classes */
+#define SLAB_MAX_CLASSES 48
+#define SLAB_CHUNK_ALIGN 16
+
+/* Slab_Class that tracks the pages cut into chunks of one size */
+typedef struct Slab_Class {
+    size_t chunk_size;
+    unsigned int per_page;          /* Chunks per page */
+    struct Slab_Page *partial;      /* Pages with a free chunk */
+    unsigned int pages;
+    unsigned int used;              /* Chunks handed out */
+} Slab_Class;
+
+/* Slab_Page that tracks one page of the arena */
+typedef struct Slab_Page {
+    int class_id;                   /* -1 while in the free page pool */
+    unsigned int used;              /* Chunks handed out */
+    void *free_chunks;              /* Chained through their second word */
+    int draining;                   /* Being emptied for another class */
+    struct Slab_Page *next;         /* Next partial page, or free page */
+    struct Slab_Page **prevp;       /* Link to this page in the partial list */
+    uint8_t *allocated;             /* One bit per chunk */
+} Slab_Page;
+
+/* Slab_Stats that tracks the memory use of the allocator */
+typedef struct Slab_Stats {
+    size_t limit;                   /* Arena bytes */
+    unsigned int pages;
+    unsigned int pages_used;        /* Pages given to a class */
+    size_t chunk_bytes;             /* Bytes of the chunks handed out */
+    size_t requested_bytes;         /* Bytes asked for in those chunks */
+    unsigned int moves;             /* Pages moved between classes */
+} Slab_Stats;
+
+
+/*
+ * Function prototypes
+ */
+void slab_init(size_t limit, int memfd);
+size_t slab_limit(void);
+int slab_fd(void);
+off_t slab_offset(const void *ptr);
+size_t slab_chunk_size(size_t size);
+void *slab_alloc(size_t size);
+void slab_free(void *ptr, size_t size);
+void slab_rebalance(size_t size, void (*evict)(void *chunk));
+void slab_stats(Slab_Stats *stats);
+
+#endif /* __SLAB_H__ */
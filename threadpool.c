@@ -0,0 +1,292 @@
+/*
+ threadpool.c for proxy lab
+ ----------------------
+ Contains the prethreaded worker pool used by the "-e pool" engine.
+
+   About thread pool design
+ ----------------------
+    Instead of creating a thread for every accepted connection, the main
+ thread hands the connection descriptor to a fixed-size queue, and a set
+ of prethreaded workers take connections off the queue and serve them
+ with the blocking handler. No thread is created or destroyed per
+ request, and both the number of threads and the number of queued
+ connections have a ceiling.
+
+    The queue is a bounded lock-free multi-producer multi-consumer ring
+ (after Dmitry Vyukov's design). Each cell carries a sequence number that
+ tells producers and consumers whose turn the cell is, so a push or a pop
+ is one compare-and-swap on the shared position plus one store on the
+ cell. Idle workers sleep on a semaphore that counts the queued cells,
+ so they never spin on an empty queue.
+
+    A manager thread scales the pool between the minimum and maximum
+ worker counts. Workers record how long each connection waited in the
+ queue; when the longest wait of the last period exceeds the scaling
+ latency (or connections are queued while no worker is idle), the
+ manager doubles the workers up to the maximum. When workers stay idle
+ for a while, the manager retires them one at a time down to the minimum
+ by queueing a retire request (a cell with connfd == -1).
+ */
+
+#include "threadpool.h"
+
+#define MIN_STACK_SIZE  (256 * 1024)    /* Handler needs ~180 KB of stack */
+#define MANAGER_PERIOD_US 100000        /* Scaling decision period */
+#define RETIRE_PERIODS  50              /* Idle periods before retiring */
+
+
+/*
+ * Function prototypes
+ */
+static int pool_push(Thread_Pool *pool, int connfd);
+static void pool_pop(Thread_Pool *pool, Pool_Cell *out);
+static int spawn_worker(Thread_Pool *pool);
+static void *worker_thread(void *args);
+static void *manager_thread(void *args);
+static size_t queue_length(Thread_Pool *pool);
+
+
+
+/* Create a pool running handler on min_workers prethreaded workers */
+Thread_Pool *threadpool_create(pool_handler_t *handler, int min_workers,
+        int max_workers, size_t stack_size, size_t queue_depth,
+        int scale_latency_ms)
+{
+    Thread_Pool *pool;
+    size_t depth = 2, i;
+    pthread_t tid;
+    int rc;
+
+    if (stack_size < MIN_STACK_SIZE) {
+        printf("Worker stack size raised to %d KB\n", MIN_STACK_SIZE / 1024);
+        stack_size = MIN_STACK_SIZE;
+    }
+    if (max_workers < min_workers) max_workers = min_workers;
+    while (depth < queue_depth) depth <<= 1;
+
+    if ((rc = posix_memalign((void **) &pool, CACHE_LINE,
+            sizeof(Thread_Pool))) != 0)
+    {
+        posix_error(rc, "posix_memalign error");
+    }
+    memset(pool, 0, sizeof(Thread_Pool));
+    pool->cells = Calloc(depth, sizeof(Pool_Cell));
+    pool->mask = depth - 1;
+    for (i = 0; i < depth; i++) {
+        atomic_init(&pool->cells[i].seq, i);
+    }
+    atomic_init(&pool->enqueue_pos, 0);
+    atomic_init(&pool->dequeue_pos, 0);
+    Sem_init(&pool->items, 0, 0);
+
+    pool->handler = handler;
+    pool->min_workers = min_workers;
+    pool->max_workers = max_workers;
+    pool->stack_size = stack_size;
+    pool->scale_latency_ns = (long long) scale_latency_ms * 1000000;
+    atomic_init(&pool->live_workers, 0);
+    atomic_init(&pool->idle_workers, 0);
+    atomic_init(&pool->next_worker_id, 0);
+    atomic_init(&pool->max_wait_ns, 0);
+
+    if ((rc = pthread_attr_init(&pool->attr)) != 0
+            || (rc = pthread_attr_setdetachstate(&pool->attr,
+                PTHREAD_CREATE_DETACHED)) != 0
+            || (rc = pthread_attr_setstacksize(&pool->attr, stack_size)) != 0)
+    {
+        posix_error(rc, "pthread_attr error");
+    }
+
+    for (i = 0; i < min_workers; i++) {
+        if (spawn_worker(pool) == -1)
+            app_error("Unable to start the worker threads");
+    }
+    if (min_workers < max_workers) {
+        Pthread_create(&tid, NULL, manager_thread, pool);
+        Pthread_detach(tid);
+    }
+
+    printf("{ Thread pool: %d-%d workers, %zu KB stacks, queue depth %zu }\n\n",
+            min_workers, max_workers, stack_size / 1024, depth);
+    return pool;
+}
+
+/* Queue an accepted connection. Returns 0 on success, -1 if it is full */
+int threadpool_submit(Thread_Pool *pool, int connfd) {
+    if (pool_push(pool, connfd) == -1) {
+        return -1;
+    }
+    V(&pool->items);
+    return 0;
+}
+
+/* Current time in nanoseconds from the monotonic clock */
+long long monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Lock-free push of one cell. Returns -1 if the queue is full */
+static int pool_push(Thread_Pool *pool, int connfd) {
+    Pool_Cell *cell;
+    size_t pos, seq;
+    intptr_t diff;
+
+    pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        cell = &pool->cells[pos & pool->mask];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            /* Cell is free for this turn, try to claim it */
+            if (atomic_compare_exchange_weak_explicit(&pool->enqueue_pos,
+                    &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return -1;      /* Still holds a cell from the previous lap */
+        }
+        else {
+            pos = atomic_load_explicit(&pool->enqueue_pos,
+                    memory_order_relaxed);
+        }
+    }
+
+    cell->connfd = connfd;
+    cell->enqueue_ns = monotonic_ns();
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+/* Lock-free pop of one cell. The caller holds a count from pool->items,
+   so a published cell is guaranteed to be there. */
+static void pool_pop(Thread_Pool *pool, Pool_Cell *out) {
+    Pool_Cell *cell;
+    size_t pos, seq;
+    intptr_t diff;
+
+    pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+    while (1) {
+        cell = &pool->cells[pos & pool->mask];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->dequeue_pos,
+                    &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else {
+            pos = atomic_load_explicit(&pool->dequeue_pos,
+                    memory_order_relaxed);
+        }
+    }
+
+    out->connfd = cell->connfd;
+    out->enqueue_ns = cell->enqueue_ns;
+    atomic_store_explicit(&cell->seq, pos + pool->mask + 1,
+            memory_order_release);
+}
+
+/* Start one more worker. Returns 0 on success, -1 on failure */
+static int spawn_worker(Thread_Pool *pool) {
+    pthread_t tid;
+
+    atomic_fetch_add(&pool->live_workers, 1);
+    if (pthread_create(&tid, &pool->attr, worker_thread, pool) != 0) {
+        atomic_fetch_sub(&pool->live_workers, 1);
+        return -1;
+    }
+    return 0;
+}
+
+/* Worker thread routine */
+static void *worker_thread(void *args) {
+    Thread_Pool *pool = (Thread_Pool *) args;
+    int worker_id = atomic_fetch_add(&pool->next_worker_id, 1) + 1;
+    long long wait, max;
+    Pool_Cell cell;
+
+    while (1) {
+        atomic_fetch_add(&pool->idle_workers, 1);
+        P(&pool->items);
+        atomic_fetch_sub(&pool->idle_workers, 1);
+
+        pool_pop(pool, &cell);
+        if (cell.connfd < 0) {
+            break;      /* Retired by the manager */
+        }
+
+        /* Record the longest queue wait for the manager */
+        wait = monotonic_ns() - cell.enqueue_ns;
+        max = atomic_load_explicit(&pool->max_wait_ns, memory_order_relaxed);
+        while (wait > max && !atomic_compare_exchange_weak(&pool->max_wait_ns,
+                &max, wait))
+            ;
+
+        pool->handler(cell.connfd, worker_id);
+    }
+
+    atomic_fetch_sub(&pool->live_workers, 1);
+    return NULL;
+}
+
+/* Manager thread routine that scales the pool between min and max */
+static void *manager_thread(void *args) {
+    Thread_Pool *pool = (Thread_Pool *) args;
+    int live, idle, grow, idle_periods = 0;
+    long long wait;
+    size_t queued;
+
+    while (1) {
+        usleep(MANAGER_PERIOD_US);
+
+        wait = atomic_exchange(&pool->max_wait_ns, 0);
+        live = atomic_load(&pool->live_workers);
+        idle = atomic_load(&pool->idle_workers);
+        queued = queue_length(pool);
+
+        if (wait > pool->scale_latency_ns || (queued > 0 && idle == 0)) {
+            /* Connections are waiting: double the workers */
+            idle_periods = 0;
+            grow = live;
+            if (grow > pool->max_workers - live)
+                grow = pool->max_workers - live;
+            if (grow <= 0) continue;
+
+            while (grow-- > 0 && spawn_worker(pool) == 0)
+                ;
+            printf("{ Thread pool scaled up to %d workers "
+                    "(queue wait %lld ms) }\n\n",
+                    atomic_load(&pool->live_workers), wait / 1000000);
+        }
+        else if (idle > 0 && queued == 0 && live > pool->min_workers) {
+            /* Workers have nothing to do: retire one at a time */
+            if (++idle_periods < RETIRE_PERIODS) continue;
+            idle_periods = 0;
+            if (threadpool_submit(pool, -1) == 0) {
+                printf("{ Thread pool retiring a worker (%d live) }\n\n",
+                        live);
+            }
+        }
+        else {
+            idle_periods = 0;
+        }
+    }
+    return NULL;
+}
+
+/* Approximate number of queued cells */
+static size_t queue_length(Thread_Pool *pool) {
+    size_t head = atomic_load(&pool->enqueue_pos);
+    size_t tail = atomic_load(&pool->dequeue_pos);
+
+    return (head > tail) ? head - tail : 0;
+}
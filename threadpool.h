@@ -0,0 +1,60 @@
+/*
+ threadpool.h for proxy lab
+ ----------------------
+ Contains the prethreaded worker pool used by the "-e pool" engine.
+ See "threadpool.c" for the design of the pool.
+ */
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <stdatomic.h>
+#include "csapp.h"
+
+#define CACHE_LINE 64
+
+/* Handler run by a worker for every accepted connection */
+typedef void pool_handler_t(int connfd, int worker_id);
+
+/* Pool_Cell that holds one queued connection */
+typedef struct Pool_Cell {
+    atomic_size_t seq;          /* Turn of the cell in the ring */
+    int connfd;                 /* -1 asks the worker to retire */
+    long long enqueue_ns;       /* When the connection was queued */
+} Pool_Cell;
+
+/* Thread_Pool that tracks the queue and its workers */
+typedef struct Thread_Pool {
+    /* Producer and consumer positions live on separate cache lines */
+    _Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+    _Alignas(CACHE_LINE) Pool_Cell *cells;
+    size_t mask;                /* Queue depth - 1, depth is a power of 2 */
+    sem_t items;                /* Number of queued cells */
+
+    pool_handler_t *handler;
+    int min_workers;
+    int max_workers;
+    size_t stack_size;
+    long long scale_latency_ns; /* Queue wait that triggers scaling up */
+    pthread_attr_t attr;
+
+    atomic_int live_workers;
+    atomic_int idle_workers;
+    atomic_int next_worker_id;
+    atomic_llong max_wait_ns;   /* Longest queue wait since last check */
+} Thread_Pool;
+
+
+/*
+ * Function prototypes
+ */
+Thread_Pool *threadpool_create(pool_handler_t *handler, int min_workers,
+        int max_workers, size_t stack_size, size_t queue_depth,
+        int scale_latency_ms);
+
+int threadpool_submit(Thread_Pool *pool, int connfd);
+
+long long monotonic_ns(void);
+
+#endif /* __THREADPOOL_H__ */
@@ -0,0 +1,855 @@
+/*
+ upstream.c for proxy lab
+ ----------------------
+ Contains the pool of persistent server connections, and the response
+ relay used by the blocking handler and the work-stealing engine.
+
+   About upstream pool design
+ ----------------------
+    Originally every cache miss opened a new connection to the server
+ and sent "Connection: close", so each miss paid for a DNS lookup, a
+ socket and a TCP handshake, and the server closed the connection after
+ one response. With the pool, requests are forwarded as HTTP/1.1 with
+ "Connection: keep-alive", and a server connection that ended its
+ response cleanly is kept for the next request to the same hostname:port.
+
+    Hosts live in a small chained hash table. Each host keeps its idle
+ connections in a stack, so the most recently used (and most likely
+ still open) connection is reused first. The pool is bounded three ways:
+ at most max_idle_per_host idle connections per host, at most max_idle
+ idle connections overall, and optionally at most max_per_host idle plus
+ busy connections per host; a request over that cap waits for one to be
+ released, and gives up after UPSTREAM_WAIT_SEC. The waiting requests of
+ a host are queued, each with a timerfd set to its deadline, which
+ upstream_release() makes fire at once for the first one. Waiting is a
+ read() of it through rio_read_hook, so a request on a fiber yields
+ instead of blocking its scheduler.
+
+    Before an idle connection is reused, a non-blocking MSG_PEEK recv()
+ checks that the server has not closed it (or sent something unexpected)
+ meanwhile. A server can still close it just after the check; in that
+ case the request is retried once on a new connection (see proxy.c).
+ A reaper thread closes the connections idle for longer than the idle
+ timeout, and drops hosts that have no connection left.
+
+   About response relay
+ ----------------------
+    Reusing a connection requires knowing where the response ends
+ instead of reading until the server closes. relay_step() parses the
+ status line and headers, then reads the body by Content-Length, by
+ chunks for "Transfer-Encoding: chunked", or until close when neither is
+ given (such a connection is not reused).
+
+    The client gets the response as an HTTP/1.0 one would be, since its
+ connection is closed after it, whatever version the client speaks: the
+ hop-by-hop "Connection:", "Keep-Alive:" and "Proxy-Connection:" headers
+ are replaced with "Connection: close", and a chunked body is passed on
+ without its chunk sizes and trailers, so it lasts until close. The rest
+ of the response is passed on unchanged. What is cached is the response
+ as sent, so a hit suits any client as well.
+
+    Once the headers are in, the relay asks the cache whether it would
+ cache the response (see cache_admits()): whether its headers, and
+ those of the request, allow it and, when the size is known, whether
+ TinyLFU would admit it. If not, it is only relayed through the buffer,
+ and nothing is allocated nor evicted for it.
+
+    Otherwise the rest of the response is received straight into the
+ cache, so relay_cache() inserts it without another copy. With a
+ Content-Length, the relay allocates the cache item right away (see
+ alloc_cache_item()) and moves the headers into it. The content of a
+ large item is in segments (see item_segment()): the relay fills and
+ sends one after the other. A chunked response, or one that lasts until
+ close, is received into slab pages one after the other (see
+ reserve_cache_fill()), which become the item once it ends, or are given
+ back once it outgrows max_object_size. Either way, a response is cached
+ up to max_object_size, and the buffer only holds the headers.
+
+    Each call of relay_step() reads at most RELAY_CHUNK bytes of body,
+ so the work-stealing engine can run it as one continuation per chunk.
+ When the relay leads a coalesced fetch, every part sent to the client is
+ also appended to the fetch for its followers (see "inflight.c").
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <sys/timerfd.h>
+#include "proxy.h"
+#include "upstream.h"
+#include "threadpool.h"
+
+#define UPSTREAM_WAIT_SEC   5       /* Longest wait at the per-host cap */
+#define REAPER_PERIOD_SEC   1
+#define RELAY_CHUNK         (2 * MAXBUF)
+
+/* Phases of a response relay */
+#define PHASE_HEADERS       0
+#define PHASE_LENGTH        1       /* Body of Content-Length bytes */
+#define PHASE_CHUNK_SIZE    2
+#define PHASE_CHUNK_DATA    3
+#define PHASE_CHUNK_END     4       /* CRLF after the chunk data */
+#define PHASE_TRAILER       5
+#define PHASE_UNTIL_CLOSE   6
+#define PHASE_DONE          7
+
+/* Sent to the client instead of the hop-by-hop headers of the response */
+static const char *close_hdr = "Connection: close\r\n";
+
+/*
+ *  Global/shared variables
+ */
+Upstream_Pool upstream_pool;
+
+
+/*
+ * Function prototypes
+ */
+static Upstream_Host *find_host(char *hostname, int port, int create);
+static int conn_alive(int fd);
+static int wait_released(Upstream_Host *host, long long deadline_ns);
+static void wake_waiter(Upstream_Host *host);
+static void *reaper_thread(void *args);
+static int relay_headers(Response_Relay *relay);
+static void relay_into_cache(Response_Relay *relay, long long size);
+static void relay_into_item(Response_Relay *relay, size_t size);
+static void relay_into_fill(Response_Relay *relay);
+static int relay_line(Response_Relay *relay, char *line);
+static int skip_line(Response_Relay *relay, char *line);
+static int relay_data(Response_Relay *relay, size_t want);
+static int relay_put(Response_Relay *relay, char *data, size_t n);
+static char *relay_reserve(Response_Relay *relay, size_t want,
+        size_t *room);
+static int relay_flush(Response_Relay *relay);
+
+
+
+/* Enable the pool. Until this is called, every request is forwarded as
+   HTTP/1.0 on a new connection. */
+void upstream_init(int max_idle_per_host, int max_idle, int max_per_host,
+        int idle_timeout_sec)
+{
+    pthread_t tid;
+
+    Pthread_mutex_init(&upstream_pool.mutex, NULL);
+    upstream_pool.max_idle_per_host = max_idle_per_host;
+    upstream_pool.max_idle = max_idle;
+    upstream_pool.max_per_host = max_per_host;
+    upstream_pool.idle_timeout_ns = (long long) idle_timeout_sec * 1000000000;
+    upstream_pool.enabled = 1;
+
+    Pthread_create(&tid, NULL, reaper_thread, NULL);
+    Pthread_detach(tid);
+
+    printf("{ Upstream pool: %d idle per host, %d idle in all, ",
+            max_idle_per_host, max_idle);
+    if (max_per_host > 0)
+        printf("%d per host, ", max_per_host);
+    printf("%d s idle timeout }\n\n", idle_timeout_sec);
+}
+
+/*
+ *  Get a connection to hostname:port, reusing an idle one if it is still
+ *  open. Sets *reused accordingly. Returns the descriptor, -2 on DNS
+ *  error, or -1 on other errors (as Open_clientfd_r).
+ */
+int upstream_acquire(char *hostname, int port, int *reused) {
+    Upstream_Pool *pool = &upstream_pool;
+    Upstream_Host *host;
+    Upstream_Conn *conn;
+    long long now, deadline_ns;
+    int fd, stale;
+
+    *reused = 0;
+    if (!pool->enabled) {
+        return Open_clientfd_r(hostname, port);
+    }
+
+    deadline_ns = monotonic_ns() + UPSTREAM_WAIT_SEC * 1000000000LL;
+
+    Pthread_mutex_lock(&pool->mutex);
+    host = find_host(hostname, port, 1);
+    while (1) {
+        if ((conn = host->idle) != NULL) {
+            host->idle = conn->next;
+            host->idle_count--;
+            pool->idle_count--;
+            host->busy_count++;
+            Pthread_mutex_unlock(&pool->mutex);
+
+            now = monotonic_ns();
+            stale = (now - conn->idle_since_ns > pool->idle_timeout_ns);
+            fd = conn->fd;
+            Free(conn);
+            if (!stale && conn_alive(fd)) {
+                *reused = 1;
+                return fd;
+            }
+            /* Closed by the server, try the next idle one */
+            close(fd);
+            Pthread_mutex_lock(&pool->mutex);
+            host->busy_count--;
+            continue;
+        }
+
+        if (pool->max_per_host <= 0
+                || host->idle_count + host->busy_count < pool->max_per_host)
+        {
+            break;
+        }
+        /* At the cap: wait for a connection to be released */
+        if (wait_released(host, deadline_ns) == -1) {
+            Pthread_mutex_unlock(&pool->mutex);
+            printf("Too many connections to %s:%d!\n", hostname, port);
+            return -1;
+        }
+    }
+    host->busy_count++;
+    Pthread_mutex_unlock(&pool->mutex);
+
+    if ((fd = Open_clientfd_r(hostname, port)) < 0) {
+        Pthread_mutex_lock(&pool->mutex);
+        host->busy_count--;
+        wake_waiter(host);
+        Pthread_mutex_unlock(&pool->mutex);
+    }
+    return fd;
+}
+
+/* Give back a connection from upstream_acquire(). It is kept for reuse
+   if reusable and the idle limits allow, otherwise it is closed. */
+void upstream_release(char *hostname, int port, int fd, int reusable) {
+    Upstream_Pool *pool = &upstream_pool;
+    Upstream_Host *host;
+    Upstream_Conn *conn = NULL;
+
+    if (!pool->enabled) {
+        Close(fd);
+        return;
+    }
+    if (reusable) {
+        conn = Malloc(sizeof(Upstream_Conn));
+    }
+
+    Pthread_mutex_lock(&pool->mutex);
+    host = find_host(hostname, port, 0);
+    if (host) {
+        host->busy_count--;
+        if (conn && host->idle_count < pool->max_idle_per_host
+                && pool->idle_count < pool->max_idle)
+        {
+            conn->fd = fd;
+            conn->idle_since_ns = monotonic_ns();
+            conn->next = host->idle;
+            host->idle = conn;
+            host->idle_count++;
+            pool->idle_count++;
+            fd = -1;
+            conn = NULL;
+        }
+        wake_waiter(host);
+    }
+    Pthread_mutex_unlock(&pool->mutex);
+
+    if (conn) Free(conn);
+    if (fd >= 0) Close(fd);
+}
+
+/* Look up a host, optionally adding it. Called with the pool mutex held */
+static Upstream_Host *find_host(char *hostname, int port, int create) {
+    Upstream_Host *host;
+    unsigned int hash = 2166136261u;    /* FNV-1a */
+    char *ptr;
+
+    for (ptr = hostname; *ptr; ptr++) {
+        hash = (hash ^ (unsigned char) *ptr) * 16777619u;
+    }
+    hash = (hash ^ (unsigned int) port) * 16777619u;
+    hash %= UPSTREAM_BUCKETS;
+
+    for (host = upstream_pool.buckets[hash]; host; host = host->next) {
+        if (host->port == port && !strcmp(host->hostname, hostname))
+            return host;
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    host = Calloc(1, sizeof(Upstream_Host));
+    host->hostname = strdup(hostname);
+    host->port = port;
+    host->next = upstream_pool.buckets[hash];
+    upstream_pool.buckets[hash] = host;
+    return host;
+}
+
+/* An idle connection is alive if reading it would block */
+static int conn_alive(int fd) {
+    char c;
+
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+            && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Wait at the per-host cap of host until a connection is released, or
+   until deadline_ns. Called with the pool mutex held, which is released
+   meanwhile. Returns -1 once the deadline has passed, otherwise 0 */
+static int wait_released(Upstream_Host *host, long long deadline_ns) {
+    Upstream_Waiter waiter, **waiterp;
+    struct itimerspec at = {{0, 0}, {0, 0}};
+    struct pollfd pfd;
+    long long left = deadline_ns - monotonic_ns();
+    uint64_t ticks;
+
+    if (left <= 0) {
+        return -1;
+    }
+    at.it_value.tv_sec = left / 1000000000;
+    at.it_value.tv_nsec = left % 1000000000;
+    if ((waiter.fd = timerfd_create(CLOCK_MONOTONIC,
+            TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+    {
+        return -1;
+    }
+    if (timerfd_settime(waiter.fd, 0, &at, NULL) < 0) {
+        close(waiter.fd);
+        return -1;
+    }
+
+    /* First come, first woken */
+    waiter.linked = 1;
+    waiter.next = NULL;
+    for (waiterp = &host->waiters; *waiterp; waiterp = &(*waiterp)->next)
+        ;
+    *waiterp = &waiter;
+    host->waiting++;
+    Pthread_mutex_unlock(&upstream_pool.mutex);
+
+    /* On a fiber the read yields until the timer fires; elsewhere it
+     * fails with EAGAIN and poll() does the waiting */
+    pfd.fd = waiter.fd;
+    pfd.events = POLLIN;
+    while (rio_read_hook(waiter.fd, &ticks, sizeof(ticks)) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN || (poll(&pfd, 1, -1) < 0 && errno != EINTR))
+            break;
+    }
+
+    Pthread_mutex_lock(&upstream_pool.mutex);
+    host->waiting--;
+    if (waiter.linked) {
+        for (waiterp = &host->waiters; *waiterp != &waiter;
+                waiterp = &(*waiterp)->next)
+            ;
+        *waiterp = waiter.next;
+    }
+    close(waiter.fd);
+    return 0;
+}
+
+/* Wake the first request waiting at the per-host cap of host, if any, by
+   making its timer fire now. Called with the pool mutex held */
+static void wake_waiter(Upstream_Host *host) {
+    struct itimerspec now = {{0, 0}, {0, 1}};
+    Upstream_Waiter *waiter;
+
+    if ((waiter = host->waiters) == NULL) {
+        return;
+    }
+    host->waiters = waiter->next;
+    waiter->linked = 0;
+    timerfd_settime(waiter->fd, 0, &now, NULL);
+}
+
+/* Reaper thread routine: close expired idle connections, drop idle hosts */
+static void *reaper_thread(void *args) {
+    Upstream_Pool *pool = &upstream_pool;
+    Upstream_Host **hostp, *host;
+    Upstream_Conn **connp, *conn;
+    long long now;
+    int i;
+
+    while (1) {
+        sleep(REAPER_PERIOD_SEC);
+        now = monotonic_ns();
+
+        Pthread_mutex_lock(&pool->mutex);
+        for (i = 0; i < UPSTREAM_BUCKETS; i++) {
+            hostp = &pool->buckets[i];
+            while ((host = *hostp) != NULL) {
+                connp = &host->idle;
+                while ((conn = *connp) != NULL) {
+                    if (now - conn->idle_since_ns > pool->idle_timeout_ns) {
+                        *connp = conn->next;
+                        close(conn->fd);
+                        Free(conn);
+                        host->idle_count--;
+                        pool->idle_count--;
+                    }
+                    else {
+                        connp = &conn->next;
+                    }
+                }
+
+                if (host->idle_count == 0 && host->busy_count == 0
+                        && host->waiting == 0)
+                {
+                    *hostp = host->next;
+                    free(host->hostname);
+                    Free(host);
+                }
+                else {
+                    hostp = &host->next;
+                }
+            }
+        }
+        Pthread_mutex_unlock(&pool->mutex);
+    }
+    return NULL;
+}
+
+/* Start relaying a response read from rio to clientfd */
+void relay_init(Response_Relay *relay, rio_t *rio, int clientfd, char *buf) {
+    relay->rio = rio;
+    relay->clientfd = clientfd;
+    relay->buf = buf;
+    relay->stage = buf;
+    relay->cap = MAX_OBJECT_SIZE;
+    relay->len = 0;
+    relay->sent = 0;
+    relay->cacheable = 1;
+    relay->byte_count = 0;
+    relay->phase = PHASE_HEADERS;
+    relay->remaining = 0;
+    relay->keep_alive = 0;
+    relay->uri = NULL;
+    relay->request = 0;
+    relay->item = NULL;
+    relay->segment = 0;
+    init_cache_fill(&relay->fill);
+    relay->filling = 0;
+    relay->expires = 0;
+    relay->start_ns = monotonic_ns();
+    relay->fetch = NULL;
+    relay->client_gone = 0;
+}
+
+/* Cache the whole response, once relay_step() is done and it is still
+   cacheable, with the time the server took as its cost */
+void relay_cache(Response_Relay *relay) {
+    if (relay->filling) {
+        /* The pages filled become the item */
+        relay->item = build_filled_item(&relay->fill, relay->uri);
+        relay->filling = 0;
+    }
+    if (relay->item != NULL) {
+        relay->item->fetch_us = (monotonic_ns() - relay->start_ns) / 1000;
+        insert_cache_item(&cache_list, relay->item);
+        relay->item = NULL;
+    }
+}
+
+/* Free the cache item or the pages the response was received into, if
+   not cached */
+void relay_free(Response_Relay *relay) {
+    if (relay->item != NULL) {
+        destroy_cache_item(NULL, relay->item);
+        relay->item = NULL;
+    }
+    if (relay->filling) {
+        free_cache_fill(&relay->fill);
+        relay->filling = 0;
+    }
+}
+
+/*
+ *  Relay the next part of the response: the headers, or up to
+ *  RELAY_CHUNK bytes of body. Returns RELAY_MORE, RELAY_DONE, RELAY_ERROR
+ *  or RELAY_NO_RESPONSE. When done, relay->keep_alive tells if the server
+ *  connection can be reused.
+ */
+int relay_step(Response_Relay *relay) {
+    char line[MAXLINE];
+    int rc, data_read = 0;
+    size_t want;
+
+    if (relay->phase == PHASE_HEADERS) {
+        if ((rc = relay_headers(relay)) != RELAY_MORE)
+            return rc;
+        data_read = 1;
+    }
+
+    while (!data_read && relay->phase != PHASE_DONE) {
+        switch (relay->phase) {
+        case PHASE_LENGTH:
+        case PHASE_CHUNK_DATA:
+            want = (relay->remaining < RELAY_CHUNK) ?
+                    relay->remaining : RELAY_CHUNK;
+            if (relay_data(relay, want) != (int) want)
+                return RELAY_ERROR;     /* Truncated response */
+            relay->remaining -= want;
+            if (relay->remaining == 0) {
+                relay->phase = (relay->phase == PHASE_LENGTH) ?
+                        PHASE_DONE : PHASE_CHUNK_END;
+            }
+            data_read = 1;
+            break;
+
+        /* Only the chunk data is relayed */
+        case PHASE_CHUNK_SIZE:
+            if (skip_line(relay, line) <= 0)
+                return RELAY_ERROR;
+            if ((relay->remaining = strtoll(line, NULL, 16)) > 0) {
+                relay->phase = PHASE_CHUNK_DATA;
+            }
+            else {
+                relay->phase = PHASE_TRAILER;
+            }
+            break;
+
+        case PHASE_CHUNK_END:
+            if (skip_line(relay, line) <= 0)
+                return RELAY_ERROR;
+            relay->phase = PHASE_CHUNK_SIZE;
+            break;
+
+        case PHASE_TRAILER:
+            if (skip_line(relay, line) <= 0)
+                return RELAY_ERROR;
+            if (!strcmp(line, "\r\n") || !strcmp(line, "\n"))
+                relay->phase = PHASE_DONE;
+            break;
+
+        case PHASE_UNTIL_CLOSE:
+            if ((rc = relay_data(relay, RELAY_CHUNK)) < 0)
+                return RELAY_ERROR;
+            if (rc == 0)
+                relay->phase = PHASE_DONE;
+            data_read = 1;
+            break;
+        }
+    }
+
+    if (relay_flush(relay) == -1) {
+        return RELAY_ERROR;
+    }
+    if (relay->phase != PHASE_DONE) {
+        return RELAY_MORE;
+    }
+    /* Anything left unread means the framing was not understood */
+    if (relay->rio->rio_cnt > 0) {
+        relay->keep_alive = 0;
+    }
+    return RELAY_DONE;
+}
+
+/* Relay the status line and the headers, and choose how to read the body.
+   Returns RELAY_MORE, RELAY_ERROR or RELAY_NO_RESPONSE */
+static int relay_headers(Response_Relay *relay) {
+    char line[MAXLINE];
+    int http11, status, chunked = 0, conn_close = 0, conn_keep = 0, hop;
+    long long content_length = -1;
+    ssize_t n;
+
+    if ((n = relay_line(relay, line)) <= 0) {
+        return (n == 0 && relay->byte_count == 0) ?
+                RELAY_NO_RESPONSE : RELAY_ERROR;
+    }
+    if (strncmp(line, "HTTP/", 5)) {
+        /* No status line (HTTP/0.9): the body lasts until close */
+        relay->phase = PHASE_UNTIL_CLOSE;
+        relay_into_cache(relay, 0);
+        return RELAY_MORE;
+    }
+    http11 = !strncmp(line, "HTTP/1.1", 8);
+    status = (strlen(line) > 9) ? atoi(line + 9) : 0;
+
+    while (1) {
+        if ((n = skip_line(relay, line)) <= 0)
+            return RELAY_ERROR;
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n"))
+            break;
+
+        /* Hop-by-hop headers are not relayed */
+        hop = 0;
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            content_length = strtoll(line + 15, NULL, 10);
+        } else if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+            chunked = (strcasestr(line + 18, "chunked") != NULL);
+            hop = chunked;
+        } else if (!strncasecmp(line, "Connection:", 11)) {
+            conn_close |= (strcasestr(line + 11, "close") != NULL);
+            conn_keep |= (strcasestr(line + 11, "keep-alive") != NULL);
+            hop = 1;
+        } else if (!strncasecmp(line, "Keep-Alive:", 11)
+                || !strncasecmp(line, "Proxy-Connection:", 17))
+        {
+            hop = 1;
+        }
+        if (!hop && relay_put(relay, line, n) == -1)
+            return RELAY_ERROR;
+    }
+    if (relay_put(relay, (char *) close_hdr, strlen(close_hdr)) == -1
+            || relay_put(relay, line, n) == -1)
+    {
+        return RELAY_ERROR;
+    }
+
+    /* HTTP/1.1 is persistent unless closed, HTTP/1.0 only if asked */
+    relay->keep_alive = http11 ? !conn_close : (conn_keep && !conn_close);
+
+    if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+        relay->phase = PHASE_DONE;      /* No body */
+        relay_into_cache(relay, relay->len);
+    } else if (chunked) {
+        relay->phase = PHASE_CHUNK_SIZE;
+        relay_into_cache(relay, 0);
+    } else if (content_length >= 0) {
+        relay->remaining = content_length;
+        relay->phase = content_length ? PHASE_LENGTH : PHASE_DONE;
+        relay_into_cache(relay, relay->len + content_length);
+    } else {
+        relay->phase = PHASE_UNTIL_CLOSE;
+        relay->keep_alive = 0;
+        relay_into_cache(relay, 0);
+    }
+    return RELAY_MORE;
+}
+
+/*
+ *  Once the headers are in, decide whether the response of size bytes (0
+ *  if not known) is cached before anything is allocated for it (see
+ *  cache_admits()), and if so receive the rest of it into a new cache
+ *  item, or into a fill if its size is not known. A response that gets
+ *  neither is only relayed, and one that may not be stored is not shared
+ *  with the followers of the fetch either.
+ */
+static void relay_into_cache(Response_Relay *relay, long long size) {
+    int rc;
+
+    if (relay->uri == NULL || !relay->cacheable) {
+        relay->cacheable = 0;
+        return;
+    }
+    if (size > max_object_size) {
+        relay->cacheable = 0;
+        return;
+    }
+    if ((rc = cache_admits(&cache_list, relay->uri, relay->request,
+            relay->buf, relay->len, size, &relay->expires)) <= 0)
+    {
+        /* Not storable is not shareable either: the followers of the
+         * fetch, if any, get their own response */
+        if (rc < 0 && relay->fetch != NULL) {
+            inflight_detach(relay->fetch);
+        }
+        relay->cacheable = 0;
+        return;
+    }
+    if (size > 0) {
+        relay_into_item(relay, size);
+    }
+    else {
+        relay_into_fill(relay);
+    }
+}
+
+/* Receive the rest of a response of size bytes into a new cache item */
+static void relay_into_item(Response_Relay *relay, size_t size) {
+    Cache_Item *item;
+    size_t length;
+    char *segment;
+
+    if ((item = alloc_cache_item(relay->uri, size)) == NULL) {
+        relay->cacheable = 0;
+        return;
+    }
+    segment = item_segment(item, 0, &length);
+    if (relay->len > length) {
+        /* Headers longer than a chunk */
+        destroy_cache_item(NULL, item);
+        relay->cacheable = 0;
+        return;
+    }
+    /* The headers, sent or not, move along */
+    memcpy(segment, relay->buf, relay->len);
+    item->expires = relay->expires;
+    relay->item = item;
+    relay->segment = 0;
+    relay->buf = segment;
+    relay->cap = length;
+}
+
+/* Receive the rest of a response of unknown size into slab pages, page
+   after page, until it ends or is larger than max_object_size */
+static void relay_into_fill(Response_Relay *relay) {
+    size_t room;
+    char *page;
+
+    if ((page = reserve_cache_fill(&relay->fill, &room)) == NULL
+            || relay->len > room)
+    {
+        /* Headers longer than a page */
+        free_cache_fill(&relay->fill);
+        relay->cacheable = 0;
+        return;
+    }
+    memcpy(page, relay->buf, relay->len);
+    relay->fill.length = relay->len;
+    relay->fill.checked = 1;
+    relay->fill.expires = relay->expires;
+    relay->filling = 1;
+    relay->buf = page;
+    relay->cap = room;
+}
+
+/* Read one line of response into line, and relay it. Returns its length,
+   0 on EOF or -1 on error */
+static int relay_line(Response_Relay *relay, char *line) {
+    ssize_t n;
+
+    if ((n = Rio_readlineb(relay->rio, line, MAXLINE)) <= 0) {
+        return n;
+    }
+    if (relay_put(relay, line, n) == -1) {
+        return -1;
+    }
+    return n;
+}
+
+/* Read one line of response into line, without relaying it. Returns its
+   length, 0 on EOF or -1 on error */
+static int skip_line(Response_Relay *relay, char *line) {
+    return Rio_readlineb(relay->rio, line, MAXLINE);
+}
+
+/* Read up to want bytes of body straight into the buffer. Returns the
+   number of bytes read (less than want only at EOF), or -1 */
+static int relay_data(Response_Relay *relay, size_t want) {
+    size_t got = 0, room;
+    char *dst;
+    ssize_t n;
+
+    while (got < want) {
+        if ((dst = relay_reserve(relay, want - got, &room)) == NULL) {
+            return -1;
+        }
+        if ((n = Rio_readnb(relay->rio, dst, room)) < 0) {
+            return -1;
+        }
+        relay->len += n;
+        relay->byte_count += n;
+        if (relay->filling)
+            relay->fill.length += n;
+        got += n;
+        if (n < room)
+            break;
+    }
+    return got;
+}
+
+/* Append n bytes of response to the buffer */
+static int relay_put(Response_Relay *relay, char *data, size_t n) {
+    size_t room;
+    char *dst;
+
+    while (n > 0) {
+        if ((dst = relay_reserve(relay, n, &room)) == NULL) {
+            return -1;
+        }
+        memcpy(dst, data, room);
+        relay->len += room;
+        relay->byte_count += room;
+        if (relay->filling)
+            relay->fill.length += room;
+        data += room;
+        n -= room;
+    }
+    return 0;
+}
+
+/*
+ *  Make room for want more bytes at the end of the buffer, and set room
+ *  to how many of them fit there. A full segment of the item received
+ *  into, or a full page of the fill, is sent, and the next one becomes
+ *  the buffer. A response that is not cached reuses the buffer after
+ *  sending what it holds, as does a fill that outgrows max_object_size.
+ */
+static char *relay_reserve(Response_Relay *relay, size_t want,
+        size_t *room)
+{
+    if (relay->filling && relay->len == relay->cap) {
+        if (relay_flush(relay) == -1) {
+            return NULL;
+        }
+        relay->len = relay->sent = 0;
+        if ((relay->buf = reserve_cache_fill(&relay->fill, &relay->cap))
+                == NULL)
+        {
+            /* Too large to be cached: only relayed from now on */
+            free_cache_fill(&relay->fill);
+            relay->filling = 0;
+            relay->cacheable = 0;
+            relay->buf = relay->stage;
+            relay->cap = MAX_OBJECT_SIZE;
+        }
+    }
+    if (relay->filling) {
+        *room = (want < relay->cap - relay->len) ?
+                want : relay->cap - relay->len;
+        return relay->buf + relay->len;
+    }
+
+    if (relay->item != NULL) {
+        if (relay->len == relay->cap) {
+            if (relay_flush(relay) == -1) {
+                return NULL;
+            }
+            relay->buf = item_segment(relay->item, ++relay->segment,
+                    &relay->cap);
+            relay->len = relay->sent = 0;
+            if (relay->buf == NULL) {
+                /* More bytes than the Content-Length: not read here */
+                return NULL;
+            }
+        }
+        *room = (want < relay->cap - relay->len) ?
+                want : relay->cap - relay->len;
+        return relay->buf + relay->len;
+    }
+
+    /* Headers longer than the buffer */
+    if (relay->cacheable && relay->len + want >= relay->cap) {
+        relay->cacheable = 0;
+    }
+    if (!relay->cacheable && relay->len + want > relay->cap) {
+        if (relay_flush(relay) == -1) {
+            return NULL;
+        }
+        relay->len = relay->sent = 0;
+    }
+    *room = want;
+    return relay->buf + relay->len;
+}
+
+/* Send the bytes of the buffer not sent to the client yet, and publish
+   them to the followers */
+static int relay_flush(Response_Relay *relay) {
+    if (relay->len > relay->sent) {
+        /* Followers of a coalesced fetch get the same bytes */
+        if (relay->fetch) {
+            inflight_append(relay->fetch, relay->buf + relay->sent,
+                    relay->len - relay->sent);
+        }
+        if (!relay->client_gone && Rio_writen(relay->clientfd,
+                relay->buf + relay->sent, relay->len - relay->sent) == -1)
+        {
+            /* Keep on fetching if somebody else is waiting for it */
+            if (relay->fetch == NULL || !inflight_followed(relay->fetch))
+                return -1;
+            relay->client_gone = 1;
+        }
+        relay->sent = relay->len;
+    }
+    return 0;
+}
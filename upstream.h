@@ -0,0 +1,113 @@
+/*
+ upstream.h for proxy lab
+ ----------------------
+ Contains the pool of persistent server connections and the response
+ relay that finds where a response ends.
+ See "upstream.c" for the design of the pool.
+ */
+
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "inflight.h"
+
+#define UPSTREAM_BUCKETS 256    /* Hash buckets of the host table */
+#define UPSTREAM_MAX_IDLE 1024  /* Idle connections kept over all hosts */
+
+/* Upstream_Conn that holds one idle server connection */
+typedef struct Upstream_Conn {
+    int fd;
+    long long idle_since_ns;
+    struct Upstream_Conn *next;
+} Upstream_Conn;
+
+/* Upstream_Waiter that tracks a request waiting at the per-host cap */
+typedef struct Upstream_Waiter {
+    int fd;                     /* timerfd, fires at the deadline or woken */
+    int linked;                 /* Still in the queue of its host */
+    struct Upstream_Waiter *next;
+} Upstream_Waiter;
+
+/* Upstream_Host that tracks the connections to one hostname:port */
+typedef struct Upstream_Host {
+    char *hostname;
+    int port;
+    Upstream_Conn *idle;        /* Most recently used first */
+    int idle_count;
+    int busy_count;             /* Connections handed out */
+    Upstream_Waiter *waiters;   /* Woken in order as connections return */
+    int waiting;                /* Requests waiting, in the queue or not */
+    struct Upstream_Host *next;
+} Upstream_Host;
+
+/* Upstream_Pool that tracks all hosts */
+typedef struct Upstream_Pool {
+    pthread_mutex_t mutex;
+    Upstream_Host *buckets[UPSTREAM_BUCKETS];
+    int enabled;                /* 0: HTTP/1.0 with a new connection each */
+    int max_idle_per_host;
+    int max_idle;               /* Idle connections over all hosts */
+    int max_per_host;           /* Idle and busy, 0 means no cap */
+    long long idle_timeout_ns;
+    int idle_count;
+} Upstream_Pool;
+
+/* Response_Relay that passes one response on while finding its end */
+typedef struct Response_Relay {
+    rio_t *rio;
+    int clientfd;
+    char *buf;                  /* stage, a segment of the content of
+                                   item, or the last page of fill */
+    char *stage;                /* MAX_OBJECT_SIZE bytes, for headers and
+                                   the responses not cached */
+    size_t cap;                 /* Bytes of buf */
+    size_t len;                 /* Bytes in buf */
+    size_t sent;                /* Bytes of buf already sent to client */
+    int cacheable;              /* To be cached, in item or fill once
+                                   the headers are in */
+    unsigned int byte_count;    /* Bytes of response so far */
+
+    int phase;
+    long long remaining;        /* Body or chunk bytes left to read */
+    int keep_alive;             /* Server allows the connection reuse */
+
+    char *uri;                  /* URI to cache the response for, or NULL */
+    int request;                /* CACHE_REQ_* flags of the request */
+    Cache_Item *item;           /* Received into, not cached yet, or NULL */
+    unsigned int segment;       /* item_segment() of item in buf */
+    Cache_Fill fill;            /* Or the pages a response of unknown
+                                   size is received into */
+    int filling;                /* fill is in use */
+    time_t expires;             /* For the item, from cache_admits() */
+    long long start_ns;         /* When the request was forwarded */
+
+    Inflight_Fetch *fetch;      /* Coalesced fetch to publish to, or NULL */
+    int client_gone;            /* Client closed, still relaying for the
+                                   followers of fetch */
+} Response_Relay;
+
+/* Return values of relay_step() */
+#define RELAY_MORE           1  /* Call again for the next part */
+#define RELAY_DONE           0
+#define RELAY_ERROR         -1
+#define RELAY_NO_RESPONSE   -2  /* Closed before the first byte */
+
+extern Upstream_Pool upstream_pool;
+
+
+/*
+ * Function prototypes
+ */
+void upstream_init(int max_idle_per_host, int max_idle, int max_per_host,
+        int idle_timeout_sec);
+int upstream_acquire(char *hostname, int port, int *reused);
+void upstream_release(char *hostname, int port, int fd, int reusable);
+
+void relay_init(Response_Relay *relay, rio_t *rio, int clientfd, char *buf);
+int relay_step(Response_Relay *relay);
+void relay_cache(Response_Relay *relay);
+void relay_free(Response_Relay *relay);
+
+#endif /* __UPSTREAM_H__ */
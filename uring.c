@@ -0,0 +1,724 @@
+/*
+ uring.c for proxy lab
+ ----------------------
+ Contains the io_uring engine, selected with "-e uring".
+
+   About io_uring design
+ ----------------------
+    The blocking handler pays for a read() or write() system call for
+ every few kilobytes it moves, and the epoll engine still pays one per
+ I/O plus the epoll_wait() itself. This engine queues all socket I/O on
+ an io_uring instead, so the operations of every connection on a loop
+ are submitted and reaped together with a single io_uring_enter() call
+ per batch.
+
+    Like the epoll engine, it runs one loop per core (or one per
+ SO_REUSEPORT listener), and a connection stays on the loop that accepted
+ it. Each loop uses:
+
+    - One multishot accept on its listener, which keeps posting a
+      completion for every new connection until it is cancelled.
+    - A provided buffer ring of BUF_COUNT buffers. Receives do not own a
+      buffer while they wait; the kernel picks one from the ring when
+      data arrives, and the buffer goes back to the ring as soon as its
+      bytes have been parsed or sent on.
+    - An asynchronous connect to the server, linked (IOSQE_IO_LINK) to
+      the send of the rebuilt request and to the first receive of the
+      response, so a cache miss is submitted as one chain.
+    - For every chunk of response, a send to the client linked to the
+      next receive from the server.
+
+    A response that may be cached is copied from the provided buffers
+ into slab pages of the cache as it arrives (see reserve_cache_fill()),
+ which become its cache item once it ends.
+
+    The io_uring is driven through the raw system calls and the shared
+ ring layout from <linux/io_uring.h>, so no extra library is needed. The
+ sqe->user_data of every operation carries the connection pointer with
+ the operation type in its low bits. A connection is only freed once it
+ has no operation left in flight; closing it cancels whatever is pending.
+
+    Note: as in the epoll engine, a server name the caching resolver has
+ not cached yet is looked up by the loop thread, which blocks meanwhile.
+ */
+
+#define _GNU_SOURCE
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include "proxy.h"
+#include "uring.h"
+#include "threadpool.h"
+
+#define RING_ENTRIES    4096        /* Submission queue entries per loop */
+#define BUF_GROUP       0           /* ID of the provided buffer ring */
+#define BUF_COUNT       256         /* Provided buffers per loop (pow. 2) */
+#define BUF_SIZE        (2 * MAXBUF)    /* Bytes per provided buffer */
+#define HEADER_BUFSIZE  1024        /* Initial size of the header buffer */
+#define MAX_HEADER_SIZE (4 * MAXLINE)   /* Largest request header block */
+
+/* Operation types carried in the low bits of sqe->user_data */
+#define OP_ACCEPT       0
+#define OP_RECV_CLIENT  1
+#define OP_CONNECT      2
+#define OP_SEND_REQUEST 3
+#define OP_RECV_SERVER  4
+#define OP_SEND_CLIENT  5
+#define OP_SEND_HIT     6
+#define OP_CANCEL       7
+#define OP_MASK         7
+
+/* Uring_Conn that tracks one client connection on its loop */
+typedef struct Uring_Conn {
+    unsigned int conn_id;
+    int clientfd;
+    int serverfd;
+    int inflight;           /* Submitted operations not completed yet */
+    int closing;
+
+    char *inbuf;            /* Request header block read so far */
+    size_t in_len, in_cap;
+
+    char *uri;              /* Cache item ID */
+    char *host;
+    char *hostname;
+    int port;
+    char *request;          /* Rebuilt request forwarded to server */
+    size_t request_len;
+    int cache_request;      /* CACHE_REQ_* flags of the request */
+    struct sockaddr_storage addr;   /* Server address for connect */
+    socklen_t addrlen;
+
+    Cache_Item *hit;        /* Pinned cache item being sent */
+    unsigned int hit_segment;   /* item_segment() of hit being sent */
+    int send_bid;           /* Provided buffer being sent, or -1 */
+    Cache_Fill fill;        /* Slab pages the response is copied into */
+    int cacheable;
+    long long fetch_start_ns;   /* When the server was asked */
+
+    unsigned int byte_count;
+} Uring_Conn;
+
+/* Uring_Loop that tracks one loop thread and its ring */
+typedef struct Uring_Loop {
+    int id;
+    int pinned;             /* Pin the loop thread to a core */
+    int listenfd;
+    int ring_fd;
+
+    /* Submission queue, shared with the kernel */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;      /* Next free sqe, ahead of *sq_tail */
+    struct io_uring_sqe *sqes;
+
+    /* Completion queue, shared with the kernel */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Provided buffer ring */
+    struct io_uring_buf_ring *buf_ring;
+    char *bufs;
+    unsigned short buf_tail;
+
+    unsigned int conn_count;        /* Connections owned by this loop */
+    unsigned int next_conn_id;
+} Uring_Loop;
+
+
+/*
+ * Function prototypes
+ */
+static void *uring_loop_thread(void *args);
+static int ring_setup(Uring_Loop *loop, unsigned entries);
+static int setup_buffers(Uring_Loop *loop);
+static int ring_enter(Uring_Loop *loop, unsigned wait);
+static struct io_uring_sqe *get_sqe(Uring_Loop *loop, Uring_Conn *conn,
+        int op);
+static void submit_accept(Uring_Loop *loop);
+static void submit_recv(Uring_Loop *loop, Uring_Conn *conn, int fd, int op,
+        unsigned flags);
+static void submit_send(Uring_Loop *loop, Uring_Conn *conn, int fd,
+        char *buf, size_t len, int op, unsigned flags);
+static void recycle_buffer(Uring_Loop *loop, int bid);
+static void handle_cqe(Uring_Loop *loop, struct io_uring_cqe *cqe);
+static void new_conn(Uring_Loop *loop, int connfd);
+static void on_recv_client(Uring_Loop *loop, Uring_Conn *conn, int res,
+        int bid);
+static void start_request(Uring_Loop *loop, Uring_Conn *conn);
+static int send_hit_segment(Uring_Loop *loop, Uring_Conn *conn);
+static void start_fetch(Uring_Loop *loop, Uring_Conn *conn);
+static void on_recv_server(Uring_Loop *loop, Uring_Conn *conn, int res,
+        int bid);
+static void conn_close(Uring_Loop *loop, Uring_Conn *conn);
+static void conn_free(Uring_Conn *conn);
+
+
+
+/* Check that io_uring and provided buffer rings work on this kernel */
+int uring_supported(void) {
+    Uring_Loop loop;
+    int ok;
+
+    memset(&loop, 0, sizeof(loop));
+    if (ring_setup(&loop, 8) == -1) return 0;
+    ok = (setup_buffers(&loop) == 0);
+    close(loop.ring_fd);
+    return ok;
+}
+
+/*
+ *  Start nloops io_uring loops. With a single listener all loops share it;
+ *  otherwise loop i owns listenfds[i] and is pinned to a core. The calling
+ *  thread runs the first loop, so this function never returns.
+ */
+void uring_run(int *listenfds, int nlisteners, int nloops) {
+    Uring_Loop *loops;
+    int i;
+
+    raise_fd_limit();
+    loops = Calloc(nloops, sizeof(Uring_Loop));
+    for (i = 0; i < nloops; i++) {
+        loops[i].id = i;
+        loops[i].pinned = (nlisteners > 1);
+        loops[i].listenfd = listenfds[i % nlisteners];
+    }
+
+    printf("{ io_uring engine: %d loop(s), %d listener(s) }\n\n",
+            nloops, nlisteners);
+
+    for (i = 1; i < nloops; i++) {
+        pthread_t tid;
+        Pthread_create(&tid, NULL, uring_loop_thread, &loops[i]);
+    }
+    uring_loop_thread(&loops[0]);
+}
+
+/* Loop thread routine: submit, wait and reap completions forever */
+static void *uring_loop_thread(void *args) {
+    Uring_Loop *loop = (Uring_Loop *) args;
+    unsigned head, tail;
+
+    if (loop->pinned) {
+        pin_to_core(loop->id);
+    }
+    /* The ring is created by the thread that submits to it */
+    if (ring_setup(loop, RING_ENTRIES) == -1)
+        unix_error("io_uring_setup error");
+    if (setup_buffers(loop) == -1)
+        unix_error("io_uring provided buffers error");
+    submit_accept(loop);
+
+    while (1) {
+        if (ring_enter(loop, 1) < 0 && errno != EINTR && errno != EBUSY)
+            unix_error("io_uring_enter error");
+
+        head = *loop->cq_head;
+        tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            handle_cqe(loop, &loop->cqes[head & *loop->cq_mask]);
+            head++;
+        }
+        __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* Create the ring and map its queues. Returns 0 or -1 */
+static int ring_setup(Uring_Loop *loop, unsigned entries) {
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *sq_ptr, *cq_ptr;
+    unsigned i;
+
+    /* Only this thread submits, and completions are reaped on demand */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    if ((loop->ring_fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        memset(&p, 0, sizeof(p));
+        if ((loop->ring_fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+            return -1;
+    }
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_len > sq_len) sq_len = cq_len;
+        cq_len = sq_len;
+    }
+
+    sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    }
+    else {
+        cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) goto fail;
+    }
+    loop->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            loop->ring_fd, IORING_OFF_SQES);
+    if (loop->sqes == MAP_FAILED) goto fail;
+
+    loop->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    loop->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    loop->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    loop->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+    loop->sq_entries = p.sq_entries;
+    loop->sqe_tail = *loop->sq_tail;
+    loop->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    loop->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    loop->cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+    /* Slot i of the submission array always points at sqe i */
+    for (i = 0; i < p.sq_entries; i++) {
+        loop->sq_array[i] = i;
+    }
+    return 0;
+
+ fail:
+    close(loop->ring_fd);
+    return -1;
+}
+
+/* Register the provided buffer ring and fill it. Returns 0 or -1 */
+static int setup_buffers(Uring_Loop *loop) {
+    struct io_uring_buf_reg reg;
+    int i;
+
+    loop->buf_ring = mmap(NULL, BUF_COUNT * sizeof(struct io_uring_buf),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->buf_ring == MAP_FAILED) return -1;
+    if ((loop->bufs = malloc(BUF_COUNT * BUF_SIZE)) == NULL) return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) loop->buf_ring;
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+    if (syscall(__NR_io_uring_register, loop->ring_fd,
+            IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        return -1;
+    }
+
+    loop->buf_tail = 0;
+    for (i = 0; i < BUF_COUNT; i++) {
+        recycle_buffer(loop, i);
+    }
+    return 0;
+}
+
+/* Submit queued sqes, and wait for at least wait completions */
+static int ring_enter(Uring_Loop *loop, unsigned wait) {
+    unsigned submit;
+
+    __atomic_store_n(loop->sq_tail, loop->sqe_tail, __ATOMIC_RELEASE);
+    submit = loop->sqe_tail - __atomic_load_n(loop->sq_head,
+            __ATOMIC_ACQUIRE);
+    return syscall(__NR_io_uring_enter, loop->ring_fd, submit, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* Get a cleared sqe for an operation of conn, flushing a full queue */
+static struct io_uring_sqe *get_sqe(Uring_Loop *loop, Uring_Conn *conn,
+        int op)
+{
+    struct io_uring_sqe *sqe;
+
+    while (loop->sqe_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE)
+            >= loop->sq_entries)
+    {
+        ring_enter(loop, 0);
+    }
+    sqe = &loop->sqes[loop->sqe_tail & *loop->sq_mask];
+    loop->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (unsigned long) conn | op;
+    if (conn) conn->inflight++;
+    return sqe;
+}
+
+/* Multishot accept on the listener of this loop */
+static void submit_accept(Uring_Loop *loop) {
+    struct io_uring_sqe *sqe = get_sqe(loop, NULL, OP_ACCEPT);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/* Receive into a buffer picked from the provided buffer ring */
+static void submit_recv(Uring_Loop *loop, Uring_Conn *conn, int fd, int op,
+        unsigned flags)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop, conn, op);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT | flags;
+    sqe->buf_group = BUF_GROUP;
+}
+
+/* Send a whole buffer (the kernel retries short sends with MSG_WAITALL) */
+static void submit_send(Uring_Loop *loop, Uring_Conn *conn, int fd,
+        char *buf, size_t len, int op, unsigned flags)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop, conn, op);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->flags = flags;
+}
+
+/* Give a provided buffer back to the kernel */
+static void recycle_buffer(Uring_Loop *loop, int bid) {
+    struct io_uring_buf *buf;
+
+    buf = &loop->buf_ring->bufs[loop->buf_tail & (BUF_COUNT - 1)];
+    buf->addr = (unsigned long) (loop->bufs + (size_t) bid * BUF_SIZE);
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    loop->buf_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail,
+            __ATOMIC_RELEASE);
+}
+
+/* Dispatch one completion */
+static void handle_cqe(Uring_Loop *loop, struct io_uring_cqe *cqe) {
+    int op = cqe->user_data & OP_MASK;
+    Uring_Conn *conn = (Uring_Conn *) (unsigned long)
+            (cqe->user_data & ~(unsigned long long) OP_MASK);
+    int res = cqe->res;
+    int bid = (cqe->flags & IORING_CQE_F_BUFFER) ?
+            (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+
+    if (op == OP_ACCEPT) {
+        if (res >= 0)
+            new_conn(loop, res);
+        else if (res != -EINTR && res != -ECANCELED)
+            fprintf(stderr, "Accept error: %s\n", strerror(-res));
+        /* Re-arm the multishot accept once the kernel stops it */
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            submit_accept(loop);
+        return;
+    }
+
+    conn->inflight--;
+    if (conn->closing) {
+        /* Drain what was still in flight when it was closed */
+        if (bid >= 0) recycle_buffer(loop, bid);
+        if (op == OP_SEND_CLIENT && conn->send_bid >= 0) {
+            recycle_buffer(loop, conn->send_bid);
+            conn->send_bid = -1;
+        }
+        if (conn->inflight == 0) conn_free(conn);
+        return;
+    }
+
+    switch (op) {
+    case OP_RECV_CLIENT:
+        on_recv_client(loop, conn, res, bid);
+        break;
+    case OP_CONNECT:
+        if (res < 0) {
+            printf("To-server socket connection error!\n");
+            printf("Hostname: %s\tPort: %d\n", conn->hostname, conn->port);
+            conn_close(loop, conn);
+        }
+        break;
+    case OP_SEND_REQUEST:
+        if (res < 0)
+            conn_close(loop, conn);
+        else
+            printf("{ Forwarded request to server. "
+                    "Ready to read response. }\n");
+        break;
+    case OP_RECV_SERVER:
+        on_recv_server(loop, conn, res, bid);
+        break;
+    case OP_SEND_CLIENT:
+        recycle_buffer(loop, conn->send_bid);
+        conn->send_bid = -1;
+        if (res < 0) conn_close(loop, conn);
+        break;
+    case OP_SEND_HIT:
+        if (res >= 0) {
+            conn->byte_count += res;
+            conn->hit_segment++;
+            if (send_hit_segment(loop, conn) == 0)
+                break;
+            printf("\n(%d bytes have been transmited as response.)\n",
+                    conn->byte_count);
+        }
+        conn_close(loop, conn);
+        break;
+    }
+
+    if (conn->closing && conn->inflight == 0) conn_free(conn);
+}
+
+/* Set up a newly accepted connection and start reading its request */
+static void new_conn(Uring_Loop *loop, int connfd) {
+    Uring_Conn *conn;
+
+    if ((conn = calloc(1, sizeof(Uring_Conn))) == NULL) {
+        close(connfd);
+        return;
+    }
+    conn->conn_id = ++loop->next_conn_id;
+    conn->clientfd = connfd;
+    conn->serverfd = -1;
+    conn->send_bid = -1;
+
+    loop->conn_count++;
+    printf("{ [%d:%u] Client connected. \tConnections on loop: %u }\n\n",
+            loop->id, conn->conn_id, loop->conn_count);
+
+    submit_recv(loop, conn, connfd, OP_RECV_CLIENT, 0);
+}
+
+/* Request bytes arrived: accumulate them until the blank line */
+static void on_recv_client(Uring_Loop *loop, Uring_Conn *conn, int res,
+        int bid)
+{
+    size_t from;
+    char *newbuf;
+
+    if (res == -ENOBUFS) {
+        /* All buffers are in use, try again */
+        submit_recv(loop, conn, conn->clientfd, OP_RECV_CLIENT, 0);
+        return;
+    }
+    if (res < 0 || (res == 0 && conn->in_len == 0)) {
+        conn_close(loop, conn);
+        return;
+    }
+    if (res == 0) {
+        /* Client finished sending, parse whatever has arrived */
+        start_request(loop, conn);
+        return;
+    }
+
+    /* Keep one byte for the null terminator */
+    if (conn->in_len + res + 1 > conn->in_cap) {
+        size_t cap = conn->in_cap ? conn->in_cap : HEADER_BUFSIZE;
+        while (cap < conn->in_len + res + 1) cap *= 2;
+        if (cap > MAX_HEADER_SIZE
+                || (newbuf = realloc(conn->inbuf, cap)) == NULL)
+        {
+            printf("\t(Request header too large!)\n");
+            recycle_buffer(loop, bid);
+            conn_close(loop, conn);
+            return;
+        }
+        conn->inbuf = newbuf;
+        conn->in_cap = cap;
+    }
+    memcpy(conn->inbuf + conn->in_len, loop->bufs + (size_t) bid * BUF_SIZE,
+            res);
+    recycle_buffer(loop, bid);
+
+    /* Only look for the blank line in the bytes just received */
+    from = (conn->in_len > 3) ? conn->in_len - 3 : 0;
+    conn->in_len += res;
+    conn->inbuf[conn->in_len] = '\0';
+    if (strstr(conn->inbuf + from, "\r\n\r\n")) {
+        start_request(loop, conn);
+    }
+    else {
+        submit_recv(loop, conn, conn->clientfd, OP_RECV_CLIENT, 0);
+    }
+}
+
+/* Parse the header block, then serve from the cache or fetch */
+static void start_request(Uring_Loop *loop, Uring_Conn *conn) {
+    Http_Request req;
+
+    if (parse_request_block(&req, conn->inbuf, conn->clientfd)
+            != REQUEST_OK)
+    {
+        conn_close(loop, conn);
+        return;
+    }
+    free(conn->inbuf);
+    conn->inbuf = NULL;
+
+    if ((conn->uri = strdup(req.uri)) == NULL
+            || (conn->host = strdup(req.host)) == NULL
+            || (conn->hostname = strdup(req.hostname)) == NULL
+            || (conn->request = strdup(req.new_request)) == NULL)
+    {
+        conn_close(loop, conn);
+        return;
+    }
+    conn->port = req.port;
+    conn->request_len = strlen(conn->request);
+    conn->cache_request = req.cache_request;
+
+    /* Search uri in cache */
+    if ((conn->hit = search_and_pin(&cache_list, conn->uri)) != NULL) {
+        printf("URI: %s\nCache Hit!\n\n", conn->uri);
+        /* Sent from the cache memory, unpinned when the conn is freed */
+        conn->hit_segment = 0;
+        send_hit_segment(loop, conn);
+        return;
+    }
+
+    printf("URI: %s\nCache Miss.\n\n", conn->uri);
+    start_fetch(loop, conn);
+}
+
+/* Submit the send of the current segment of the hit. Returns -1 if all 
+   were sent */
+static int send_hit_segment(Uring_Loop *loop, Uring_Conn *conn) {
+    size_t length;
+    char *segment;
+
+    if ((segment = item_segment(conn->hit, conn->hit_segment, &length))
+            == NULL)
+    {
+        return -1;
+    }
+    submit_send(loop, conn, conn->clientfd, segment, length, OP_SEND_HIT, 0);
+    return 0;
+}
+
+/* Resolve the server, then submit connect -> send request -> recv */
+static void start_fetch(Uring_Loop *loop, Uring_Conn *conn) {
+    struct in_addr addr;
+    struct sockaddr_in *serveraddr = (struct sockaddr_in *) &conn->addr;
+    struct io_uring_sqe *sqe;
+
+    conn->fetch_start_ns = monotonic_ns();
+    if (resolve_hook(conn->hostname, &addr, 1) <= 0) {
+        printf("DNS error! Hostname: %s\tPort: %d\n",
+                conn->hostname, conn->port);
+        clienterror(conn->clientfd, conn->host, "400", "Bad Request",
+                "This webpage is not available, because DNS lookup failed");
+        conn_close(loop, conn);
+        return;
+    }
+    memset(serveraddr, 0, sizeof(struct sockaddr_in));
+    serveraddr->sin_family = AF_INET;
+    serveraddr->sin_addr = addr;
+    serveraddr->sin_port = htons(conn->port);
+    conn->addrlen = sizeof(struct sockaddr_in);
+
+    if ((conn->serverfd = socket(conn->addr.ss_family,
+            SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+        printf("To-server socket connection error!\n");
+        conn_close(loop, conn);
+        return;
+    }
+
+    printf("New request:\n");
+    printf("%s", conn->request);    /* Print the new HTTP request */
+
+    sqe = get_sqe(loop, conn, OP_CONNECT);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = conn->serverfd;
+    sqe->addr = (unsigned long) &conn->addr;
+    sqe->off = conn->addrlen;
+    sqe->flags = IOSQE_IO_LINK;
+    submit_send(loop, conn, conn->serverfd, conn->request,
+            conn->request_len, OP_SEND_REQUEST, IOSQE_IO_LINK);
+    conn->cacheable = 1;
+    submit_recv(loop, conn, conn->serverfd, OP_RECV_SERVER, 0);
+}
+
+/* Response bytes arrived: cache them and pass them on to the client */
+static void on_recv_server(Uring_Loop *loop, Uring_Conn *conn, int res,
+        int bid)
+{
+    Cache_Item *item;
+    char *data;
+
+    if (res == -ENOBUFS) {
+        submit_recv(loop, conn, conn->serverfd, OP_RECV_SERVER, 0);
+        return;
+    }
+    if (res < 0) {
+        conn_close(loop, conn);
+        return;
+    }
+    if (res == 0) {
+        /* End of response */
+        if (conn->cacheable && (item = build_filled_item(&conn->fill,
+                conn->uri)) != NULL)
+        {
+            item->fetch_us = (monotonic_ns() - conn->fetch_start_ns) / 1000;
+            insert_cache_item(&cache_list, item);
+        }
+        printf("\n(%d bytes have been transmited as response.)\n",
+                conn->byte_count);
+        conn_close(loop, conn);
+        return;
+    }
+
+    data = loop->bufs + (size_t) bid * BUF_SIZE;
+
+    /* Copy it into the cache pages while the response may be cached: 
+     * its headers allow it and it fits in the object size */
+    if (conn->cacheable
+            && (append_cache_fill(&conn->fill, data, res) == -1
+            || !admit_cache_fill(&cache_list, &conn->fill, conn->uri,
+                    conn->cache_request)))
+    {
+        conn->cacheable = 0;
+        free_cache_fill(&conn->fill);
+    }
+    conn->byte_count += res;
+
+    /* Send this chunk, then receive the next one */
+    conn->send_bid = bid;
+    submit_send(loop, conn, conn->clientfd, data, res, OP_SEND_CLIENT,
+            IOSQE_IO_LINK);
+    submit_recv(loop, conn, conn->serverfd, OP_RECV_SERVER, 0);
+}
+
+/* Start closing a connection: cancel what is still in flight */
+static void conn_close(Uring_Loop *loop, Uring_Conn *conn) {
+    struct io_uring_sqe *sqe;
+    int fds[2], i;
+
+    if (conn->closing) return;
+    conn->closing = 1;
+
+    fds[0] = conn->clientfd;
+    fds[1] = conn->serverfd;
+    for (i = 0; i < 2; i++) {
+        if (fds[i] < 0 || conn->inflight == 0) continue;
+        shutdown(fds[i], SHUT_RDWR);
+        sqe = get_sqe(loop, conn, OP_CANCEL);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fds[i];
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+
+    loop->conn_count--;
+    printf("{ [%d:%u] Connection closed. \tConnections on loop: %u }\n\n",
+            loop->id, conn->conn_id, loop->conn_count);
+}
+
+/* Close the descriptors and free a connection with nothing in flight */
+static void conn_free(Uring_Conn *conn) {
+    if (conn->serverfd >= 0) close(conn->serverfd);
+    if (conn->clientfd >= 0) close(conn->clientfd);
+    free(conn->inbuf);
+    free(conn->uri);
+    free(conn->host);
+    free(conn->hostname);
+    free(conn->request);
+    if (conn->hit) unpin_cache_item(conn->hit);
+    free_cache_fill(&conn->fill);
+    free(conn);
+}
@@ -0,0 +1,19 @@
+/*
+ uring.h for proxy lab
+ ----------------------
+ Contains the entry points of the io_uring engine.
+ See "uring.c" for the design of the io_uring backend.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "csapp.h"
+
+/*
+ * Function prototypes
+ */
+int uring_supported(void);
+void uring_run(int *listenfds, int nlisteners, int nloops);
+
+#endif /* __URING_H__ */